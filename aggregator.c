@@ -0,0 +1,321 @@
+/***********************************
+*          aggregator.c
+*
+* -Windowed aggregation: keeps the
+*  last samples of every (slave,
+*  register) read at bus speed and
+*  publishes their min, max, mean,
+*  standard deviation and RMS at
+*  the publish interval.
+*
+* used with aggregator.h
+*
+***********************************/
+
+// Include header file
+#include "aggregator.h"
+
+// Define constants
+#define SeriesMask (SeriesCapacity - 1)     // Wraps positions in the rings
+#define AggregateGap FLT_MAX                // Read error kept in a ring (finite, never the min of a window)
+
+// Structs
+typedef struct{
+    int         first;                          // First series of the block
+    int         n;                              // Number of series (parameters of the group)
+    uint8_t     slave_id;
+    FunctionCode function_code;
+    int         users;                          // Register maps polling the block (0: free)
+    uint32_t    head;                           // Scans pushed
+    int64_t     stamps_ms[SeriesCapacity];      // Time of each scan (ms since epoch, CLOCK_REALTIME)
+    int64_t     next_ms;                        // Next time the statistics are published (0 before the first scan)
+}AggregateBlock;
+
+typedef struct{
+    float       min[AggregateLanes];
+    float       max[AggregateLanes];
+    float       sum[AggregateLanes];            // Sum of the differences to the reference value
+    float       squares[AggregateLanes];        // Sum of their squares
+    int         count[AggregateLanes];          // Values read (errors are skipped)
+}LaneSums;
+
+// Internal functions
+int         seriesRange(int n);
+int         aggregateCount(const AggregateBlock *block, int64_t from_ms);
+void        aggregateSeries(const float ring[], uint32_t head, int k, float stats[AggregateStats], int *count);
+void        aggregateRange(const float values[], int n, float reference, LaneSums *lanes);
+
+// Variables (structure of arrays: the samples of a series are contiguous, each block is only used by its bus thread)
+static float            seriesValues[MaxSeries][SeriesCapacity];
+static uint16_t         seriesAddress[MaxSeries];
+static char             seriesTopics[MaxSeries][AggregateStats][AggregateTopicSize];
+static uint8_t          seriesUsed[MaxSeries];                  // Series of a block in use
+static AggregateBlock   blocks[MaxAggregateBlocks];
+static int              n_blocks    = 0;                        // Blocks ever used (free ones are used again)
+static int              windowMs    = 0;        // Length of the window (0: the publish interval)
+static const char       *statNames[AggregateStats] = {"", "min", "max", "mean", "stddev", "rms"};
+static pthread_mutex_t  addLock     = PTHREAD_MUTEX_INITIALIZER;   // Bus threads add blocks when their register map is reloaded
+
+
+
+/* SET WINDOW: Length of the window the statistics are computed on (mili seconds).
+    Windows longer than the publish interval overlap, 0 uses the publish interval.
+    Only the last SeriesCapacity samples of a register are kept.
+*/
+void aggregatorSetWindow(int window_ms){
+    if(window_ms >= 0) windowMs = window_ms;
+}
+
+
+
+/* ADD BLOCK: Aggregates the parameters of a register group of one meter (before the group is polled).
+    The topic of each statistic is "<topic>/<statistic>" (example "parameters/voltage/mean").
+    A block in use with the same meter, function code and registers is shared (register map reloaded):
+    its samples are kept and its topics renamed. Each map releases its blocks (aggregatorRelease) when freed.
+    returns number of the block
+            or -1 if the tables are full or a topic is too long
+*/
+int aggregatorAdd(uint8_t slave_id, FunctionCode function_code, const StartAddress_3X addresses[], char * const topics[], int n){
+    AggregateBlock  *block;
+    int             number  = -1;
+    int             first;
+
+    for(int i = 0; i < n; i ++){
+        for(int s = StatMin; s < AggregateStats; s ++){
+            if(strlen(topics[i]) + 1 + strlen(statNames[s]) >= AggregateTopicSize){
+                printf("ERROR: Topic %s too long to aggregate\n", topics[i]);
+                syslog(LOG_ERR, "ERROR from aggregatorAdd: Topic %s too long to aggregate.", topics[i]);
+                return -1;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&addLock);
+    for(int b = 0; b < n_blocks && number < 0; b ++){
+        int same = blocks[b].users > 0 && blocks[b].slave_id == slave_id && blocks[b].function_code == function_code && blocks[b].n == n;
+        for(int i = 0; i < n && same; i ++) same = seriesAddress[blocks[b].first + i] == addresses[i];
+        if(same) number = b;
+    }
+
+    if(number < 0){
+        for(int b = 0; b < n_blocks && number < 0; b ++) if(blocks[b].users == 0) number = b;
+        if(number < 0 && n_blocks < MaxAggregateBlocks) number = n_blocks;
+        first = seriesRange(n);
+        if(number < 0 || first < 0){
+            pthread_mutex_unlock(&addLock);
+            printf("ERROR: Too many registers aggregated, max %i\n", MaxSeries);
+            syslog(LOG_ERR, "ERROR from aggregatorAdd: Too many registers aggregated, max %i.", MaxSeries);
+            return -1;
+        }
+        if(number == n_blocks) n_blocks ++;
+        block                   = &blocks[number];
+        block->first            = first;
+        block->n                = n;
+        block->slave_id         = slave_id;
+        block->function_code    = function_code;
+        block->users            = 0;
+        block->head             = 0;
+        block->next_ms          = 0;
+        for(int i = 0; i < n; i ++){
+            seriesUsed[first + i]       = 1;
+            seriesAddress[first + i]    = addresses[i];
+        }
+    }
+
+    block = &blocks[number];
+    for(int i = 0; i < n; i ++){
+        for(int s = StatMin; s < AggregateStats; s ++){
+            snprintf(seriesTopics[block->first + i][s], AggregateTopicSize, "%s/%s", topics[i], statNames[s]);
+        }
+    }
+    block->users ++;
+    pthread_mutex_unlock(&addLock);
+    return number;
+}
+
+
+
+/* RELEASE BLOCK: A register map doesn't poll the block any more, its series are freed with its last map.
+*/
+void aggregatorRelease(int block){
+    AggregateBlock *b = &blocks[block];
+
+    pthread_mutex_lock(&addLock);
+    if(b->users > 0 && -- b->users == 0){
+        for(int i = 0; i < b->n; i ++) seriesUsed[b->first + i] = 0;
+    }
+    pthread_mutex_unlock(&addLock);
+}
+
+
+
+/* SERIES RANGE: First of n contiguous free series (first fit, called with addLock held).
+    returns the first series
+            or -1 if there isn't room
+*/
+int seriesRange(int n){
+    int run = 0;
+
+    for(int s = 0; s < MaxSeries; s ++){
+        run = seriesUsed[s] ? 0 : run + 1;
+        if(run == n) return s - n + 1;
+    }
+    return -1;
+}
+
+
+
+/* PUSH SCAN: Stores the values of one scan of a block (errors are skipped by the statistics).
+    The time of the scan is the time its last register was read.
+*/
+void aggregatorPush(int block, const float values[], const struct timespec stamps[]){
+    AggregateBlock  *b      = &blocks[block];
+    uint32_t        slot    = b->head & SeriesMask;
+
+    b->stamps_ms[slot] = (int64_t)stamps[b->n - 1].tv_sec*1000 + stamps[b->n - 1].tv_nsec/1000000;
+    for(int i = 0; i < b->n; i ++) seriesValues[b->first + i][slot] = isnan(values[i]) ? AggregateGap : values[i];
+    b->head ++;
+}
+
+
+
+/* COLLECT: Statistics of the window of every parameter, once per publish interval.
+    The intervals are aligned to the clock (a 1 s interval publishes on every second).
+    +Interval::         Publish interval (mili seconds)
+    +Samples::          Where the statistics are written (AggregateStats - 1 per parameter, the last one closes the scan)
+    returns number of samples written (0 if the interval hasn't ended)
+*/
+int aggregatorCollect(int block, int interval_ms, Sample samples[]){
+    AggregateBlock  *b      = &blocks[block];
+    int64_t         now_ms;                     // Time of the last scan
+    int             k;                          // Scans inside the window
+    int             n_samples = 0;
+
+    if(b->head == 0) return 0;
+    if(interval_ms <= 0) interval_ms = 1;
+    now_ms = b->stamps_ms[(b->head - 1) & SeriesMask];
+    if(b->next_ms == 0) b->next_ms = (now_ms/interval_ms + 1)*interval_ms;
+    if(now_ms < b->next_ms) return 0;
+    b->next_ms = (now_ms/interval_ms + 1)*interval_ms;
+    k = aggregateCount(b, now_ms - (windowMs > 0 ? windowMs : interval_ms));
+
+    for(int i = 0; i < b->n; i ++){
+        int     series = b->first + i;
+        float   stats[AggregateStats];
+        int     count;
+
+        aggregateSeries(seriesValues[series], b->head, k, stats, &count);
+        for(int s = StatMin; s < AggregateStats; s ++){
+            Sample *sample = &samples[n_samples ++];
+            sample->timestamp.tv_sec    = now_ms/1000;
+            sample->timestamp.tv_nsec   = (now_ms%1000)*1000000;
+            sample->slave_id            = b->slave_id;
+            sample->address             = seriesAddress[series];
+            sample->value               = count > 0 ? stats[s] : NAN;
+            sample->status              = count > 0 ? SampleOk : SampleError;
+            strncpy(sample->topic, seriesTopics[series][s], SampleTopicSize - 1);
+            sample->topic[SampleTopicSize - 1] = '\0';
+            sample->statistic           = s;
+            sample->last                = 0;
+        }
+    }
+    samples[n_samples - 1].last = 1;
+    return n_samples;
+}
+
+
+
+/* WINDOW COUNT: Number of the last scans of a block taken after a time (newest first, they're in time order).
+    The last scan is always counted, the window ends with it.
+*/
+int aggregateCount(const AggregateBlock *block, int64_t from_ms){
+    int available = block->head < SeriesCapacity ? (int)block->head : SeriesCapacity;
+    int k = 0;
+
+    while(k < available && block->stamps_ms[(block->head - 1 - k) & SeriesMask] > from_ms) k ++;
+    return k;
+}
+
+
+
+/* SERIES STATISTICS: Min, max, mean, standard deviation and RMS of the last k values of a ring.
+    Sums are taken on the differences to the first value read, so the variance of a large value
+    that barely moves (230 V +/- 0.5 V) keeps its precision in single precision.
+    +Count::            Values read in the window (0: every read failed, the statistics are undefined)
+*/
+void aggregateSeries(const float ring[], uint32_t head, int k, float stats[AggregateStats], int *count){
+    uint32_t            start       = (head - k) & SeriesMask;
+    int                 first       = k;                    // Values of the first segment (the ring may wrap)
+    float               reference   = AggregateGap;
+    LaneSums            lanes;
+    double              n = 0, sum = 0, squares = 0, mean, variance;
+
+    if(start + k > SeriesCapacity) first = SeriesCapacity - start;
+    for(int i = 0; i < k && reference == AggregateGap; i ++) reference = ring[(start + i) & SeriesMask];
+    for(int l = 0; l < AggregateLanes; l ++){
+        lanes.min[l]        = AggregateGap;
+        lanes.max[l]        = -AggregateGap;
+        lanes.sum[l]        = 0;
+        lanes.squares[l]    = 0;
+        lanes.count[l]      = 0;
+    }
+    aggregateRange(&ring[start], first, reference, &lanes);
+    aggregateRange(&ring[0], k - first, reference, &lanes);
+
+    stats[StatMin] = AggregateGap;
+    stats[StatMax] = -AggregateGap;
+    for(int l = 0; l < AggregateLanes; l ++){
+        if(lanes.min[l] < stats[StatMin]) stats[StatMin] = lanes.min[l];
+        if(lanes.max[l] > stats[StatMax]) stats[StatMax] = lanes.max[l];
+        n       += lanes.count[l];
+        sum     += lanes.sum[l];
+        squares += lanes.squares[l];
+    }
+    *count = (int)n;
+    if(n == 0) return;
+    mean        = sum/n;
+    variance    = squares/n - mean*mean;
+    if(variance < 0) variance = 0;
+    mean       += reference;
+    stats[StatMean]     = mean;
+    stats[StatStddev]   = sqrt(variance);
+    stats[StatRms]      = sqrt(variance + mean*mean);
+}
+
+
+
+/* RANGE: Adds contiguous values to the partial results. Each lane takes one value of every
+   AggregateLanes, without branches and on local copies, so the compiler turns the inner loop
+   into SIMD instructions (min/max need the values to be finite: errors are stored as AggregateGap).
+*/
+__attribute__((optimize("tree-vectorize", "no-trapping-math", "finite-math-only", "no-signed-zeros")))
+void aggregateRange(const float values[], int n, float reference, LaneSums *lanes){
+    LaneSums    l_ = *lanes;                    // Local copy (can't alias the values)
+    int         i = 0;
+
+    for(; i + AggregateLanes <= n; i += AggregateLanes){
+        for(int l = 0; l < AggregateLanes; l ++){
+            float   v   = values[i + l];
+            int     ok  = v != AggregateGap;
+            l_.min[l]       = v < l_.min[l] ? v : l_.min[l];
+            v               = ok ? v : -AggregateGap;
+            l_.max[l]       = v > l_.max[l] ? v : l_.max[l];
+            v               = ok ? v - reference : 0;
+            l_.sum[l]      += v;
+            l_.squares[l]  += v*v;
+            l_.count[l]    += ok;
+        }
+    }
+    for(int l = 0; i < n; i ++, l ++){
+        float   v   = values[i];
+        int     ok  = v != AggregateGap;
+        l_.min[l]       = v < l_.min[l] ? v : l_.min[l];
+        v               = ok ? v : -AggregateGap;
+        l_.max[l]       = v > l_.max[l] ? v : l_.max[l];
+        v               = ok ? v - reference : 0;
+        l_.sum[l]      += v;
+        l_.squares[l]  += v*v;
+        l_.count[l]    += ok;
+    }
+    *lanes = l_;
+}
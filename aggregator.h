@@ -0,0 +1,36 @@
+#ifndef aggregator
+#define aggregator
+
+// Include the modbus (register addresses) and sample queue headers
+#include "modbus.h"
+#include "sampleQueue.h"
+
+// Linux headers
+#include <pthread.h>
+
+// Defines
+#define MaxSeries           256     // (slave, register) pairs aggregated
+#define SeriesCapacity      1024    // Samples kept by each series (power of 2), longest window in samples
+#define MaxAggregateBlocks  64      // Register groups aggregated (one per meter and group of the maps in use)
+#define AggregateLanes      8       // Partial results computed side by side (one SIMD register of floats)
+#define AggregateTopicSize  38      // Topic of a statistic (fits in a journal record)
+
+// Enums
+typedef enum{
+    StatValue,              // Value read (not aggregated)
+    StatMin,                // ".../min"
+    StatMax,                // ".../max"
+    StatMean,               // ".../mean"
+    StatStddev,             // ".../stddev" (population standard deviation)
+    StatRms,                // ".../rms"
+    AggregateStats
+}AggregateStat;
+
+// Functions
+void        aggregatorSetWindow(int window_ms);
+int         aggregatorAdd(uint8_t slave_id, FunctionCode function_code, const StartAddress_3X addresses[], char * const topics[], int n);
+void        aggregatorRelease(int block);
+void        aggregatorPush(int block, const float values[], const struct timespec stamps[]);
+int         aggregatorCollect(int block, int interval_ms, Sample samples[]);
+
+#endif
@@ -0,0 +1,161 @@
+/***********************************
+*          deadband.c
+*
+* -Report by exception: remembers the
+*  last value published of every
+*  (slave, register) and only lets a
+*  new one through if it moved more
+*  than the deadband of its class.
+*
+* used with deadband.h
+*
+***********************************/
+
+// Include header file
+#include "deadband.h"
+
+// Define constants
+#define TableMask (DeadbandTableSize - 1)   // Wraps positions in the table
+
+// Structs
+typedef struct{
+    uint32_t        key;            // (statistic << 24) | (slave << 16) | register, 0 if the slot is free
+    float           value;          // Last value published
+    SampleStatus    status;         // Status of the last value published
+    time_t          published;      // Time it was published (seconds)
+}LastPublished;
+
+// Internal functions
+DeadbandClass   deadbandClass(uint16_t address);
+LastPublished   *lastPublished(const Sample *sample);
+
+// Variables (only used from the publisher thread)
+static LastPublished    table[DeadbandTableSize];
+static Deadband         deadbands[DeadbandClasses];     // All 0: every value is published
+static const char       *classNames[DeadbandClasses] = {"parameters", "frequency", "power", "energy"};
+static int              heartbeat = 0;                  // Max time without publishing a register (seconds, 0 disables)
+
+
+
+/* SET DEADBAND: Sets the change needed to publish a register of a class.
+   With both limits at 0 every value of the class is published.
+*/
+void deadbandSet(DeadbandClass deadband_class, float absolute, float percent){
+    if(deadband_class < 0 || deadband_class >= DeadbandClasses) return;
+    deadbands[deadband_class].absolute  = absolute;
+    deadbands[deadband_class].percent   = percent;
+}
+
+
+
+/* PARSE DEADBAND: Sets a deadband from "<class>:<absolute>:<percent>" (example "power:5:1").
+    returns 0 if set
+            or -1 if the option is not valid
+*/
+int deadbandParse(const char *option){
+    char    name[16];
+    float   absolute, percent;
+
+    if(sscanf(option, "%15[^:]:%f:%f", name, &absolute, &percent) != 3) return -1;
+    if(absolute < 0 || percent < 0) return -1;
+    for(int c = 0; c < DeadbandClasses; c ++){
+        if(strcmp(name, classNames[c]) == 0){
+            deadbandSet(c, absolute, percent);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+
+/* SET HEARTBEAT: A register is published at least once every interval, even if it didn't change.
+*/
+void deadbandSetHeartbeat(int seconds){
+    if(seconds >= 0) heartbeat = seconds;
+}
+
+
+
+/* DEADBAND PASS: Decides if a sample has to be published (deadbandCommit remembers it once it is).
+    A sample is published if:
+        - it's the first one of its register, or its status changed
+        - it moved more than the absolute or percent deadband of its class from the last value published
+        - the register has been silent for the heartbeat interval
+        - the class has no deadband
+    returns 1 if the sample must be published
+            0 if not
+*/
+int deadbandPass(const Sample *sample){
+    Deadband        *band   = &deadbands[deadbandClass(sample->address)];
+    LastPublished   *last   = lastPublished(sample);
+    int             publish = 0;
+
+    if(last == NULL) return 1;      // Table full: don't filter
+    if(last->key == 0 || last->status != sample->status) publish = 1;
+    else if(band->absolute == 0 && band->percent == 0) publish = 1;
+    else if(sample->status != SampleOk) publish = 0;
+    else{
+        float change = fabsf(sample->value - last->value);
+        if(band->absolute > 0 && change > band->absolute) publish = 1;
+        if(band->percent > 0 && change > band->percent*fabsf(last->value)/100) publish = 1;
+    }
+    if(heartbeat > 0 && sample->timestamp.tv_sec - last->published >= heartbeat) publish = 1;
+    return publish;
+}
+
+
+
+/* DEADBAND COMMIT: Remembers a sample as the last value of its register, once it has been
+   published or journaled (a sample lost on the way must not hide the next ones).
+*/
+void deadbandCommit(const Sample *sample){
+    LastPublished *last = lastPublished(sample);
+
+    if(last == NULL) return;
+    last->key       = ((uint32_t)sample->statistic << 24) | ((uint32_t)sample->slave_id << 16) | sample->address;
+    last->value     = sample->value;
+    last->status    = sample->status;
+    last->published = sample->timestamp.tv_sec;
+}
+
+
+
+/* DEADBAND CLASS: Class of a 3X register.
+*/
+DeadbandClass deadbandClass(uint16_t address){
+    switch(address){
+        case FREQUENCY:
+            return DeadbandFrequency;
+        case POWER_ACTIVE:          case POWER_APPARENT:        case POWER_REACTIVE:
+        case T_PDEMAND:             case T_PDEMAND_MAX:
+        case POS_PDEMAND_CURRENT:   case POS_PDEMAND_MAX:
+        case REV_PDEMAND_CURRENT:   case REV_PDEMAND_MAX:
+            return DeadbandPower;
+        case ACT_ENERGY_IM:         case ACT_ENERGY_EX:
+        case REA_ENERGY_IM:         case REA_ENERGY_EX:
+        case ACT_ENERGY_T:          case REA_ENERGY_T:
+        case RS_ACT_ENERGY:         case RS_REA_ENERGY:
+            return DeadbandEnergy;
+        default:
+            return DeadbandParameters;
+    }
+}
+
+
+
+/* LAST PUBLISHED: Slot of a (slave, register) in the table (open addressing, linear probing).
+    Each statistic of an aggregated register has its own slot.
+    returns the slot (key 0 if nothing was published yet)
+            or NULL if the table is full
+*/
+LastPublished *lastPublished(const Sample *sample){
+    uint32_t key    = ((uint32_t)sample->statistic << 24) | ((uint32_t)sample->slave_id << 16) | sample->address;
+    uint32_t slot   = (key * 2654435761u) & TableMask;
+
+    for(int i = 0; i < DeadbandTableSize; i ++){
+        LastPublished *last = &table[(slot + i) & TableMask];
+        if(last->key == key || last->key == 0) return last;
+    }
+    return NULL;
+}
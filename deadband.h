@@ -0,0 +1,33 @@
+#ifndef deadband
+#define deadband
+
+// Include the modbus (register addresses) and sample queue headers
+#include "modbus.h"
+#include "sampleQueue.h"
+
+// Defines
+#define DeadbandTableSize   4096    // (slave, register) pairs tracked (power of 2)
+
+// Enums
+typedef enum{
+    DeadbandParameters,     // Voltage, current, power factor, phase
+    DeadbandFrequency,      // Frequency
+    DeadbandPower,          // Power and power demand
+    DeadbandEnergy,         // Energy counters
+    DeadbandClasses
+}DeadbandClass;
+
+// Structs
+typedef struct{
+    float       absolute;       // Change needed to publish, in the units of the register (0 disables)
+    float       percent;        // Change needed to publish, in % of the last value published (0 disables)
+}Deadband;
+
+// Functions
+void        deadbandSet(DeadbandClass deadband_class, float absolute, float percent);
+int         deadbandParse(const char *option);
+void        deadbandSetHeartbeat(int seconds);
+int         deadbandPass(const Sample *sample);
+void        deadbandCommit(const Sample *sample);
+
+#endif
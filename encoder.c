@@ -0,0 +1,235 @@
+/***********************************
+*          encoder.c
+*
+* -Binary payload encoder: writes
+*  protobuf fields (Sparkplug B) and
+*  CBOR items into a fixed buffer,
+*  without allocating.
+*
+* used with encoder.h
+*
+***********************************/
+
+// Include header file
+#include "encoder.h"
+
+// Internal functions
+void    putByte(Encoder *enc, uint8_t byte);
+void    putVarint(Encoder *enc, uint64_t value);
+int     varintSize(uint64_t value);
+int     getVarint(const uint8_t data[], int len, int *pos, uint64_t *value);
+
+
+
+/* INIT ENCODER: Starts an empty payload in a buffer.
+*/
+void encoderInit(Encoder *enc, uint8_t *data, int size){
+    enc->data       = data;
+    enc->size       = size;
+    enc->len        = 0;
+    enc->overflow   = 0;
+}
+
+
+
+/* PROTOBUF VARINT: Writes an integer field (uint32, uint64, bool, enum).
+*/
+void protoVarint(Encoder *enc, int field, uint64_t value){
+    putVarint(enc, (uint64_t)field << 3 | WireVarint);
+    putVarint(enc, value);
+}
+
+
+
+/* PROTOBUF FLOAT: Writes a float field (fixed 32 bits, little endian).
+*/
+void protoFloat(Encoder *enc, int field, float value){
+    uint32_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    putVarint(enc, (uint64_t)field << 3 | WireFixed32);
+    for(int i = 0; i < 4; i ++) putByte(enc, bits >> 8*i);
+}
+
+
+
+/* PROTOBUF STRING: Writes a string field.
+*/
+void protoString(Encoder *enc, int field, const char *s){
+    int len = strlen(s);
+
+    putVarint(enc, (uint64_t)field << 3 | WireLength);
+    putVarint(enc, len);
+    for(int i = 0; i < len; i ++) putByte(enc, s[i]);
+}
+
+
+
+/* PROTOBUF BEGIN: Starts an embedded message field, its length is written by protoEnd().
+    One byte is kept for the length, enough for most messages.
+    returns mark to pass to protoEnd()
+*/
+int protoBegin(Encoder *enc, int field){
+    putVarint(enc, (uint64_t)field << 3 | WireLength);
+    putByte(enc, 0);
+    return enc->len;
+}
+
+
+
+/* PROTOBUF END: Writes the length of the embedded message started at mark.
+    Longer messages are moved forward to make room for the length.
+*/
+void protoEnd(Encoder *enc, int mark){
+    int len = enc->len - mark;
+    int extra;
+
+    if(enc->overflow) return;
+    extra = varintSize(len) - 1;
+    if(enc->len + extra > enc->size){
+        enc->overflow = 1;
+        return;
+    }
+    memmove(enc->data + mark + extra, enc->data + mark, len);
+    enc->len = mark - 1;
+    putVarint(enc, len);
+    enc->len += len;
+}
+
+
+
+/* PROTOBUF NEXT: Reads the next field of a received message (commands).
+    Integer and fixed fields: value is the field, length fields: value is the length
+    and pos is left at its first byte (skip it or read the embedded message).
+    returns wire type of the field
+            or -1 at the end or if the message is not valid
+*/
+int protoNext(const uint8_t data[], int len, int *pos, int *field, uint64_t *value){
+    uint64_t key;
+
+    if(*pos >= len || getVarint(data, len, pos, &key) < 0) return -1;
+    *field = key >> 3;
+    switch(key & 0x07){
+        case WireVarint:
+            if(getVarint(data, len, pos, value) < 0) return -1;
+            return WireVarint;
+        case WireLength:
+            if(getVarint(data, len, pos, value) < 0 || *value > (uint64_t)(len - *pos)) return -1;
+            return WireLength;
+        case WireFixed32:
+        case WireFixed64:{
+            int bytes = (key & 0x07) == WireFixed32 ? 4 : 8;
+            if(*pos + bytes > len) return -1;
+            *value = 0;
+            for(int i = 0; i < bytes; i ++) *value |= (uint64_t)data[*pos + i] << 8*i;
+            *pos += bytes;
+            return key & 0x07;
+        }
+    }
+    return -1;
+}
+
+
+
+/* CBOR HEAD: Writes the head of an item, with its argument in the shortest form.
+    (Unsigned integer: the value, text: its length, map: number of pairs)
+*/
+void cborHead(Encoder *enc, CborMajor major, uint64_t value){
+    uint8_t type = major << 5;
+    int     bytes;
+
+    if(value < 24){
+        putByte(enc, type | value);
+        return;
+    }
+    if(value <= 0xFF)               {putByte(enc, type | 24); bytes = 1;}
+    else if(value <= 0xFFFF)        {putByte(enc, type | 25); bytes = 2;}
+    else if(value <= 0xFFFFFFFF)    {putByte(enc, type | 26); bytes = 4;}
+    else                            {putByte(enc, type | 27); bytes = 8;}
+    for(int i = bytes - 1; i >= 0; i --) putByte(enc, value >> 8*i);
+}
+
+
+
+/* CBOR STRING: Writes a text string.
+*/
+void cborString(Encoder *enc, const char *s){
+    int len = strlen(s);
+
+    cborHead(enc, CborText, len);
+    for(int i = 0; i < len; i ++) putByte(enc, s[i]);
+}
+
+
+
+/* CBOR FLOAT: Writes a single precision float (big endian).
+*/
+void cborFloat(Encoder *enc, float value){
+    uint32_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    putByte(enc, CborSimple << 5 | 26);
+    for(int i = 3; i >= 0; i --) putByte(enc, bits >> 8*i);
+}
+
+
+
+/* CBOR NULL: Writes null (value that couldn't be read).
+*/
+void cborNull(Encoder *enc){
+    putByte(enc, CborSimple << 5 | 22);
+}
+
+
+
+/* PUT BYTE: Appends a byte, or flags the overflow if the buffer is full.
+*/
+void putByte(Encoder *enc, uint8_t byte){
+    if(enc->len == enc->size){
+        enc->overflow = 1;
+        return;
+    }
+    enc->data[enc->len ++] = byte;
+}
+
+
+
+/* PUT VARINT: Appends an integer in 7 bit groups, least significant first.
+*/
+void putVarint(Encoder *enc, uint64_t value){
+    while(value >= 0x80){
+        putByte(enc, (value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    putByte(enc, value);
+}
+
+
+
+/* VARINT SIZE: Bytes taken by an integer as a varint.
+*/
+int varintSize(uint64_t value){
+    int bytes = 1;
+
+    while(value >= 0x80){
+        value >>= 7;
+        bytes ++;
+    }
+    return bytes;
+}
+
+
+
+/* GET VARINT: Reads a varint at pos, and moves pos past it.
+    returns 0 if read
+            or -1 if it doesn't end in the data
+*/
+int getVarint(const uint8_t data[], int len, int *pos, uint64_t *value){
+    *value = 0;
+    for(int shift = 0; shift < 64 && *pos < len; shift += 7){
+        uint8_t byte = data[(*pos) ++];
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if(!(byte & 0x80)) return 0;
+    }
+    return -1;
+}
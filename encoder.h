@@ -0,0 +1,48 @@
+#ifndef encoder
+#define encoder
+
+// C headers
+#include <stdint.h>
+#include <string.h>
+
+// Enums
+typedef enum{
+    WireVarint      = 0,    // Protobuf wire types
+    WireFixed64     = 1,
+    WireLength      = 2,
+    WireFixed32     = 5
+}WireType;
+
+typedef enum{
+    CborUnsigned    = 0,    // CBOR major types
+    CborText        = 3,
+    CborMap         = 5,
+    CborSimple      = 7
+}CborMajor;
+
+// Structs
+typedef struct{
+    uint8_t     *data;          // Buffer the payload is written to
+    int         size;           // Size of the buffer
+    int         len;            // Bytes written
+    int         overflow;       // The payload didn't fit (len stops growing)
+}Encoder;
+
+// Functions
+void        encoderInit(Encoder *enc, uint8_t *data, int size);
+
+// Protobuf
+void        protoVarint(Encoder *enc, int field, uint64_t value);
+void        protoFloat(Encoder *enc, int field, float value);
+void        protoString(Encoder *enc, int field, const char *s);
+int         protoBegin(Encoder *enc, int field);
+void        protoEnd(Encoder *enc, int mark);
+int         protoNext(const uint8_t data[], int len, int *pos, int *field, uint64_t *value);
+
+// CBOR
+void        cborHead(Encoder *enc, CborMajor major, uint64_t value);
+void        cborString(Encoder *enc, const char *s);
+void        cborFloat(Encoder *enc, float value);
+void        cborNull(Encoder *enc);
+
+#endif
@@ -0,0 +1,426 @@
+/***********************************
+*          eventLoop.c
+*
+* -Single threaded engine: one epoll
+*  loop drives the serial ports, the
+*  MQTT socket and the scan timers.
+*  Modbus transactions are state
+*  machines moved by ready events.
+*
+* used with eventLoop.h
+*
+***********************************/
+
+// Include header file
+#include "eventLoop.h"
+
+// Define constants
+#define MaxEvents 16        // Events handled per epoll_wait()
+
+// Enums
+typedef enum{
+    SourceSerial,           // Bytes on a serial port
+    SourceTimer,            // Timer of a serial port (schedule, response timeout, silence)
+    SourceMqtt,             // MQTT socket
+    SourceMisc              // MQTT keepalive timer
+}EventSource;
+
+typedef enum{
+    PortIdle,               // Waiting for the next group to be due
+    PortWaiting             // Request sent, waiting for the response
+}PortState;
+
+// Structs
+typedef struct{
+    ModbusPort      *port;                          // Serial port of the bus
+    Schedule        *schedule;                      // Register groups polled on this bus (asked when the port is idle)
+    CommandQueue    *commands;                      // On-demand reads of this bus (NULL: none)
+    void            *context;                       // Caller data passed to the callbacks
+    int             timer_fd;                       // Schedule and response timer
+    PortState       state;
+    ScheduleEntry   *entry;                         // Group being read (or the entry of the command)
+    Command         command;                        // On-demand read being read
+    int             on_command;                     // The port is reading the command, not a group
+    const RegisterWindow *windows;                  // Windows of the group (planned by the scheduler)
+    int             n_windows;
+    int             window;                         // Window being read
+    int             attempts;                       // Attempts of the current window
+    RtuParser       parser;                         // Stream parser for the response
+    RtuFrame        frame;                          // Recieved message
+    struct timespec response_deadline;              // Time the response must be complete
+    struct timespec sent;                           // Time the request was sent
+    struct timespec group_start;                    // Time the group started to be read
+    uint8_t         data[2*MaxWindowRegisters];     // Register bytes of one window
+    float           values[MaxEntryParameters];     // Values of the group
+    struct timespec stamps[MaxEntryParameters];     // Time each value was read (CLOCK_REALTIME)
+}LoopPort;
+
+// Internal functions
+void        armTimer(int timer_fd, const struct timespec *at);
+void        portSchedule(LoopPort *lp);
+void        portStartGroup(LoopPort *lp);
+int         portDue(LoopPort *lp);
+void        portSendWindow(LoopPort *lp);
+void        portNextWindow(LoopPort *lp);
+void        portRetry(LoopPort *lp);
+void        portFrame(LoopPort *lp);
+void        portReadable(LoopPort *lp);
+void        portTimer(LoopPort *lp);
+void        mqttWatch();
+
+// Variables
+static LoopPort         loopPorts[MaxLoopPorts];
+static int              n_loopPorts     = 0;
+static int              epoll_fd        = -1;
+static int              mqtt_fd         = -1;   // MQTT socket registered in epoll
+static uint32_t         mqtt_events     = 0;    // Events registered for the MQTT socket
+static GroupCallback    groupDone;
+static ScheduleCallback scheduleOf;
+
+
+
+/* ADD PORT: Adds an open serial port to the event loop, its schedule is asked with the callback of eventLoopRun().
+    +Commands::         On-demand reads of the meters of the bus, read ahead of the schedule (NULL if not used)
+    returns 0 if added
+            or -1 if error
+*/
+int eventLoopAddPort(ModbusPort *port, CommandQueue *commands, void *context){
+    LoopPort *lp;
+
+    if(n_loopPorts == MaxLoopPorts){
+        printf("ERROR: Too many ports in the event loop, max %i\n", MaxLoopPorts);
+        return -1;
+    }
+    if(port->transport != TransportRtu){
+        printf("ERROR: Modbus TCP gateway %s can't be polled by the event loop, run without -e\n", port->path);
+        return -1;
+    }
+    lp = &loopPorts[n_loopPorts];
+    lp->port        = port;
+    lp->schedule    = NULL;
+    lp->commands    = commands;
+    lp->context     = context;
+    lp->state       = PortIdle;
+    lp->on_command  = 0;
+    lp->timer_fd    = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(lp->timer_fd < 0){
+        printf("ERROR %i from timerfd_create: %s\n", errno, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from timerfd_create: %s", errno, strerror(errno));
+        return -1;
+    }
+    n_loopPorts ++;
+    return 0;
+}
+
+
+
+/* RUN EVENT LOOP: Polls every port and serves the MQTT client forever from this thread.
+    +Publish::          Called with the values of each register group read
+    +Schedule Of::      Called with the context of a port for the schedule it polls next
+*/
+void eventLoopRun(GroupCallback publish, ScheduleCallback schedule_of){
+    struct epoll_event  ev;
+    struct epoll_event  events[MaxEvents];
+    struct itimerspec   misc    = {{MiscPeriod/1000, (MiscPeriod%1000)*1000000}, {MiscPeriod/1000, (MiscPeriod%1000)*1000000}};
+    struct timespec     at_once = {0, 0};       // A time passed: the timer fires at once
+    int                 misc_fd;
+
+    groupDone = publish;
+    scheduleOf = schedule_of;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0){
+        printf("ERROR %i from epoll_create1: %s\n", errno, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from epoll_create1: %s", errno, strerror(errno));
+        abort();
+    }
+
+    // Serial ports and their timers
+    for(int i = 0; i < n_loopPorts; i ++){
+        ev.events   = EPOLLIN;
+        ev.data.u64 = ((uint64_t)SourceSerial << 32) | i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, loopPorts[i].port->fd, &ev);
+        ev.data.u64 = ((uint64_t)SourceTimer << 32) | i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, loopPorts[i].timer_fd, &ev);
+        portSchedule(&loopPorts[i]);
+    }
+
+    // MQTT keepalive and reconnection
+    misc_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    timerfd_settime(misc_fd, 0, &misc, NULL);
+    ev.events   = EPOLLIN;
+    ev.data.u64 = (uint64_t)SourceMisc << 32;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, misc_fd, &ev);
+
+    while(1){
+        mqttWatch();
+        int n = epoll_wait(epoll_fd, events, MaxEvents, -1);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            printf("ERROR %i from epoll_wait: %s\n", errno, strerror(errno));
+            syslog(LOG_ERR, "ERROR %i from epoll_wait: %s", errno, strerror(errno));
+            abort();
+        }
+        for(int i = 0; i < n; i ++){
+            EventSource source  = events[i].data.u64 >> 32;
+            int         index   = events[i].data.u64 & 0xFFFFFFFF;
+            uint64_t    expirations;
+
+            switch(source){
+                case SourceSerial:
+                    portReadable(&loopPorts[index]);
+                    break;
+                case SourceTimer:
+                    if(read(loopPorts[index].timer_fd, &expirations, sizeof(expirations)) < 0) break;
+                    portTimer(&loopPorts[index]);
+                    break;
+                case SourceMqtt:
+                    if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) mqtt_loop_read();
+                    if(events[i].events & EPOLLOUT) mqtt_loop_write();
+                    break;
+                case SourceMisc:
+                    if(read(misc_fd, &expirations, sizeof(expirations)) < 0) break;
+                    if(mqtt_socket() < 0) mqtt_reconnect();
+                    else mqtt_loop_misc();
+                    break;
+            }
+        }
+
+        // Commands queued by the MQTT client wake the idle ports (see portTimer)
+        for(int i = 0; i < n_loopPorts; i ++){
+            LoopPort *lp = &loopPorts[i];
+            if(lp->state == PortIdle && lp->commands != NULL && commandPending(lp->commands)) armTimer(lp->timer_fd, &at_once);
+        }
+    }
+}
+
+
+
+/* MQTT WATCH: Keeps the MQTT socket registered in epoll (it changes on reconnection)
+   and asks for EPOLLOUT only while the client has data to send.
+*/
+void mqttWatch(){
+    struct epoll_event  ev;
+    int                 fd      = mqtt_socket();
+
+    ev.events   = EPOLLIN | (mqtt_want_write() ? EPOLLOUT : 0);
+    ev.data.u64 = (uint64_t)SourceMqtt << 32;
+    if(fd != mqtt_fd){
+        // A closed socket leaves epoll by itself
+        if(mqtt_fd >= 0) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, mqtt_fd, NULL);
+        if(fd >= 0) epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        mqtt_fd     = fd;
+        mqtt_events = ev.events;
+    }else if(fd >= 0 && ev.events != mqtt_events){
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        mqtt_events = ev.events;
+    }
+}
+
+
+
+/* ARM TIMER: Sets the timer of a port to fire at an absolute time (CLOCK_MONOTONIC).
+   A time already passed fires at once.
+*/
+void armTimer(int timer_fd, const struct timespec *at){
+    struct itimerspec spec = {{0, 0}, *at};
+
+    // A zero value would disarm the timer
+    if(spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+
+
+/* PORT SCHEDULE: Waits for the next register group of the port to be due.
+    No group is being read: the schedule can be swapped here (register map reloaded).
+*/
+void portSchedule(LoopPort *lp){
+    lp->state = PortIdle;
+    lp->schedule = scheduleOf(lp->context);
+    lp->entry = schedulerNext(lp->schedule);
+    if(lp->entry != NULL) armTimer(lp->timer_fd, &lp->entry->deadline);
+}
+
+
+
+/* PORT START GROUP: Starts reading the windows of the group that is due (or of the command) and sends the first request.
+*/
+void portStartGroup(LoopPort *lp){
+    uint8_t error_signal[4] = {0xFF,0xFF,0xFF,0xFF};    // Value used if the window can't be read
+    ScheduleEntry *entry = lp->entry;
+
+    logDebug("**--Begining Publishing Loop (%s)--**\n", lp->port->path);
+    if(!lp->on_command) schedulerStart(entry);
+    clock_gettime(CLOCK_MONOTONIC, &lp->group_start);
+    for(int i = 0; i < entry->n; i ++) lp->values[i] = bytesToFloat(error_signal);
+    lp->windows = entry->windows;
+    lp->n_windows = entry->n_windows;
+    lp->window = -1;
+    portNextWindow(lp);
+}
+
+
+
+/* PORT NEXT WINDOW: Sends the request of the next window, or hands the values over when the group is complete.
+*/
+void portNextWindow(LoopPort *lp){
+    // The transaction of the previous window completed (read or given up)
+    if(lp->window >= 0) modbusStampWindow(&lp->windows[lp->window], lp->entry->addresses, lp->entry->n, lp->stamps);
+    lp->window ++;
+    // Once the meter is found down (its probe failed) the rest of the windows aren't sent
+    while(lp->window > 0 && lp->window < lp->n_windows && healthDown(lp->entry->slave_id)){
+        modbusStampWindow(&lp->windows[lp->window], lp->entry->addresses, lp->entry->n, lp->stamps);
+        lp->window ++;
+    }
+    if(lp->window < lp->n_windows){
+        lp->attempts = 0;
+        portSendWindow(lp);
+        return;
+    }
+
+    // Command complete: its values go back to the topic of the command
+    if(lp->on_command){
+        commandReply(&lp->command, lp->values);
+        lp->on_command = 0;
+        portSchedule(lp);
+        return;
+    }
+
+    // Group complete
+    metricsScan(lp->entry->slave_id, &lp->group_start, lp->entry->period_ms == ScanRatePeriod);
+    logDebug("**Publishing to MQTT\n");
+    groupDone(lp->context, lp->entry, lp->values, lp->stamps);
+    schedulerDone(lp->schedule, lp->entry, getScanRate());
+    portSchedule(lp);
+}
+
+
+
+/* PORT DUE: The group of the port is due (the timer may fire before for a command).
+*/
+int portDue(LoopPort *lp){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespecDiffUs(&lp->entry->deadline, &now) >= 0;
+}
+
+
+
+/* PORT SEND WINDOW: Sends the request of the current window and starts the response timeout.
+*/
+void portSendWindow(LoopPort *lp){
+    const RegisterWindow *window = &lp->windows[lp->window];
+
+    logDebug("--Block query [%#06x ... %#06x]--\n", window->start, window->start + window->count - 1);
+    modbusSendFrame(lp->port, window->request, RequestSize);
+    rtuParserInit(&lp->parser, lp->entry->slave_id, window->request[1]);
+    clock_gettime(CLOCK_MONOTONIC, &lp->sent);
+    lp->response_deadline = lp->sent;
+    timespecAddMs(&lp->response_deadline, modbusResponseMs(lp->port, lp->entry->slave_id, 5 + 2*window->count));
+    armTimer(lp->timer_fd, &lp->response_deadline);
+    lp->state = PortWaiting;
+}
+
+
+
+/* PORT RETRY: Sends the window again, or gives up on it after AttemptTimeout attempts (one if the meter is down).
+*/
+void portRetry(LoopPort *lp){
+    lp->attempts ++;
+    if(lp->attempts < healthAttempts(lp->entry->slave_id, AttemptTimeout)){
+        metricsCount(lp->entry->slave_id, CounterRetries, 1);
+        portSendWindow(lp);
+        return;
+    }
+    printf("ERROR: Too many attemps, returning error signal.\n");
+    metricsCount(lp->entry->slave_id, CounterFailures, 1);
+    healthFailure(lp->entry->slave_id);
+    portNextWindow(lp);
+}
+
+
+
+/* PORT FRAME: Handles a complete frame recieved for the current window.
+*/
+void portFrame(LoopPort *lp){
+    const RegisterWindow *window = &lp->windows[lp->window];
+    int data_bytes;
+
+    healthResponse(lp->entry->slave_id, &lp->sent, modbusWireUs(lp->port, RequestSize + lp->frame.length));
+    data_bytes = modbusProcessResponse(&lp->frame, window->count, lp->data);
+
+    if(data_bytes >= 0){
+        metricsTransaction(lp->entry->slave_id, window->start, &lp->sent);
+        modbusDecodeWindow(window, lp->data, lp->entry->addresses, lp->entry->fields, lp->entry->n, lp->values);
+        portNextWindow(lp);
+    }else if(data_bytes == ResponseRetry){
+        portRetry(lp);
+    }else{
+        metricsCount(lp->entry->slave_id, CounterFailures, 1);
+        portNextWindow(lp);
+    }
+}
+
+
+
+/* PORT READABLE: Bytes arrived on the serial port.
+*/
+void portReadable(LoopPort *lp){
+    struct timespec silence;
+
+    if(lp->state != PortWaiting){
+        // Nobody asked: drop the bytes
+        RtuParser idle;
+        rtuParserInit(&idle, 0, 0);
+        modbusReadPort(lp->port, &idle);
+        return;
+    }
+
+    if(modbusReadPort(lp->port, &lp->parser) < 0) return;
+    if(rtuParserNext(&lp->parser, &lp->frame)){
+        portFrame(lp);
+        return;
+    }
+    // A frame has started: the line going silent also ends it
+    if(rtuParserPending(&lp->parser) > 0){
+        clock_gettime(CLOCK_MONOTONIC, &silence);
+        timespecAddMs(&silence, modbusSilenceMs(lp->port));
+        if(timespecDiffMs(&silence, &lp->response_deadline) > 0) armTimer(lp->timer_fd, &silence);
+    }
+}
+
+
+
+/* PORT TIMER: The group is due, a command is waiting, the line went silent, or the response timed out.
+    Commands go ahead of the groups, unless a group has waited for CommandBurst of them (see commandTake).
+*/
+void portTimer(LoopPort *lp){
+    struct timespec now;
+
+    if(lp->state == PortIdle){
+        if(lp->commands != NULL && commandTake(lp->commands, &lp->command, lp->entry != NULL ? &lp->entry->deadline : NULL)){
+            lp->on_command  = 1;
+            lp->entry       = &lp->command.entry;
+            portStartGroup(lp);
+        }
+        else if(lp->entry != NULL && portDue(lp)) portStartGroup(lp);
+        else portSchedule(lp);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(timespecDiffMs(&now, &lp->response_deadline) > 0){
+        // Silence: the partial frame is noise, look for a frame in the bytes after it
+        if(modbusSilence(&lp->parser, &lp->frame)){
+            portFrame(lp);
+            return;
+        }
+        armTimer(lp->timer_fd, &lp->response_deadline);
+        return;
+    }
+
+    // Timeout
+    modbusReceiveWarning(&lp->parser);
+    portRetry(lp);
+}
@@ -0,0 +1,28 @@
+#ifndef eventLoop
+#define eventLoop
+
+// Include the modbus, scheduler, on-demand read and MQTT headers
+#include "modbus.h"
+#include "scheduler.h"
+#include "onDemand.h"
+#include "mqttClient.h"
+
+// Linux headers
+#include <sys/epoll.h>      // epoll_create1(), epoll_wait()
+#include <sys/timerfd.h>    // timerfd_create(), timers as file descriptors
+
+// Defines
+#define MaxLoopPorts        8       // Max serial ports driven by the event loop
+#define MiscPeriod          1000    // Period of the MQTT keepalive/reconnect work (mili seconds)
+
+// Callback with the values of a register group once all its windows are read, and the time each one was read
+typedef void (*GroupCallback)(void *context, ScheduleEntry *entry, float values[], struct timespec stamps[]);
+
+// Callback with the schedule of a port, asked each time the port is idle (it may be a new one: the old one is left)
+typedef Schedule *(*ScheduleCallback)(void *context);
+
+// Functions
+int         eventLoopAddPort(ModbusPort *port, CommandQueue *commands, void *context);
+void        eventLoopRun(GroupCallback publish, ScheduleCallback schedule_of);
+
+#endif
@@ -0,0 +1,305 @@
+/***********************************
+*          floatText.c
+*
+* -Float to text: writes the shortest
+*  decimal that reads back as the same
+*  float (Ryu algorithm), without
+*  printf and without allocating.
+*
+* used with floatText.h
+*
+***********************************/
+
+// Include header file
+#include "floatText.h"
+
+// Linux headers
+#include <string.h>
+
+// Define constants
+#define MantissaBits    23      // IEEE 754 single precision
+#define ExponentBits    8
+#define ExponentBias    127
+#define Pow5InvBits     59      // Bits of the multipliers in the tables
+#define Pow5Bits        61
+#define MaxPlainExp     9       // Values in [1e-5, 1e9) are written without exponent
+
+// Internal functions
+int         decimalShortest(uint32_t ieee_mantissa, uint32_t ieee_exponent, int32_t *exponent, uint32_t *digits);
+int         writeDigits(char *s, uint32_t digits, int length);
+int         digitCount(uint32_t digits);
+uint32_t    mulShift(uint32_t m, uint64_t factor, int32_t shift);
+int         pow5Factor(uint32_t value);
+int32_t     pow5BitCount(int32_t e);
+
+// floor(2^(k + Pow5InvBits - 1) / 5^i) + 1, k = bits of 5^i
+static const uint64_t pow5InvSplit[31] = {
+    576460752303423489u, 461168601842738791u, 368934881474191033u,
+    295147905179352826u, 472236648286964522u, 377789318629571618u,
+    302231454903657294u, 483570327845851670u, 386856262276681336u,
+    309485009821345069u, 495176015714152110u, 396140812571321688u,
+    316912650057057351u, 507060240091291761u, 405648192073033409u,
+    324518553658426727u, 519229685853482763u, 415383748682786211u,
+    332306998946228969u, 531691198313966350u, 425352958651173080u,
+    340282366920938464u, 544451787073501542u, 435561429658801234u,
+    348449143727040987u, 557518629963265579u, 446014903970612463u,
+    356811923176489971u, 570899077082383953u, 456719261665907162u,
+    365375409332725730u
+};
+
+// 5^i scaled to Pow5Bits bits
+static const uint64_t pow5Split[48] = {
+    1152921504606846976u, 1441151880758558720u, 1801439850948198400u,
+    2251799813685248000u, 1407374883553280000u, 1759218604441600000u,
+    2199023255552000000u, 1374389534720000000u, 1717986918400000000u,
+    2147483648000000000u, 1342177280000000000u, 1677721600000000000u,
+    2097152000000000000u, 1310720000000000000u, 1638400000000000000u,
+    2048000000000000000u, 1280000000000000000u, 1600000000000000000u,
+    2000000000000000000u, 1250000000000000000u, 1562500000000000000u,
+    1953125000000000000u, 1220703125000000000u, 1525878906250000000u,
+    1907348632812500000u, 1192092895507812500u, 1490116119384765625u,
+    1862645149230957031u, 1164153218269348144u, 1455191522836685180u,
+    1818989403545856475u, 2273736754432320594u, 1421085471520200371u,
+    1776356839400250464u, 2220446049250313080u, 1387778780781445675u,
+    1734723475976807094u, 2168404344971008868u, 1355252715606880542u,
+    1694065894508600678u, 2117582368135750847u, 1323488980084844279u,
+    1654361225106055349u, 2067951531382569187u, 1292469707114105741u,
+    1615587133892632177u, 2019483917365790221u, 1262177448353618888u
+};
+
+
+
+/* FLOAT TO TEXT: Writes the shortest decimal that reads back as the same float (strtof()),
+   the closest to the value if there are several. Exponent notation outside [1e-5, 1e9).
+   Examples: 230.1 -> "230.1", 0.1f -> "0.1", 1e10f -> "1e+10", NaN -> "nan"
+
+    +S::    Buffer of FloatTextSize characters at least
+
+    returns length of the text (null character not counted)
+*/
+int floatToText(char *s, float value){
+    uint32_t    bits;
+    uint32_t    ieee_mantissa, ieee_exponent;
+    uint32_t    digits;                     // Decimal digits of the value
+    int32_t     exponent;                   // Value is digits * 10^exponent
+    int         length, point, len = 0;
+
+    memcpy(&bits, &value, sizeof(bits));
+    ieee_mantissa = bits & ((1u << MantissaBits) - 1);
+    ieee_exponent = (bits >> MantissaBits) & ((1u << ExponentBits) - 1);
+    if(bits >> 31) s[len ++] = '-';
+
+    // Special values (printed as printf does)
+    if(ieee_exponent == (1u << ExponentBits) - 1){
+        memcpy(s + len, ieee_mantissa ? "nan" : "inf", 4);
+        return len + 3;
+    }
+    if(ieee_exponent == 0 && ieee_mantissa == 0){
+        memcpy(s + len, "0", 2);
+        return len + 1;
+    }
+
+    length = decimalShortest(ieee_mantissa, ieee_exponent, &exponent, &digits);
+    point = exponent + length;              // Digits before the decimal point
+
+    if(point > -5 && point <= MaxPlainExp){
+        if(point <= 0){
+            // 0.000ddd
+            s[len ++] = '0';
+            s[len ++] = '.';
+            for(int i = point; i < 0; i ++) s[len ++] = '0';
+            len += writeDigits(s + len, digits, length);
+        }else if(exponent >= 0){
+            // ddd000
+            len += writeDigits(s + len, digits, length);
+            for(int i = 0; i < exponent; i ++) s[len ++] = '0';
+        }else{
+            // ddd.ddd
+            len += writeDigits(s + len, digits, length);
+            memmove(s + len - length + point + 1, s + len - length + point, length - point);
+            s[len - length + point] = '.';
+            len ++;
+        }
+    }else{
+        // d.ddde+XX (at least two exponent digits, as printf)
+        int e10 = point - 1;
+        len += writeDigits(s + len, digits, length);
+        if(length > 1){
+            memmove(s + len - length + 2, s + len - length + 1, length - 1);
+            s[len - length + 1] = '.';
+            len ++;
+        }
+        s[len ++] = 'e';
+        s[len ++] = e10 < 0 ? '-' : '+';
+        if(e10 < 0) e10 = -e10;
+        if(e10 < 10) s[len ++] = '0';
+        len += writeDigits(s + len, e10, digitCount(e10));
+    }
+    s[len] = '\0';
+    return len;
+}
+
+
+
+/* DECIMAL SHORTEST: Finds the shortest digits inside the interval of values that round to the float
+   (Ryu, Ulf Adams 2018: the bounds are scaled by a power of 10 with 64 bit multipliers,
+   and digits are removed while both bounds still differ).
+    returns number of digits
+*/
+int decimalShortest(uint32_t ieee_mantissa, uint32_t ieee_exponent, int32_t *exponent, uint32_t *digits){
+    int32_t     e2;
+    uint32_t    m2;
+    uint32_t    vr, vp, vm;                 // Value, upper and lower bound scaled
+    int32_t     e10;
+    int         vm_trailing_zeros = 0, vr_trailing_zeros = 0;
+    uint8_t     last_removed = 0;
+    int32_t     removed = 0;
+    uint32_t    output;
+
+    if(ieee_exponent == 0){
+        e2 = 1 - ExponentBias - MantissaBits - 2;
+        m2 = ieee_mantissa;
+    }else{
+        e2 = (int32_t)ieee_exponent - ExponentBias - MantissaBits - 2;
+        m2 = (1u << MantissaBits) | ieee_mantissa;
+    }
+    int accept_bounds = (m2 & 1) == 0;      // Round half to even: the bounds read back as the float
+
+    // Interval of the values that round to the float (times 4)
+    uint32_t mv = 4*m2;
+    uint32_t mp = 4*m2 + 2;
+    uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+    uint32_t mm = 4*m2 - 1 - mm_shift;
+
+    if(e2 >= 0){
+        uint32_t q = ((uint32_t)e2*78913) >> 18;                // log10(2^e2)
+        int32_t k = Pow5InvBits + pow5BitCount(q) - 1;
+        int32_t i = -e2 + (int32_t)q + k;
+        e10 = q;
+        vr = mulShift(mv, pow5InvSplit[q], i);
+        vp = mulShift(mp, pow5InvSplit[q], i);
+        vm = mulShift(mm, pow5InvSplit[q], i);
+        if(q != 0 && (vp - 1)/10 <= vm/10){
+            int32_t l = Pow5InvBits + pow5BitCount(q - 1) - 1;
+            last_removed = mulShift(mv, pow5InvSplit[q - 1], -e2 + (int32_t)q - 1 + l) % 10;
+        }
+        if(q <= 9){
+            if(mv % 5 == 0) vr_trailing_zeros = pow5Factor(mv) >= (int)q;
+            else if(accept_bounds) vm_trailing_zeros = pow5Factor(mm) >= (int)q;
+            else vp -= pow5Factor(mp) >= (int)q;
+        }
+    }else{
+        uint32_t q = ((uint32_t)-e2*732923) >> 20;              // log10(5^-e2)
+        int32_t i = -e2 - (int32_t)q;
+        int32_t k = pow5BitCount(i) - Pow5Bits;
+        int32_t j = (int32_t)q - k;
+        e10 = (int32_t)q + e2;
+        vr = mulShift(mv, pow5Split[i], j);
+        vp = mulShift(mp, pow5Split[i], j);
+        vm = mulShift(mm, pow5Split[i], j);
+        if(q != 0 && (vp - 1)/10 <= vm/10){
+            j = (int32_t)q - 1 - (pow5BitCount(i + 1) - Pow5Bits);
+            last_removed = mulShift(mv, pow5Split[i + 1], j) % 10;
+        }
+        if(q <= 1){
+            vr_trailing_zeros = 1;
+            if(accept_bounds) vm_trailing_zeros = mm_shift == 1;
+            else vp --;
+        }else if(q < 31){
+            vr_trailing_zeros = (mv & ((1u << (q - 1)) - 1)) == 0;
+        }
+    }
+
+    // Remove digits while the bounds still differ
+    if(vm_trailing_zeros || vr_trailing_zeros){
+        while(vp/10 > vm/10){
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last_removed == 0;
+            last_removed = vr % 10;
+            vr /= 10; vp /= 10; vm /= 10;
+            removed ++;
+        }
+        if(vm_trailing_zeros){
+            while(vm % 10 == 0){
+                vr_trailing_zeros &= last_removed == 0;
+                last_removed = vr % 10;
+                vr /= 10; vp /= 10; vm /= 10;
+                removed ++;
+            }
+        }
+        // Exactly halfway: round to even
+        if(vr_trailing_zeros && last_removed == 5 && vr % 2 == 0) last_removed = 4;
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed >= 5);
+    }else{
+        while(vp/10 > vm/10){
+            last_removed = vr % 10;
+            vr /= 10; vp /= 10; vm /= 10;
+            removed ++;
+        }
+        output = vr + (vr == vm || last_removed >= 5);
+    }
+
+    *exponent = e10 + removed;
+    *digits = output;
+    return digitCount(output);
+}
+
+
+
+/* WRITE DIGITS: Writes the decimal digits of a number (no null character).
+*/
+int writeDigits(char *s, uint32_t digits, int length){
+    for(int i = length - 1; i >= 0; i --){
+        s[i] = '0' + digits % 10;
+        digits /= 10;
+    }
+    return length;
+}
+
+
+
+/* DIGIT COUNT: Number of decimal digits of a number (1 for 0).
+*/
+int digitCount(uint32_t digits){
+    int length = 1;
+
+    while(digits >= 10){
+        digits /= 10;
+        length ++;
+    }
+    return length;
+}
+
+
+
+/* MULTIPLY AND SHIFT: (m * factor) >> shift, with shift > 32 (96 bit product).
+*/
+uint32_t mulShift(uint32_t m, uint64_t factor, int32_t shift){
+    uint64_t low    = (uint64_t)m * (uint32_t)factor;
+    uint64_t high   = (uint64_t)m * (uint32_t)(factor >> 32);
+    uint64_t sum    = (low >> 32) + high;
+
+    return (uint32_t)(sum >> (shift - 32));
+}
+
+
+
+/* POWER OF 5 FACTOR: Times the value can be divided by 5.
+*/
+int pow5Factor(uint32_t value){
+    int count = 0;
+
+    while(value % 5 == 0){
+        value /= 5;
+        count ++;
+    }
+    return count;
+}
+
+
+
+/* POWER OF 5 BITS: Bits needed for 5^e (1 for e = 0).
+*/
+int32_t pow5BitCount(int32_t e){
+    return (int32_t)(((uint32_t)e*1217359) >> 19) + 1;
+}
@@ -0,0 +1,13 @@
+#ifndef floatText
+#define floatText
+
+// C headers
+#include <stdint.h>
+
+// Defines
+#define FloatTextSize       24      // Buffer for any float ("-1.23456789e-45" and the null character)
+
+// Functions
+int         floatToText(char *s, float value);
+
+#endif
@@ -0,0 +1,161 @@
+/***********************************
+*          health.c
+*
+* -Meter health: response timeout of
+*  every meter from its measured
+*  response times (like the TCP
+*  retransmission timeout), backoff
+*  on timeouts, and a breaker that
+*  only probes dead meters from time
+*  to time.
+*
+* used with health.h
+*
+***********************************/
+
+// Include header file
+#include "health.h"
+
+// Include the logger
+#include "logger.h"
+
+// Linux headers
+#include <syslog.h>
+
+// Structs
+typedef struct{
+    long            srtt_us;        // Smoothed response time (after the frames are on the wire)
+    long            rttvar_us;      // Smoothed deviation of the response time
+    int             samples;        // Responses measured
+    int             backoff;        // Timeouts in a row (the timeout doubles with each one)
+    int             failures;       // Transactions given up in a row
+    int             down;           // Breaker open: the meter is only probed
+    int             probe_ms;       // Period of the probes
+    struct timespec next_probe;     // Time of the next probe (CLOCK_MONOTONIC)
+}SlaveHealth;
+
+// Variables
+static SlaveHealth healthTable[256];   // By slave ID (each meter is polled by one thread)
+
+
+
+/* RESPONSE TIMEOUT: Time to wait for the response of a meter, without the time of the frames on the wire.
+    Smoothed response time plus 4 deviations, doubled for every timeout in a row.
+    +Default::          Timeout used until the meter has answered (mili seconds)
+*/
+int healthTimeoutMs(uint8_t slave_id, int default_ms){
+    SlaveHealth *h = &healthTable[slave_id];
+    long        timeout_us;
+
+    if(h->samples == 0) timeout_us = default_ms*1000L;
+    else{
+        timeout_us = h->srtt_us + 4*h->rttvar_us;
+        if(timeout_us < MinResponseTimeout*1000L) timeout_us = MinResponseTimeout*1000L;
+    }
+    timeout_us <<= h->backoff;
+    if(timeout_us > MaxResponseTimeout*1000L) timeout_us = MaxResponseTimeout*1000L;
+    return (timeout_us + 999)/1000;
+}
+
+
+
+/* ATTEMPTS: Requests sent for a window before giving up, only one for meters found down.
+*/
+int healthAttempts(uint8_t slave_id, int attempts){
+    return healthTable[slave_id].down ? 1 : attempts;
+}
+
+
+
+/* DOWN: The breaker of a meter is open.
+*/
+int healthDown(uint8_t slave_id){
+    return healthTable[slave_id].down;
+}
+
+
+
+/* HOLD: Time until a meter found down can be probed again (0 if it's up or the probe is due).
+*/
+long healthHoldMs(uint8_t slave_id){
+    SlaveHealth     *h = &healthTable[slave_id];
+    struct timespec now;
+    long            hold_ms;
+
+    if(!h->down) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    hold_ms = (h->next_probe.tv_sec - now.tv_sec)*1000 + (h->next_probe.tv_nsec - now.tv_nsec)/1000000;
+    return hold_ms > 0 ? hold_ms : 0;
+}
+
+
+
+/* RESPONSE: A meter answered (data or exception), adds its response time to the estimator.
+    +Sent::             Time the request was sent (CLOCK_MONOTONIC)
+    +Wire::             Time of the request and the response on the wire (micro seconds)
+*/
+void healthResponse(uint8_t slave_id, const struct timespec *sent, long wire_us){
+    SlaveHealth     *h = &healthTable[slave_id];
+    struct timespec now;
+    long            rtt_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rtt_us = (now.tv_sec - sent->tv_sec)*1000000 + (now.tv_nsec - sent->tv_nsec)/1000 - wire_us;
+    if(rtt_us < 0) rtt_us = 0;
+
+    // RFC 6298: gains of 1/8 (mean) and 1/4 (deviation)
+    if(h->samples == 0){
+        h->srtt_us      = rtt_us;
+        h->rttvar_us    = rtt_us/2;
+    }else{
+        long error = rtt_us - h->srtt_us;
+        h->rttvar_us    += ((error < 0 ? -error : error) - h->rttvar_us)/4;
+        h->srtt_us      += error/8;
+    }
+    h->samples ++;
+    h->backoff  = 0;
+    h->failures = 0;
+    if(h->down){
+        h->down = 0;
+        logInfo("  Slave %i answers again, polled at its period.\n", slave_id);
+        syslog(LOG_INFO, "Slave %i answers again, polled at its period.", slave_id);
+    }
+}
+
+
+
+/* TIMEOUT: A request of a meter got no valid response in time, its next timeout doubles.
+*/
+void healthTimeout(uint8_t slave_id){
+    SlaveHealth *h = &healthTable[slave_id];
+
+    if(h->backoff < MaxBackoff) h->backoff ++;
+}
+
+
+
+/* FAILURE: A transaction of a meter was given up. After BreakerFailures in a row the meter is
+   demoted to probes, every ProbeMinPeriod at first and twice as long after each failed probe.
+*/
+void healthFailure(uint8_t slave_id){
+    SlaveHealth *h = &healthTable[slave_id];
+
+    h->failures ++;
+    if(!h->down){
+        if(h->failures < BreakerFailures) return;
+        h->down     = 1;
+        h->probe_ms = ProbeMinPeriod;
+        logWarning("WARNING: Slave %i not answering, probed every %i s.\n", slave_id, h->probe_ms/1000);
+        syslog(LOG_WARNING, "WARNING from healthFailure: Slave %i not answering, probed every %i s.", slave_id, h->probe_ms/1000);
+    }else if(h->probe_ms < ProbeMaxPeriod){
+        h->probe_ms *= 2;
+        if(h->probe_ms > ProbeMaxPeriod) h->probe_ms = ProbeMaxPeriod;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &h->next_probe);
+    h->next_probe.tv_sec    += h->probe_ms/1000;
+    h->next_probe.tv_nsec   += (h->probe_ms%1000)*1000000;
+    if(h->next_probe.tv_nsec >= 1000000000){
+        h->next_probe.tv_sec ++;
+        h->next_probe.tv_nsec -= 1000000000;
+    }
+}
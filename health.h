@@ -0,0 +1,25 @@
+#ifndef health
+#define health
+
+// C headers
+#include <stdint.h>
+#include <time.h>
+
+// Defines
+#define MinResponseTimeout  50      // Shortest response timeout set by the estimator (mili seconds)
+#define MaxResponseTimeout  1000    // Longest response timeout, backoff included (mili seconds)
+#define MaxBackoff          2       // Consecutive timeouts doubling the timeout (up to x4)
+#define BreakerFailures     2       // Transactions given up in a row before a meter is demoted
+#define ProbeMinPeriod      5000    // First probe of a meter found down (mili seconds)
+#define ProbeMaxPeriod      60000   // Longest period between two probes (mili seconds)
+
+// Functions
+int         healthTimeoutMs(uint8_t slave_id, int default_ms);
+int         healthAttempts(uint8_t slave_id, int attempts);
+int         healthDown(uint8_t slave_id);
+long        healthHoldMs(uint8_t slave_id);
+void        healthResponse(uint8_t slave_id, const struct timespec *sent, long wire_us);
+void        healthTimeout(uint8_t slave_id);
+void        healthFailure(uint8_t slave_id);
+
+#endif
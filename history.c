@@ -0,0 +1,746 @@
+/***********************************
+*          history.c
+*
+* -Local history: every sample of
+*  the buses is kept compressed in
+*  mmap'd day partitions (Gorilla:
+*  delta of delta times and XOR'd
+*  values), and time ranges are
+*  streamed back
+*  over MQTT on request.
+*
+* used with history.h
+*
+***********************************/
+
+// Include header file
+#include "history.h"
+
+// Define constants
+#define HistoryMagic    0x48535431                  // "HST1"
+#define DayMs           86400000LL                  // Length of a partition (UTC days)
+#define BlockData       (HistoryBlockSize - 40)     // Bytes of compressed points in a block
+#define BlockBits       (BlockData*8)
+#define PointBits       80                          // Longest point: 4 + 32 bits of time, 2 + 10 + 32 bits of value
+#define MaxBlockPoints  (BlockBits/2 + 1)           // Shortest point: 2 bits (same delta, same value)
+#define HashBits        11                          // Series index (twice MaxHistorySeries)
+#define NoWindow        0xFF                        // No XOR window written yet in the block
+
+// Structs
+typedef struct{
+    uint32_t    first;                      // Offset of the first block (0: none)
+    uint32_t    last;                       // Offset of the block being appended to
+    uint32_t    points;                     // Points stored
+    uint16_t    address;                    // Register (StartAddress_3X)
+    uint8_t     slave_id;
+    uint8_t     statistic;                  // AggregateStat (0: value read)
+    char        topic[HistoryTopicSize];    // Topic of the parameter (without the meter prefix)
+}HistorySeries;
+
+typedef struct{
+    uint32_t    magic;                      // HistoryMagic
+    uint32_t    day;                        // Days since epoch (UTC)
+    uint32_t    size;                       // Bytes of the file
+    uint32_t    next;                       // Offset of the next free block
+    uint32_t    n_series;
+    uint32_t    dropped;                    // Points dropped because the partition was full
+    HistorySeries series[MaxHistorySeries];
+}Partition;
+
+typedef struct{
+    uint32_t    next;                       // Offset of the next block of the series (0: last block)
+    uint16_t    count;                      // Points in the block
+    uint16_t    bits;                       // Bits used in data
+    int64_t     first_ms;                   // Time of the first point (ms since epoch)
+    int64_t     last_ms;                    // Time of the last point
+    int32_t     delta;                      // Last time delta (encoder state: appending doesn't decode the block)
+    uint32_t    value;                      // Bits of the last value
+    uint8_t     leading;                    // Window of the last XOR written (NoWindow: none)
+    uint8_t     trailing;
+    uint8_t     spare[6];
+    uint8_t     data[BlockData];            // Points, most significant bit first
+}Block;
+
+typedef struct{
+    char        id[HistoryIdSize];
+    uint8_t     slave_id;
+    int64_t     from_ms;
+    int64_t     to_ms;
+    char        topic[HistoryTopicSize];    // Only the series whose topic starts with it ("": every series)
+}Query;
+
+typedef struct{
+    Query       query;
+    int         active;
+    uint32_t    day;                        // Partition being read
+    uint32_t    last_day;                   // Last partition read (the day after the range: late samples)
+    Partition   *map;                       // Its map (NULL if there's no partition that day)
+    int         mapped;                     // Mapped for the query (else it's the partition written)
+    int         series;                     // Series being read
+    char        topic[HistoryTopicSize];    // Its topic
+    uint32_t    block;                      // Next block of the series (0: the series is done)
+    int         seq;                        // Messages sent
+    uint32_t    points;                     // Points sent
+    int         n;                          // Points in the chunk
+    int64_t     stamps[HistoryChunkPoints];
+    float       values[HistoryChunkPoints];
+}Cursor;
+
+// Internal functions
+int         switchPartition(uint32_t day);
+Partition   *readPartition(uint32_t day);
+void        releasePartition(Partition *map);
+void        prunePartitions(uint32_t day);
+void        partitionPath(char *path, int size, uint32_t day);
+void        indexSeries(int s);
+int         findSeries(const Sample *sample);
+Block       *blockAt(Partition *map, uint32_t offset);
+void        blockAppend(Block *block, int64_t t_ms, uint32_t value);
+int         blockDecode(const Block *block, int64_t stamps[], uint32_t values[]);
+void        putBits(uint8_t data[], uint16_t *pos, uint64_t value, int n);
+uint64_t    getBits(const uint8_t data[], int *pos, int n);
+int         startQuery();
+int         nextSeries();
+int         nextPartition();
+void        serveBlock(const Block *block);
+void        sendChunk();
+void        sendEnd();
+
+// Variables (only used from the publisher thread, but the requests waiting)
+static char             historyDir[200];
+static int              enabled     = 0;
+static size_t           daySize;                    // Size of a new partition
+static int              keepDays;                   // Partitions kept
+static Partition        *partition  = NULL;         // Partition written
+static uint32_t         openDay;
+static int16_t          seriesIndex[1 << HashBits]; // Series of each (slave, register, statistic) + 1, 0 if free
+static Query            pending[HistoryRequests];
+static int              n_pending   = 0;
+static pthread_mutex_t  pendingLock = PTHREAD_MUTEX_INITIALIZER;
+static Cursor           cursor;                     // Request being served
+static int64_t          blockStamps[MaxBlockPoints];
+static uint32_t         blockValues[MaxBlockPoints];
+
+
+
+/* OPEN HISTORY: Keeps every sample in a directory (created if needed), one file per UTC day ("YYYYMMDD.hst").
+    Each partition has a fixed size, points beyond it are dropped until the next day.
+    +Day MiB::          Size of a partition (MiB)
+    +Days::             Partitions kept, older ones are deleted
+    returns 0 if opened
+            or -1 if error
+*/
+int historyOpen(const char *dir, int day_mib, int days){
+    if(day_mib <= 0 || day_mib >= 4096 || days <= 0 || strlen(dir) >= sizeof(historyDir)) return -1;
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST){
+        printf("ERROR %i from mkdir %s: %s\n", errno, dir, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from mkdir %s: %s", errno, dir, strerror(errno));
+        return -1;
+    }
+    strcpy(historyDir, dir);
+    daySize     = (size_t)day_mib << 20;
+    keepDays    = days;
+    enabled     = 1;
+    logInfo("  History in %s (%i MiB per day, %i days)\n", dir, day_mib, days);
+    return 0;
+}
+
+
+
+/* HISTORY ENABLED: Samples are kept (see historyOpen).
+*/
+int historyEnabled(){
+    return enabled;
+}
+
+
+
+/* APPEND: Adds a sample to the series of its register (read errors are kept as NaN).
+    The points of a series must come in time order. A point of a day before the partition
+    written goes to that partition (a request reads the partition of the next day too).
+*/
+void historyAppend(const Sample *sample){
+    int64_t         t_ms    = (int64_t)sample->timestamp.tv_sec*1000 + sample->timestamp.tv_nsec/1000000;
+    uint32_t        day     = t_ms/DayMs;
+    float           value   = sample->status == SampleOk ? sample->value : NAN;
+    uint32_t        bits;
+    HistorySeries   *series;
+    Block           *block;
+    int             s;
+
+    if(!enabled) return;
+    if((partition == NULL || day > openDay) && switchPartition(day) < 0) return;
+
+    s = findSeries(sample);
+    if(s < 0){
+        if(partition->dropped ++ == 0){
+            logWarning("WARNING: Too many series in the history of day %u, max %i.\n", openDay, MaxHistorySeries);
+            syslog(LOG_WARNING, "WARNING from historyAppend: Too many series in the history of day %u, max %i.", openDay, MaxHistorySeries);
+        }
+        return;
+    }
+    series  = &partition->series[s];
+    block   = series->last != 0 ? blockAt(partition, series->last) : NULL;
+
+    // A new block when the point may not fit
+    if(block == NULL || block->bits + PointBits > BlockBits){
+        uint32_t offset = partition->next;
+        if(offset + HistoryBlockSize > partition->size){
+            if(partition->dropped ++ == 0){
+                logWarning("WARNING: History of day %u full, points are dropped until the next day.\n", openDay);
+                syslog(LOG_WARNING, "WARNING from historyAppend: History of day %u full (%u bytes).", openDay, partition->size);
+            }
+            return;
+        }
+        memset(blockAt(partition, offset), 0, HistoryBlockSize);
+        partition->next += HistoryBlockSize;
+        if(block != NULL) block->next = offset;
+        else series->first = offset;
+        series->last = offset;
+        block = blockAt(partition, offset);
+    }
+
+    memcpy(&bits, &value, sizeof(bits));
+    blockAppend(block, t_ms, bits);
+    series->points ++;
+}
+
+
+
+/* REQUEST: Queues a request for a time range, served by the publisher thread (called from the MQTT client).
+    Payload: "<id> <slave> <from ms> <to ms> [<topic>]", times in ms since epoch, the topic selects the series
+    whose topic starts with it (example "parameters/voltage" also selects "parameters/voltage/mean").
+    The points are sent in "meter/history/response/<id>" (see sendChunk and sendEnd).
+*/
+void historyRequest(const char *payload, int len){
+    char        text[128];
+    Query       query;
+    int         slave_id;
+    long long   from_ms, to_ms;
+
+    if(!enabled) return;
+    if(len >= (int)sizeof(text)) len = sizeof(text) - 1;
+    memcpy(text, payload, len);
+    text[len] = '\0';
+
+    memset(&query, 0, sizeof(query));
+    if(sscanf(text, "%23s %i %lld %lld %37s", query.id, &slave_id, &from_ms, &to_ms, query.topic) < 4
+       || slave_id < 1 || slave_id > 247 || from_ms < 0 || from_ms > to_ms || strpbrk(query.id, "/+#") != NULL){
+        logWarning("WARNING: Invalid history request '%s'.\n", text);
+        syslog(LOG_WARNING, "WARNING from historyRequest: Invalid request '%s'.", text);
+        return;
+    }
+    query.slave_id  = slave_id;
+    query.from_ms   = from_ms;
+    query.to_ms     = to_ms;
+
+    pthread_mutex_lock(&pendingLock);
+    if(n_pending < HistoryRequests) pending[n_pending ++] = query;
+    else{
+        logWarning("WARNING: History request %s dropped, %i requests waiting.\n", query.id, HistoryRequests);
+        syslog(LOG_WARNING, "WARNING from historyRequest: Request %s dropped, %i requests waiting.", query.id, HistoryRequests);
+    }
+    pthread_mutex_unlock(&pendingLock);
+}
+
+
+
+/* SERVE: Sends part of the request being served, up to HistoryBlocksPerPass blocks, so the samples
+   read keep being published. Blocks are skipped by their times, only the ones inside the range are decoded.
+    returns number of blocks read
+*/
+int historyServe(){
+    int blocks = 0;
+
+    if(!enabled || !mqtt_connected()) return 0;
+    if(!cursor.active && !startQuery()) return 0;
+
+    while(blocks < HistoryBlocksPerPass){
+        if(cursor.block == 0 && nextSeries() < 0){
+            if(nextPartition() < 0){
+                sendEnd();
+                break;
+            }
+            continue;
+        }
+
+        const Block *block = blockAt(cursor.map, cursor.block);
+        if(block == NULL){
+            cursor.block = 0;
+            continue;
+        }
+        cursor.block = block->next;
+        blocks ++;
+        if(block->count == 0 || block->last_ms < cursor.query.from_ms) continue;
+        if(block->first_ms > cursor.query.to_ms){
+            cursor.block = 0;                   // The next blocks are later
+            continue;
+        }
+        serveBlock(block);
+    }
+    return blocks;
+}
+
+
+
+/* SWITCH PARTITION: Maps the partition of a day to write it (created if needed), and deletes the old ones.
+    A partition written with another size starts empty.
+    returns 0 if mapped
+            or -1 if error
+*/
+int switchPartition(uint32_t day){
+    char        path[256];
+    Partition   *map;
+    int         fd;
+
+    partitionPath(path, sizeof(path), day);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0 || ftruncate(fd, daySize) < 0){
+        printf("ERROR %i from open %s: %s\n", errno, path, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from open %s: %s", errno, path, strerror(errno));
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    map = mmap(NULL, daySize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        printf("ERROR %i from mmap %s: %s\n", errno, path, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from mmap %s: %s", errno, path, strerror(errno));
+        return -1;
+    }
+
+    // The request being served keeps reading the old partition
+    if(partition != NULL){
+        if(cursor.active && !cursor.mapped && cursor.map == partition){
+            cursor.map      = readPartition(openDay);
+            cursor.mapped   = 1;
+        }
+        msync(partition, partition->size, MS_ASYNC);
+        munmap(partition, partition->size);
+    }
+    partition   = map;
+    openDay     = day;
+
+    if(map->magic != HistoryMagic || map->day != day || map->size != daySize){
+        logInfo("  Creating history partition %s\n", path);
+        memset(map, 0, sizeof(Partition));
+        map->day    = day;
+        map->size   = daySize;
+        map->next   = (sizeof(Partition) + HistoryBlockSize - 1)/HistoryBlockSize*HistoryBlockSize;
+        map->magic  = HistoryMagic;
+    }
+    memset(seriesIndex, 0, sizeof(seriesIndex));
+    for(uint32_t s = 0; s < map->n_series; s ++) indexSeries(s);
+
+    prunePartitions(day);
+    return 0;
+}
+
+
+
+/* READ PARTITION: Maps the partition of a day to read it.
+    returns the map
+            or NULL if there's no valid partition that day
+*/
+Partition *readPartition(uint32_t day){
+    char        path[256];
+    struct stat st;
+    Partition   *map;
+    int         fd;
+
+    partitionPath(path, sizeof(path), day);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return NULL;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(Partition)){
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return NULL;
+    if(map->magic != HistoryMagic || map->day != day || map->size != (uint32_t)st.st_size){
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    return map;
+}
+
+
+
+/* RELEASE PARTITION: Unmaps a partition mapped by readPartition.
+*/
+void releasePartition(Partition *map){
+    if(map != NULL) munmap(map, map->size);
+}
+
+
+
+/* PRUNE PARTITIONS: Deletes the partitions older than the days kept.
+*/
+void prunePartitions(uint32_t day){
+    DIR             *dir = opendir(historyDir);
+    struct dirent   *entry;
+    char            path[512];
+
+    if(dir == NULL) return;
+    while((entry = readdir(dir)) != NULL){
+        struct tm   date;
+        unsigned    ymd;
+        char        extension[8];
+
+        if(sscanf(entry->d_name, "%8u.%3s", &ymd, extension) != 2 || strcmp(extension, "hst") != 0) continue;
+        memset(&date, 0, sizeof(date));
+        date.tm_year    = ymd/10000 - 1900;
+        date.tm_mon     = ymd/100%100 - 1;
+        date.tm_mday    = ymd%100;
+        if(timegm(&date)/86400 + keepDays > day) continue;
+        snprintf(path, sizeof(path), "%s/%s", historyDir, entry->d_name);
+        if(unlink(path) == 0) logInfo("  History partition %s deleted\n", path);
+    }
+    closedir(dir);
+}
+
+
+
+/* PARTITION PATH: "<dir>/YYYYMMDD.hst" of a day.
+*/
+void partitionPath(char *path, int size, uint32_t day){
+    time_t      t = (time_t)day*86400;
+    struct tm   date;
+
+    gmtime_r(&t, &date);
+    snprintf(path, size, "%s/%04i%02i%02i.hst", historyDir, date.tm_year + 1900, date.tm_mon + 1, date.tm_mday);
+}
+
+
+
+/* INDEX SERIES: Adds a series of the partition written to the index (open addressing).
+*/
+void indexSeries(int s){
+    HistorySeries   *series = &partition->series[s];
+    uint32_t        key     = (uint32_t)series->statistic << 24 | (uint32_t)series->slave_id << 16 | series->address;
+    uint32_t        h       = (key*2654435761u) >> (32 - HashBits);
+
+    while(seriesIndex[h] != 0) h = (h + 1) & ((1 << HashBits) - 1);
+    seriesIndex[h] = s + 1;
+}
+
+
+
+/* FIND SERIES: Series of a sample in the partition written, added if it's the first point.
+    returns number of the series
+            or -1 if the partition has MaxHistorySeries series
+*/
+int findSeries(const Sample *sample){
+    uint32_t        key = (uint32_t)sample->statistic << 24 | (uint32_t)sample->slave_id << 16 | sample->address;
+    uint32_t        h   = (key*2654435761u) >> (32 - HashBits);
+    HistorySeries   *series;
+    int             s;
+
+    for(; seriesIndex[h] != 0; h = (h + 1) & ((1 << HashBits) - 1)){
+        series = &partition->series[seriesIndex[h] - 1];
+        if(series->slave_id == sample->slave_id && series->address == sample->address && series->statistic == sample->statistic){
+            return seriesIndex[h] - 1;
+        }
+    }
+    if(partition->n_series == MaxHistorySeries) return -1;
+
+    s = partition->n_series;
+    series = &partition->series[s];
+    memset(series, 0, sizeof(HistorySeries));
+    series->slave_id    = sample->slave_id;
+    series->address     = sample->address;
+    series->statistic   = sample->statistic;
+    snprintf(series->topic, HistoryTopicSize, "%s", sample->topic);
+    partition->n_series ++;
+    seriesIndex[h] = s + 1;
+    return s;
+}
+
+
+
+/* BLOCK AT: Block at an offset of a partition.
+    returns NULL if the offset is outside the blocks of the partition
+*/
+Block *blockAt(Partition *map, uint32_t offset){
+    if(map == NULL || offset < sizeof(Partition) || offset % HistoryBlockSize != 0 || offset + HistoryBlockSize > map->size) return NULL;
+    return (Block *)((uint8_t *)map + offset);
+}
+
+
+
+/* BLOCK APPEND: Adds a point to a block (Gorilla encoding, the caller checks there's room for PointBits).
+    Time: delta of delta, '0' (same delta), '10' + 7 bits, '110' + 9 bits, '1110' + 12 bits or '1111' + 32 bits.
+    Value: XOR with the previous one, '0' (same value), '10' + the bits inside the last window,
+    or '11' + 5 bits of leading zeros + 5 bits of length - 1 + the bits of the new window.
+    The header is written after the points, a point cut by a crash isn't counted.
+*/
+void blockAppend(Block *block, int64_t t_ms, uint32_t value){
+    uint16_t pos = block->bits;
+
+    if(block->count == 0){
+        block->first_ms = t_ms;
+        block->delta    = 0;
+        block->leading  = NoWindow;
+        putBits(block->data, &pos, value, 32);
+    }
+    else{
+        int32_t     delta   = t_ms - block->last_ms;
+        int32_t     dod     = delta - block->delta;
+        uint32_t    x       = value ^ block->value;
+
+        if(dod == 0) putBits(block->data, &pos, 0, 1);
+        else if(dod >= -63 && dod <= 64) putBits(block->data, &pos, 0x2 << 7 | (dod + 63), 9);
+        else if(dod >= -255 && dod <= 256) putBits(block->data, &pos, 0x6 << 9 | (dod + 255), 12);
+        else if(dod >= -2047 && dod <= 2048) putBits(block->data, &pos, 0xE << 12 | (dod + 2047), 16);
+        else{
+            putBits(block->data, &pos, 0xF, 4);
+            putBits(block->data, &pos, (uint32_t)dod, 32);
+        }
+        block->delta = delta;
+
+        if(x == 0) putBits(block->data, &pos, 0, 1);
+        else{
+            int leading     = __builtin_clz(x);
+            int trailing    = __builtin_ctz(x);
+            if(block->leading != NoWindow && leading >= block->leading && trailing >= block->trailing){
+                putBits(block->data, &pos, 0x2, 2);
+                putBits(block->data, &pos, x >> block->trailing, 32 - block->leading - block->trailing);
+            }
+            else{
+                int length = 32 - leading - trailing;
+                putBits(block->data, &pos, 0x3 << 10 | leading << 5 | (length - 1), 12);
+                putBits(block->data, &pos, x >> trailing, length);
+                block->leading  = leading;
+                block->trailing = trailing;
+            }
+        }
+    }
+    block->last_ms  = t_ms;
+    block->value    = value;
+    block->bits     = pos;
+    block->count ++;
+}
+
+
+
+/* BLOCK DECODE: Points of a block (see blockAppend).
+    returns number of points decoded (fewer than its count if the block is damaged)
+*/
+int blockDecode(const Block *block, int64_t stamps[], uint32_t values[]){
+    int         pos         = 0;
+    int         leading     = 0;
+    int         trailing    = 0;
+    int64_t     t_ms        = block->first_ms;
+    int32_t     delta       = 0;
+    uint32_t    value;
+
+    if(block->count == 0 || block->bits > BlockBits) return 0;
+    value       = getBits(block->data, &pos, 32);
+    stamps[0]   = t_ms;
+    values[0]   = value;
+
+    for(int i = 1; i < block->count; i ++){
+        int32_t dod;
+
+        if(getBits(block->data, &pos, 1) == 0) dod = 0;
+        else if(getBits(block->data, &pos, 1) == 0) dod = (int)getBits(block->data, &pos, 7) - 63;
+        else if(getBits(block->data, &pos, 1) == 0) dod = (int)getBits(block->data, &pos, 9) - 255;
+        else if(getBits(block->data, &pos, 1) == 0) dod = (int)getBits(block->data, &pos, 12) - 2047;
+        else dod = (int32_t)getBits(block->data, &pos, 32);
+        delta  += dod;
+        t_ms   += delta;
+
+        if(getBits(block->data, &pos, 1) != 0){
+            if(getBits(block->data, &pos, 1) != 0){
+                leading     = getBits(block->data, &pos, 5);
+                trailing    = 32 - leading - ((int)getBits(block->data, &pos, 5) + 1);
+                if(trailing < 0) return i;
+            }
+            value ^= (uint32_t)(getBits(block->data, &pos, 32 - leading - trailing) << trailing);
+        }
+        if(pos > block->bits) return i;
+        stamps[i] = t_ms;
+        values[i] = value;
+    }
+    return block->count;
+}
+
+
+
+/* PUT BITS: Writes the n low bits of a value (most significant first) and moves the position.
+    The bits are cleared first, a block may keep the bits of a point cut by a crash.
+*/
+void putBits(uint8_t data[], uint16_t *pos, uint64_t value, int n){
+    while(n > 0){
+        int     room    = 8 - (*pos & 7);
+        int     k       = n < room ? n : room;
+        uint8_t mask    = ((1 << k) - 1) << (room - k);
+
+        data[*pos >> 3] = (data[*pos >> 3] & ~mask) | (((value >> (n - k)) << (room - k)) & mask);
+        *pos   += k;
+        n      -= k;
+    }
+}
+
+
+
+/* GET BITS: Reads n bits (most significant first) and moves the position.
+*/
+uint64_t getBits(const uint8_t data[], int *pos, int n){
+    uint64_t value = 0;
+
+    while(n > 0){
+        int     room    = 8 - (*pos & 7);
+        int     k       = n < room ? n : room;
+
+        value   = value << k | ((data[*pos >> 3] >> (room - k)) & ((1 << k) - 1));
+        *pos   += k;
+        n      -= k;
+    }
+    return value;
+}
+
+
+
+/* START QUERY: Takes the oldest request waiting, the range is limited to the days kept.
+    returns 1 if there was one
+*/
+int startQuery(){
+    uint32_t today = time(NULL)/86400;
+    uint32_t first;
+
+    pthread_mutex_lock(&pendingLock);
+    if(n_pending == 0){
+        pthread_mutex_unlock(&pendingLock);
+        return 0;
+    }
+    cursor.query = pending[0];
+    memmove(&pending[0], &pending[1], (n_pending - 1)*sizeof(Query));
+    n_pending --;
+    pthread_mutex_unlock(&pendingLock);
+
+    first           = cursor.query.from_ms/DayMs;
+    if(first + keepDays < today) first = today - keepDays;
+    cursor.active   = 1;
+    cursor.day      = first - 1;                        // nextPartition() moves to the first day
+    cursor.last_day = cursor.query.to_ms/DayMs + 1;
+    if(cursor.last_day > today + 1) cursor.last_day = today + 1;
+    cursor.map      = NULL;
+    cursor.mapped   = 0;
+    cursor.series   = -1;
+    cursor.block    = 0;
+    cursor.seq      = 0;
+    cursor.points   = 0;
+    cursor.n        = 0;
+    logDebug("History request %s: slave %i, %lld to %lld ms\n", cursor.query.id, cursor.query.slave_id,
+             (long long)cursor.query.from_ms, (long long)cursor.query.to_ms);
+    return 1;
+}
+
+
+
+/* NEXT SERIES: Moves to the next series of the partition selected by the request (the chunk of the last one is sent).
+    returns 0 if found
+            or -1 if the partition is done
+*/
+int nextSeries(){
+    size_t prefix = strlen(cursor.query.topic);
+
+    sendChunk();
+    if(cursor.map == NULL) return -1;
+    while(++ cursor.series < (int)cursor.map->n_series && cursor.series < MaxHistorySeries){
+        const HistorySeries *series = &cursor.map->series[cursor.series];
+        if(series->slave_id != cursor.query.slave_id || strncmp(series->topic, cursor.query.topic, prefix) != 0) continue;
+        cursor.block = series->first;
+        memcpy(cursor.topic, series->topic, HistoryTopicSize);
+        cursor.topic[HistoryTopicSize - 1] = '\0';
+        if(cursor.block != 0) return 0;
+    }
+    return -1;
+}
+
+
+
+/* NEXT PARTITION: Moves to the partition of the next day of the request.
+    returns 0 if there's another day (its partition may not exist)
+            or -1 if the range is done
+*/
+int nextPartition(){
+    if(cursor.mapped) releasePartition(cursor.map);
+    cursor.map      = NULL;
+    cursor.mapped   = 0;
+    cursor.series   = -1;
+    cursor.block    = 0;
+    if(++ cursor.day > cursor.last_day) return -1;
+
+    if(partition != NULL && cursor.day == openDay) cursor.map = partition;
+    else{
+        cursor.map      = readPartition(cursor.day);
+        cursor.mapped   = cursor.map != NULL;
+    }
+    return 0;
+}
+
+
+
+/* SERVE BLOCK: Adds the points of a block inside the range to the chunk, sent when it's full.
+*/
+void serveBlock(const Block *block){
+    int n = blockDecode(block, blockStamps, blockValues);
+
+    for(int i = 0; i < n; i ++){
+        if(blockStamps[i] < cursor.query.from_ms || blockStamps[i] > cursor.query.to_ms) continue;
+        cursor.stamps[cursor.n] = blockStamps[i];
+        memcpy(&cursor.values[cursor.n], &blockValues[i], sizeof(float));
+        if(++ cursor.n == HistoryChunkPoints) sendChunk();
+    }
+}
+
+
+
+/* SEND CHUNK: Publishes the points collected of a series:
+    {"id":"<id>","seq":<n>,"slave":<id>,"topic":"<topic>","t":[<ms>,...],"v":[<value>,...]}
+    Read errors are null. Messages are numbered from 0, the points of a series are in time order.
+*/
+void sendChunk(){
+    char    payload[HistoryPayloadSize];
+    char    topic[64];
+    int     len;
+
+    if(cursor.n == 0) return;
+    len = snprintf(payload, sizeof(payload), "{\"id\":\"%s\",\"seq\":%i,\"slave\":%i,\"topic\":\"%s\",\"t\":[",
+                   cursor.query.id, cursor.seq, cursor.query.slave_id, cursor.topic);
+    for(int i = 0; i < cursor.n; i ++) len += sprintf(payload + len, i ? ",%lld" : "%lld", (long long)cursor.stamps[i]);
+    len += sprintf(payload + len, "],\"v\":[");
+    for(int i = 0; i < cursor.n; i ++){
+        if(i) payload[len ++] = ',';
+        if(isnan(cursor.values[i])) len += sprintf(payload + len, "null");
+        else len += floatToText(payload + len, cursor.values[i]);
+    }
+    len += sprintf(payload + len, "]}");
+
+    snprintf(topic, sizeof(topic), HistoryResponseTopic "%s", cursor.query.id);
+    mqtt_publish(topic, payload, len, 1, false);
+    cursor.seq ++;
+    cursor.points  += cursor.n;
+    cursor.n        = 0;
+}
+
+
+
+/* SEND END: Publishes the last message of a request: {"id":"<id>","seq":<n>,"last":true,"points":<points sent>}
+*/
+void sendEnd(){
+    char    payload[128];
+    char    topic[64];
+    int     len;
+
+    sendChunk();
+    len = snprintf(payload, sizeof(payload), "{\"id\":\"%s\",\"seq\":%i,\"last\":true,\"points\":%u}",
+                   cursor.query.id, cursor.seq, cursor.points);
+    snprintf(topic, sizeof(topic), HistoryResponseTopic "%s", cursor.query.id);
+    mqtt_publish(topic, payload, len, 1, false);
+    logDebug("History request %s: %u points in %i messages\n", cursor.query.id, cursor.points, cursor.seq);
+    cursor.active = 0;
+}
@@ -0,0 +1,37 @@
+#ifndef history
+#define history
+
+// Include the modbus (system headers), sample queue and MQTT headers
+#include "modbus.h"
+#include "sampleQueue.h"
+#include "floatText.h"
+#include "mqttClient.h"
+
+// Linux headers
+#include <pthread.h>
+#include <dirent.h>         // opendir(), old partitions
+#include <sys/mman.h>       // mmap(), msync()
+#include <sys/stat.h>       // mkdir(), fstat()
+
+// Defines
+#define HistoryDayMiB       16      // Default size of a day partition (MiB), points beyond it are dropped
+#define HistoryDays         31      // Default day partitions kept
+#define HistoryBlockSize    512     // Compressed block of a series (bytes, header included)
+#define MaxHistorySeries    1024    // Series (slave, register, statistic) in a day partition
+#define HistoryTopicSize    38      // Topic of a series (without the meter prefix)
+#define HistoryIdSize       24      // Id of a request (names its response topic)
+#define HistoryRequests     4       // Requests waiting to be served
+#define HistoryChunkPoints  128     // Points in one response message
+#define HistoryBlocksPerPass 64     // Blocks read each time the publisher serves the requests
+#define HistoryPayloadSize  8192    // Size of a response message
+#define HistoryRequestTopic "meter/history/request"
+#define HistoryResponseTopic "meter/history/response/"     // Followed by the id of the request
+
+// Functions
+int         historyOpen(const char *dir, int day_mib, int days);
+int         historyEnabled();
+void        historyAppend(const Sample *sample);
+void        historyRequest(const char *payload, int len);
+int         historyServe();
+
+#endif
@@ -0,0 +1,252 @@
+/***********************************
+*          journal.c
+*
+* -Store and forward journal: samples
+*  that can't be published are kept
+*  in mmap'd segment files on disk
+*  and replayed in order when the
+*  broker is back.
+*
+* used with journal.h
+*
+***********************************/
+
+// Include header file
+#include "journal.h"
+
+// Define constants
+#define JournalMagic 0x4A4E4C31     // "JNL1"
+#define SyncEvery 256               // Records written or replayed between msync() of the checkpoint
+
+// Structs
+typedef struct{
+    uint32_t    magic;              // JournalMagic
+    uint32_t    segments;           // Geometry the journal was created with
+    uint32_t    segment_records;
+    uint64_t    write_seq;          // Next record written
+    uint64_t    read_seq;           // Next record replayed
+    uint64_t    lost;               // Records overwritten before they were replayed
+}Checkpoint;
+
+// Internal functions
+JournalRecord   *journalRecord(uint64_t seq);
+int             recordValid(JournalRecord *record, uint64_t seq);
+void            *mapFile(const char *path, size_t size);
+void            journalSync();
+
+// Variables (only used from the publisher thread)
+static Checkpoint       *checkpoint     = NULL;     // mmap'd checkpoint file
+static JournalRecord    **segmentMaps   = NULL;     // mmap'd segment files
+static uint64_t         capacity;                   // Records held by all the segments
+static int              unsynced        = 0;        // Changes since the last msync()
+static uint64_t         readAhead       = 0;        // Records read after the checkpoint, not committed yet
+
+
+
+/* OPEN JOURNAL: Maps the segment files and the checkpoint in a directory (created if needed).
+    The records written after the last checkpoint are recovered by their sequence and error check.
+    If the geometry changed the journal starts empty.
+    returns 0 if opened
+            or -1 if error
+*/
+int journalOpen(const char *dir, int segments, int segment_records){
+    char path[256];
+
+    if(segments <= 0 || segment_records <= 0) return -1;
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST){
+        printf("ERROR %i from mkdir %s: %s\n", errno, dir, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from mkdir %s: %s", errno, dir, strerror(errno));
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/checkpoint.jnl", dir);
+    checkpoint = mapFile(path, sizeof(Checkpoint));
+    if(checkpoint == NULL) return -1;
+
+    segmentMaps = calloc(segments, sizeof(JournalRecord *));
+    for(int i = 0; i < segments; i ++){
+        snprintf(path, sizeof(path), "%s/segment-%03i.jnl", dir, i);
+        segmentMaps[i] = mapFile(path, (size_t)segment_records*sizeof(JournalRecord));
+        if(segmentMaps[i] == NULL) return -1;
+    }
+    capacity = (uint64_t)segments*segment_records;
+
+    if(checkpoint->magic != JournalMagic || checkpoint->segments != (uint32_t)segments || checkpoint->segment_records != (uint32_t)segment_records){
+        logInfo("  Creating journal in %s (%llu records)\n", dir, (unsigned long long)capacity);
+        checkpoint->segments        = segments;
+        checkpoint->segment_records = segment_records;
+        checkpoint->write_seq       = 0;
+        checkpoint->read_seq        = 0;
+        checkpoint->lost            = 0;
+        checkpoint->magic           = JournalMagic;
+    }
+
+    // Recover the records written after the checkpoint was saved
+    while(recordValid(journalRecord(checkpoint->write_seq), checkpoint->write_seq)) checkpoint->write_seq ++;
+    if(checkpoint->write_seq - checkpoint->read_seq > capacity) checkpoint->read_seq = checkpoint->write_seq - capacity;
+    journalSync();
+
+    logInfo("  Journal %s: %llu records to replay\n", dir, (unsigned long long)journalPending());
+    return 0;
+}
+
+
+
+/* JOURNAL ENABLED: The journal has been opened.
+*/
+int journalEnabled(){
+    return checkpoint != NULL;
+}
+
+
+
+/* APPEND SAMPLE: Writes a sample at the end of the journal.
+    If the journal is full the oldest record is overwritten (and counted as lost).
+*/
+void journalAppend(const Sample *sample, uint8_t flags){
+    uint64_t        seq     = checkpoint->write_seq;
+    JournalRecord   *record = journalRecord(seq);
+
+    if(seq - checkpoint->read_seq == capacity){
+        checkpoint->read_seq ++;
+        checkpoint->lost ++;
+        if(readAhead > 0) readAhead --;
+    }
+
+    memset(record, 0, sizeof(JournalRecord));
+    record->seq             = seq;
+    record->timestamp_ms    = (int64_t)sample->timestamp.tv_sec*1000 + sample->timestamp.tv_nsec/1000000;
+    record->value           = sample->value;
+    record->address         = sample->address;
+    record->slave_id        = sample->slave_id;
+    record->status          = sample->status;
+    record->flags           = flags;
+    memcpy(record->topic, sample->topic, strnlen(sample->topic, sizeof(record->topic)));   // Not terminated if it fills it (see journalRead)
+    record->crc             = errorCheck((uint8_t *)record, offsetof(JournalRecord, crc));
+
+    checkpoint->write_seq = seq + 1;
+    if(++ unsynced >= SyncEvery) journalSync();
+}
+
+
+
+/* READ SAMPLE: Reads the next record not replayed yet. The records read stay in the journal
+   until journalCommit(), journalRewind() reads them again.
+    Corrupted records are skipped.
+    returns 1 if a sample was read
+            0 if there is nothing to replay
+*/
+int journalRead(Sample *sample, uint8_t *flags){
+    while(checkpoint->read_seq + readAhead < checkpoint->write_seq){
+        uint64_t        seq     = checkpoint->read_seq + readAhead;
+        JournalRecord   *record = journalRecord(seq);
+
+        readAhead ++;
+        if(!recordValid(record, seq)){
+            logWarning("WARNING: Journal record %llu corrupted, skipped.\n", (unsigned long long)seq);
+            syslog(LOG_WARNING, "WARNING from journalRead: Journal record %llu corrupted, skipped.", (unsigned long long)seq);
+            continue;
+        }
+        memcpy(sample->topic, record->topic, sizeof(record->topic));
+        sample->topic[sizeof(record->topic)] = '\0';
+        sample->timestamp.tv_sec        = record->timestamp_ms/1000;
+        sample->timestamp.tv_nsec       = (record->timestamp_ms%1000)*1000000;
+        sample->value                   = record->value;
+        sample->address                 = record->address;
+        sample->slave_id                = record->slave_id;
+        sample->status                  = record->status;
+        sample->statistic               = 0;        // Not kept, the deadband was applied before journaling
+        sample->last                    = (record->flags & RecordLast) != 0;
+        *flags                          = record->flags;
+        return 1;
+    }
+    return 0;
+}
+
+
+
+/* COMMIT: The records returned by journalRead() have been delivered.
+*/
+void journalCommit(){
+    checkpoint->read_seq += readAhead;
+    readAhead = 0;
+    if(++ unsynced >= SyncEvery || checkpoint->read_seq == checkpoint->write_seq) journalSync();
+}
+
+
+
+/* REWIND: The records returned by journalRead() since the last commit couldn't be delivered,
+   they are read again.
+*/
+void journalRewind(){
+    readAhead = 0;
+}
+
+
+
+/* UNREAD: The last record returned by journalRead() is read again.
+*/
+void journalUnread(){
+    if(readAhead > 0) readAhead --;
+}
+
+
+
+/* PENDING RECORDS: Number of records waiting to be replayed.
+*/
+uint64_t journalPending(){
+    if(checkpoint == NULL) return 0;
+    return checkpoint->write_seq - checkpoint->read_seq;
+}
+
+
+
+/* JOURNAL RECORD: Record slot of a sequence number (segments are used as a ring).
+*/
+JournalRecord *journalRecord(uint64_t seq){
+    uint64_t slot = seq % capacity;
+    return &segmentMaps[slot / checkpoint->segment_records][slot % checkpoint->segment_records];
+}
+
+
+
+/* RECORD VALID: The record holds the sequence expected and its error check is right.
+*/
+int recordValid(JournalRecord *record, uint64_t seq){
+    return record->seq == seq && record->crc == errorCheck((uint8_t *)record, offsetof(JournalRecord, crc));
+}
+
+
+
+/* JOURNAL SYNC: Schedules the write of the checkpoint to disk.
+*/
+void journalSync(){
+    msync(checkpoint, sizeof(Checkpoint), MS_ASYNC);
+    unsynced = 0;
+}
+
+
+
+/* MAP FILE: Opens (or creates) a file of a given size and maps it in memory.
+    returns the mapping
+            or NULL if error
+*/
+void *mapFile(const char *path, size_t size){
+    void    *map;
+    int     fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if(fd < 0 || ftruncate(fd, size) < 0){
+        printf("ERROR %i from open %s: %s\n", errno, path, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from open %s: %s", errno, path, strerror(errno));
+        if(fd >= 0) close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        printf("ERROR %i from mmap %s: %s\n", errno, path, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from mmap %s: %s", errno, path, strerror(errno));
+        return NULL;
+    }
+    return map;
+}
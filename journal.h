@@ -0,0 +1,48 @@
+#ifndef journal
+#define journal
+
+// Include the modbus (errorCheck) and sample queue headers
+#include "modbus.h"
+#include "sampleQueue.h"
+
+// C headers
+#include <stddef.h>         // offsetof()
+
+// Linux headers
+#include <sys/mman.h>       // mmap(), msync()
+#include <sys/stat.h>       // mkdir()
+
+// Defines
+#define JournalSegments     16      // Default number of segment files
+#define JournalRecords      65536   // Default records per segment (4 MiB with 64 byte records)
+#define JournalTopicSize    38      // Topic text kept in a record
+#define ReplayRate          200     // Default records replayed per second
+
+// Record flags
+#define RecordLast          0x01    // Last sample of a scan
+#define RecordInclude       0x02    // Sample passed its deadband (else only marks the end of a scan)
+
+// Structs
+typedef struct{
+    uint64_t    seq;                        // Position of the record in the journal
+    int64_t     timestamp_ms;               // Time the value was read (ms since epoch)
+    float       value;
+    uint16_t    address;                    // Register (StartAddress_3X)
+    uint8_t     slave_id;
+    uint8_t     status;                     // SampleStatus
+    uint8_t     flags;                      // RecordLast, RecordInclude
+    char        topic[JournalTopicSize-1];  // Topic of the parameter (without the meter prefix)
+    uint16_t    crc;                        // errorCheck() of the bytes before it
+}JournalRecord;
+
+// Functions
+int         journalOpen(const char *dir, int segments, int segment_records);
+int         journalEnabled();
+void        journalAppend(const Sample *sample, uint8_t flags);
+int         journalRead(Sample *sample, uint8_t *flags);
+void        journalCommit();
+void        journalRewind();
+void        journalUnread();
+uint64_t    journalPending();
+
+#endif
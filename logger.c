@@ -0,0 +1,159 @@
+/***********************************
+*          logger.c
+*
+* -Asynchronous logger: messages are
+*  formatted into a lock free ring
+*  and written to stdout by a
+*  background thread, so the bus
+*  threads never wait on the console
+*  or journald.
+*
+* used with logger.h
+*
+***********************************/
+
+// Include header file
+#include "logger.h"
+
+// Linux headers
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+
+// Define constants
+#define RingMask (LogRingSize - 1)      // Wraps positions in the ring
+
+// Structs
+typedef struct{
+    _Atomic uint32_t    sequence;               // Position the slot can be written at, +1 once written
+    int                 length;                 // Length of the message
+    char                text[LogMessageSize];
+}LogSlot;
+
+// Internal functions
+void        loggerPush(const char *text, int length);
+void        *writerThread(void *arg);
+
+// Variables
+int                     loggerLevel = LevelInfo;
+static LogSlot          ring[LogRingSize];
+static _Atomic uint32_t head        = 0;        // Next position taken by a producer
+static uint32_t         tail        = 0;        // Next position written (writer thread only)
+static _Atomic uint32_t drops       = 0;        // Messages lost because the ring was full
+static int              started     = 0;        // Writer thread running (before, messages are printed at once)
+
+
+
+/* START LOGGER: Starts the thread that writes the messages.
+    returns 0 if started
+            or -1 if error (messages are printed at once)
+*/
+int loggerStart(){
+    pthread_t   thread;
+    int         error;
+
+    for(uint32_t i = 0; i < LogRingSize; i ++) atomic_init(&ring[i].sequence, i);
+    error = pthread_create(&thread, NULL, writerThread, NULL);
+    if(error != 0){
+        printf("ERROR %i from pthread_create: %s\n", error, strerror(error));
+        syslog(LOG_ERR, "ERROR %i from pthread_create: %s", error, strerror(error));
+        return -1;
+    }
+    pthread_detach(thread);
+    started = 1;
+    return 0;
+}
+
+
+
+/* WRITE: Formats a message (printf format) and queues it for the writer.
+*/
+void loggerWrite(const char *format, ...){
+    char    text[LogMessageSize];
+    int     length;
+    va_list args;
+
+    va_start(args, format);
+    length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if(length < 0) return;
+    if(length >= (int)sizeof(text)) length = sizeof(text) - 1;
+    loggerPush(text, length);
+}
+
+
+
+/* HEX DUMP: Queues a label followed by the bytes in hex, in one line.
+*/
+void loggerHex(const char *label, const uint8_t bytes[], int n){
+    char    text[LogMessageSize];
+    int     length = snprintf(text, sizeof(text), "%s", label);
+
+    for(int i = 0; i < n && length < (int)sizeof(text) - 6; i ++) length += sprintf(text + length, "%#02x ", bytes[i]);
+    if(length > (int)sizeof(text) - 2) length = sizeof(text) - 2;
+    text[length ++] = '\n';
+    text[length] = '\0';
+    loggerPush(text, length);
+}
+
+
+
+/* PUSH: Copies a message into the ring (many producers, never blocks).
+    A producer takes a position with compare and swap, fills its slot and publishes it
+    through the sequence of the slot. If the ring is full the message is dropped.
+*/
+void loggerPush(const char *text, int length){
+    LogSlot     *slot;
+    uint32_t    pos = atomic_load_explicit(&head, memory_order_relaxed);
+
+    if(!started){
+        fwrite(text, 1, length, stdout);
+        return;
+    }
+    while(1){
+        slot = &ring[pos & RingMask];
+        int32_t diff = (int32_t)(atomic_load_explicit(&slot->sequence, memory_order_acquire) - pos);
+        if(diff == 0){
+            if(atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        }else if(diff < 0){
+            atomic_fetch_add_explicit(&drops, 1, memory_order_relaxed);
+            return;
+        }else{
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+    memcpy(slot->text, text, length);
+    slot->length = length;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+}
+
+
+
+/* WRITER THREAD: Writes the messages in order, flushing stdout when the ring is empty.
+*/
+void *writerThread(void *arg){
+    uint32_t reported = 0;      // Drops already reported
+    (void)arg;
+
+    while(1){
+        LogSlot *slot = &ring[tail & RingMask];
+
+        if(atomic_load_explicit(&slot->sequence, memory_order_acquire) == tail + 1){
+            fwrite(slot->text, 1, slot->length, stdout);
+            atomic_store_explicit(&slot->sequence, tail + LogRingSize, memory_order_release);
+            tail ++;
+            continue;
+        }
+
+        uint32_t dropped = atomic_load_explicit(&drops, memory_order_relaxed);
+        if(dropped != reported){
+            printf("WARNING: %u log messages dropped, the console is too slow.\n", dropped - reported);
+            reported = dropped;
+        }
+        fflush(stdout);
+        usleep(LoggerIdle*1000);
+    }
+    return NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef logger
+#define logger
+
+// C headers
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+
+// Log levels
+#define LevelWarning        1       // Something went wrong, the query is sent again
+#define LevelInfo           2       // Ports opened, journal replayed, ...
+#define LevelDebug          3       // Progress of every query and scan
+#define LevelTrace          4       // Steps of every transaction and frame hex dumps
+
+// Build-time threshold: messages above it are compiled out (example: -DLogLevel=LevelInfo)
+#ifndef LogLevel
+#define LogLevel            LevelTrace
+#endif
+
+// Defines
+#define LogRingSize         1024    // Messages waiting for the writer (power of 2)
+#define LogMessageSize      240     // Max length of a message (longer ones are cut)
+#define LoggerIdle          20      // Wait of the writer when the ring is empty (mili seconds)
+
+// Macros (errors are still printed at once and sent to syslog where they happen)
+#define logAt(level, ...)   do{ if((level) <= LogLevel && (level) <= loggerLevel) loggerWrite(__VA_ARGS__); }while(0)
+#define logWarning(...)     logAt(LevelWarning, __VA_ARGS__)
+#define logInfo(...)        logAt(LevelInfo, __VA_ARGS__)
+#define logDebug(...)       logAt(LevelDebug, __VA_ARGS__)
+#define logTrace(...)       logAt(LevelTrace, __VA_ARGS__)
+#define logHex(level, label, bytes, n) \
+                            do{ if((level) <= LogLevel && (level) <= loggerLevel) loggerHex(label, bytes, n); }while(0)
+
+// Shared Variables
+extern int loggerLevel;             // Runtime threshold (LevelInfo by default)
+
+// Functions
+int         loggerStart();
+void        loggerWrite(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void        loggerHex(const char *label, const uint8_t bytes[], int n);
+
+#endif
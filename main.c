@@ -8,69 +8,434 @@
 // Include the modbus header
 #include "modbus.h"
 #include "mqttClient.h"
+#include "scheduler.h"
+#include "eventLoop.h"
+#include "publisher.h"
+#include "serialLine.h"
+#include "aggregator.h"
+#include "onDemand.h"
+#include "registerMap.h"
+#include <pthread.h>         // One polling thread per bus
+#include <signal.h>          // SIGHUP reloads the register map
 
 #define COM "/dev/ttyUSB0"   // For MODBUS device: "ttyUSB0"
+#define MaxSlaves 30         // Max meters on one RS-485 line
+#define MaxPorts 8           // Max RS-485 adapters polled by the daemon
+
+// Structs
+typedef struct{
+    ModbusPort              port;           // Serial port of the bus
+    RegisterMap             *map;           // Register map compiled for the meters of this bus (its schedule is polled)
+    int                     generation;     // Reload the map was loaded for
+    uint8_t                 slave_ids[MaxSlaves];
+    int                     n_slaves;
+    SampleQueue             queue;          // Samples waiting for the publisher
+    CommandQueue            commands;       // On-demand reads of the meters on this bus ("-C")
+    pthread_t               thread;         // Thread polling the bus
+}BusWorker;
 
 // Internal Functions
-void publishMsgs();
+void *busWorker(void *arg);
+void openPort(ModbusPort *port);
+void setupLine(BusWorker *worker);
+void publishMsgs(BusWorker *worker, ScheduleEntry *entry);
+void publishValues(void *context, ScheduleEntry *entry, float values[], struct timespec stamps[]);
+Schedule *loadMap(void *context);
+void reloadSignal(int signal_number);
 
 // Internal Variables
-uint8_t M_ID = 0x01;
+uint8_t M_ID = 0x01;         // Default slave if none given in the command line
+static int probeLine = 0;    // Find the line settings of the serial buses before polling them
+static int raiseBaud = 0;    // Raise the meters of the serial buses up to this rate (0 keeps their rate)
+static int aggregateMs = 0;  // Poll period of the aggregated groups (0 publishes every value read)
+static int commandReads = 0; // Read commands from "meter/read/request" ahead of the polls
+
+static BusWorker workers[MaxPorts];
+
+/* MAIN: Each "-p <port>" adds an RS-485 bus, followed by the slave IDs of the meters on it.
+    Example: modbus -p /dev/ttyUSB0 1 2 3 -p /dev/ttyUSB1 1 4
+    "-t <host>[:<port>]" adds a Modbus TCP gateway instead, followed by the unit IDs of the meters behind it
+    (its requests are pipelined, not supported with "-e").
+    With "-e" every bus and the MQTT client run in a single thread (epoll event loop),
+    otherwise each bus has its own thread. Samples are published from another thread.
+    With "-b" a bus waits when its sample queue is full, otherwise the oldest sample is dropped.
+    With "-j" each scan of a meter is published as one JSON message in "meter/<id>/scan",
+    with "-c" as one CBOR message. "-B <group>:<node>" publishes the scans with Sparkplug B,
+    each meter is the device "meter<id>" of the edge node (an NCMD "Node Control/Rebirth" sends the births again).
+    "-Q <class>:<qos>:<retain>" sets the QoS and retain flag of a topic class
+    (parameters, power, energy, scan), example: -Q energy:1:1
+    "-D <class>:<absolute>:<percent>" only publishes a register of a class (parameters, frequency, power, energy)
+    when it moves more than the deadband, example: -D power:5:1
+    "-H <seconds>" publishes every register at least once per interval, even inside its deadband
+    "-J <dir>" keeps the samples that can't be published in a journal on disk and replays them later
+    "-S <segments>:<records>" sets the size of the journal, "-R <records/s>" its replay rate
+    "-Y <dir>[:<MiB per day>[:<days>]]" keeps every sample, compressed, in one file per day
+    (default 16 MiB, 31 days), and sends back time ranges asked in "meter/history/request"
+    ("<id> <slave> <from ms> <to ms> [<topic>]") as chunks in "meter/history/response/<id>"
+    "-M <seconds>" publishes a summary of the runtime metrics in "meter/sys/metrics" with that period,
+    "-P <port>" serves them in Prometheus text format on http://127.0.0.1:<port>/metrics
+    "-A" finds the baud rate and parity of the meters on each serial bus before polling them,
+    "-U <bauds>" also raises them to the fastest rate they all accept up to <bauds> (written to NET_BD),
+    going back to the old rate if a meter stops answering
+    "-G <ms>[:<window ms>]" polls the fast parameters every <ms> and publishes their min, max, mean,
+    standard deviation and RMS over the last <window ms> at the scan rate ("<topic>/mean", ...),
+    the window is the scan rate by default
+    "-C" reads registers asked in "meter/read/request" ("<id> <slave> <3x|4x> <register>...") ahead of the polls,
+    and sends their values in "meter/read/response/<id>"
+    "-m <file>" reads the devices, register groups, field types and topics from a register map (see registerMap.c,
+    example in sdm230.map) instead of the built-in SDM230 map, SIGHUP reads it again without stopping the polls
+    "-v" shows the progress of every query (twice: every frame too), "-q" only warnings and errors
+    Without arguments the meter 1 on "/dev/ttyUSB0" is polled.
+    Slave IDs must be unique across buses, they name the topics ("meter/<id>/...").
+*/
+int main(int argc, char *argv[]){
+    int     n_ports = 0;
+    int     event_loop = 0;
+    OverflowPolicy policy = DropOldest;
+    char    *journal_dir = NULL;
+    int     metrics_port = 0;
+    int     journal_segments = JournalSegments;
+    int     journal_records = JournalRecords;
+    char    *history_dir = NULL;
+    int     history_mib = HistoryDayMiB;
+    int     history_days = HistoryDays;
+
+    // Buses and meters on each bus
+    for(int i = 1; i < argc; i ++){
+        if(strcmp(argv[i], "-e") == 0){
+            event_loop = 1;
+            continue;
+        }
+        if(strcmp(argv[i], "-v") == 0){
+            if(loggerLevel < LevelTrace) loggerLevel ++;
+            continue;
+        }
+        if(strcmp(argv[i], "-q") == 0){
+            loggerLevel = LevelWarning;
+            continue;
+        }
+        if(strcmp(argv[i], "-C") == 0){
+            commandReads = 1;
+            continue;
+        }
+        if(strcmp(argv[i], "-A") == 0){
+            probeLine = 1;
+            continue;
+        }
+        if(strcmp(argv[i], "-U") == 0 && i + 1 < argc){
+            probeLine = 1;
+            raiseBaud = atoi(argv[++ i]);
+            continue;
+        }
+        if(strcmp(argv[i], "-G") == 0 && i + 1 < argc){
+            int window_ms = 0;
+            if(sscanf(argv[++ i], "%i:%i", &aggregateMs, &window_ms) < 1 || aggregateMs <= 0 || window_ms < 0){
+                printf("ERROR: Invalid aggregation %s\n", argv[i]);
+                return 1;
+            }
+            if(window_ms/aggregateMs > SeriesCapacity){
+                logWarning("WARNING: Only the last %i samples of a window are kept.\n", SeriesCapacity);
+            }
+            aggregatorSetWindow(window_ms);
+            continue;
+        }
+        if(strcmp(argv[i], "-b") == 0){
+            policy = BlockProducer;
+            continue;
+        }
+        if(strcmp(argv[i], "-j") == 0){
+            publisherSetMode(PublishBatch);
+            continue;
+        }
+        if(strcmp(argv[i], "-c") == 0){
+            publisherSetMode(PublishCbor);
+            continue;
+        }
+        if(strcmp(argv[i], "-B") == 0 && i + 1 < argc){
+            if(sparkplugInit(argv[++ i]) < 0){
+                printf("ERROR: Invalid Sparkplug IDs %s\n", argv[i]);
+                return 1;
+            }
+            publisherSetMode(PublishSparkplug);
+            continue;
+        }
+        if(strcmp(argv[i], "-D") == 0 && i + 1 < argc){
+            if(deadbandParse(argv[++ i]) < 0){
+                printf("ERROR: Invalid deadband %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        if(strcmp(argv[i], "-J") == 0 && i + 1 < argc){
+            journal_dir = argv[++ i];
+            continue;
+        }
+        if(strcmp(argv[i], "-m") == 0 && i + 1 < argc){
+            registerMapSetPath(argv[++ i]);
+            continue;
+        }
+        if(strcmp(argv[i], "-Y") == 0 && i + 1 < argc){
+            char *sizes = strchr(argv[++ i], ':');
+            history_dir = argv[i];
+            if(sizes != NULL){
+                *sizes = '\0';
+                if(sscanf(sizes + 1, "%i:%i", &history_mib, &history_days) < 1){
+                    printf("ERROR: Invalid history size %s\n", sizes + 1);
+                    return 1;
+                }
+            }
+            continue;
+        }
+        if(strcmp(argv[i], "-S") == 0 && i + 1 < argc){
+            if(sscanf(argv[++ i], "%i:%i", &journal_segments, &journal_records) != 2){
+                printf("ERROR: Invalid journal size %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        if(strcmp(argv[i], "-R") == 0 && i + 1 < argc){
+            publisherSetReplayRate(atoi(argv[++ i]));
+            continue;
+        }
+        if(strcmp(argv[i], "-M") == 0 && i + 1 < argc){
+            metricsSetPeriod(atoi(argv[++ i]));
+            continue;
+        }
+        if(strcmp(argv[i], "-P") == 0 && i + 1 < argc){
+            metrics_port = atoi(argv[++ i]);
+            continue;
+        }
+        if(strcmp(argv[i], "-H") == 0 && i + 1 < argc){
+            deadbandSetHeartbeat(atoi(argv[++ i]));
+            continue;
+        }
+        if(strcmp(argv[i], "-Q") == 0 && i + 1 < argc){
+            if(publisherParseOptions(argv[++ i]) < 0){
+                printf("ERROR: Invalid publish options %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        if(strcmp(argv[i], "-p") == 0 && i + 1 < argc){
+            if(n_ports == MaxPorts){
+                printf("ERROR: Too many ports, max %i\n", MaxPorts);
+                return 1;
+            }
+            workers[n_ports ++].port.path = argv[++ i];
+            continue;
+        }
+        if(strcmp(argv[i], "-t") == 0 && i + 1 < argc){
+            if(n_ports == MaxPorts){
+                printf("ERROR: Too many ports, max %i\n", MaxPorts);
+                return 1;
+            }
+            workers[n_ports].port.transport = TransportTcp;
+            workers[n_ports ++].port.path = argv[++ i];
+            continue;
+        }
+        int id = atoi(argv[i]);
+        if(id < 1 || id > 247){
+            printf("ERROR: Invalid slave ID %s\n", argv[i]);
+            return 1;
+        }
+        if(n_ports == 0) workers[n_ports ++].port.path = COM;
+        BusWorker *worker = &workers[n_ports-1];
+        if(worker->n_slaves < MaxSlaves) worker->slave_ids[worker->n_slaves ++] = id;
+    }
+    if(n_ports == 0) workers[n_ports ++].port.path = COM;
+
+    // Poll every register group of every meter, as the register map describes them
+    for(int p = 0; p < n_ports; p ++){
+        BusWorker *worker = &workers[p];
+        if(worker->n_slaves == 0) worker->slave_ids[worker->n_slaves ++] = M_ID;
+        sampleQueueInit(&worker->queue, policy);
+        if(publisherAddQueue(&worker->queue) < 0) return 1;
+        if(commandReads){
+            commandQueueInit(&worker->commands);
+            for(int i = 0; i < worker->n_slaves; i ++) commandAddSlave(&worker->commands, worker->slave_ids[i]);
+        }
+        worker->generation = registerMapGeneration();
+        worker->map = registerMapCreate(worker->slave_ids, worker->n_slaves, aggregateMs);
+        if(worker->map == NULL) return 1;
+    }
+    signal(SIGHUP, reloadSignal);
+
+    // Messages are written by the logger thread, off the polling path
+    loggerStart();
+
+    // Journal for broker outages
+    if(journal_dir != NULL && journalOpen(journal_dir, journal_segments, journal_records) < 0) return 1;
+
+    // Local history, ranges are asked over MQTT
+    if(history_dir != NULL){
+        if(historyOpen(history_dir, history_mib, history_days) < 0){
+            printf("ERROR: Invalid history %s:%i:%i\n", history_dir, history_mib, history_days);
+            return 1;
+        }
+        mqtt_handler(HistoryRequestTopic, historyRequest);
+    }
+
+    // Prometheus endpoint
+    if(metrics_port > 0 && metricsServe(metrics_port) < 0) return 1;
+
+    // On-demand reads
+    if(commandReads) mqtt_handler(CommandRequestTopic, commandRequest);
+
+    // Setup MQTT (shared by all the buses) and the publisher thread
+    mqtt_setup(!event_loop);
+    if(publisherStart() < 0) return 1;
+
+    // Single thread: the event loop drives every bus and the MQTT client
+    if(event_loop){
+        for(int p = 0; p < n_ports; p ++){
+            openPort(&workers[p].port);
+            setupLine(&workers[p]);
+            if(eventLoopAddPort(&workers[p].port, commandReads ? &workers[p].commands : NULL, &workers[p]) < 0) return 1;
+        }
+        eventLoopRun(publishValues, loadMap);
+        return 0;
+    }
+
+    // One thread per bus
+    for(int p = 0; p < n_ports; p ++){
+        int error = pthread_create(&workers[p].thread, NULL, busWorker, &workers[p]);
+        if(error != 0){
+            printf("ERROR %i from pthread_create: %s\n", error, strerror(error));
+            syslog(LOG_ERR, "ERROR %i from pthread_create: %s", error, strerror(error));
+            return 1;
+        }
+    }
+    for(int p = 0; p < n_ports; p ++) pthread_join(workers[p].thread, NULL);
+    return 0;
+}
+
+/* BUS WORKER: Opens the port of one bus and polls its meters forever.
+*/
+void *busWorker(void *arg){
+    BusWorker *worker = arg;
+    Command command;            // On-demand read being read
+    Schedule *schedule;
 
-int main(void){
-    // Setup MQTT
-    mqtt_setup();
+    openPort(&worker->port);
+    setupLine(worker);
 
-    // Try until port is connected
+    // Infinite loop for publishing to MQTT
+    while(1){
+        logDebug("**--Begining Publishing Loop (%s)--**\n", worker->port.path);
+        // Wait until the next group is due, commands go first unless the group has waited for CommandBurst of them
+        schedule = loadMap(worker);
+        ScheduleEntry *entry = schedulerNext(schedule);
+        if(commandReads && commandWait(&worker->commands, &entry->deadline) && commandTake(&worker->commands, &command, &entry->deadline)){
+            commandRun(&worker->port, &command);
+            continue;
+        }
+        schedulerWait(entry);
+        schedulerStart(entry);
+        // Publish the group to the MQTT Broker
+        logDebug("**Publishing to MQTT\n");
+        publishMsgs(worker, entry);
+        schedulerDone(schedule, entry, getScanRate());
+    }
+    return NULL;
+}
+
+/* LOAD MAP: Schedule of a bus, with the register map compiled again if a reload was asked since it was loaded.
+    Called between polls: the new table is built on the side and swapped in, the bus never stops.
+    A map file with errors keeps the old table. The old one is freed at once, the samples
+    in the queue carry copies of their topics.
+*/
+Schedule *loadMap(void *context){
+    BusWorker *worker = context;
+    int generation = registerMapGeneration();
+    RegisterMap *map;
+
+    if(generation == worker->generation) return &worker->map->schedule;
+    worker->generation = generation;
+    map = registerMapCreate(worker->slave_ids, worker->n_slaves, aggregateMs);
+    if(map == NULL){
+        logWarning("WARNING: Register map not reloaded on %s, the old one is kept.\n", worker->port.path);
+        syslog(LOG_WARNING, "WARNING from loadMap: Register map not reloaded on %s, the old one is kept.", worker->port.path);
+        return &worker->map->schedule;
+    }
+    registerMapFree(worker->map);
+    worker->map = map;
+    logInfo("** Register map reloaded on %s: %i groups\n", worker->port.path, map->schedule.n_entries);
+    return &worker->map->schedule;
+}
+
+/* RELOAD SIGNAL: SIGHUP, every bus loads the register map again before its next poll.
+*/
+void reloadSignal(int signal_number){
+    (void)signal_number;
+    registerMapReload();
+}
+
+/* OPEN PORT: Tries until the serial port is connected.
+*/
+void openPort(ModbusPort *port){
     while(1){
-        printf("** Connecting to USB Port\n");
+        logInfo("** Connecting to %s %s\n", port->transport == TransportTcp ? "Modbus TCP gateway" : "USB Port", port->path);
         // Initialize port
-        if(initializePort(COM) < 0) continue;
-        else break;
+        if(initializePort(port, port->path) >= 0) break;
         // Wait 5 seconds
         usleep(5*1000*1000);
     }
+}
 
-    // Infinite loop for publishing to MQTT
-    while(1){
-        printf("**--Begining Publishing Loop--**\n");
-        // Wait to not overload the system
-        if(usleep(getScanRate()*1000) < 0) printf("ERROR %i from usleep: %s\n", errno, strerror(errno));
-        // Publish all the parameters to the MQTT Broker
-        printf("**Publishing to MQTT\n");
-        publishMsgs();
-        modbusQuery(M_ID,VOLTAGE);
+/* SETUP LINE: Probes the line settings of a serial bus and raises its rate, if asked ("-A", "-U").
+*/
+void setupLine(BusWorker *worker){
+    if(!probeLine || worker->port.transport == TransportTcp) return;
+    if(lineProbe(&worker->port, worker->slave_ids, worker->n_slaves) == worker->n_slaves && raiseBaud > 0){
+        lineRaise(&worker->port, worker->slave_ids, worker->n_slaves, raiseBaud);
     }
 }
 
-void publishMsgs(){
-    char s[64];
-    
-    sprintf(s,"%f",modbusQuery(M_ID,VOLTAGE));
-    mqtt_send(s,"parameters/voltage");
-    sprintf(s,"%f",modbusQuery(M_ID, CURRENT));
-    mqtt_send(s,"parameters/current");
-    sprintf(s,"%f",modbusQuery(M_ID, POWER_FACTOR));
-    mqtt_send(s,"parameters/pf");
-    sprintf(s,"%f",modbusQuery(M_ID, PHASE));
-    mqtt_send(s,"parameters/phase");
-    sprintf(s,"%f",modbusQuery(M_ID, FREQUENCY));
-    mqtt_send(s,"parameters/frequency");
-
-    sprintf(s,"%f",modbusQuery(M_ID, ACT_ENERGY_IM));
-    mqtt_send(s,"energy/import/active");
-    sprintf(s,"%f",modbusQuery(M_ID, REA_ENERGY_IM));
-    mqtt_send(s,"energy/import/reactive");
-    sprintf(s,"%f",modbusQuery(M_ID, ACT_ENERGY_EX));
-    mqtt_send(s,"energy/export/active");
-    sprintf(s,"%f",modbusQuery(M_ID, REA_ENERGY_EX));
-    mqtt_send(s,"energy/export/reactive");
-
-    sprintf(s,"%f",modbusQuery(M_ID, POWER_APPARENT));
-    mqtt_send(s,"power/apparent");
-    sprintf(s,"%f",modbusQuery(M_ID, POWER_ACTIVE));
-    mqtt_send(s,"power/active");
-    sprintf(s,"%f",modbusQuery(M_ID, POWER_REACTIVE));
-    mqtt_send(s,"power/reactive");
+/* PUBLISH MESSAGES: Reads a register group of one meter and queues it for the publisher.
+*/
+void publishMsgs(BusWorker *worker, ScheduleEntry *entry){
+    float values[entry->n];
+    struct timespec stamps[entry->n];
+    struct timespec start;
+
+    // Read all the parameters with as few transactions as possible
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    modbusWindowQuery(&worker->port, entry->slave_id, entry->windows, entry->n_windows, entry->addresses, entry->fields, entry->n, values, stamps);
+    metricsScan(entry->slave_id, &start, entry->period_ms == ScanRatePeriod);
+    publishValues(worker, entry, values, stamps);
 }
 
+/* PUBLISH VALUES: Queues every parameter of a register group for the publisher thread,
+   timestamped when the transaction that read it completed.
+    Parameters that couldn't be read carry the error signal (NaN) and SampleError.
+    Topics and sample addresses come from the register map (a walk of the fields of the group).
+*/
+void publishValues(void *context, ScheduleEntry *entry, float values[], struct timespec stamps[]){
+    BusWorker *worker = context;
+    const MapEntry *group = entry->context;
+    const StartAddress_3X *keys = &group->device->keys[group->group->first];
+    char * const *topics = &group->device->topic_list[group->group->first];
+    Sample sample;
+
+    // Aggregated groups only publish their statistics, once per scan rate
+    if(group->block >= 0){
+        Sample statistics[(AggregateStats - 1)*MaxEntryParameters];
+        aggregatorPush(group->block, values, stamps);
+        int n = aggregatorCollect(group->block, getScanRate(), statistics);
+        for(int i = 0; i < n; i ++) sampleQueuePush(&worker->queue, &statistics[i]);
+        return;
+    }
+
+    sample.slave_id = entry->slave_id;
+    sample.statistic = StatValue;
+    for(int i = 0; i < entry->n; i ++){
+        sample.timestamp    = stamps[i];
+        sample.address      = keys[i];
+        sample.value        = values[i];
+        sample.status       = isnan(values[i]) ? SampleError : SampleOk;
+        strncpy(sample.topic, topics[i], SampleTopicSize - 1);
+        sample.topic[SampleTopicSize - 1] = '\0';
+        sample.last         = (i == entry->n - 1);
+        sampleQueuePush(&worker->queue, &sample);
+    }
+}
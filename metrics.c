@@ -0,0 +1,499 @@
+/***********************************
+*          metrics.c
+*
+* -Runtime metrics: latency histograms
+*  and error counters of every meter,
+*  scan timing and publisher health.
+*  Updated lock free from any thread,
+*  reported as JSON over MQTT and as
+*  Prometheus text on localhost.
+*
+* used with metrics.h
+*
+***********************************/
+
+// Include header file
+#include "metrics.h"
+
+// Include the MQTT header (periodic report)
+#include "mqttClient.h"
+
+// Linux headers
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Define constants
+#define TableMask (MetricsTableSize - 1)    // Wraps positions in the table
+
+// Structs
+typedef struct{
+    _Atomic uint32_t    key;            // (slave << 16) | first register, 0 if the slot is free
+    Histogram           latency;        // Transaction latency of the window
+}WindowMetrics;
+
+typedef struct{
+    _Atomic uint32_t    counters[SlaveCounters];
+    _Atomic uint32_t    exceptions[MaxExceptionCode];   // Exceptions by code
+    Histogram           scan;                           // Time to read a register group
+    struct timespec     last_scan;                      // Start of the last scan that follows the scan rate (bus thread only)
+    _Atomic uint32_t    interval_ms;                    // Time between the last two of those scans
+    _Atomic uint64_t    jitter_sum_us;                  // Deviations of the poll spacing from the nominal period
+    _Atomic uint32_t    jitter_count;
+    _Atomic uint32_t    jitter_max_us;
+    _Atomic int         seen;                           // The meter has been polled
+}SlaveMetrics;
+
+typedef struct{
+    _Atomic uint32_t    depth;          // Samples waiting
+    _Atomic uint32_t    max_depth;      // Highest number of samples waiting
+    _Atomic uint32_t    drops;          // Samples dropped
+    _Atomic int         seen;
+}QueueMetrics;
+
+// Internal functions
+void            histogramAdd(Histogram *histogram, double ms);
+double          histogramPercentile(const Histogram *histogram, double p);
+void            writeHistogram(FILE *out, const char *name, const char *labels, const Histogram *histogram);
+WindowMetrics   *windowMetrics(uint8_t slave_id, uint16_t start);
+double          elapsedMs(const struct timespec *from, const struct timespec *to);
+double          jitterMeanMs(SlaveMetrics *slave);
+void            *serverThread(void *arg);
+
+// Variables
+static const double     bucketBounds[HistogramBuckets - 1] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};    // Mili seconds
+static WindowMetrics    windowTable[MetricsTableSize];
+static SlaveMetrics     slaveTable[256];                // By slave ID
+static Histogram        publishLatency;                 // Time from the reading to its publication
+static Histogram        commandLatency;                 // Time from an on-demand read command to its response
+static QueueMetrics     queueTable[MetricsQueues];
+static const char       *counterNames[SlaveCounters] = {"retries", "timeouts", "crc_errors", "unidentified", "failures", "deadline_misses"};
+static int              serverFd = -1;                  // Prometheus endpoint
+static int              reportPeriod = 0;               // Seconds between two MQTT reports (0 disables)
+
+
+
+/* COUNT: Adds n to a counter of a meter.
+*/
+void metricsCount(uint8_t slave_id, SlaveCounter counter, uint32_t n){
+    if(n == 0) return;
+    atomic_fetch_add_explicit(&slaveTable[slave_id].counters[counter], n, memory_order_relaxed);
+    atomic_store_explicit(&slaveTable[slave_id].seen, 1, memory_order_relaxed);
+}
+
+
+
+/* EXCEPTION: Counts an exception response of a meter by its code.
+*/
+void metricsException(uint8_t slave_id, uint8_t code){
+    if(code >= MaxExceptionCode) code = 0;
+    atomic_fetch_add_explicit(&slaveTable[slave_id].exceptions[code], 1, memory_order_relaxed);
+    atomic_store_explicit(&slaveTable[slave_id].seen, 1, memory_order_relaxed);
+}
+
+
+
+/* TRANSACTION: Adds the latency of a valid response, from the time its request was sent.
+*/
+void metricsTransaction(uint8_t slave_id, uint16_t start, const struct timespec *sent){
+    struct timespec now;
+    WindowMetrics   *window = windowMetrics(slave_id, start);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(window != NULL) histogramAdd(&window->latency, elapsedMs(sent, &now));
+    atomic_store_explicit(&slaveTable[slave_id].seen, 1, memory_order_relaxed);
+}
+
+
+
+/* SCAN: Adds the time taken to read a register group of a meter, started at start (CLOCK_MONOTONIC).
+    For the groups that follow the scan rate, also keeps the time between two scans.
+*/
+void metricsScan(uint8_t slave_id, const struct timespec *start, int follows_scan_rate){
+    SlaveMetrics    *slave = &slaveTable[slave_id];
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    histogramAdd(&slave->scan, elapsedMs(start, &now));
+    if(follows_scan_rate){
+        if(slave->last_scan.tv_sec != 0) atomic_store_explicit(&slave->interval_ms, elapsedMs(&slave->last_scan, start), memory_order_relaxed);
+        slave->last_scan = *start;
+    }
+    atomic_store_explicit(&slave->seen, 1, memory_order_relaxed);
+}
+
+
+
+/* JITTER: Adds how far the spacing of two polls of a register group moved from its period (micro seconds).
+*/
+void metricsJitter(uint8_t slave_id, long deviation_us){
+    SlaveMetrics    *slave  = &slaveTable[slave_id];
+    uint32_t        max     = atomic_load_explicit(&slave->jitter_max_us, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&slave->jitter_sum_us, deviation_us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slave->jitter_count, 1, memory_order_relaxed);
+    while((uint32_t)deviation_us > max &&
+          !atomic_compare_exchange_weak_explicit(&slave->jitter_max_us, &max, deviation_us, memory_order_relaxed, memory_order_relaxed));
+}
+
+
+
+/* PUBLISH: Adds the time from a reading (timestamp, CLOCK_REALTIME) to its publication.
+*/
+void metricsPublish(const struct timespec *timestamp){
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    histogramAdd(&publishLatency, elapsedMs(timestamp, &now));
+}
+
+
+
+/* COMMAND: Adds the time from an on-demand read command arriving (received, CLOCK_MONOTONIC) to its response.
+*/
+void metricsCommand(const struct timespec *received){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    histogramAdd(&commandLatency, elapsedMs(received, &now));
+}
+
+
+
+/* QUEUE: Keeps the state of a sample queue.
+*/
+void metricsQueue(int queue, uint32_t depth, uint32_t max_depth, uint32_t drops){
+    if(queue < 0 || queue >= MetricsQueues) return;
+    atomic_store_explicit(&queueTable[queue].depth, depth, memory_order_relaxed);
+    atomic_store_explicit(&queueTable[queue].max_depth, max_depth, memory_order_relaxed);
+    atomic_store_explicit(&queueTable[queue].drops, drops, memory_order_relaxed);
+    atomic_store_explicit(&queueTable[queue].seen, 1, memory_order_relaxed);
+}
+
+
+
+/* WRITE METRICS: Writes every metric in Prometheus text format.
+*/
+void metricsWrite(FILE *out){
+    char labels[64];
+
+    fprintf(out, "# HELP modbus_transaction_seconds Time from a request to its valid response.\n");
+    fprintf(out, "# TYPE modbus_transaction_seconds histogram\n");
+    for(int i = 0; i < MetricsTableSize; i ++){
+        uint32_t key = atomic_load_explicit(&windowTable[i].key, memory_order_acquire);
+        if(key == 0) continue;
+        sprintf(labels, "slave=\"%u\",register=\"0x%04x\"", key >> 16, key & 0xFFFF);
+        writeHistogram(out, "modbus_transaction_seconds", labels, &windowTable[i].latency);
+    }
+
+    for(int c = 0; c < SlaveCounters; c ++){
+        fprintf(out, "# TYPE modbus_%s_total counter\n", counterNames[c]);
+        for(int s = 0; s < 256; s ++){
+            if(!atomic_load_explicit(&slaveTable[s].seen, memory_order_relaxed)) continue;
+            fprintf(out, "modbus_%s_total{slave=\"%i\"} %u\n", counterNames[c], s,
+                    atomic_load_explicit(&slaveTable[s].counters[c], memory_order_relaxed));
+        }
+    }
+
+    fprintf(out, "# TYPE modbus_exceptions_total counter\n");
+    for(int s = 0; s < 256; s ++){
+        for(int code = 0; code < MaxExceptionCode; code ++){
+            uint32_t n = atomic_load_explicit(&slaveTable[s].exceptions[code], memory_order_relaxed);
+            if(n > 0) fprintf(out, "modbus_exceptions_total{slave=\"%i\",code=\"%i\"} %u\n", s, code, n);
+        }
+    }
+
+    fprintf(out, "# HELP modbus_scan_seconds Time to read a register group of a meter.\n");
+    fprintf(out, "# TYPE modbus_scan_seconds histogram\n");
+    for(int s = 0; s < 256; s ++){
+        if(!atomic_load_explicit(&slaveTable[s].seen, memory_order_relaxed)) continue;
+        sprintf(labels, "slave=\"%i\"", s);
+        writeHistogram(out, "modbus_scan_seconds", labels, &slaveTable[s].scan);
+    }
+    fprintf(out, "# HELP modbus_scan_interval_seconds Time between the last two scans that follow the scan rate.\n");
+    fprintf(out, "# TYPE modbus_scan_interval_seconds gauge\n");
+    for(int s = 0; s < 256; s ++){
+        if(!atomic_load_explicit(&slaveTable[s].seen, memory_order_relaxed)) continue;
+        fprintf(out, "modbus_scan_interval_seconds{slave=\"%i\"} %.3f\n", s,
+                atomic_load_explicit(&slaveTable[s].interval_ms, memory_order_relaxed)/1000.0);
+    }
+    fprintf(out, "# HELP modbus_scan_jitter_mean_seconds Mean deviation of the poll spacing from the nominal period.\n");
+    fprintf(out, "# TYPE modbus_scan_jitter_mean_seconds gauge\n");
+    for(int s = 0; s < 256; s ++){
+        if(!atomic_load_explicit(&slaveTable[s].seen, memory_order_relaxed)) continue;
+        fprintf(out, "modbus_scan_jitter_mean_seconds{slave=\"%i\"} %.6f\n", s, jitterMeanMs(&slaveTable[s])/1000.0);
+    }
+    fprintf(out, "# HELP modbus_scan_jitter_max_seconds Max deviation of the poll spacing from the nominal period.\n");
+    fprintf(out, "# TYPE modbus_scan_jitter_max_seconds gauge\n");
+    for(int s = 0; s < 256; s ++){
+        if(!atomic_load_explicit(&slaveTable[s].seen, memory_order_relaxed)) continue;
+        fprintf(out, "modbus_scan_jitter_max_seconds{slave=\"%i\"} %.6f\n", s,
+                atomic_load_explicit(&slaveTable[s].jitter_max_us, memory_order_relaxed)/1000000.0);
+    }
+    fprintf(out, "# TYPE modbus_scan_rate_seconds gauge\n");
+    fprintf(out, "modbus_scan_rate_seconds %.3f\n", getScanRate()/1000.0);
+
+    fprintf(out, "# HELP mqtt_publish_latency_seconds Time from a reading to its publication.\n");
+    fprintf(out, "# TYPE mqtt_publish_latency_seconds histogram\n");
+    writeHistogram(out, "mqtt_publish_latency_seconds", "", &publishLatency);
+    fprintf(out, "# HELP modbus_command_seconds Time from an on-demand read command to its response.\n");
+    fprintf(out, "# TYPE modbus_command_seconds histogram\n");
+    writeHistogram(out, "modbus_command_seconds", "", &commandLatency);
+    fprintf(out, "# TYPE sample_queue_depth gauge\n");
+    fprintf(out, "# TYPE sample_queue_max_depth gauge\n");
+    fprintf(out, "# TYPE sample_queue_drops_total counter\n");
+    for(int q = 0; q < MetricsQueues; q ++){
+        if(!atomic_load_explicit(&queueTable[q].seen, memory_order_relaxed)) continue;
+        fprintf(out, "sample_queue_depth{queue=\"%i\"} %u\n", q, atomic_load_explicit(&queueTable[q].depth, memory_order_relaxed));
+        fprintf(out, "sample_queue_max_depth{queue=\"%i\"} %u\n", q, atomic_load_explicit(&queueTable[q].max_depth, memory_order_relaxed));
+        fprintf(out, "sample_queue_drops_total{queue=\"%i\"} %u\n", q, atomic_load_explicit(&queueTable[q].drops, memory_order_relaxed));
+    }
+}
+
+
+
+/* REPORT PERIOD: Seconds between two summaries published in MetricsTopic (0 disables).
+*/
+void metricsSetPeriod(int period_s){
+    reportPeriod = period_s;
+}
+
+
+
+/* REPORT: Publishes a summary in MetricsTopic every reportPeriod seconds, as JSON:
+    {"ts":<ms>,"scan_rate_ms":<ms>,"slaves":{"<id>":{"p50_ms":..,"p99_ms":..,"transactions":..,<counters>,
+     "scan_p99_ms":..,"scan_interval_ms":..,"jitter_mean_ms":..,"jitter_max_ms":..,"exceptions":{"<code>":..}},...},
+     "publish_p99_ms":..,"command_p50_ms":..,"command_p99_ms":..,"commands":..,"queues":[..]}
+    Called from the publisher thread.
+*/
+void metricsReport(){
+    static time_t   last = 0;           // Time of the last report
+    static char     payload[MetricsPayloadSize];
+    struct timespec now;
+    int             len;
+    int             first = 1;
+
+    if(reportPeriod <= 0) return;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(now.tv_sec - last < reportPeriod) return;
+    last = now.tv_sec;
+
+    len = snprintf(payload, sizeof(payload), "{\"ts\":%lld,\"scan_rate_ms\":%i,\"slaves\":{",
+            (long long)now.tv_sec*1000 + now.tv_nsec/1000000, getScanRate());
+    for(int s = 0; s < 256 && len < (int)sizeof(payload); s ++){
+        SlaveMetrics *slave = &slaveTable[s];
+        Histogram    latency;
+
+        if(!atomic_load_explicit(&slave->seen, memory_order_relaxed)) continue;
+        // Latency of the meter: every window of it together
+        memset(&latency, 0, sizeof(latency));
+        for(int i = 0; i < MetricsTableSize; i ++){
+            if(atomic_load_explicit(&windowTable[i].key, memory_order_acquire) >> 16 != (uint32_t)s) continue;
+            for(int b = 0; b < HistogramBuckets; b ++) latency.buckets[b] += atomic_load_explicit(&windowTable[i].latency.buckets[b], memory_order_relaxed);
+            latency.count += atomic_load_explicit(&windowTable[i].latency.count, memory_order_relaxed);
+        }
+
+        len += snprintf(payload + len, sizeof(payload) - len, "%s\"%i\":{\"p50_ms\":%g,\"p99_ms\":%g,\"transactions\":%u",
+                first ? "" : ",", s, histogramPercentile(&latency, 0.5), histogramPercentile(&latency, 0.99), latency.count);
+        for(int c = 0; c < SlaveCounters && len < (int)sizeof(payload); c ++){
+            len += snprintf(payload + len, sizeof(payload) - len, ",\"%s\":%u", counterNames[c],
+                    atomic_load_explicit(&slave->counters[c], memory_order_relaxed));
+        }
+        if(len < (int)sizeof(payload)) len += snprintf(payload + len, sizeof(payload) - len,
+                ",\"scan_p99_ms\":%g,\"scan_interval_ms\":%u,\"jitter_mean_ms\":%.3f,\"jitter_max_ms\":%.3f,\"exceptions\":{",
+                histogramPercentile(&slave->scan, 0.99), atomic_load_explicit(&slave->interval_ms, memory_order_relaxed),
+                jitterMeanMs(slave), atomic_load_explicit(&slave->jitter_max_us, memory_order_relaxed)/1000.0);
+        for(int code = 0, n_codes = 0; code < MaxExceptionCode && len < (int)sizeof(payload); code ++){
+            uint32_t n = atomic_load_explicit(&slave->exceptions[code], memory_order_relaxed);
+            if(n > 0) len += snprintf(payload + len, sizeof(payload) - len, "%s\"%i\":%u", n_codes ++ ? "," : "", code, n);
+        }
+        if(len < (int)sizeof(payload)) len += snprintf(payload + len, sizeof(payload) - len, "}}");
+        first = 0;
+    }
+    if(len < (int)sizeof(payload)) len += snprintf(payload + len, sizeof(payload) - len,
+            "},\"publish_p99_ms\":%g,\"command_p50_ms\":%g,\"command_p99_ms\":%g,\"commands\":%u,\"queues\":[",
+            histogramPercentile(&publishLatency, 0.99), histogramPercentile(&commandLatency, 0.5), histogramPercentile(&commandLatency, 0.99),
+            atomic_load_explicit(&commandLatency.count, memory_order_relaxed));
+    for(int q = 0, n_queues = 0; q < MetricsQueues && len < (int)sizeof(payload); q ++){
+        if(!atomic_load_explicit(&queueTable[q].seen, memory_order_relaxed)) continue;
+        len += snprintf(payload + len, sizeof(payload) - len, "%s{\"depth\":%u,\"max_depth\":%u,\"drops\":%u}", n_queues ++ ? "," : "",
+                atomic_load_explicit(&queueTable[q].depth, memory_order_relaxed),
+                atomic_load_explicit(&queueTable[q].max_depth, memory_order_relaxed),
+                atomic_load_explicit(&queueTable[q].drops, memory_order_relaxed));
+    }
+    if(len < (int)sizeof(payload)) len += snprintf(payload + len, sizeof(payload) - len, "]}");
+    if(len >= (int)sizeof(payload)){
+        printf("ERROR: Metrics message too long, not published.\n");
+        return;
+    }
+    mqtt_publish(MetricsTopic, payload, len, 0, false);
+}
+
+
+
+/* PROMETHEUS ENDPOINT: Serves the metrics in text format on 127.0.0.1:<port> from its own thread.
+    returns 0 if listening
+            or -1 if error
+*/
+int metricsServe(int port){
+    struct sockaddr_in  address;
+    pthread_t           thread;
+    int                 on = 1;
+    int                 error;
+
+    serverFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(serverFd < 0){
+        printf("ERROR %i from socket: %s\n", errno, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from socket: %s", errno, strerror(errno));
+        return -1;
+    }
+    setsockopt(serverFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_port        = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(serverFd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(serverFd, 4) < 0){
+        printf("ERROR %i from bind: %s\n", errno, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from bind 127.0.0.1:%i: %s", errno, port, strerror(errno));
+        close(serverFd);
+        return -1;
+    }
+
+    error = pthread_create(&thread, NULL, serverThread, NULL);
+    if(error != 0){
+        printf("ERROR %i from pthread_create: %s\n", error, strerror(error));
+        syslog(LOG_ERR, "ERROR %i from pthread_create: %s", error, strerror(error));
+        return -1;
+    }
+    pthread_detach(thread);
+    logInfo("  Metrics on http://127.0.0.1:%i/metrics\n", port);
+    return 0;
+}
+
+
+
+/* SERVER THREAD: Answers every HTTP request with the metrics, whatever the path.
+*/
+void *serverThread(void *arg){
+    struct timeval  timeout = {1, 0};   // Time to wait for the request
+    char            request[1024];
+    (void)arg;
+
+    while(1){
+        int client = accept(serverFd, NULL, NULL);
+        if(client < 0){
+            if(errno == EINTR) continue;
+            printf("ERROR %i from accept: %s\n", errno, strerror(errno));
+            syslog(LOG_ERR, "ERROR %i from accept: %s", errno, strerror(errno));
+            sleep(1);
+            continue;
+        }
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if(recv(client, request, sizeof(request), 0) <= 0){
+            close(client);
+            continue;
+        }
+
+        FILE *out = fdopen(client, "w");
+        if(out == NULL){
+            close(client);
+            continue;
+        }
+        fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+        metricsWrite(out);
+        fclose(out);
+    }
+    return NULL;
+}
+
+
+
+/* HISTOGRAM ADD: Adds an observation (mili seconds).
+*/
+void histogramAdd(Histogram *histogram, double ms){
+    int b = 0;
+
+    while(b < HistogramBuckets - 1 && ms > bucketBounds[b]) b ++;
+    atomic_fetch_add_explicit(&histogram->buckets[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum_us, (uint64_t)(ms*1000), memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+}
+
+
+
+/* HISTOGRAM PERCENTILE: Upper bound of the bucket where the percentile p [0...1] falls (mili seconds).
+    Observations over the last bound report the last bound.
+*/
+double histogramPercentile(const Histogram *histogram, double p){
+    uint32_t total = 0, cumulative = 0;
+
+    for(int b = 0; b < HistogramBuckets; b ++) total += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+    if(total == 0) return 0;
+    for(int b = 0; b < HistogramBuckets - 1; b ++){
+        cumulative += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+        if(cumulative >= p*total) return bucketBounds[b];
+    }
+    return bucketBounds[HistogramBuckets - 2];
+}
+
+
+
+/* WRITE HISTOGRAM: Writes a histogram in Prometheus text format (cumulative buckets, in seconds).
+*/
+void writeHistogram(FILE *out, const char *name, const char *labels, const Histogram *histogram){
+    uint32_t    cumulative = 0;
+    const char  *separator = labels[0] ? "," : "";
+
+    for(int b = 0; b < HistogramBuckets - 1; b ++){
+        cumulative += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %u\n", name, labels, separator, bucketBounds[b]/1000, cumulative);
+    }
+    cumulative += atomic_load_explicit(&histogram->buckets[HistogramBuckets - 1], memory_order_relaxed);
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %u\n", name, labels, separator, cumulative);
+    fprintf(out, "%s_sum{%s} %.6f\n", name, labels, atomic_load_explicit(&histogram->sum_us, memory_order_relaxed)/1e6);
+    fprintf(out, "%s_count{%s} %u\n", name, labels, atomic_load_explicit(&histogram->count, memory_order_relaxed));
+}
+
+
+
+/* WINDOW METRICS: Slot of a (slave, register window) pair, taken the first time it is seen.
+    Slots are taken with compare and swap, so any thread can add a window.
+    (Slave IDs start at 1, so a key is never 0)
+    returns the slot
+            or NULL if the table is full
+*/
+WindowMetrics *windowMetrics(uint8_t slave_id, uint16_t start){
+    uint32_t key = (uint32_t)slave_id << 16 | start;
+    uint32_t pos = (key*2654435761u) & TableMask;      // Multiplicative hash
+
+    for(int i = 0; i < MetricsTableSize; i ++){
+        WindowMetrics   *slot = &windowTable[(pos + i) & TableMask];
+        uint32_t        free = 0;
+
+        if(atomic_load_explicit(&slot->key, memory_order_acquire) == key) return slot;
+        if(atomic_compare_exchange_strong_explicit(&slot->key, &free, key, memory_order_acq_rel, memory_order_acquire)) return slot;
+        if(free == key) return slot;
+    }
+    return NULL;
+}
+
+
+
+/* ELAPSED: Mili seconds from one time to another.
+*/
+double elapsedMs(const struct timespec *from, const struct timespec *to){
+    return (to->tv_sec - from->tv_sec)*1000.0 + (to->tv_nsec - from->tv_nsec)/1e6;
+}
+
+
+
+/* JITTER MEAN: Mean deviation of the poll spacing of a meter (mili seconds).
+*/
+double jitterMeanMs(SlaveMetrics *slave){
+    uint32_t count = atomic_load_explicit(&slave->jitter_count, memory_order_relaxed);
+
+    if(count == 0) return 0;
+    return atomic_load_explicit(&slave->jitter_sum_us, memory_order_relaxed)/1000.0/count;
+}
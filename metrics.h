@@ -0,0 +1,50 @@
+#ifndef metrics
+#define metrics
+
+// C headers
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Defines
+#define HistogramBuckets    13      // Latency buckets (the last one has no upper bound)
+#define MetricsTableSize    1024    // (slave, register window) pairs tracked (power of 2)
+#define MaxExceptionCode    12      // Exception codes counted one by one (higher ones count as 0)
+#define MetricsQueues       8       // Sample queues tracked
+#define MetricsTopic        "meter/sys/metrics"
+#define MetricsPayloadSize  16384   // Size of the metrics message
+
+// Enums
+typedef enum{
+    CounterRetries,         // Requests sent again
+    CounterTimeouts,        // Requests without a valid response in time
+    CounterCrcErrors,       // Responses with a wrong error check
+    CounterUnidentified,    // Responses that don't match the request
+    CounterFailures,        // Transactions given up (error signal returned)
+    CounterMisses,          // Poll periods skipped because the bus was busy (deadlines missed)
+    SlaveCounters
+}SlaveCounter;
+
+// Structs
+typedef struct{
+    _Atomic uint32_t    buckets[HistogramBuckets];  // Observations in each bucket (not cumulative)
+    _Atomic uint64_t    sum_us;                     // Sum of the observations (micro seconds)
+    _Atomic uint32_t    count;                      // Number of observations
+}Histogram;
+
+// Functions
+void        metricsCount(uint8_t slave_id, SlaveCounter counter, uint32_t n);
+void        metricsException(uint8_t slave_id, uint8_t code);
+void        metricsTransaction(uint8_t slave_id, uint16_t start, const struct timespec *sent);
+void        metricsScan(uint8_t slave_id, const struct timespec *start, int follows_scan_rate);
+void        metricsJitter(uint8_t slave_id, long deviation_us);
+void        metricsPublish(const struct timespec *timestamp);
+void        metricsCommand(const struct timespec *received);
+void        metricsQueue(int queue, uint32_t depth, uint32_t max_depth, uint32_t drops);
+void        metricsWrite(FILE *out);
+void        metricsSetPeriod(int period_s);
+void        metricsReport();
+int         metricsServe(int port);
+
+#endif
@@ -11,64 +11,115 @@
 
 // Include header file with defines, enums, macros and funcionts
 #include "modbus.h"
+#include "modbusTcp.h"
 
 // Define constants
-#define AttemptTimeout 2    // Attempts to recieve correct message
-#define SendDelay 1000000      // Micro Seconds
+#define CharBits 11         // Bits per character on the line (start + 8 data + parity + stop)
 
 
 // Internal functions declaration
-void        serialConfig(struct termios *tty);
-uint16_t    errorCheck(uint8_t bytes[], int wordSize);
-float       bytesToFloat(uint8_t bytes[]);
-int         modbusExceptionLogger(uint8_t bytes[]);
-
-
-// Variable to be used in all function (must preserve value when out of scope)
-static int serial_port;
+void        serialConfig(ModbusPort *port, struct termios *tty);
+int         modbusReceive(ModbusPort *port, RtuParser *parser, RtuFrame *frame, int expected);
+int         modbusTransaction(ModbusPort *port, uint8_t slave_id, FunctionCode funtion_code, const RegisterWindow *window, uint8_t data[]);
+int         modbusExchange(ModbusPort *port, uint8_t slave_id, const uint8_t request[], int length, FunctionCode funtion_code, int expected, RtuFrame *frame);
+void        lineFlags(struct termios *tty, LineParity parity);
+speed_t     lineSpeed(int baud_rate);
+
+
+// CRC of every byte value (polynomial 0xA001, reflected), see errorCheck()
+static const uint16_t crcTable[256] = {
+    0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+    0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+    0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+    0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+    0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+    0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+    0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+    0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+    0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+    0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+    0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+    0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+    0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+    0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+    0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+    0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+    0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+    0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+    0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+    0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+    0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+    0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+    0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+    0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+    0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+    0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+    0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+    0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+    0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+    0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+    0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+    0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
 
 
 
 /* MODBUS ININITILIZATION: Initialize the port for protocol communication
+    Every RS-485 adapter has its own port context, so several buses can be polled at the same time.
+    Ports with TransportTcp connect to their Modbus TCP gateway instead ("<host>[:<port>]").
     - Returns
-        [serial_port] if everything is initialized correctly
-        [>0] if there was an error.
+        [port->fd] if everything is initialized correctly
+        [<0] if there was an error.
 */
-int initializePort(char *COM){
-    printf("--Initializing MODBUS communication--\n");
+int initializePort(ModbusPort *port, char *COM){
+    logInfo("--Initializing MODBUS communication--\n");
+
+    port->path              = COM;
+    port->response_timeout  = ResponseTimeout;
+    // Keep the line settings found by a probe when the port is opened again
+    if(port->baud_rate == 0){
+        port->baud_rate     = BaudRate;
+        port->parity        = DefaultParity;
+    }
+    if(port->transport == TransportTcp) return modbusTcpConnect(port);
 
     // Open the port
-    printf("  Opening serial port in: %s\n",COM);
-    serial_port = open(COM, O_RDWR);
-    if(serial_port < 0){
+    logInfo("  Opening serial port in: %s\n",COM);
+    port->fd = open(COM, O_RDWR | O_NOCTTY);
+    if(port->fd < 0){
         printf("ERROR %i from open: %s\n", errno, strerror(errno));
-        syslog(LOG_ERR, "ERROR %i from open: %s", errno, strerror(errno));
-        return serial_port;
+        syslog(LOG_ERR, "ERROR %i from open %s: %s", errno, COM, strerror(errno));
+        return port->fd;
     }
 
-    // Create a termios object
-    printf("  Creating termios object...\n");
+    // Create a termios object from the current settings
+    logDebug("  Creating termios object...\n");
     struct termios tty;
+    if(tcgetattr(port->fd, &tty) != 0){
+        printf("ERROR %i from tcgetattr: %s\n", errno, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from tcgetattr: %s", errno, strerror(errno));
+        close(port->fd);
+        port->fd = -1;
+        return port->fd;
+    }
 
     // Configure Termio Posix
-    serialConfig(&tty);
-    printf("--Initialization Complete--\n");
+    serialConfig(port, &tty);
+    logInfo("--Initialization Complete--\n");
 
-    return serial_port;
+    return port->fd;
 }
 
 
 
 /* TERMIOS POSIX CONFIGURATION: Initial configuration to enable serial communication in IO using the linux terminal.
 */
-void serialConfig(struct termios* tty){
-    printf(" -Serial configuration started-\n");
+void serialConfig(ModbusPort *port, struct termios* tty){
+    logDebug(" -Serial configuration started-\n");
     
     // Control Flags
-    printf("   Serial configuration (1/8)\n");
-    (*tty).c_cflag |= PARENB;          // Enable parity (Can be disabled -> "&= ~PARENB") EVEN by default
-    //(*tty).c_cflag |= PARODD;        // Uncomment for ODD parity
-    (*tty).c_cflag &= ~CSTOPB;         // Only one stop bit (If parity disabled, 2 stop bits -> "|= CSTOPB")
+    logDebug("   Serial configuration (1/8)\n");
+    lineFlags(tty, port->parity);      // Parity and stop bits (EVEN and one stop bit by default)
     (*tty).c_cflag &= ~CSIZE;          // Clear size, and set to 8 data bits per word
     (*tty).c_cflag |= CS8;
     (*tty).c_cflag &= ~CRTSCTS;        // Disable flow control
@@ -76,26 +127,26 @@ void serialConfig(struct termios* tty){
     
     // Local modes
         // Canonical mode
-    printf("   Serial configuration (2/8)\n");
+    logDebug("   Serial configuration (2/8)\n");
     (*tty).c_lflag &= ~ICANON;         // Select non-cannonical mode (signal process doesn't need the end of line character to start)
 
         // Echoing
-    printf("   Serial configuration (3/8)\n");
+    logDebug("   Serial configuration (3/8)\n");
     (*tty).c_lflag &= ~ECHO;           // Disable echo
     (*tty).c_lflag &= ~ECHOE;          // Disable erasure
     (*tty).c_lflag &= ~ECHONL;         // Disable new line echo
 
         // Signal characters
-    printf("   Serial configuration (4/8)\n");
+    logDebug("   Serial configuration (4/8)\n");
     (*tty).c_lflag &= ~ISIG;           // Disable interpretation of INTR, QUIT and SUSP characters
 
     // Input modes
-    printf("   Serial configuration (5/8)\n");
+    logDebug("   Serial configuration (5/8)\n");
     (*tty).c_iflag &= ~(IXON | IXOFF | IXANY);                             // Turn off software flow ctrl
     (*tty).c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL);    // Disable any special handling of received byte
 
     // Output modes
-    printf("   Serial configuration (6/8)\n");
+    logDebug("   Serial configuration (6/8)\n");
     (*tty).c_oflag &= ~OPOST;      // Prevent special interpretation of output bytes
     (*tty).c_oflag &= ~ONLCR;      // Prevent conversion of newline to carriage return/line feed
     //(*tty).c_oflag &= ~OXTABS;     // Prevent conversion of tabs to spaces (Comment out if errors)
@@ -104,190 +155,699 @@ void serialConfig(struct termios* tty){
     // Return timings (for read() function)
         // VMIN -> number of bytes
         // VTIME -> timeout value
-    printf("   Serial configuration (7/8)\n");
-    (*tty).c_cc[VTIME] = 1;         // Block for up to 0.1 s, until a byte arrives.
-    (*tty).c_cc[VMIN] = 0;          // Block until 0 bytes have arrived.
+    logDebug("   Serial configuration (7/8)\n");
+    (*tty).c_cc[VTIME] = 0;         // Don't block, poll() waits for the bytes (see modbusReceive).
+    (*tty).c_cc[VMIN] = 0;          // Return whatever bytes are already buffered.
 
     // Baund rate
-        // Set in/out baud rate to be 9600
-    printf("   Serial configuration (8/8)\n");
-    cfsetispeed(tty, B9600);
-    cfsetospeed(tty, B9600);
+        // Set in/out baud rate (9600 by default)
+    logDebug("   Serial configuration (8/8)\n");
+    cfsetispeed(tty, lineSpeed(port->baud_rate));
+    cfsetospeed(tty, lineSpeed(port->baud_rate));
 
-    printf("  Saving serial settings...\n");
-    if (tcsetattr(serial_port, TCSANOW, tty) != 0) {
+    logDebug("  Saving serial settings...\n");
+    if (tcsetattr(port->fd, TCSANOW, tty) != 0) {
         printf("Error %i from tcsetattr: %s\n", errno, strerror(errno));
         syslog(LOG_ERR, "ERROR %i from tcsetattr: %s", errno, strerror(errno));
         abort();
     }
 
-    if(tcgetattr(serial_port, tty) != 0){
+    if(tcgetattr(port->fd, tty) != 0){
         printf("ERROR %i from tcgetattr: %s\n", errno, strerror(errno));
         syslog(LOG_ERR, "ERROR %i from tcgetattr: %s", errno, strerror(errno));
         abort();
     }
-    printf(" -Serial configuration successful-\n");
+    logDebug(" -Serial configuration successful-\n");
 }
 
 
 
-/* MODBUS MASTER QUERY AND RESPONSE: Send all the necessary bytes for the salve to understand the message.
+/* LINE SETTINGS: Changes the baud rate, parity and stop bits of an open serial port.
+    Bytes still on the buffers are dropped, they were sent with the old settings.
+    +Baud Rate::        1200, 2400, 4800, 9600, 19200 or 38400
+    +Parity::           Choose from the LineParity typedef ennum
+    returns 0 if the port uses the new settings
+            or -1 if error (the old settings are kept)
+*/
+int modbusSetLine(ModbusPort *port, int baud_rate, LineParity parity){
+    struct termios tty;
+
+    if(port->transport == TransportTcp || lineSpeed(baud_rate) == B0) return -1;
+    if(tcgetattr(port->fd, &tty) != 0){
+        printf("ERROR %i from tcgetattr: %s\n", errno, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from tcgetattr: %s", errno, strerror(errno));
+        return -1;
+    }
+    lineFlags(&tty, parity);
+    cfsetispeed(&tty, lineSpeed(baud_rate));
+    cfsetospeed(&tty, lineSpeed(baud_rate));
+    if(tcsetattr(port->fd, TCSADRAIN, &tty) != 0){
+        printf("ERROR %i from tcsetattr: %s\n", errno, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from tcsetattr: %s", errno, strerror(errno));
+        return -1;
+    }
+    tcflush(port->fd, TCIOFLUSH);
+    port->baud_rate = baud_rate;
+    port->parity    = parity;
+    logDebug("  Line of %s set to %i bauds, parity code %i\n", port->path, baud_rate, parity);
+    return 0;
+}
+
+
+
+/* LINE FLAGS: Control flags of a parity setting (codes of the NET_PARITY register).
+*/
+void lineFlags(struct termios *tty, LineParity parity){
+    (*tty).c_cflag &= ~(PARENB | PARODD | CSTOPB);
+    if(parity == ParityEven) (*tty).c_cflag |= PARENB;
+    if(parity == ParityOdd) (*tty).c_cflag |= PARENB | PARODD;
+    if(parity == ParityNoneTwo) (*tty).c_cflag |= CSTOPB;
+}
+
+
+
+/* LINE SPEED: termios speed of a baud rate.
+    returns B0 if the rate isn't supported by the meters
+*/
+speed_t lineSpeed(int baud_rate){
+    switch(baud_rate){
+        case 1200:  return B1200;
+        case 2400:  return B2400;
+        case 4800:  return B4800;
+        case 9600:  return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        default:    return B0;
+    }
+}
+
+
+
+/* MODBUS TIMEOUT: Sets the time to wait for a response after the request has been sent (mili seconds),
+   until the response time of the meter is measured (see healthTimeoutMs).
+    The wire time of the request and the response is added on top of it.
+*/
+void modbusSetTimeout(ModbusPort *port, int timeout_ms){
+    if(timeout_ms > 0) port->response_timeout = timeout_ms;
+}
+
+
+
+/* FRAME TIMINGS: Times used to detect the end of a frame on this port (mili seconds, rounded up).
+    - Silence: 3.5 characters without bytes ends a RTU frame (fixed 1.75 ms over 19200 bauds, MODBUS over serial line V1.02)
+    - Response: response timeout of the meter plus the wire time of the request (8 bytes) and of the expected response
+    - Wire: time of some bytes on the line (micro seconds, 0 for Modbus TCP)
+*/
+int modbusSilenceMs(ModbusPort *port){
+    int char_us = (CharBits*1000000)/port->baud_rate;   // Time to send one character (micro seconds)
+
+    if(port->baud_rate > 19200) return 2;
+    return (7*char_us/2 + 999)/1000;
+}
+
+int modbusResponseMs(ModbusPort *port, uint8_t slave_id, int expected){
+    return healthTimeoutMs(slave_id, port->response_timeout) + (modbusWireUs(port, 8 + expected) + 999)/1000;
+}
+
+long modbusWireUs(ModbusPort *port, int bytes){
+    if(port->transport == TransportTcp) return 0;
+    return (long)bytes*CharBits*1000000/port->baud_rate;
+}
+
+
+
+/* FRAME RECEIVER: Reads an RTU frame as soon as it arrives, using poll() on the serial port.
+    Bytes are passed to the stream parser as they come (partial reads are fine) and the function
+    returns when the parser finds a complete valid frame or the overall timeout expires.
+    When the line is silent for 3.5 characters a partial frame can't be completed, so the parser
+    drops it and resynchronises on the next bytes.
+    Parameters:
+        -parser     : stream parser initialized with the reply expected
+        -frame      : where the frame recieved is copied
+        -expected   : size of a complete frame (to add its wire time to the timeout)
+    returns 1 if a frame was recieved
+            0 if timeout
+*/
+int modbusReceive(ModbusPort *port, RtuParser *parser, RtuFrame *frame, int expected){
+    struct pollfd   fds         = {port->fd, POLLIN, 0};        // Serial port to wait on
+    struct timespec start, now;                                 // Time the wait started and current time
+    int             silence_ms  = modbusSilenceMs(port);        // 3.5 character times
+    int             deadline_ms = modbusResponseMs(port, parser->slave_id, expected); // Overall time allowed for the frame
+    int             wait_ms;                                    // Time allowed for the next poll()
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(1){
+        if(rtuParserNext(parser, frame)) return 1;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        wait_ms = deadline_ms - (int)((now.tv_sec - start.tv_sec)*1000 + (now.tv_nsec - start.tv_nsec)/1000000);
+        if(wait_ms <= 0) return 0;
+        // Once a frame has started, silence ends it
+        if(rtuParserPending(parser) > 0 && silence_ms < wait_ms) wait_ms = silence_ms;
+
+        int ready = poll(&fds, 1, wait_ms);
+        if(ready < 0){
+            if(errno == EINTR) continue;
+            printf("ERROR %i from poll: %s\n", errno, strerror(errno));
+            syslog(LOG_ERR, "ERROR %i from poll: %s", errno, strerror(errno));
+            return 0;
+        }
+        if(ready == 0){
+            // Silence: the partial frame is noise, look for a frame in the bytes after it
+            if(modbusSilence(parser, frame)) return 1;
+            continue;
+        }
+        if(modbusReadPort(port, parser) < 0) return 0;
+    }
+}
+
+
+
+/* READ PORT: Passes the bytes waiting on the serial port to the stream parser (never blocks).
+    returns number of bytes read
+            or -1 if error
+*/
+int modbusReadPort(ModbusPort *port, RtuParser *parser){
+    uint8_t rx_buffer[64];      // Bytes returned by one read()
+    int     n_read;             // Number of bytes returned by one read()
+
+    n_read = read(port->fd, rx_buffer, sizeof(rx_buffer));
+    if(n_read < 0){
+        if(errno == EAGAIN || errno == EINTR) return 0;
+        printf("ERROR %i from read: %s\n", errno, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from read: %s", errno, strerror(errno));
+        return -1;
+    }
+    rtuParserFeed(parser, rx_buffer, n_read);
+    return n_read;
+}
+
+
+
+/* LINE SILENCE: The line has been silent for 3.5 characters, so a partial frame can't be completed.
+    Drops it and looks for a complete frame in the bytes after it.
+    returns 1 if a frame was found
+            0 if not
+*/
+int modbusSilence(RtuParser *parser, RtuFrame *frame){
+    while(rtuParserPending(parser) > 0){
+        if(rtuParserNext(parser, frame)) return 1;
+        rtuParserSkip(parser);
+    }
+    return 0;
+}
+
+
+
+/* SEND REQUEST: Composes a read request, clears the port and sends it.
+    Polling paths send the frames built once by modbusBuildRequest() with modbusSendFrame().
 
     +Slave ID::         [0...255] in HEX
-    +Start Address::    Choose from the StartAddress typedef ennum [2 bytes]
+    +Function Code::    Choose from the FunctionCode typedef ennum
+    +Start Address::    First register to read [2 bytes]
+    +Register Count::   Number of registers to read [1...MaxWindowRegisters]
+*/
+void modbusSendRequest(ModbusPort *port, uint8_t slave_id, FunctionCode funtion_code, uint16_t StartAddress, uint16_t register_count){
+    RegisterWindow window = {StartAddress, register_count, {0}};
 
-    returns 0xFFFFFFFF if error
-            or value of parameter in float format
+    modbusBuildRequest(&window, slave_id, funtion_code);
+    modbusSendFrame(port, window.request, RequestSize);
+}
+
+
+
+/* BUILD REQUEST: Composes the read request of a window, so it can be sent again and again
+   without computing its error check.
+
+    +Slave ID::         [0...255] in HEX
+    +Function Code::    Choose from the FunctionCode typedef ennum
 */
-float modbusQuery(uint8_t slave_id, StartAddress_3X StartAddress){
-    uint16_t    byte_count      = 0x0002;                       // Register Size (2 bytes)
-    uint8_t     funtion_code    = R_3X;                         // Function code for message (read from 3x registers)
-    uint8_t     tx_msg[8];                                      // Transfer message (8 bytes)
+void modbusBuildRequest(RegisterWindow *window, uint8_t slave_id, FunctionCode funtion_code){
+    uint8_t     *tx_msg = window->request;                      // Transfer message (8 bytes)
     uint16_t    errorWord;                                      // Error check word (2 bytes)
-    int         attempts        = 0;                            // Counter that keeps track of the attempts
-    int         n_bytes;                                        // Number of bytes recieved
-    uint8_t     rx_buffer[64];                                  // Recieved bytes buffer (64 bytes reserved)
-    uint8_t     rx_message[20];                                 // Array for the recieved message (Max size of 20 bits (device max is 9 bytes))
-    uint8_t     *byte_response  = calloc(4, sizeof(uint8_t));   // Pointer of the response in bytes
-    float       float_response  = 0xFFFFFFFF;                   // Number that the funtion will return                     
 
-    printf("--Begining Query process--\n");
-    //_____SEND MESSAGE_______
+    //_____COMPOSE MESSAGE_______
     // MESSAGE FORMAT (8 bytes) 
     //[Salve Adress | Function Code | Start Address (H) | Start Address (L) | Register Size (H) | Register Size (L) | Error Check (L) | Error Check (H)]
-    printf("  Composing message to send...\n");
-
-    // Initialize message without error check bytes
-    printf("   Composing message (1/2)\n");
     tx_msg[0] = slave_id;
     tx_msg[1] = funtion_code;
-    tx_msg[2] = GET_HIGH(StartAddress);
-    tx_msg[3] = GET_LOW(StartAddress);
-    tx_msg[4] = GET_HIGH(byte_count);
-    tx_msg[5] = GET_LOW(byte_count);
+    tx_msg[2] = GET_HIGH(window->start);
+    tx_msg[3] = GET_LOW(window->start);
+    tx_msg[4] = GET_HIGH(window->count);
+    tx_msg[5] = GET_LOW(window->count);
 
     // Calcualte error checking bytes CRC (only for the part of the message without error check bytes (6 bytes))
     errorWord = errorCheck(tx_msg, 6);
     // Add error check bytes to transfer message (first the Low bytes then the High)
-    printf("   Composing message (2/2)\n");
     tx_msg[6] = GET_LOW(errorWord);
-    tx_msg[7] = GET_HIGH(errorWord);        
-    
+    tx_msg[7] = GET_HIGH(errorWord);
+}
 
-    //___SEND MESSEGE AND PROCESS RESPONSE___
-    printf("  Preparing to send message...\n");
-    // Initialize response to error signal by default
-    byte_response[0] = 0xFF;
-    byte_response[1] = 0xFF;
-    byte_response[2] = 0xFF;
-    byte_response[3] = 0xFF;
 
+
+/* SEND FRAME: Clears the port and sends a frame already composed.
+*/
+void modbusSendFrame(ModbusPort *port, const uint8_t frame[], int length){
     // Delete any bytes already on the buffer
-    tcflush(serial_port,TCIOFLUSH);
-
-    while(attempts < AttemptTimeout){
-        // Delete any bytes already on the buffer
-        tcflush(serial_port,TCIOFLUSH);
-        //___Send the message___
-        printf("  Sending message...\n");
-        if( write(serial_port, tx_msg, sizeof(tx_msg)) < 0){
-            printf("ERROR %i from write: %s\n", errno, strerror(errno));
-            syslog(LOG_ERR, "ERROR %i from write: %s", errno, strerror(errno));
-            abort();
-        }
-        printf("   Sending : ");
-        for(int i = 0; i < sizeof(tx_msg); i ++) printf("%#02x ", tx_msg[i]);
-        printf("\n");
-        printf("  Message Sent\n");
-
-        //___Wait for response___
-        // Wait 1 ms for buffered message to be transfered and reply waiting in buffer
-        printf("  Waiting for response...\n");
-        if(usleep(SendDelay) < 0) printf("ERROR %i from usleep: %s\n", errno, strerror(errno));
-        
-        
-        //___Read response___
-        printf("  Reading response...\n");
-        n_bytes = read(serial_port+1, rx_buffer, 20);
-        for(int i = 0; i < n_bytes; i ++)rx_message[i] = rx_buffer[i];
-        int temp = 0;       // Variable to temporarly hold the real message size
-        if(n_bytes < 5){
+    tcflush(port->fd,TCIOFLUSH);
+    //___Send the message___
+    logTrace("  Sending message...\n");
+    if( write(port->fd, frame, length) < 0){
+        printf("ERROR %i from write: %s\n", errno, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from write: %s", errno, strerror(errno));
+        abort();
+    }
+    logHex(LevelTrace, "   Sending : ", frame, length);
+    logTrace("  Message Sent\n");
+}
+
+
+
+/* PROCESS RESPONSE: Checks a frame returned by the parser (slave, function code and error check already verified)
+   and copies its register bytes.
+
+    +Register Count::   Number of registers requested
+    +Data::             Array where the register bytes are copied (2 bytes per register)
+
+    returns number of data bytes copied
+            ResponseRetry if the query should be sent again
+            ResponseFailed if the query should not be sent again
+*/
+int modbusProcessResponse(RtuFrame *frame, uint16_t register_count, uint8_t data[]){
+    uint8_t     *rx_message     = frame->bytes;                 // Bytes of the recieved message
+
+    logHex(LevelTrace, "  Message recieved: ", rx_message, frame->length);
+
+    //___Process message___
+    // Recieved message structure (9 bytes for a single register pair)
+    //    0         1         2          3           4          5           6             7                 8
+    //[Slave ID, Fn Code, Byte Count, Reg1(high), Reg1(low), Reg2(high), Reg2(low), Error Check(low), Error Check(high)]
+    logTrace("  Processing Response...\n");
+
+    // Check if exception code was sent (its error check was verified by the parser)
+    if(rx_message[1] & 0x80) return modbusExceptionResponse(rx_message[0], rx_message[2]);
+
+    // Check if it's the reply to the message we sent out (slave and function code checked by the parser)
+    if(rx_message[2] != 2*register_count){
+        metricsCount(rx_message[0], CounterUnidentified, 1);
+        logWarning(" WARNING: MODBUS unidentified message. Sending query again.\n"
+                   "  [%i bytes](local) doesn't match [%i bytes](RX)\n", 2*register_count, rx_message[2]);
+        return ResponseRetry;
+    }
+
+    // Extract register bytes
+    for(int i = 0; i < rx_message[2]; i ++) data[i] = rx_message[i+3];
+    logHex(LevelTrace, "  Response recieved succesfully: ", data, rx_message[2]);
+    return rx_message[2];
+}
+
+
+
+/* MODBUS MASTER TRANSACTION: Send a read request for a range of registers and wait for a valid response.
+
+    +Slave ID::         [0...255] in HEX
+    +Function Code::    Choose from the FunctionCode typedef ennum
+    +Window::           Registers to read, with its request built for this slave and function code
+    +Data::             Array where the register bytes are copied (2 bytes per register)
+
+    returns number of data bytes copied
+            or -1 if error
+*/
+int modbusTransaction(ModbusPort *port, uint8_t slave_id, FunctionCode funtion_code, const RegisterWindow *window, uint8_t data[]){
+    int         attempts        = 0;                            // Counter that keeps track of the attempts
+    int         max_attempts    = healthAttempts(slave_id, AttemptTimeout); // Attempts allowed (a single probe if the meter is down)
+    RtuParser   parser;                                         // Stream parser for the response
+    RtuFrame    frame;                                          // Recieved message
+    int         data_bytes      = -1;                           // Number of bytes that the function will return
+    struct timespec sent;                                       // Time the request was sent
+
+    if(port->transport == TransportTcp){
+        modbusTcpPipeline(port, slave_id, funtion_code, window, 1, &data, &data_bytes);
+        return data_bytes;
+    }
+
+    logDebug("--Begining Query process--\n");
+
+    while(attempts < max_attempts){
+        if(attempts > 0) metricsCount(slave_id, CounterRetries, 1);
+        modbusSendFrame(port, window->request, RequestSize);
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+
+        //___Wait for response and read it___
+        // Returns as soon as a valid frame is complete or the timeout expires
+        logTrace("  Waiting for response...\n");
+        rtuParserInit(&parser, slave_id, funtion_code);
+        // Response size: [Slave ID, Fn Code, Byte Count, Data (2 bytes per register), Error Check(low), Error Check(high)]
+        if(modbusReceive(port, &parser, &frame, 5 + 2*window->count) == 0){
             // Send message again
-            printf(" WARNING: Modbus message to short. Sending again...\n");
+            modbusReceiveWarning(&parser);
             attempts ++;
             continue;
         }
-        n_bytes = n_bytes + temp;
-        printf("  Message of %i bytes recieved: ", n_bytes);
-        for(int i = 0; i < n_bytes; i ++) printf("%#02x ", rx_message[i]);
-        printf("\n");
-
-        //___Process message___
-        // Recieved message structure (9 bytes usually)
-        //    0         1         2          3           4          5           6             7                 8
-        //[Slave ID, Fn Code, Byte Count, Reg1(high), Reg1(low), Reg2(high), Reg2(low), Error Check(low), Error Check(high)]
-        printf("  Processing Response...\n");
-
-        // Check if exception code was sent
-        if(n_bytes == 5){
-            if(modbusExceptionLogger(rx_message) == 0) break;
-            else{
-                attempts ++;
-                continue;
-            }
-        }
+        healthResponse(slave_id, &sent, modbusWireUs(port, RequestSize + frame.length));
 
-        // Remove Error check bytes from message, compute locally, and compare if it's the same. Re-run if not.
-        errorWord = errorCheck(rx_message, (n_bytes - 2));
-        if((GET_HIGH(errorWord) != rx_message[n_bytes-1]) || (GET_LOW(errorWord) != rx_message[n_bytes-2])){
-            printf(" WARNING: MODBUS message corrupted. Sending query again.\n");
-            printf("  [%#02x, %#02x](local) doesn't match [%#02x, %#02x](RX)\n",
-                    GET_HIGH(errorWord), GET_LOW(errorWord),
-                    rx_message[n_bytes-1],rx_message[n_bytes-2]);
-            attempts ++;
-            continue;
-        }else if((rx_message[0] != slave_id) || (rx_message[1] != funtion_code)){
-        // Check if it's from the same slave and message we sent out
-            printf(" WARNING: MODBUS unidentified message. Sending query again.\n");
-            printf("  [%#02x, %#02x](local) doesn't match [%#02x, %#02x](RX)\n",
-                    slave_id, funtion_code,
-                    rx_message[0],rx_message[1]);
-            attempts ++;
-            continue;
-        }else{
-        // Extract float bytes
-            printf("  Response recieved succesfully: ");
-            for(int i = 0; i < rx_message[2]; i ++) byte_response[i] = rx_message[i+3];
-            for(int i = 0; i < rx_message[2]; i ++) printf("%#02x ",byte_response[i]);
-            printf("\n");
+        data_bytes = modbusProcessResponse(&frame, window->count, data);
+        if(data_bytes >= 0){
+            metricsTransaction(slave_id, window->start, &sent);
             break;
         }
+        if(data_bytes == ResponseFailed) break;
+        attempts ++;
+    }
+    if (!(attempts < max_attempts)){
+        printf("ERROR: Too many attemps, returning error signal.\n");
+        healthFailure(slave_id);
     }
-    if (!(attempts < AttemptTimeout)) printf("ERROR: Too many attemps, returning error signal.\n");
+    if(data_bytes < 0) metricsCount(slave_id, CounterFailures, 1);
+
+    logDebug("--Query process finished--\n");
+    return data_bytes < 0 ? -1 : data_bytes;
+}
+
+
+
+/* RECEIVE WARNING: Explains why no valid response was found before the timeout.
+*/
+void modbusReceiveWarning(RtuParser *parser){
+    healthTimeout(parser->slave_id);
+    metricsCount(parser->slave_id, CounterTimeouts, 1);
+    metricsCount(parser->slave_id, CounterCrcErrors, parser->crc_errors);
+    if(parser->discarded > 0) metricsCount(parser->slave_id, CounterUnidentified, 1);
+    if(parser->crc_errors > 0) logWarning(" WARNING: MODBUS message corrupted. Sending query again.\n");
+    else if(parser->discarded > 0) logWarning(" WARNING: MODBUS unidentified message. Sending query again.\n");
+    else logWarning(" WARNING: Modbus message to short. Sending again...\n");
+}
+
+
+
+/* MODBUS MASTER QUERY AND RESPONSE: Send all the necessary bytes for the salve to understand the message.
+
+    +Slave ID::         [0...255] in HEX
+    +Start Address::    Choose from the StartAddress typedef ennum [2 bytes]
+
+    returns 0xFFFFFFFF if error
+            or value of parameter in float format
+*/
+float modbusQuery(ModbusPort *port, uint8_t slave_id, StartAddress_3X StartAddress){
+    RegisterWindow window = {StartAddress, 0x0002, {0}};       // Register Size (2 registers)
+    uint8_t     byte_response[4] = {0xFF,0xFF,0xFF,0xFF};       // Response in bytes (error signal by default)
+    float       float_response  = 0xFFFFFFFF;                   // Number that the funtion will return                     
+
+    modbusBuildRequest(&window, slave_id, R_3X);
+    modbusTransaction(port, slave_id, R_3X, &window, byte_response);
     
     float_response = bytesToFloat(byte_response);
-    free(byte_response);
-    printf("--FLOAT TO SEND: %f--\n", float_response);
-    printf("--Query process finished--\n");
+    logDebug("--FLOAT TO SEND: %f--\n", float_response);
     return float_response;
 }
 
 
 
-/* MODBUS EXCEPTION LOGGER: Logs to the linux system the message exceptions sent by the device
+/* MODBUS MASTER WRITE: Writes a range of 4X registers (function code 16) and checks the echo of the meter.
+    Settings are written once: the caller decides what to do if the meter doesn't answer,
+    and the transaction doesn't count in the health of the meter (see serialLine.c).
+
+    +Slave ID::         [1...247] in HEX
+    +Start Address::    First register to write [2 bytes]
+    +Data::             Register bytes (2 bytes per register, high byte first)
+    +Register Count::   Number of registers to write [1...MaxWriteRegisters]
+
+    returns 0 if the registers were written
+            exception code sent by the meter (the registers are unchanged)
+            or -1 if there was no valid response
+*/
+int modbusWriteRegisters(ModbusPort *port, uint8_t slave_id, uint16_t StartAddress, const uint8_t data[], uint16_t register_count){
+    uint8_t     tx_msg[9 + 2*MaxWriteRegisters];                // Transfer message
+    int         length          = 7 + 2*register_count;         // Bytes before the error check
+    uint16_t    errorWord;                                      // Error check word (2 bytes)
+    RtuFrame    frame;                                          // Recieved message
+
+    if(port->transport == TransportTcp || register_count == 0 || register_count > MaxWriteRegisters) return -1;
+
+    //_____COMPOSE MESSAGE_______
+    //[Slave ID | Fn Code | Start (H) | Start (L) | Count (H) | Count (L) | Byte Count | Data (2 bytes per register) | Error Check (L) | Error Check (H)]
+    tx_msg[0] = slave_id;
+    tx_msg[1] = W_4X;
+    tx_msg[2] = GET_HIGH(StartAddress);
+    tx_msg[3] = GET_LOW(StartAddress);
+    tx_msg[4] = GET_HIGH(register_count);
+    tx_msg[5] = GET_LOW(register_count);
+    tx_msg[6] = 2*register_count;
+    memcpy(&tx_msg[7], data, 2*register_count);
+    errorWord = errorCheck(tx_msg, length);
+    tx_msg[length ++] = GET_LOW(errorWord);
+    tx_msg[length ++] = GET_HIGH(errorWord);
+
+    if(!modbusExchange(port, slave_id, tx_msg, length, W_4X, WriteResponseSize, &frame)) return -1;
+    logHex(LevelTrace, "  Message recieved: ", frame.bytes, frame.length);
+    if(frame.bytes[1] & 0x80){
+        metricsException(slave_id, frame.bytes[2]);
+        return frame.bytes[2] != 0 ? frame.bytes[2] : -1;
+    }
+    // The response echoes the start address and the register count
+    if(memcmp(&frame.bytes[2], &tx_msg[2], 4) != 0){
+        metricsCount(slave_id, CounterUnidentified, 1);
+        return -1;
+    }
+    return 0;
+}
+
+int modbusWriteFloat(ModbusPort *port, uint8_t slave_id, StartAddress_4X StartAddress, float value){
+    uint8_t bytes[4];
+
+    floatToBytes(value, bytes);
+    return modbusWriteRegisters(port, slave_id, StartAddress, bytes, 2);
+}
+
+
+
+/* READ SETTING: Reads a float setting (4X) with a single request, without counting in the health of the meter.
+    Used to find the meters on a line before polling them.
+    returns 0 if the value was read
+            or -1 if there was no valid response
+*/
+int modbusReadSetting(ModbusPort *port, uint8_t slave_id, StartAddress_4X StartAddress, float *value){
+    RegisterWindow  window = {StartAddress, 0x0002, {0}};
+    RtuFrame        frame;
+    uint8_t         data[4];
+
+    if(port->transport == TransportTcp) return -1;
+    modbusBuildRequest(&window, slave_id, RW_4X);
+    if(!modbusExchange(port, slave_id, window.request, RequestSize, RW_4X, 9, &frame)) return -1;
+    if(frame.bytes[1] & 0x80 || frame.bytes[2] != 4) return -1;
+    memcpy(data, &frame.bytes[3], 4);
+    *value = bytesToFloat(data);
+    return 0;
+}
+
+
+
+/* EXCHANGE: Sends a request once and waits for the reply of the slave to that function code (or its exception).
+    +Expected::         Size of a complete reply (to add its wire time to the timeout)
+    returns 1 if a frame was recieved
+            0 if timeout
+*/
+int modbusExchange(ModbusPort *port, uint8_t slave_id, const uint8_t request[], int length, FunctionCode funtion_code, int expected, RtuFrame *frame){
+    RtuParser parser;
+
+    modbusSendFrame(port, request, length);
+    rtuParserInit(&parser, slave_id, funtion_code);
+    return modbusReceive(port, &parser, frame, expected);
+}
+
+
+
+/* BLOCK READ PLANNER: Groups the wanted parameters into the fewest contiguous register windows.
+    Two parameters share a window if the registers between them are no more than max_gap
+    and the window stays under MaxWindowRegisters.
 
-    -Returns 0 if message is undefined
-            -1 if exception is exception is recognized
+    +Addresses::        Wanted parameters (any order)
+    +Fields::           Registers of each parameter (NULL: 2 registers each, the floats of the SDM230)
+    +Max gap::          Unwanted registers read to join two parameters: MaxWindowGap for 3X,
+                        0 for 4X (holding registers in a gap may not exist, or have side effects)
+    +Windows::          Array where the planned windows are stored
+
+    returns number of windows planned
+            or -1 if they don't fit in max_windows
 */
-int modbusExceptionLogger(uint8_t bytes[]){
-    uint16_t errorword = errorCheck(bytes, 3);
-    // Check integrity of message
-    if((GET_LOW(errorword) != bytes[3]) || GET_HIGH(errorword) != bytes[4]){
-        printf("ERROR: MODBUS unidentified message. Sending query again.\n");
-        printf("  MODBUS Exception message not recognized.\n");
-        return 0;
+int modbusPlanWindows(const StartAddress_3X addresses[], const RegisterField fields[], int n, int max_gap, RegisterWindow windows[], int max_windows){
+    uint16_t    sorted[n];          // Wanted start addresses in ascending order
+    uint8_t     counts[n];          // Registers of each one
+    int         n_windows   = 0;    // Number of windows planned
+
+    if(n <= 0) return 0;
+
+    // Sort the start addresses (insertion sort, scans only have a few parameters)
+    for(int i = 0; i < n; i ++){
+        int j = i;
+        while(j > 0 && sorted[j-1] > addresses[i]){
+            sorted[j] = sorted[j-1];
+            counts[j] = counts[j-1];
+            j --;
+        }
+        sorted[j] = addresses[i];
+        counts[j] = fields != NULL ? fields[i].registers : 2;
+    }
+
+    for(int i = 0; i < n; i ++){
+        if(n_windows > 0){
+            RegisterWindow *last = &windows[n_windows-1];
+            uint16_t end = last->start + last->count;
+            // Join the current window if the gap is small and the frame doesn't grow too much
+            if((sorted[i] < end + max_gap + 1) && (sorted[i] + counts[i] - last->start <= MaxWindowRegisters)){
+                if(sorted[i] + counts[i] > end) last->count = sorted[i] + counts[i] - last->start;
+                continue;
+            }
+        }
+        if(n_windows == max_windows) return -1;
+        windows[n_windows].start = sorted[i];
+        windows[n_windows].count = counts[i];
+        n_windows ++;
     }
-    switch(bytes[2]){
+    return n_windows;
+}
+
+
+
+/* MODBUS BLOCK QUERY: Reads several 3X parameters with one transaction per contiguous register window.
+    Plans the windows on every call, polling paths plan them once (see schedulerAdd) and use modbusWindowQuery().
+
+    +Slave ID::         [0...255] in HEX
+    +Addresses::        Choose from the StartAddress typedef ennum (any order)
+    +Values::           Array where the floats are stored, in the same order as addresses
+
+    returns number of parameters read
+            or -1 if the addresses can't be planned
+    Parameters of failed windows are set to the error signal (0xFFFFFFFF)
+*/
+int modbusBlockQuery(ModbusPort *port, uint8_t slave_id, const StartAddress_3X addresses[], int n, float values[]){
+    RegisterWindow  windows[MaxWindows];                    // Planned windows
+    int             n_windows;                              // Number of windows planned
+
+    n_windows = modbusPlanWindows(addresses, NULL, n, MaxWindowGap, windows, MaxWindows);
+    if(n_windows < 0){
+        printf("ERROR: Too many register windows for block query.\n");
+        return -1;
+    }
+    for(int w = 0; w < n_windows; w ++) modbusBuildRequest(&windows[w], slave_id, R_3X);
+    return modbusWindowQuery(port, slave_id, windows, n_windows, addresses, NULL, n, values, NULL);
+}
+
+
+
+/* MODBUS WINDOW QUERY: Reads several 3X parameters from windows already planned, with their requests built.
+    Nothing is allocated: the register bytes are kept on the stack.
+    4X parameters are read the same way, with the requests built for RW_4X (see onDemand.c).
+
+    +Slave ID::         [0...255] in HEX
+    +Windows::          Windows planned by modbusPlanWindows(), requests built by modbusBuildRequest()
+    +Addresses::        Parameters read by the windows (any order)
+    +Fields::           How each parameter is decoded (NULL: SDM230 floats)
+    +Values::           Array where the values are stored, in the same order as addresses
+    +Stamps::           Array where the time each parameter was read is stored (CLOCK_REALTIME), or NULL
+
+    returns number of parameters read
+    Parameters of failed windows are set to the error signal (0xFFFFFFFF)
+*/
+int modbusWindowQuery(ModbusPort *port, uint8_t slave_id, const RegisterWindow windows[], int n_windows,
+                      const StartAddress_3X addresses[], const RegisterField fields[], int n, float values[], struct timespec stamps[]){
+    uint8_t         data[2*MaxWindowRegisters];             // Register bytes of one window
+    uint8_t         error_signal[4] = {0xFF,0xFF,0xFF,0xFF};// Value used if the window can't be read
+    int             n_values    = 0;                        // Number of parameters read
+    FunctionCode    funtion_code = n_windows > 0 ? windows[0].request[1] : R_3X;   // The requests were built with it
+
+    for(int i = 0; i < n; i ++) values[i] = bytesToFloat(error_signal);
+
+    // Modbus TCP: every window is requested at once, round trips overlap
+    if(port->transport == TransportTcp){
+        uint8_t tcp_data[MaxWindows][2*MaxWindowRegisters];     // Register bytes of every window
+        uint8_t *window_data[MaxWindows];
+        int     lengths[MaxWindows];                            // Bytes read of each window (-1 failed)
+
+        for(int w = 0; w < n_windows; w ++) window_data[w] = tcp_data[w];
+        modbusTcpPipeline(port, slave_id, funtion_code, windows, n_windows, window_data, lengths);
+        for(int w = 0; w < n_windows; w ++){
+            if(lengths[w] >= 0) n_values += modbusDecodeWindow(&windows[w], tcp_data[w], addresses, fields, n, values);
+            if(stamps != NULL) modbusStampWindow(&windows[w], addresses, n, stamps);
+        }
+        return n_values;
+    }
+
+    for(int w = 0, skip = 0; w < n_windows; w ++){
+        int data_bytes = -1;
+        // Once the meter is found down (its probe failed) the rest of the windows aren't sent
+        if(!skip){
+            logDebug("--Block query [%#06x ... %#06x]--\n", windows[w].start, windows[w].start + windows[w].count - 1);
+            data_bytes = modbusTransaction(port, slave_id, funtion_code, &windows[w], data);
+        }
+        if(stamps != NULL) modbusStampWindow(&windows[w], addresses, n, stamps);
+        if(data_bytes < 0){
+            skip = healthDown(slave_id);
+            continue;
+        }
+
+        n_values += modbusDecodeWindow(&windows[w], data, addresses, fields, n, values);
+    }
+    return n_values;
+}
+
+
+
+/* DECODE WINDOW: Decodes the parameters that fall in a window from its register bytes.
+    Each field is decoded by its own function (a walk of the field table), SDM230 floats if fields is NULL.
+    returns number of parameters decoded
+*/
+int modbusDecodeWindow(const RegisterWindow *window, uint8_t data[], const StartAddress_3X addresses[], const RegisterField fields[], int n, float values[]){
+    int n_values = 0;
+
+    for(int i = 0; i < n; i ++){
+        const RegisterField *field = fields != NULL ? &fields[i] : NULL;
+        int registers = field != NULL ? field->registers : 2;
+        if(addresses[i] < window->start || addresses[i] + registers > window->start + window->count) continue;
+        if(field != NULL) values[i] = field->decode(&data[2*(addresses[i] - window->start)], field);
+        else values[i] = bytesToFloat(&data[2*(addresses[i] - window->start)]);
+        n_values ++;
+    }
+    return n_values;
+}
+
+
+
+/* STAMP WINDOW: Sets the time the transaction of a window completed (now, CLOCK_REALTIME)
+   to the parameters that fall in it, so samples are stamped when the bus read them.
+   A parameter never spans two windows, the window of its first register reads it.
+*/
+void modbusStampWindow(const RegisterWindow *window, const StartAddress_3X addresses[], int n, struct timespec stamps[]){
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    for(int i = 0; i < n; i ++){
+        if(addresses[i] < window->start || addresses[i] >= window->start + window->count) continue;
+        stamps[i] = now;
+    }
+}
+
+
+
+/* EXCEPTION RESPONSE: Counts and logs an exception sent by a slave, the same way for every transport.
+    returns ResponseRetry if the exception is recognized (the query is sent again)
+            ResponseFailed if not
+*/
+int modbusExceptionResponse(uint8_t slave_id, uint8_t code){
+    metricsException(slave_id, code);
+    if(modbusException(code) == 0) return ResponseFailed;
+    return ResponseRetry;
+}
+
+
+
+/* MODBUS EXCEPTION: Logs an exception code sent by the device (any transport)
+
+    -Returns 0 if exception is undefined
+            -1 if exception is recognized
+*/
+int modbusException(uint8_t code){
+    switch(code){
         case 0x01: 
             printf("ERROR: Modbus excpetion 0x01");
             syslog(LOG_ERR, "ERROR 0x01 from modbusExceptionLogger: MODBUS EXCEPTION Illegal Function.");
@@ -314,6 +874,8 @@ int modbusExceptionLogger(uint8_t bytes[]){
 
 
 /* ERROR CHECK ALGORITHM: crc error checking bytes required by the MODBUS protocol
+    Table driven version of the bit by bit algorithm in SDM230-ModBus Protocol V1.2 (polynomial 0xA001):
+    the 8 shifts of each byte are precomputed in crcTable, indexed by the low byte of the running CRC.
     Parameters:
         -bytes : messages of n bytes that requires CRC
         -n     : number of bytes in message
@@ -322,27 +884,26 @@ int modbusExceptionLogger(uint8_t bytes[]){
 uint16_t errorCheck(uint8_t bytes[], int n){
     // Calcualte error checking bytes CRC
     uint16_t errorWord = 0xFFFF;   // Set to 1's
-    // For each byte in message (Code from: SDM230-ModBus Protocol V1.2)
+    // For each byte in message
     for(int i = 0; i < n; i ++){
-        errorWord ^= bytes[i];
-        // For each bit in current byte
-        for(int j = 0; j < 8; j++){
-            uint8_t LSB = errorWord & 0x1;
-            if(LSB == 0x1){
-                errorWord -= 0x1;
-            }
-            errorWord = errorWord/2;
-            if (LSB == 0x1){
-                errorWord ^= 0xA001;
-            }
-            
-        }
+        errorWord = (errorWord >> 8) ^ crcTable[(errorWord ^ bytes[i]) & 0xFF];
     }
     return errorWord;
 }
 
 
 
+/* FLOAT TO BYTES: Inverse of bytesToFloat(), high byte first.
+*/
+void floatToBytes(float f, uint8_t bytes[]){
+    bytes[0] = *((uint8_t*)(&f) + 3);
+    bytes[1] = *((uint8_t*)(&f) + 2);
+    bytes[2] = *((uint8_t*)(&f) + 1);
+    bytes[3] = *((uint8_t*)(&f) + 0);
+}
+
+
+
 /* BYTES TO FLOATING POINT NUMBER: function that recieves an array of 4 bytes an returns a floating poiny number*/
 float bytesToFloat(uint8_t bytes[]){
     float f;
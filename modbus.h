@@ -16,20 +16,61 @@
 #include <termios.h>    // Contains POSIX terminal controls
 #include <unistd.h>     // write(), read(), close()
 #include <syslog.h>     // Log events (/var/logs)
+#include <poll.h>       // poll(), wait for bytes on the serial port
+#include <time.h>       // clock_gettime(), monotonic timestamps
 
 // MQTT Server (Mosquitto)
 #include <mosquitto.h>
 
+// RTU stream parser, runtime metrics, meter health and logger
+#include "rtuParser.h"
+#include "metrics.h"
+#include "health.h"
+#include "logger.h"
+
 // Macros
 #define GET_HIGH(a)(a >> 8)     // Get high 8 bits of 16
 #define GET_LOW(a)(a & 0xFF)    // Get low 8 bits of 16
 
+// Port defaults
+#define BaudRate            9600    // Serial speed until the line is probed (see serialLine.h)
+#define DefaultParity       ParityEven  // Parity and stop bits until the line is probed
+#define ResponseTimeout     500     // Time to wait for a response until the meter has answered (Mili Seconds, see health.h)
+#define AttemptTimeout      2       // Attempts to recieve correct message (1 for meters found down)
+
+// Results of modbusProcessResponse()
+#define ResponseRetry       -1      // Send the query again
+#define ResponseFailed      -2      // Don't send the query again
+
+// Block read planning
+#define MaxWindowRegisters  80  // Max registers read in one transaction (SDM230: 40 parameters)
+#define MaxWindowGap        8   // Max unwanted registers read to join two windows (3X only)
+#define MaxWindows          16  // Max windows planned in one block query
+#define RequestSize         8   // RTU read request: [Slave ID, Fn Code, Start (2), Count (2), Error Check (2)]
+
+// Register writes
+#define MaxWriteRegisters   4   // Max registers written in one transaction (two floats)
+#define WriteResponseSize   8   // FC16 response: [Slave ID, Fn Code, Start (2), Count (2), Error Check (2)]
+
 // Enums
+typedef enum{
+    TransportRtu,       // RTU frames over a serial port (RS-485 adapter)
+    TransportTcp        // Modbus TCP frames (MBAP header) to a gateway
+}ModbusTransport;
+
 typedef enum{
     RW_4X   = 0x03,     // Read contents of read/write locations (4X References )
-    R_3X    = 0x04      // Read contents of read-only location (3X References)
+    R_3X    = 0x04,     // Read contents of read-only location (3X References)
+    W_4X    = 0x10      // Write multiple read/write locations (4X References)
 }FunctionCode;
 
+typedef enum{
+    ParityNone      = 0,    // 1 stop bit, no parity (same codes as NET_PARITY)
+    ParityEven      = 1,    // 1 stop bit, even parity
+    ParityOdd       = 2,    // 1 stop bit, odd parity
+    ParityNoneTwo   = 3     // 2 stop bits, no parity
+}LineParity;
+
 
 
 typedef enum{
@@ -83,8 +124,67 @@ typedef enum{
 
 
 
+// Structs
+typedef struct{
+    char        *path;              // Serial device ("/dev/ttyUSB0") or gateway ("<host>[:<port>]")
+    ModbusTransport transport;      // How frames reach the meters
+    int         fd;                 // File descriptor of the open port (or connected socket)
+    int         baud_rate;          // Serial speed (bauds, 0 sets BaudRate when the port is initialized)
+    LineParity  parity;             // Parity and stop bits (set with the baud rate)
+    int         response_timeout;   // Overall timeout for a response (mili seconds)
+    uint16_t    transaction_id;     // Next MBAP transaction identifier (TransportTcp)
+}ModbusPort;
+
+typedef struct{
+    uint16_t start;                 // First register of the window
+    uint16_t count;                 // Number of registers in the window
+    uint8_t  request[RequestSize];  // RTU request frame, error check included (see modbusBuildRequest)
+}RegisterWindow;
+
+// Decoder of a field: turns its register bytes (as read, big endian registers) into a value (see registerMap.c)
+typedef struct RegisterField RegisterField;
+typedef float (*FieldDecoder)(const uint8_t bytes[], const RegisterField *field);
+
+struct RegisterField{
+    FieldDecoder    decode;         // Function that decodes the bytes
+    uint8_t         registers;      // Registers of the field (1 or 2)
+    uint8_t         shift;          // First bit of a bitfield
+    uint8_t         bits;           // Bits of a bitfield
+    float           scale;          // The decoded value is multiplied by it
+};
+
+
+
 // Functions
-int         initializePort(char *COM);
-float       modbusQuery(uint8_t slave_id, StartAddress_3X StartAddress);
+int         initializePort(ModbusPort *port, char *COM);
+float       modbusQuery(ModbusPort *port, uint8_t slave_id, StartAddress_3X StartAddress);
+void        modbusSetTimeout(ModbusPort *port, int timeout_ms);
+uint16_t    errorCheck(uint8_t bytes[], int n);
+int         modbusPlanWindows(const StartAddress_3X addresses[], const RegisterField fields[], int n, int max_gap, RegisterWindow windows[], int max_windows);
+int         modbusSetLine(ModbusPort *port, int baud_rate, LineParity parity);
+int         modbusWriteRegisters(ModbusPort *port, uint8_t slave_id, uint16_t StartAddress, const uint8_t data[], uint16_t register_count);
+int         modbusWriteFloat(ModbusPort *port, uint8_t slave_id, StartAddress_4X StartAddress, float value);
+int         modbusReadSetting(ModbusPort *port, uint8_t slave_id, StartAddress_4X StartAddress, float *value);
+int         modbusBlockQuery(ModbusPort *port, uint8_t slave_id, const StartAddress_3X addresses[], int n, float values[]);
+void        modbusBuildRequest(RegisterWindow *window, uint8_t slave_id, FunctionCode funtion_code);
+int         modbusWindowQuery(ModbusPort *port, uint8_t slave_id, const RegisterWindow windows[], int n_windows,
+                              const StartAddress_3X addresses[], const RegisterField fields[], int n, float values[], struct timespec stamps[]);
+
+// Step by step transaction (used by the event loop)
+void        modbusSendRequest(ModbusPort *port, uint8_t slave_id, FunctionCode funtion_code, uint16_t StartAddress, uint16_t register_count);
+void        modbusSendFrame(ModbusPort *port, const uint8_t frame[], int length);
+int         modbusReadPort(ModbusPort *port, RtuParser *parser);
+int         modbusSilence(RtuParser *parser, RtuFrame *frame);
+int         modbusProcessResponse(RtuFrame *frame, uint16_t register_count, uint8_t data[]);
+void        modbusReceiveWarning(RtuParser *parser);
+int         modbusDecodeWindow(const RegisterWindow *window, uint8_t data[], const StartAddress_3X addresses[], const RegisterField fields[], int n, float values[]);
+void        modbusStampWindow(const RegisterWindow *window, const StartAddress_3X addresses[], int n, struct timespec stamps[]);
+int         modbusSilenceMs(ModbusPort *port);
+int         modbusResponseMs(ModbusPort *port, uint8_t slave_id, int expected);
+long        modbusWireUs(ModbusPort *port, int bytes);
+int         modbusException(uint8_t code);
+int         modbusExceptionResponse(uint8_t slave_id, uint8_t code);
+float       bytesToFloat(uint8_t bytes[]);
+void        floatToBytes(float f, uint8_t bytes[]);
 
 #endif
\ No newline at end of file
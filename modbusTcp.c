@@ -0,0 +1,360 @@
+/***********************************
+*          modbusTcp.c
+*
+* -Modbus TCP transport: reads the
+*  meters behind a gateway over a
+*  persistent connection. Requests
+*  are pipelined, each response is
+*  matched to its request by the
+*  MBAP transaction identifier.
+*
+* used with modbusTcp.h
+*
+***********************************/
+
+// Include header file
+#include "modbusTcp.h"
+
+// Enums
+typedef enum{
+    WindowQueued,           // Request waiting to be sent (again)
+    WindowInFlight,         // Request sent, waiting for its response
+    WindowDone              // Read, or given up
+}WindowState;
+
+// Structs
+typedef struct{
+    uint8_t     buffer[2*TcpFrameSize];     // Bytes recieved not processed yet
+    int         length;                     // Number of bytes in the buffer
+}TcpReceiver;
+
+// Internal functions
+int         tcpConnectWait(int fd);
+int         tcpSendRequest(ModbusPort *port, uint8_t unit_id, FunctionCode function_code, const RegisterWindow *window, uint16_t transaction_id);
+int         tcpReceive(ModbusPort *port, TcpReceiver *rx, uint8_t frame[], int timeout_ms);
+int         tcpProcessResponse(uint8_t frame[], int length, uint8_t unit_id, FunctionCode function_code, uint16_t register_count, uint8_t data[]);
+
+
+
+/* MODBUS TCP CONNECTION: Connects to the gateway in port->path ("<host>[:<port>]", port 502 by default).
+    The connection is kept open between queries, and opened again if it is lost.
+    - Returns
+        [port->fd] if connected
+        [<0] if there was an error.
+*/
+int modbusTcpConnect(ModbusPort *port){
+    char            host[128];                      // Gateway host name or address
+    char            service[8];                     // TCP port
+    char            *colon;                         // Separator of the TCP port in the path
+    struct addrinfo hints, *result, *ai;            // Addresses of the gateway
+    int             error;
+    int             on = 1;
+
+    logInfo("--Connecting to MODBUS TCP gateway %s--\n", port->path);
+    snprintf(host, sizeof(host), "%s", port->path);
+    sprintf(service, "%i", TcpPort);
+    colon = strrchr(host, ':');
+    if(colon != NULL){
+        *colon = '\0';
+        snprintf(service, sizeof(service), "%s", colon + 1);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family     = AF_UNSPEC;
+    hints.ai_socktype   = SOCK_STREAM;
+    error = getaddrinfo(host, service, &hints, &result);
+    if(error != 0){
+        printf("ERROR %i from getaddrinfo: %s\n", error, gai_strerror(error));
+        syslog(LOG_ERR, "ERROR %i from getaddrinfo %s: %s", error, port->path, gai_strerror(error));
+        port->fd = -1;
+        return port->fd;
+    }
+
+    // Try every address of the gateway, without blocking longer than TcpConnectTimeout on each
+    port->fd = -1;
+    for(ai = result; ai != NULL && port->fd < 0; ai = ai->ai_next){
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if(fd < 0) continue;
+        if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || (errno == EINPROGRESS && tcpConnectWait(fd) == 0)) port->fd = fd;
+        else close(fd);
+    }
+    freeaddrinfo(result);
+    if(port->fd < 0){
+        printf("ERROR %i from connect: %s\n", errno, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from connect %s: %s", errno, port->path, strerror(errno));
+        return port->fd;
+    }
+
+    // Requests are small and pipelined, send them right away
+    setsockopt(port->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    logInfo("--Connection Complete--\n");
+    return port->fd;
+}
+
+
+
+/* MODBUS TCP CLOSE: Closes the connection (opened again by the next query).
+*/
+void modbusTcpClose(ModbusPort *port){
+    if(port->fd < 0) return;
+    close(port->fd);
+    port->fd = -1;
+}
+
+
+
+/* CONNECT WAIT: Waits for a non blocking connect() to finish.
+    returns 0 if connected
+            or -1 if error (errno set)
+*/
+int tcpConnectWait(int fd){
+    struct pollfd   fds     = {fd, POLLOUT, 0};
+    int             error   = 0;
+    socklen_t       len     = sizeof(error);
+    int             ready;
+
+    do{
+        ready = poll(&fds, 1, TcpConnectTimeout);
+    }while(ready < 0 && errno == EINTR);
+    if(ready < 0) return -1;
+    if(ready == 0){
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) return -1;
+    if(error != 0){
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/* MODBUS TCP PIPELINE: Reads several register windows of one unit, keeping up to MaxPipeline
+   requests on the wire so their round trips overlap. Responses may come in any order.
+   Requests without a valid response are sent again, up to AttemptTimeout times (once if the unit is down).
+
+    +Unit ID::          [0...255] Slave behind the gateway
+    +Function Code::    Choose from the FunctionCode typedef ennum
+    +Windows::          Register windows to read
+    +Data::             Where the register bytes of each window are copied (2 bytes per register)
+    +Lengths::          Set to the bytes copied of each window, or -1 if it couldn't be read
+
+    returns number of windows read
+*/
+int modbusTcpPipeline(ModbusPort *port, uint8_t unit_id, FunctionCode function_code, const RegisterWindow windows[], int n, uint8_t *data[], int lengths[]){
+    WindowState     state[n];                   // State of the request of each window
+    int             attempts[n];                // Requests sent for each window
+    uint16_t        transaction_ids[n];         // Transaction ID of the last request of each window
+    struct timespec sent[n];                    // Time the last request of each window was sent
+    TcpReceiver     rx;                         // Bytes recieved from the gateway
+    uint8_t         frame[TcpFrameSize];        // Response recieved
+    int             in_flight   = 0;            // Requests waiting for a response
+    int             n_read      = 0;            // Number of windows read
+
+    for(int w = 0; w < n; w ++){
+        lengths[w]  = -1;
+        state[w]    = WindowQueued;
+        attempts[w] = 0;
+    }
+    rx.length = 0;
+    if(port->fd < 0 && modbusTcpConnect(port) < 0) return 0;
+
+    logDebug("--Begining pipelined query (%i windows)--\n", n);
+    while(1){
+        int lost = 0;   // Connection lost, the requests in flight won't be answered
+
+        // Keep the pipeline full
+        for(int w = 0; w < n && in_flight < MaxPipeline && !lost; w ++){
+            if(state[w] != WindowQueued) continue;
+            if(attempts[w] >= healthAttempts(unit_id, AttemptTimeout)){
+                printf("ERROR: Too many attemps for window [%#06x ...], returning error signal.\n", windows[w].start);
+                healthFailure(unit_id);
+                state[w] = WindowDone;
+                continue;
+            }
+            transaction_ids[w] = port->transaction_id ++;
+            if(attempts[w] ++ > 0) metricsCount(unit_id, CounterRetries, 1);
+            clock_gettime(CLOCK_MONOTONIC, &sent[w]);
+            if(tcpSendRequest(port, unit_id, function_code, &windows[w], transaction_ids[w]) < 0){
+                lost = 1;
+                break;
+            }
+            state[w] = WindowInFlight;
+            in_flight ++;
+        }
+        if(in_flight == 0 && !lost) break;
+
+        int length = lost ? -1 : tcpReceive(port, &rx, frame, healthTimeoutMs(unit_id, port->response_timeout));
+        if(length <= 0){
+            // Timeout or connection lost: every request in flight is sent again
+            if(length == 0){
+                logWarning(" WARNING: MODBUS TCP response timeout. Sending %i queries again.\n", in_flight);
+                metricsCount(unit_id, CounterTimeouts, in_flight);
+                healthTimeout(unit_id);
+            }
+            for(int w = 0; w < n; w ++) if(state[w] == WindowInFlight) state[w] = WindowQueued;
+            in_flight = 0;
+            if(length < 0){
+                modbusTcpClose(port);
+                rx.length = 0;
+                if(modbusTcpConnect(port) < 0) break;
+            }
+            continue;
+        }
+
+        // Match the response with its request
+        uint16_t transaction_id = frame[0] << 8 | frame[1];
+        int w = 0;
+        while(w < n && !(state[w] == WindowInFlight && transaction_ids[w] == transaction_id)) w ++;
+        if(w == n){
+            logWarning(" WARNING: MODBUS TCP response to an old request (transaction %u) dropped.\n", transaction_id);
+            continue;
+        }
+        in_flight --;
+        healthResponse(unit_id, &sent[w], 0);
+
+        int data_bytes = tcpProcessResponse(frame, length, unit_id, function_code, windows[w].count, data[w]);
+        if(data_bytes >= 0){
+            metricsTransaction(unit_id, windows[w].start, &sent[w]);
+            lengths[w] = data_bytes;
+            state[w] = WindowDone;
+            n_read ++;
+        }
+        else if(data_bytes == ResponseFailed) state[w] = WindowDone;
+        else state[w] = WindowQueued;
+    }
+    metricsCount(unit_id, CounterFailures, n - n_read);
+    logDebug("--Pipelined query finished (%i/%i windows)--\n", n_read, n);
+    return n_read;
+}
+
+
+
+/* SEND REQUEST: Composes a read request with its MBAP header and sends it (no error check, TCP has its own).
+    returns 0 if sent
+            or -1 if the connection is lost
+*/
+int tcpSendRequest(ModbusPort *port, uint8_t unit_id, FunctionCode function_code, const RegisterWindow *window, uint16_t transaction_id){
+    uint8_t tx_msg[12];     // Transfer message (12 bytes)
+
+    // MESSAGE FORMAT (12 bytes)
+    //[Transaction ID (H) | Transaction ID (L) | Protocol ID (2 bytes, 0) | Length (H) | Length (L) | Unit ID | Function Code | Start Address (H) | Start Address (L) | Register Size (H) | Register Size (L)]
+    tx_msg[0]   = GET_HIGH(transaction_id);
+    tx_msg[1]   = GET_LOW(transaction_id);
+    tx_msg[2]   = 0;
+    tx_msg[3]   = 0;
+    tx_msg[4]   = 0;
+    tx_msg[5]   = 6;        // Bytes after the length: Unit ID and PDU
+    tx_msg[6]   = unit_id;
+    tx_msg[7]   = function_code;
+    tx_msg[8]   = GET_HIGH(window->start);
+    tx_msg[9]   = GET_LOW(window->start);
+    tx_msg[10]  = GET_HIGH(window->count);
+    tx_msg[11]  = GET_LOW(window->count);
+
+    if(send(port->fd, tx_msg, sizeof(tx_msg), MSG_NOSIGNAL) != (int)sizeof(tx_msg)){
+        printf("ERROR %i from send: %s\n", errno, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from send %s: %s", errno, port->path, strerror(errno));
+        return -1;
+    }
+    logTrace("   Sending transaction %u\n", transaction_id);
+    logHex(LevelTrace, "   Sending : ", tx_msg, sizeof(tx_msg));
+    return 0;
+}
+
+
+
+/* FRAME RECEIVER: Waits for the next complete Modbus TCP frame, using the length of its MBAP header.
+    Parameters:
+        -rx         : bytes recieved and not processed yet (kept between calls)
+        -frame      : where the frame recieved is copied
+        -timeout_ms : time to wait for it
+    returns size of the frame
+            0 if timeout
+            or -1 if the connection is lost or out of sync
+*/
+int tcpReceive(ModbusPort *port, TcpReceiver *rx, uint8_t frame[], int timeout_ms){
+    struct pollfd   fds     = {port->fd, POLLIN, 0};
+    struct timespec start, now;
+    int             wait_ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(1){
+        if(rx->length >= MbapHeaderSize){
+            int protocol_id = rx->buffer[2] << 8 | rx->buffer[3];
+            int length      = rx->buffer[4] << 8 | rx->buffer[5];
+            if(protocol_id != 0 || length < 2 || 6 + length > TcpFrameSize){
+                printf("ERROR: MODBUS TCP stream out of sync, connecting again.\n");
+                syslog(LOG_ERR, "ERROR from tcpReceive: MODBUS TCP stream from %s out of sync.", port->path);
+                return -1;
+            }
+            if(rx->length >= 6 + length){
+                memcpy(frame, rx->buffer, 6 + length);
+                rx->length -= 6 + length;
+                memmove(rx->buffer, rx->buffer + 6 + length, rx->length);
+                return 6 + length;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        wait_ms = timeout_ms - (int)((now.tv_sec - start.tv_sec)*1000 + (now.tv_nsec - start.tv_nsec)/1000000);
+        if(wait_ms <= 0) return 0;
+        int ready = poll(&fds, 1, wait_ms);
+        if(ready < 0){
+            if(errno == EINTR) continue;
+            printf("ERROR %i from poll: %s\n", errno, strerror(errno));
+            syslog(LOG_ERR, "ERROR %i from poll: %s", errno, strerror(errno));
+            return -1;
+        }
+        if(ready == 0) return 0;
+
+        int n_read = recv(port->fd, rx->buffer + rx->length, sizeof(rx->buffer) - rx->length, 0);
+        if(n_read == 0){
+            printf("ERROR: MODBUS TCP gateway %s closed the connection.\n", port->path);
+            syslog(LOG_ERR, "ERROR from tcpReceive: MODBUS TCP gateway %s closed the connection.", port->path);
+            return -1;
+        }
+        if(n_read < 0){
+            if(errno == EAGAIN || errno == EINTR) continue;
+            printf("ERROR %i from recv: %s\n", errno, strerror(errno));
+            syslog(LOG_ERR, "ERROR %i from recv: %s", errno, strerror(errno));
+            return -1;
+        }
+        rx->length += n_read;
+    }
+}
+
+
+
+/* PROCESS RESPONSE: Checks a response matched by transaction ID and copies its register bytes.
+    Response structure: [MBAP header (7 bytes), Fn Code, Byte Count, Reg1(high), Reg1(low), ...]
+
+    +Register Count::   Number of registers requested
+    +Data::             Array where the register bytes are copied (2 bytes per register)
+
+    returns number of data bytes copied
+            ResponseRetry if the query should be sent again
+            ResponseFailed if the query should not be sent again
+*/
+int tcpProcessResponse(uint8_t frame[], int length, uint8_t unit_id, FunctionCode function_code, uint16_t register_count, uint8_t data[]){
+    if(frame[6] != unit_id || (frame[7] & 0x7F) != function_code || length < MbapHeaderSize + 2){
+        metricsCount(unit_id, CounterUnidentified, 1);
+        logWarning(" WARNING: MODBUS unidentified message. Sending query again.\n");
+        return ResponseRetry;
+    }
+
+    // Check if exception code was sent
+    if(frame[7] & 0x80) return modbusExceptionResponse(unit_id, frame[8]);
+
+    if(frame[8] != 2*register_count || length != MbapHeaderSize + 2 + 2*register_count){
+        metricsCount(unit_id, CounterUnidentified, 1);
+        logWarning(" WARNING: MODBUS unidentified message. Sending query again.\n"
+                   "  [%i bytes](local) doesn't match [%i bytes](RX)\n", 2*register_count, frame[8]);
+        return ResponseRetry;
+    }
+
+    memcpy(data, &frame[MbapHeaderSize + 2], frame[8]);
+    return frame[8];
+}
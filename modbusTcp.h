@@ -0,0 +1,25 @@
+#ifndef modbusTcp
+#define modbusTcp
+
+// Include the modbus header (ports, windows, exceptions)
+#include "modbus.h"
+
+// Linux headers
+#include <netdb.h>          // getaddrinfo()
+#include <sys/socket.h>     // socket(), connect(), send(), recv()
+#include <netinet/in.h>
+#include <netinet/tcp.h>    // TCP_NODELAY
+
+// Defines
+#define TcpPort             502     // Default Modbus TCP port
+#define TcpConnectTimeout   3000    // Time to wait for the gateway to accept (mili seconds)
+#define MaxPipeline         8       // Max requests waiting for a response on one connection
+#define MbapHeaderSize      7       // [Transaction ID (2), Protocol ID (2), Length (2), Unit ID]
+#define TcpFrameSize        260     // Max size of a Modbus TCP frame (MBAP header + PDU)
+
+// Functions
+int         modbusTcpConnect(ModbusPort *port);
+void        modbusTcpClose(ModbusPort *port);
+int         modbusTcpPipeline(ModbusPort *port, uint8_t unit_id, FunctionCode function_code, const RegisterWindow windows[], int n, uint8_t *data[], int lengths[]);
+
+#endif
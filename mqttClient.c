@@ -14,17 +14,37 @@
 #define host "localhost"
 #define port 1883
 #define sub_topic "adqTime/"
+#define will_size 256
+#define max_handlers 4
 
 // Internal Function
 void log_callback(struct mosquitto *mosq, void *userdata, int level, const char *str);
 void message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message);
+void connect_callback(struct mosquitto *mosq, void *obj, int result);
+void disconnect_callback(struct mosquitto *mosq, void *obj, int result);
+
+// Topics handled by other modules
+typedef struct{
+    const char *topic;
+    void (*handler)(const char *payload, int len);
+}TopicHandler;
 
 // Varibles
 static struct mosquitto *mosq;
 static int scanRate = 1000;        // Scanning rate in miliseconds
+static volatile int connected = 0; // Connection with the broker is up
+static volatile int sessions = 0;  // Connections made (a new one needs a new birth message)
+static char willTopic[128];        // Last will, sent by the broker if the connection is lost
+static uint8_t willPayload[will_size];
+static int willLen = -1;           // No will
+static int willQos;
+static bool willRetain;
+static TopicHandler handlers[max_handlers];
+static int n_handlers = 0;
 
 // Initializer of the MQTT Client
-void mqtt_setup(){
+// threaded: run the network loop in a background thread, else the caller drives it (see eventLoop.c)
+void mqtt_setup(int threaded){
     int keepalive = 60;
     bool clean_session = true;
     
@@ -39,15 +59,19 @@ void mqtt_setup(){
 
     // Set callbacks
     mosquitto_message_callback_set(mosq, message_callback);
+    mosquitto_connect_callback_set(mosq, connect_callback);
+    mosquitto_disconnect_callback_set(mosq, disconnect_callback);
+    mosquitto_reconnect_delay_set(mosq, 1, 30, true);
+    if(willLen >= 0) mosquitto_will_set(mosq, willTopic, willLen, willPayload, willQos, willRetain);
 
-    // Connect to MQTT Server
+    // Connect to MQTT Server (if the broker is down, keep going: the loop reconnects and samples are journaled)
     if(mosquitto_connect(mosq, host, port, keepalive)){
-		fprintf(stderr, "Unable to connect.\n");
-		exit(1);
+		fprintf(stderr, "Unable to connect, retrying in the background.\n");
+        syslog(LOG_WARNING, "WARNING from mqtt_setup: Unable to connect to %s:%i, retrying.", host, port);
 	}
 
-    // Subscribre to Adquisition Time topic "adqTime/""
-    mosquitto_subscribe(mosq, NULL, sub_topic, 0);
+    // Network traffic is handled by the caller's event loop
+    if(!threaded) return;
 
     // Initialize callbacks
     int loop = mosquitto_loop_start(mosq);
@@ -62,20 +86,108 @@ int mqtt_send(char *msg, char *topic){
     return mosquitto_publish(mosq, NULL, topic, strlen(msg), msg, 2, true);
 }
 
+// Publish with the QoS and retain flag of the topic class
+int mqtt_publish(const char *topic, const void *payload, int len, int qos, bool retain){
+    return mosquitto_publish(mosq, NULL, topic, len, payload, qos, retain);
+}
+
+// Last will of the next connection (can be set before mqtt_setup)
+int mqtt_will(const char *topic, const void *payload, int len, int qos, bool retain){
+    if(len > will_size || strlen(topic) >= sizeof(willTopic)) return -1;
+    strcpy(willTopic, topic);
+    memcpy(willPayload, payload, len);
+    willLen     = len;
+    willQos     = qos;
+    willRetain  = retain;
+    if(!mosq) return 0;
+    return mosquitto_will_set(mosq, willTopic, willLen, willPayload, willQos, willRetain);
+}
+
+// Calls a handler with the payload of every message of a topic (before mqtt_setup, subscribed with QoS 1)
+int mqtt_handler(const char *topic, void (*handler)(const char *payload, int len)){
+    if(n_handlers == max_handlers) return -1;
+    handlers[n_handlers].topic = topic;
+    handlers[n_handlers ++].handler = handler;
+    return 0;
+}
+
 // Callback for the message
 void message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message){
 	bool match = 0;
-	printf("got message '%.*s' for topic '%s'\n", message->payloadlen, (char*) message->payload, message->topic);
+	logDebug("got message '%.*s' for topic '%s'\n", message->payloadlen, (char*) message->payload, message->topic);
+
+    // Requests to other modules (history ranges...)
+    for(int i = 0; i < n_handlers; i ++){
+        mosquitto_topic_matches_sub(handlers[i].topic, message->topic, &match);
+        if(match){
+            handlers[i].handler((const char*)message->payload, message->payloadlen);
+            return;
+        }
+    }
 
 	mosquitto_topic_matches_sub(sub_topic, message->topic, &match);
 	if (match) {
         scanRate = atoi((char*)message->payload);
-		printf("Changed Scan Rate to: %i\n", scanRate);
+		logInfo("Changed Scan Rate to: %i\n", scanRate);
         mqtt_send("Scan rate changed...","admin/");
 	}
 }
 
+// Callback for the connection: subscribe again on every (re)connection
+void connect_callback(struct mosquitto *mosq, void *obj, int result){
+    (void)obj;
+    if(result != 0) return;
+    connected = 1;
+    sessions ++;
+    // Subscribre to Adquisition Time topic "adqTime/""
+    mosquitto_subscribe(mosq, NULL, sub_topic, 0);
+    for(int i = 0; i < n_handlers; i ++) mosquitto_subscribe(mosq, NULL, handlers[i].topic, 1);
+}
+
+// Callback for the disconnection
+void disconnect_callback(struct mosquitto *mosq, void *obj, int result){
+    (void)mosq;
+    (void)obj;
+    (void)result;
+    connected = 0;
+}
+
+// Connection with the broker is up
+int mqtt_connected(){
+    return connected;
+}
+
+// Connections made so far
+int mqtt_sessions(){
+    return sessions;
+}
+
 // Get scan rate
 int getScanRate(){
     return scanRate;
-}
\ No newline at end of file
+}
+
+// Network loop driven by the caller (single threaded mode)
+int mqtt_socket(){
+    return mosquitto_socket(mosq);
+}
+
+int mqtt_loop_read(){
+    return mosquitto_loop_read(mosq, 1);
+}
+
+int mqtt_loop_write(){
+    return mosquitto_loop_write(mosq, 1);
+}
+
+int mqtt_loop_misc(){
+    return mosquitto_loop_misc(mosq);
+}
+
+bool mqtt_want_write(){
+    return mosquitto_want_write(mosq);
+}
+
+int mqtt_reconnect(){
+    return mosquitto_reconnect(mosq);
+}
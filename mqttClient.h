@@ -7,16 +7,33 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <syslog.h>
 
 // Include MQTT Library
 #include <mosquitto.h>
 
+// Logger
+#include "logger.h"
+
 // Shared Variables
 
 
 // Shared functions
-void mqtt_setup();
+void mqtt_setup(int threaded);
 int mqtt_send(char *msg, char *topic);
+int mqtt_publish(const char *topic, const void *payload, int len, int qos, bool retain);
 int getScanRate();
+int mqtt_connected();
+int mqtt_sessions();
+int mqtt_will(const char *topic, const void *payload, int len, int qos, bool retain);
+int mqtt_handler(const char *topic, void (*handler)(const char *payload, int len));
+
+// Single threaded network loop
+int mqtt_socket();
+int mqtt_loop_read();
+int mqtt_loop_write();
+int mqtt_loop_misc();
+bool mqtt_want_write();
+int mqtt_reconnect();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,255 @@
+/***********************************
+*          onDemand.c
+*
+* -On-demand reads: commands from
+*  MQTT read registers (3X or 4X)
+*  of a meter at once, ahead of the
+*  periodic polls of its bus, and
+*  the values are sent back in the
+*  topic of the command.
+*
+* used with onDemand.h
+*
+***********************************/
+
+// Include header file
+#include "onDemand.h"
+
+// Internal functions
+void        commandError(const char *id, const char *error);
+int         commandDue(const struct timespec *deadline);
+
+// Variables
+static CommandQueue     *slaveQueues[256];      // Queue of the bus of each meter (NULL: unknown meter)
+
+
+
+/* QUEUE INITIALIZATION: Empties the commands of a bus (waits use CLOCK_MONOTONIC, like the schedule).
+*/
+void commandQueueInit(CommandQueue *queue){
+    pthread_condattr_t attr;
+
+    queue->head     = 0;
+    queue->n        = 0;
+    queue->burst    = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue->queued, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+
+
+/* ADD SLAVE: Commands for a meter go to the queue of its bus (before mqtt_setup).
+*/
+void commandAddSlave(CommandQueue *queue, uint8_t slave_id){
+    slaveQueues[slave_id] = queue;
+}
+
+
+
+/* REQUEST: Queues a command for the bus of its meter (called from the MQTT client).
+    Payload: "<id> <slave> <3x|4x> <register> [<register>...]", registers in decimal or hex,
+    each one the first register of a parameter (2 registers: a float, or the 4 bytes of a setting).
+    Example: "r1 1 4x 0xF930 0xF500" reads RUN_TIME and DISP_SETTINGS of meter 1.
+    Commands that can't be queued are answered at once with an error (see commandError).
+*/
+void commandRequest(const char *payload, int len){
+    char            text[256];
+    char            type[4];
+    char            *next;
+    Command         command;
+    ScheduleEntry   *entry = &command.entry;
+    CommandQueue    *queue;
+    FunctionCode    function_code;
+    int             slave_id;
+    int             offset;
+    int             n = 0;
+
+    if(len >= (int)sizeof(text)) len = sizeof(text) - 1;
+    memcpy(text, payload, len);
+    text[len] = '\0';
+
+    memset(&command, 0, sizeof(command));
+    clock_gettime(CLOCK_MONOTONIC, &command.received);
+    if(sscanf(text, "%23s %i %3s%n", command.id, &slave_id, type, &offset) < 3 || strpbrk(command.id, "/+#") != NULL){
+        logWarning("WARNING: Invalid command '%s'.\n", text);
+        syslog(LOG_WARNING, "WARNING from commandRequest: Invalid command '%s'.", text);
+        return;
+    }
+
+    // Registers, up to the end of the payload
+    for(next = text + offset; n <= MaxCommandRegisters; n ++){
+        char *end;
+        long address = strtol(next, &end, 0);
+        if(end == next) break;
+        if(n == MaxCommandRegisters || address < 0 || address > 0xFFFE) break;
+        command.addresses[n] = address;
+        next = end;
+    }
+    while(*next == ' ' || *next == '\n' || *next == '\r') next ++;
+    if(strcasecmp(type, "3x") == 0) function_code = R_3X;
+    else if(strcasecmp(type, "4x") == 0) function_code = RW_4X;
+    else n = 0;
+    if(n == 0 || *next != '\0' || slave_id < 1 || slave_id > 247){
+        commandError(command.id, "invalid command");
+        return;
+    }
+    queue = slaveQueues[slave_id];
+    if(queue == NULL){
+        commandError(command.id, "unknown slave");
+        return;
+    }
+
+    // Read like a register group: windows planned and their requests built once (4X ones only join contiguous registers)
+    entry->n_windows = modbusPlanWindows(command.addresses, NULL, n, function_code == R_3X ? MaxWindowGap : 0, entry->windows, MaxWindows);
+    for(int w = 0; w < entry->n_windows; w ++) modbusBuildRequest(&entry->windows[w], slave_id, function_code);
+    entry->slave_id = slave_id;
+    entry->n        = n;
+    entry->priority = -1;           // Before any register group
+
+    pthread_mutex_lock(&queue->lock);
+    if(queue->n < CommandQueueSize){
+        queue->commands[(queue->head + queue->n) % CommandQueueSize] = command;
+        queue->n ++;
+        pthread_cond_signal(&queue->queued);
+        n = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if(n > 0) commandError(command.id, "busy");
+}
+
+
+
+/* PENDING: There are commands waiting on a bus.
+*/
+int commandPending(CommandQueue *queue){
+    int n;
+
+    pthread_mutex_lock(&queue->lock);
+    n = queue->n;
+    pthread_mutex_unlock(&queue->lock);
+    return n > 0;
+}
+
+
+
+/* WAIT: Sleeps until a deadline (absolute, CLOCK_MONOTONIC) or until a command is queued.
+    returns 1 if a command is waiting
+*/
+int commandWait(CommandQueue *queue, const struct timespec *deadline){
+    int error = 0;
+    int pending;
+
+    pthread_mutex_lock(&queue->lock);
+    while(queue->n == 0 && error == 0) error = pthread_cond_timedwait(&queue->queued, &queue->lock, deadline);
+    pending = queue->n > 0;
+    pthread_mutex_unlock(&queue->lock);
+    if(error != 0 && error != ETIMEDOUT) printf("ERROR %i from pthread_cond_timedwait: %s\n", error, strerror(error));
+    return pending;
+}
+
+
+
+/* TAKE: Takes the oldest command, ahead of the polls, unless CommandBurst commands were
+   read in a row while a poll was due: then the poll goes first, the schedule isn't starved.
+    +Poll Deadline::    Deadline of the next poll of the bus
+    returns 1 if a command was taken
+*/
+int commandTake(CommandQueue *queue, Command *command, const struct timespec *poll_deadline){
+    int due     = poll_deadline != NULL && commandDue(poll_deadline);
+    int taken   = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    if(queue->n > 0){
+        if(!due) queue->burst = 0;
+        if(queue->burst < CommandBurst){
+            *command        = queue->commands[queue->head];
+            queue->head     = (queue->head + 1) % CommandQueueSize;
+            queue->n --;
+            queue->burst   += due;
+            taken           = 1;
+        }
+        else queue->burst = 0;      // The poll goes now
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if(taken) command->entry.addresses = command->addresses;
+    return taken;
+}
+
+
+
+/* RUN: Reads the parameters of a command and sends the response (blocking, from the bus thread).
+*/
+void commandRun(ModbusPort *port, Command *command){
+    ScheduleEntry   *entry = &command->entry;
+    float           values[MaxCommandRegisters];
+
+    logDebug("--Command %s: slave %i--\n", command->id, entry->slave_id);
+    modbusWindowQuery(port, entry->slave_id, entry->windows, entry->n_windows, entry->addresses, NULL, entry->n, values, NULL);
+    commandReply(command, values);
+}
+
+
+
+/* REPLY: Sends the values read by a command in "meter/read/response/<id>":
+    {"id":"<id>","slave":<id>,"function":<code>,"latency_ms":<ms>,"registers":[{"address":"0xf930","value":8760,"raw":"460ae000"},...]}
+    The latency is the time from the command arriving to its response. Parameters that couldn't be read
+    have null value and raw, settings that aren't floats have null value (raw keeps their 4 bytes).
+*/
+void commandReply(const Command *command, const float values[]){
+    char                payload[CommandPayloadSize];
+    char                topic[64];
+    uint8_t             bytes[4];
+    struct timespec     now;
+    const ScheduleEntry *entry = &command->entry;
+    int                 len;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    metricsCommand(&command->received);
+    len = snprintf(payload, sizeof(payload), "{\"id\":\"%s\",\"slave\":%i,\"function\":%i,\"latency_ms\":%.3f,\"registers\":[",
+                   command->id, entry->slave_id, entry->windows[0].request[1], timespecDiffUs(&command->received, &now)/1000.0);
+    for(int i = 0; i < entry->n; i ++){
+        floatToBytes(values[i], bytes);
+        len += sprintf(payload + len, "%s{\"address\":\"0x%04x\",\"value\":", i ? "," : "", command->addresses[i]);
+        if(bytes[0] == 0xFF && bytes[1] == 0xFF && bytes[2] == 0xFF && bytes[3] == 0xFF){
+            len += sprintf(payload + len, "null,\"raw\":null}");
+            continue;
+        }
+        if(isfinite(values[i])) len += floatToText(payload + len, values[i]);
+        else len += sprintf(payload + len, "null");
+        len += sprintf(payload + len, ",\"raw\":\"%02x%02x%02x%02x\"}", bytes[0], bytes[1], bytes[2], bytes[3]);
+    }
+    len += sprintf(payload + len, "]}");
+
+    snprintf(topic, sizeof(topic), CommandResponseTopic "%s", command->id);
+    mqtt_publish(topic, payload, len, 1, false);
+}
+
+
+
+/* ERROR: Answers a command that can't be read: {"id":"<id>","error":"<error>"}
+*/
+void commandError(const char *id, const char *error){
+    char    payload[128];
+    char    topic[64];
+    int     len;
+
+    logWarning("WARNING: Command %s not read: %s.\n", id, error);
+    len = snprintf(payload, sizeof(payload), "{\"id\":\"%s\",\"error\":\"%s\"}", id, error);
+    snprintf(topic, sizeof(topic), CommandResponseTopic "%s", id);
+    mqtt_publish(topic, payload, len, 1, false);
+}
+
+
+
+/* DUE: A deadline (CLOCK_MONOTONIC) has passed.
+*/
+int commandDue(const struct timespec *deadline){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
@@ -0,0 +1,50 @@
+#ifndef onDemand
+#define onDemand
+
+// Include the modbus, scheduler and MQTT headers
+#include "modbus.h"
+#include "scheduler.h"
+#include "floatText.h"
+#include "mqttClient.h"
+
+// Linux headers
+#include <pthread.h>
+#include <strings.h>        // strcasecmp()
+
+// Defines
+#define MaxCommandRegisters 8       // Parameters read by one command (2 registers each)
+#define CommandQueueSize    8       // Commands waiting on a bus
+#define CommandBurst        2       // Commands read in a row while a poll is due (then the poll goes)
+#define CommandIdSize       24      // Id of a command (names its response topic)
+#define CommandPayloadSize  1024    // Size of a response message
+#define CommandRequestTopic "meter/read/request"
+#define CommandResponseTopic "meter/read/response/"     // Followed by the id of the command
+
+// Structs
+typedef struct{
+    char                id[CommandIdSize];
+    StartAddress_3X     addresses[MaxCommandRegisters];     // First register of each parameter (3X or 4X)
+    ScheduleEntry       entry;                              // Read like a register group (windows built for the function code)
+    struct timespec     received;                           // Time the command arrived (CLOCK_MONOTONIC)
+}Command;
+
+typedef struct{
+    Command             commands[CommandQueueSize];
+    int                 head;                   // Oldest command
+    int                 n;                      // Commands waiting
+    int                 burst;                  // Commands read while a poll was due
+    pthread_mutex_t     lock;
+    pthread_cond_t      queued;                 // A command was queued (CLOCK_MONOTONIC waits)
+}CommandQueue;
+
+// Functions
+void        commandQueueInit(CommandQueue *queue);
+void        commandAddSlave(CommandQueue *queue, uint8_t slave_id);
+void        commandRequest(const char *payload, int len);
+int         commandPending(CommandQueue *queue);
+int         commandWait(CommandQueue *queue, const struct timespec *deadline);
+int         commandTake(CommandQueue *queue, Command *command, const struct timespec *poll_deadline);
+void        commandRun(ModbusPort *port, Command *command);
+void        commandReply(const Command *command, const float values[]);
+
+#endif
@@ -0,0 +1,430 @@
+/***********************************
+*          publisher.c
+*
+* -Publisher: drains the sample
+*  queues of the acquisition threads
+*  and publishes to MQTT, so a slow
+*  broker never stalls the buses.
+*
+* used with publisher.h
+*
+***********************************/
+
+// Include header file
+#include "publisher.h"
+
+// Structs
+typedef struct{
+    Sample      samples[MaxBatchSize];      // Samples of the scan being collected
+    int         n;
+}Batch;
+
+// Internal functions
+void        *publisherThread(void *arg);
+void        deliverSample(Batch *batch, const Sample *sample, int include);
+int         replayJournal();
+int         publishSample(const Sample *sample);
+int         replayScan();
+void        batchSample(Batch *batch, const Sample *sample, int include);
+void        collectSample(Batch *batch, const Sample *sample);
+void        publishBatch(Batch *batch);
+int         sendBatch(Batch *batch);
+int         jsonScan(Batch *batch, char *payload, int size);
+int         cborScan(Batch *batch, uint8_t *payload, int size);
+void        journalBatch(Batch *batch, int last);
+TopicClass  topicClass(const char *topic);
+
+// Variables
+static SampleQueue      *queues[MaxQueues];
+static uint32_t         reportedDrops[MaxQueues];   // Drops already logged
+static Batch            batches[MaxQueues];         // Scan being collected from each queue
+static Batch            replayBatch;                // Scan being collected from the journal
+static int              replayRate  = ReplayRate;   // Records replayed per second
+static int              n_queues    = 0;
+static pthread_t        thread;
+static PublishMode      mode        = PublishPerTopic;
+static const char       *classNames[TopicClasses] = {"parameters", "power", "energy", "scan"};
+static PublishOptions   classOptions[TopicClasses] = {
+    {2, true},          // parameters
+    {2, true},          // power
+    {2, true},          // energy
+    {2, true}           // scan
+};
+
+
+
+/* ADD QUEUE: Adds the queue of an acquisition thread (before publisherStart).
+    returns 0 if added
+            or -1 if there are too many queues
+*/
+int publisherAddQueue(SampleQueue *queue){
+    if(n_queues == MaxQueues){
+        printf("ERROR: Too many sample queues, max %i\n", MaxQueues);
+        return -1;
+    }
+    queues[n_queues ++] = queue;
+    return 0;
+}
+
+
+
+/* PUBLISH MODE: One message per parameter (default), or the scans of the meters
+   as JSON, CBOR or Sparkplug B messages.
+*/
+void publisherSetMode(PublishMode new_mode){
+    mode = new_mode;
+}
+
+
+
+/* PUBLISH OPTIONS: Sets the QoS and retain flag of a topic class.
+*/
+void publisherSetOptions(TopicClass topic_class, int qos, bool retain){
+    if(topic_class < 0 || topic_class >= TopicClasses || qos < 0 || qos > 2) return;
+    classOptions[topic_class].qos       = qos;
+    classOptions[topic_class].retain    = retain;
+}
+
+
+
+/* PARSE OPTIONS: Sets the options of a topic class from "<class>:<qos>:<retain>" (example "energy:1:1").
+    returns 0 if set
+            or -1 if the option is not valid
+*/
+int publisherParseOptions(const char *option){
+    char    name[16];
+    int     qos, retain;
+
+    if(sscanf(option, "%15[^:]:%i:%i", name, &qos, &retain) != 3) return -1;
+    if(qos < 0 || qos > 2) return -1;
+    for(int c = 0; c < TopicClasses; c ++){
+        if(strcmp(name, classNames[c]) == 0){
+            publisherSetOptions(c, qos, retain != 0);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+
+/* REPLAY RATE: Records replayed from the journal per second once the broker is back.
+*/
+void publisherSetReplayRate(int rate){
+    if(rate > 0) replayRate = rate;
+}
+
+
+
+/* START PUBLISHER: Starts the thread that publishes the samples.
+    returns 0 if started
+            or -1 if error
+*/
+int publisherStart(){
+    int error = pthread_create(&thread, NULL, publisherThread, NULL);
+
+    if(error != 0){
+        printf("ERROR %i from pthread_create: %s\n", error, strerror(error));
+        syslog(LOG_ERR, "ERROR %i from pthread_create: %s", error, strerror(error));
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/* PUBLISHER THREAD: Drains the queues forever, waiting a bit when they are empty.
+*/
+void *publisherThread(void *arg){
+    (void)arg;
+    while(1){
+        if(publisherDrain() == 0) usleep(PublishIdle*1000);
+        metricsReport();
+    }
+    return NULL;
+}
+
+
+
+/* DRAIN QUEUES: Publishes every sample waiting in the queues and logs new drops.
+    Samples are also added to the history, part of a history request is served, and a Sparkplug rebirth.
+    returns number of samples published (and history blocks read, rebirth messages)
+*/
+int publisherDrain(){
+    Sample  sample;
+    int     n_samples = 0;
+
+    for(int q = 0; q < n_queues; q ++){
+        while(sampleQueuePop(queues[q], &sample)){
+            // Every value read is kept in the history, even inside its deadband
+            if(historyEnabled()) historyAppend(&sample);
+            // Report by exception: values inside their deadband are not published
+            int include = deadbandPass(&sample);
+            deliverSample(&batches[q], &sample, include);
+            n_samples ++;
+        }
+
+        uint32_t drops = atomic_load_explicit(&queues[q]->drops, memory_order_relaxed);
+        metricsQueue(q, sampleQueueDepth(queues[q]), atomic_load_explicit(&queues[q]->max_depth, memory_order_relaxed), drops);
+        if(drops != reportedDrops[q]){
+            logWarning("WARNING: Sample queue %i dropped %u samples (max depth %u).\n", q, drops - reportedDrops[q],
+                    atomic_load_explicit(&queues[q]->max_depth, memory_order_relaxed));
+            syslog(LOG_WARNING, "WARNING from publisherDrain: Sample queue %i dropped %u samples.", q, drops - reportedDrops[q]);
+            reportedDrops[q] = drops;
+        }
+    }
+    return n_samples + replayJournal() + historyServe() + sparkplugServe();
+}
+
+
+
+/* DELIVER SAMPLE: Publishes a sample, or journals it if the broker can't be reached.
+    While the journal has records to replay, new samples are journaled behind them so the order is kept.
+*/
+void deliverSample(Batch *batch, const Sample *sample, int include){
+    if(journalEnabled() && (journalPending() > 0 || !mqtt_connected())){
+        // The part of the scan already collected goes first
+        journalBatch(batch, 0);
+        if(include || sample->last) journalAppend(sample, (include ? RecordInclude : 0) | (sample->last ? RecordLast : 0));
+        if(include) deadbandCommit(sample);
+        return;
+    }
+    if(mode != PublishPerTopic) batchSample(batch, sample, include);
+    else if(include){
+        if(publishSample(sample) == MOSQ_ERR_SUCCESS) deadbandCommit(sample);
+        else if(journalEnabled()){
+            journalAppend(sample, RecordInclude | (sample->last ? RecordLast : 0));
+            deadbandCommit(sample);
+        }
+    }
+}
+
+
+
+/* REPLAY JOURNAL: Publishes journaled records in order while the broker is connected,
+   no faster than replayRate records per second.
+    The checkpoint only moves past records once they are published (a whole scan in batch
+    modes), the ones that fail are replayed again in the same place.
+    returns number of records replayed
+*/
+int replayJournal(){
+    static struct timespec  last;           // Last time records were replayed
+    static double           budget  = 0;    // Records that can be replayed now
+    struct timespec         now;
+    Sample                  sample;
+    uint8_t                 flags;
+    int                     n_records = 0;
+
+    if(!journalEnabled() || journalPending() == 0 || !mqtt_connected()){
+        clock_gettime(CLOCK_MONOTONIC, &last);
+        budget = 0;
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    budget += ((now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec)/1e9)*replayRate;
+    if(budget > replayRate) budget = replayRate;
+    last = now;
+
+    while(budget >= 1 && journalRead(&sample, &flags)){
+        int include = (flags & RecordInclude) != 0;
+        if(mode == PublishPerTopic){
+            if(include && publishSample(&sample) != MOSQ_ERR_SUCCESS){
+                journalRewind();
+                break;
+            }
+            journalCommit();
+        }else{
+            // A sample of another meter (the end of the scan was dropped) or a full batch: the scan collected goes first
+            if(replayBatch.n > 0 && (replayBatch.samples[0].slave_id != sample.slave_id || replayBatch.n == MaxBatchSize)){
+                journalUnread();
+                if(!replayScan()) break;
+                continue;
+            }
+            if(include) collectSample(&replayBatch, &sample);
+            if(sample.last && !replayScan()) break;
+        }
+        budget --;
+        n_records ++;
+    }
+    if(journalPending() == 0) logInfo("  Journal replayed.\n");
+    return n_records;
+}
+
+
+
+/* REPLAY SCAN: Publishes the scan collected from the journal, and commits its records.
+   If it fails they are read again later.
+    returns 1 if published (or nothing to publish)
+            0 if not
+*/
+int replayScan(){
+    int result = replayBatch.n > 0 ? sendBatch(&replayBatch) : MOSQ_ERR_SUCCESS;
+
+    replayBatch.n = 0;
+    if(result != MOSQ_ERR_SUCCESS && result != MOSQ_ERR_PAYLOAD_SIZE){
+        journalRewind();
+        return 0;
+    }
+    journalCommit();
+    return 1;
+}
+
+
+
+/* PUBLISH SAMPLE: Publishes one parameter in "meter/<id>/<topic>".
+    returns the result of mosquitto_publish()
+*/
+int publishSample(const Sample *sample){
+    char s[FloatTextSize];
+    char topic[64];
+    PublishOptions *options = &classOptions[topicClass(sample->topic)];
+
+    int len = floatToText(s, sample->value);
+    sprintf(topic,"meter/%i/%s",sample->slave_id,sample->topic);
+    int result = mqtt_publish(topic, s, len, options->qos, options->retain);
+    if(result == MOSQ_ERR_SUCCESS) metricsPublish(&sample->timestamp);
+    return result;
+}
+
+
+
+/* BATCH SAMPLE: Collects the samples of a scan, and publishes them when the scan ends.
+    Samples not included (inside their deadband) still mark the end of the scan.
+    Scans without any sample included are not published.
+*/
+void batchSample(Batch *batch, const Sample *sample, int include){
+    // A sample of another meter means the end of the scan was dropped
+    if(batch->n > 0 && batch->samples[0].slave_id != sample->slave_id) publishBatch(batch);
+    if(batch->n == MaxBatchSize) publishBatch(batch);
+
+    if(include) collectSample(batch, sample);
+    if(sample->last) publishBatch(batch);
+}
+
+
+
+/* COLLECT SAMPLE: Adds a sample to a batch.
+*/
+void collectSample(Batch *batch, const Sample *sample){
+    batch->samples[batch->n ++] = *sample;
+}
+
+
+
+/* PUBLISH BATCH: Publishes a scan collected live, the deadbands remember its samples.
+    Scans that couldn't be published are journaled.
+*/
+void publishBatch(Batch *batch){
+    int result;
+
+    if(batch->n == 0) return;
+    result = sendBatch(batch);
+    if(result == MOSQ_ERR_SUCCESS) for(int i = 0; i < batch->n; i ++) deadbandCommit(&batch->samples[i]);
+    else if(result != MOSQ_ERR_PAYLOAD_SIZE && journalEnabled()) journalBatch(batch, 1);
+    batch->n = 0;
+}
+
+
+
+/* SEND BATCH: Publishes a scan of a meter in the format of the publish mode.
+    returns the result of the publish
+            or MOSQ_ERR_PAYLOAD_SIZE if the message is too long (never published)
+*/
+int sendBatch(Batch *batch){
+    uint8_t payload[BatchPayloadSize];
+    char    topic[64];
+    int     len, result;
+    PublishOptions *options = &classOptions[ClassScan];
+
+    if(mode == PublishSparkplug) result = sparkplugPublishScan(batch->samples, batch->n);
+    else{
+        if(mode == PublishCbor) len = cborScan(batch, payload, sizeof(payload));
+        else len = jsonScan(batch, (char*)payload, sizeof(payload));
+        if(len < 0){
+            printf("ERROR: Scan message of slave %i too long, not published.\n", batch->samples[0].slave_id);
+            return MOSQ_ERR_PAYLOAD_SIZE;
+        }
+        sprintf(topic,"meter/%i/scan",batch->samples[0].slave_id);
+        result = mqtt_publish(topic, payload, len, options->qos, options->retain);
+    }
+    if(result == MOSQ_ERR_SUCCESS) metricsPublish(&batch->samples[0].timestamp);
+    return result;
+}
+
+
+
+/* JSON SCAN: Formats a scan as:
+    {"ts":<ms since epoch>,"slave":<id>,"values":{"<topic>":<value>,...}}
+    Parameters that couldn't be read are null, values are the shortest text that reads back as the float.
+    The topics are written as they are (registerMapLoad doesn't accept any that would need escaping).
+    returns length of the message
+            or -1 if it doesn't fit
+*/
+int jsonScan(Batch *batch, char *payload, int size){
+    int     len;
+    long long ts;
+
+    ts = (long long)batch->samples[0].timestamp.tv_sec*1000 + batch->samples[0].timestamp.tv_nsec/1000000;
+    len = snprintf(payload, size, "{\"ts\":%lld,\"slave\":%i,\"values\":{", ts, batch->samples[0].slave_id);
+    for(int i = 0; i < batch->n && len < size; i ++){
+        const Sample *sample = &batch->samples[i];
+        len += snprintf(payload + len, size - len, "%s\"%s\":", i ? "," : "", sample->topic);
+        if(len + FloatTextSize > size) return -1;
+        if(sample->status == SampleOk) len += floatToText(payload + len, sample->value);
+        else len += snprintf(payload + len, size - len, "null");
+    }
+    if(len < size) len += snprintf(payload + len, size - len, "}}");
+    return len < size ? len : -1;
+}
+
+
+
+/* CBOR SCAN: Formats a scan as the CBOR twin of the JSON message, values as single
+   precision floats (as read from the meter):
+    {"ts":<ms since epoch>,"slave":<id>,"values":{"<topic>":<float32>,...}}
+    returns length of the message
+            or -1 if it doesn't fit
+*/
+int cborScan(Batch *batch, uint8_t *payload, int size){
+    Encoder enc;
+
+    encoderInit(&enc, payload, size);
+    cborHead(&enc, CborMap, 3);
+    cborString(&enc, "ts");
+    cborHead(&enc, CborUnsigned, (uint64_t)batch->samples[0].timestamp.tv_sec*1000 + batch->samples[0].timestamp.tv_nsec/1000000);
+    cborString(&enc, "slave");
+    cborHead(&enc, CborUnsigned, batch->samples[0].slave_id);
+    cborString(&enc, "values");
+    cborHead(&enc, CborMap, batch->n);
+    for(int i = 0; i < batch->n; i ++){
+        cborString(&enc, batch->samples[i].topic);
+        if(batch->samples[i].status == SampleOk) cborFloat(&enc, batch->samples[i].value);
+        else cborNull(&enc);
+    }
+    return enc.overflow ? -1 : enc.len;
+}
+
+
+
+/* JOURNAL BATCH: Journals the samples collected of a scan (last: they are the whole scan).
+*/
+void journalBatch(Batch *batch, int last){
+    for(int i = 0; i < batch->n; i ++){
+        journalAppend(&batch->samples[i], RecordInclude | ((last && i == batch->n - 1) ? RecordLast : 0));
+        deadbandCommit(&batch->samples[i]);
+    }
+    batch->n = 0;
+}
+
+
+
+/* TOPIC CLASS: Class of a parameter from the first level of its topic.
+*/
+TopicClass topicClass(const char *topic){
+    for(int c = 0; c < ClassScan; c ++){
+        int len = strlen(classNames[c]);
+        if(strncmp(topic, classNames[c], len) == 0 && topic[len] == '/') return c;
+    }
+    return ClassParameters;
+}
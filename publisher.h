@@ -0,0 +1,54 @@
+#ifndef publisher
+#define publisher
+
+// Include the sample queue, deadband and MQTT headers
+#include "sampleQueue.h"
+#include "floatText.h"
+#include "deadband.h"
+#include "journal.h"
+#include "history.h"
+#include "sparkplug.h"
+#include "mqttClient.h"
+
+// Linux headers
+#include <pthread.h>
+#include <syslog.h>
+
+// Defines
+#define MaxQueues           8       // Max acquisition threads feeding the publisher
+#define PublishIdle         10      // Wait when all the queues are empty (mili seconds)
+#define MaxBatchSize        64      // Max parameters in one scan message
+#define BatchPayloadSize    2048    // Size of a scan message
+
+// Enums
+typedef enum{
+    PublishPerTopic,        // One message per parameter ("meter/<id>/<topic>")
+    PublishBatch,           // One JSON message per meter and scan ("meter/<id>/scan")
+    PublishCbor,            // One CBOR message per meter and scan ("meter/<id>/scan")
+    PublishSparkplug        // Sparkplug B messages per meter and scan ("spBv1.0/...")
+}PublishMode;
+
+typedef enum{
+    ClassParameters,        // "parameters/..."
+    ClassPower,             // "power/..."
+    ClassEnergy,            // "energy/..."
+    ClassScan,              // Scan messages (PublishBatch, PublishCbor)
+    TopicClasses
+}TopicClass;
+
+// Structs
+typedef struct{
+    int                 qos;            // MQTT QoS [0...2]
+    bool                retain;         // Broker keeps the last message
+}PublishOptions;
+
+// Functions
+int         publisherAddQueue(SampleQueue *queue);
+int         publisherStart();
+int         publisherDrain();
+void        publisherSetMode(PublishMode mode);
+void        publisherSetOptions(TopicClass topic_class, int qos, bool retain);
+int         publisherParseOptions(const char *option);
+void        publisherSetReplayRate(int rate);
+
+#endif
@@ -0,0 +1,477 @@
+/***********************************
+*          registerMap.c
+*
+* -Register map: the devices, their
+*  register groups and how each
+*  field is decoded and published,
+*  read from a text file and
+*  compiled into the schedule of a
+*  bus (requests built, windows
+*  merged, one decoder per field).
+*
+* used with registerMap.h
+*
+***********************************/
+
+// Include header file
+#include "registerMap.h"
+
+// Structs
+typedef struct{
+    const char      *name;
+    FieldDecoder    decode;
+    uint8_t         registers;      // Registers read
+    uint8_t         bitfield;       // Followed by ":<first bit>:<bits>"
+}FieldType;
+
+// Internal functions
+const char  *mapLine(RegisterMap *map, char line[]);
+const char  *mapField(MapDevice *device, MapGroup *group, char line[]);
+int         mapType(const char *type, RegisterField *field);
+int         mapTopic(char topic[MapTopicSize], const char *template, const MapDevice *device, const MapGroup *group);
+StartAddress_3X mapKey(const MapDevice *device, StartAddress_3X address);
+int         mapKeyUsed(const MapDevice *device, uint32_t key);
+float       decodeFloat32(const uint8_t bytes[], const RegisterField *field);
+float       decodeFloat32Le(const uint8_t bytes[], const RegisterField *field);
+float       decodeFloat32Ws(const uint8_t bytes[], const RegisterField *field);
+float       decodeU16(const uint8_t bytes[], const RegisterField *field);
+float       decodeS16(const uint8_t bytes[], const RegisterField *field);
+float       decodeU32(const uint8_t bytes[], const RegisterField *field);
+float       decodeU32Ws(const uint8_t bytes[], const RegisterField *field);
+float       decodeS32(const uint8_t bytes[], const RegisterField *field);
+float       decodeBits(const uint8_t bytes[], const RegisterField *field);
+float       wordToFloat(uint32_t word);
+
+// Variables
+static const char       *mapPath    = NULL;     // Map file (NULL: the built-in map)
+static _Atomic int      generation  = 0;        // Reloads asked (SIGHUP)
+
+// Types of the fields ("float32" is the SDM230 layout)
+static const FieldType  fieldTypes[] = {
+    {"float32",     decodeFloat32,      2, 0},  // IEEE 754, big endian [A B C D]
+    {"float32le",   decodeFloat32Le,    2, 0},  // Little endian [D C B A]
+    {"float32ws",   decodeFloat32Ws,    2, 0},  // Words swapped [C D A B]
+    {"u16",         decodeU16,          1, 0},
+    {"s16",         decodeS16,          1, 0},
+    {"u32",         decodeU32,          2, 0},  // High word first
+    {"u32ws",       decodeU32Ws,        2, 0},  // Low word first
+    {"s32",         decodeS32,          2, 0},
+    {"bits16",      decodeBits,         1, 1},  // Bits of one register, "bits16:<first bit>:<bits>"
+    {"bits32",      decodeBits,         2, 1}   // Bits of two registers (high word first)
+};
+#define FieldTypes (int)(sizeof(fieldTypes)/sizeof(fieldTypes[0]))
+
+// Built-in map: the parameters of the SDM230 published when no map file is given
+static const char       defaultMap[] =
+    "device sdm230\n"
+    "group fast 3x scan 0 aggregate\n"
+    "field 0x0000 float32 parameters/voltage\n"
+    "field 0x0006 float32 parameters/current\n"
+    "field 0x001E float32 parameters/pf\n"
+    "field 0x0024 float32 parameters/phase\n"
+    "field 0x0046 float32 parameters/frequency\n"
+    "field 0x0012 float32 power/apparent\n"
+    "field 0x000C float32 power/active\n"
+    "field 0x0018 float32 power/reactive\n"
+    "group energy 3x 60000 1\n"
+    "field 0x0048 float32 energy/import/active\n"
+    "field 0x004C float32 energy/import/reactive\n"
+    "field 0x004A float32 energy/export/active\n"
+    "field 0x004E float32 energy/export/reactive\n";
+
+
+
+/* SET PATH: Map file read by registerMapCreate() (NULL: the built-in SDM230 map).
+*/
+void registerMapSetPath(const char *path){
+    mapPath = path;
+}
+
+
+
+/* RELOAD: Asks every bus to read the map file again (async signal safe, called on SIGHUP).
+*/
+void registerMapReload(){
+    atomic_fetch_add(&generation, 1);
+}
+
+
+
+/* GENERATION: Number of reloads asked, a bus whose map is older loads it again.
+*/
+int registerMapGeneration(){
+    return atomic_load(&generation);
+}
+
+
+
+/* CREATE: Reads the map file and compiles it for the meters of a bus.
+    The map is built on its own, the map used by the bus is only swapped once this one is complete.
+    returns the map (registerMapFree() it)
+            or NULL if the file has errors or the table is full
+*/
+RegisterMap *registerMapCreate(const uint8_t slave_ids[], int n_slaves, int aggregate_ms){
+    RegisterMap *map = malloc(sizeof(RegisterMap));
+
+    if(map == NULL){
+        printf("ERROR: Not enough memory for the register map.\n");
+        syslog(LOG_ERR, "ERROR from registerMapCreate: Not enough memory for the register map.");
+        return NULL;
+    }
+    if(registerMapLoad(map, mapPath) < 0){
+        free(map);
+        return NULL;
+    }
+    if(registerMapCompile(map, slave_ids, n_slaves, aggregate_ms) < 0){
+        registerMapFree(map);
+        return NULL;
+    }
+    return map;
+}
+
+
+
+/* FREE: Releases the aggregator blocks of a compiled map and frees it.
+*/
+void registerMapFree(RegisterMap *map){
+    for(int e = 0; e < map->schedule.n_entries; e ++){
+        if(map->entries[e].block >= 0) aggregatorRelease(map->entries[e].block);
+    }
+    free(map);
+}
+
+
+
+/* LOAD: Reads the devices, register groups and fields of a map file, one statement per line ('#' starts a comment):
+    device <name>
+    group <name> <3x|4x> <period ms|scan> <priority> [aggregate]
+    field <register> <type> [<scale>] <topic>
+    meter <slave> <device>
+    Groups belong to the last device, fields to the last group. Types: float32, float32le, float32ws, u16, s16,
+    u32, u32ws, s32, bits16:<first bit>:<bits>, bits32:<first bit>:<bits> (first bit 0 is the least significant).
+    The value decoded is multiplied by the scale (1 by default). "{device}" and "{group}" in a topic are replaced
+    by their names. Topics can't have MQTT wildcards (+ #), quotes, backslashes or control characters, as they
+    are also the keys of the JSON scans. Meters not named in a "meter" line are the first device.
+    +Path::             Map file (NULL: the built-in SDM230 map)
+    returns 0 if loaded
+            or -1 if the file can't be read or has errors
+*/
+int registerMapLoad(RegisterMap *map, const char *path){
+    char        line[MapLineSize];
+    const char  *error = NULL;
+    const char  *name = path != NULL ? path : "(built-in)";
+    int         number = 0;
+    FILE        *file;
+
+    map->n_devices = 0;
+    memset(map->meters, 0, sizeof(map->meters));
+    file = path != NULL ? fopen(path, "r") : fmemopen((void *)defaultMap, strlen(defaultMap), "r");
+    if(file == NULL){
+        printf("ERROR %i opening register map %s: %s\n", errno, name, strerror(errno));
+        syslog(LOG_ERR, "ERROR %i from registerMapLoad: %s: %s", errno, name, strerror(errno));
+        return -1;
+    }
+    while(error == NULL && fgets(line, sizeof(line), file) != NULL){
+        number ++;
+        if(strchr(line, '\n') == NULL && !feof(file)) error = "line too long";
+        else error = mapLine(map, line);
+    }
+    fclose(file);
+    if(error == NULL && map->n_devices == 0){
+        error = "no device";
+        number = 0;
+    }
+    if(error != NULL){
+        printf("ERROR: Register map %s, line %i: %s\n", name, number, error);
+        syslog(LOG_ERR, "ERROR from registerMapLoad: Register map %s, line %i: %s.", name, number, error);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/* COMPILE: Adds every group of every meter of a bus to the schedule of the map. The windows of each group
+   are merged and their requests built (error check included) once, every poll sends them as they are
+   and decodes the registers with the decoder of each field.
+    +Aggregate::        Poll period of the aggregated groups (0 publishes every value read)
+    returns 0 if compiled
+            or -1 if the schedule or the aggregator tables are full
+*/
+int registerMapCompile(RegisterMap *map, const uint8_t slave_ids[], int n_slaves, int aggregate_ms){
+    schedulerInit(&map->schedule);
+    for(int i = 0; i < n_slaves; i ++){
+        uint8_t         slave_id    = slave_ids[i];
+        const MapDevice *device     = &map->devices[map->meters[slave_id] > 0 ? map->meters[slave_id] - 1 : 0];
+
+        for(int g = 0; g < device->n_groups; g ++){
+            const MapGroup  *group      = &device->groups[g];
+            MapEntry        *context    = &map->entries[map->schedule.n_entries];
+            int             period_ms   = group->period_ms;
+            int             block       = -1;
+
+            if(group->n == 0) continue;
+            // Aggregated groups are polled fast, their statistics are published at the scan rate
+            if(aggregate_ms > 0 && group->aggregate){
+                block = aggregatorAdd(slave_id, group->function_code, &device->keys[group->first], &device->topic_list[group->first], group->n);
+                if(block < 0) return -1;
+                period_ms = aggregate_ms;
+            }
+            if(schedulerAdd(&map->schedule, slave_id, group->function_code, &device->addresses[group->first],
+                            &device->fields[group->first], group->n, period_ms, group->priority, context) < 0){
+                if(block >= 0) aggregatorRelease(block);
+                return -1;
+            }
+            context->device = device;
+            context->group  = group;
+            context->block  = block;
+        }
+    }
+    return 0;
+}
+
+
+
+/* LINE: Adds the statement of one line to the map.
+    returns NULL if added (or the line is empty)
+            or the error
+*/
+const char *mapLine(RegisterMap *map, char line[]){
+    char        keyword[8];
+    char        name[MapNameSize + 1];
+    char        function[4];
+    char        period[8];
+    char        option[12];
+    char        *comment    = strchr(line, '#');
+    MapDevice   *device     = map->n_devices > 0 ? &map->devices[map->n_devices - 1] : NULL;
+    MapGroup    *group      = device != NULL && device->n_groups > 0 ? &device->groups[device->n_groups - 1] : NULL;
+    int         priority;
+    int         slave_id;
+    int         n;
+
+    if(comment != NULL) *comment = '\0';
+    if(sscanf(line, "%7s", keyword) < 1) return NULL;
+
+    if(strcmp(keyword, "device") == 0){
+        if(sscanf(line, "%*s %16s %11s", name, option) != 1) return "expected: device <name>";
+        if(strlen(name) >= MapNameSize) return "name too long";
+        if(map->n_devices == MaxMapDevices) return "too many devices";
+        for(int d = 0; d < map->n_devices; d ++) if(strcmp(map->devices[d].name, name) == 0) return "device defined twice";
+        device = &map->devices[map->n_devices ++];
+        strcpy(device->name, name);
+        device->n_groups = 0;
+        device->n_fields = 0;
+        return NULL;
+    }
+
+    if(strcmp(keyword, "group") == 0){
+        n = sscanf(line, "%*s %16s %3s %7s %i %11s", name, function, period, &priority, option);
+        if(n < 4) return "expected: group <name> <3x|4x> <period ms|scan> <priority> [aggregate]";
+        if(device == NULL) return "group before any device";
+        if(device->n_groups == MaxMapGroups) return "too many groups";
+        if(strlen(name) >= MapNameSize) return "name too long";
+        if(n == 5 && strcmp(option, "aggregate") != 0) return "unknown group option";
+        group = &device->groups[device->n_groups];
+        if(strcasecmp(function, "3x") == 0) group->function_code = R_3X;
+        else if(strcasecmp(function, "4x") == 0) group->function_code = RW_4X;
+        else return "unknown function, expected 3x or 4x";
+        if(strcmp(period, "scan") == 0) group->period_ms = ScanRatePeriod;
+        else if((group->period_ms = atoi(period)) <= 0) return "invalid period";
+        if(priority < 0) return "invalid priority";
+        strcpy(group->name, name);
+        group->priority     = priority;
+        group->aggregate    = n == 5;
+        group->first        = device->n_fields;
+        group->n            = 0;
+        device->n_groups ++;
+        return NULL;
+    }
+
+    if(strcmp(keyword, "field") == 0){
+        if(group == NULL) return "field before any group";
+        return mapField(device, group, line);
+    }
+
+    if(strcmp(keyword, "meter") == 0){
+        if(sscanf(line, "%*s %i %16s %11s", &slave_id, name, option) != 2) return "expected: meter <slave> <device>";
+        if(slave_id < 1 || slave_id > 247) return "invalid slave ID";
+        for(int d = 0; d < map->n_devices; d ++){
+            if(strcmp(map->devices[d].name, name) != 0) continue;
+            map->meters[slave_id] = d + 1;
+            return NULL;
+        }
+        return "unknown device";
+    }
+    return "unknown statement";
+}
+
+
+
+/* FIELD: Adds a field to the last group of a device, "field <register> <type> [<scale>] <topic>".
+    returns NULL if added
+            or the error
+*/
+const char *mapField(MapDevice *device, MapGroup *group, char line[]){
+    char            type[24];
+    char            words[2][MapLineSize];
+    char            extra[2];
+    char            *end;
+    const char      *template;
+    long            address;
+    float           scale       = 1;
+    int             i           = device->n_fields;
+    int             n;
+
+    n = sscanf(line, "%*s %li %23s %255s %255s %1s", &address, type, words[0], words[1], extra);
+    if(n < 3 || n > 4) return "expected: field <register> <type> [<scale>] <topic>";
+    if(address < 0 || address > 0xFFFE) return "invalid register";
+    if(i == MaxMapFields) return "too many fields in the device";
+    if(group->n == MaxEntryParameters) return "too many fields in the group";
+    if(mapType(type, &device->fields[i]) < 0) return "unknown type";
+    if(address + device->fields[i].registers > 0x10000) return "invalid register";
+    if(n == 4){
+        scale = strtof(words[0], &end);
+        if(*end != '\0' || !isfinite(scale)) return "invalid scale";
+    }
+    template = words[n - 3];
+    if(mapTopic(device->topics[i], template, device, group) < 0) return "topic too long";
+    if(strpbrk(device->topics[i], "+#\"\\") != NULL) return "invalid topic";     // MQTT wildcards, JSON keys
+    for(const char *c = device->topics[i]; *c != '\0'; c ++) if((unsigned char)*c < 0x20 || *c == 0x7F) return "invalid topic";
+
+    device->fields[i].scale = scale;
+    device->addresses[i]    = address;
+    device->keys[i]         = mapKey(device, address);
+    device->topic_list[i]   = device->topics[i];
+    device->n_fields ++;
+    group->n ++;
+    return NULL;
+}
+
+
+
+/* TYPE: Sets the decoder and the registers of a field from its type ("u16", "bits32:24:8", ...).
+    returns 0 if the type is known
+            or -1 if not
+*/
+int mapType(const char *type, RegisterField *field){
+    for(int t = 0; t < FieldTypes; t ++){
+        const FieldType *field_type = &fieldTypes[t];
+        size_t          len         = strlen(field_type->name);
+        int             shift, bits, used = 0;
+
+        if(strncmp(type, field_type->name, len) != 0) continue;
+        field->decode       = field_type->decode;
+        field->registers    = field_type->registers;
+        field->shift        = 0;
+        field->bits         = 16*field_type->registers;
+        if(!field_type->bitfield){
+            if(type[len] == '\0') return 0;
+            continue;
+        }
+        if(sscanf(type + len, ":%i:%i%n", &shift, &bits, &used) != 2 || type[len + used] != '\0') return -1;
+        if(shift < 0 || bits < 1 || shift + bits > field->bits) return -1;
+        field->shift    = shift;
+        field->bits     = bits;
+        return 0;
+    }
+    return -1;
+}
+
+
+
+/* TOPIC: Expands the "{device}" and "{group}" placeholders of a topic template.
+    returns 0 if expanded
+            or -1 if the topic doesn't fit
+*/
+int mapTopic(char topic[MapTopicSize], const char *template, const MapDevice *device, const MapGroup *group){
+    int len = 0;
+
+    while(*template != '\0'){
+        const char *text = NULL;
+        if(strncmp(template, "{device}", 8) == 0) text = device->name;
+        else if(strncmp(template, "{group}", 7) == 0) text = group->name;
+        if(text != NULL){
+            len += snprintf(topic + len, MapTopicSize - len, "%s", text);
+            template += text == device->name ? 8 : 7;
+        }else{
+            if(len < MapTopicSize) topic[len] = *template;
+            len ++;
+            template ++;
+        }
+        if(len >= MapTopicSize) return -1;
+    }
+    topic[len] = '\0';
+    return 0;
+}
+
+
+
+/* KEY: Address carried by the samples of a new field of a device. It is its register, but fields that
+   share a register (bitfields) must be told apart by the deadbands and the history: the fields after
+   the first one take the highest address no other field of the device uses.
+*/
+StartAddress_3X mapKey(const MapDevice *device, StartAddress_3X address){
+    uint32_t key = 0xFFFF;
+
+    if(!mapKeyUsed(device, address)) return address;
+    while(mapKeyUsed(device, key)) key --;
+    return key;
+}
+
+int mapKeyUsed(const MapDevice *device, uint32_t key){
+    for(int i = 0; i < device->n_fields; i ++) if(device->keys[i] == key || device->addresses[i] == key) return 1;
+    return 0;
+}
+
+
+
+/* DECODERS: Value of a field from its register bytes, multiplied by the scale of the field.
+*/
+float decodeFloat32(const uint8_t bytes[], const RegisterField *field){
+    return wordToFloat((uint32_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3])*field->scale;
+}
+
+float decodeFloat32Le(const uint8_t bytes[], const RegisterField *field){
+    return wordToFloat((uint32_t)bytes[3] << 24 | bytes[2] << 16 | bytes[1] << 8 | bytes[0])*field->scale;
+}
+
+float decodeFloat32Ws(const uint8_t bytes[], const RegisterField *field){
+    return wordToFloat((uint32_t)bytes[2] << 24 | bytes[3] << 16 | bytes[0] << 8 | bytes[1])*field->scale;
+}
+
+float decodeU16(const uint8_t bytes[], const RegisterField *field){
+    return (uint16_t)(bytes[0] << 8 | bytes[1])*field->scale;
+}
+
+float decodeS16(const uint8_t bytes[], const RegisterField *field){
+    return (int16_t)(bytes[0] << 8 | bytes[1])*field->scale;
+}
+
+float decodeU32(const uint8_t bytes[], const RegisterField *field){
+    return ((uint32_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3])*field->scale;
+}
+
+float decodeU32Ws(const uint8_t bytes[], const RegisterField *field){
+    return ((uint32_t)bytes[2] << 24 | bytes[3] << 16 | bytes[0] << 8 | bytes[1])*field->scale;
+}
+
+float decodeS32(const uint8_t bytes[], const RegisterField *field){
+    return (int32_t)((uint32_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3])*field->scale;
+}
+
+float decodeBits(const uint8_t bytes[], const RegisterField *field){
+    uint32_t word = field->registers == 1 ? (uint32_t)(bytes[0] << 8 | bytes[1]) : (uint32_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+
+    return (uint32_t)((word >> field->shift) & (uint32_t)((1ULL << field->bits) - 1))*field->scale;
+}
+
+
+
+/* WORD TO FLOAT: Float with the bits of a word.
+*/
+float wordToFloat(uint32_t word){
+    float f;
+
+    memcpy(&f, &word, sizeof(f));
+    return f;
+}
@@ -0,0 +1,66 @@
+#ifndef registerMap
+#define registerMap
+
+// Include the modbus (register fields), scheduler and aggregator headers
+#include "modbus.h"
+#include "scheduler.h"
+#include "aggregator.h"
+
+// C headers
+#include <stdatomic.h>
+
+// Defines
+#define MaxMapDevices       8       // Device types in a register map
+#define MaxMapGroups        8       // Register groups of a device
+#define MaxMapFields        64      // Fields of a device (all its groups)
+#define MapNameSize         16      // Name of a device or a group
+#define MapTopicSize        38      // Topic of a field, placeholders expanded (fits in a journal record)
+#define MapLineSize         256     // Longest line of a map file
+
+// Structs
+typedef struct{
+    char            name[MapNameSize];
+    FunctionCode    function_code;  // R_3X ("3x") or RW_4X ("4x")
+    int             period_ms;      // Poll period ("scan": ScanRatePeriod)
+    int             priority;       // 0 is the most important
+    int             aggregate;      // Sampled at bus speed and published as window statistics with "-G"
+    int             first;          // First field of the group in the device
+    int             n;              // Number of fields
+}MapGroup;
+
+typedef struct{
+    char            name[MapNameSize];
+    MapGroup        groups[MaxMapGroups];
+    int             n_groups;
+    StartAddress_3X addresses[MaxMapFields];            // First register of each field (the fields of a group are contiguous)
+    RegisterField   fields[MaxMapFields];               // How each field is decoded
+    StartAddress_3X keys[MaxMapFields];                 // Address of its samples (its register, unless a field before shares it)
+    char            topics[MaxMapFields][MapTopicSize]; // Topic of each field (without the meter prefix)
+    char            *topic_list[MaxMapFields];          // Pointers to the topics
+    int             n_fields;
+}MapDevice;
+
+typedef struct{
+    const MapDevice *device;        // Device of the meter
+    const MapGroup  *group;         // Group polled by the entry
+    int             block;          // Aggregator block (-1: not aggregated)
+}MapEntry;
+
+typedef struct{
+    MapDevice       devices[MaxMapDevices];
+    int             n_devices;
+    uint8_t         meters[256];                        // Device of each slave + 1 (0: the first device)
+    Schedule        schedule;                           // Groups of the meters of one bus, requests built (see registerMapCompile)
+    MapEntry        entries[MaxScheduleEntries];        // Context of each entry of the schedule
+}RegisterMap;
+
+// Functions
+void        registerMapSetPath(const char *path);
+void        registerMapReload();
+int         registerMapGeneration();
+RegisterMap *registerMapCreate(const uint8_t slave_ids[], int n_slaves, int aggregate_ms);
+void        registerMapFree(RegisterMap *map);
+int         registerMapLoad(RegisterMap *map, const char *path);
+int         registerMapCompile(RegisterMap *map, const uint8_t slave_ids[], int n_slaves, int aggregate_ms);
+
+#endif
@@ -0,0 +1,149 @@
+/***********************************
+*          rtuParser.c
+*
+* -Modbus RTU stream parser:
+*  accepts bytes as they arrive and
+*  returns complete validated frames,
+*  resynchronising after line noise.
+*
+* used with rtuParser.h
+*
+***********************************/
+
+// Include header file (through the modbus header: errorCheck, function codes)
+#include "modbus.h"
+
+// Define constants
+#define ParserMask (ParserBufferSize - 1)   // Wraps positions in the ring buffer
+
+// Internal functions declaration
+int         frameLength(RtuParser *parser);
+
+
+
+/* PARSER INITIALIZATION: Empties the buffer and sets the reply it expects.
+    +Slave ID::         Slave that was queried (0 accepts any)
+    +Function Code::    Function code that was sent (0 accepts any read)
+*/
+void rtuParserInit(RtuParser *parser, uint8_t slave_id, uint8_t function_code){
+    parser->head            = 0;
+    parser->tail            = 0;
+    parser->slave_id        = slave_id;
+    parser->function_code   = function_code;
+    parser->crc_errors      = 0;
+    parser->discarded       = 0;
+}
+
+
+
+/* FEED BYTES: Stores the bytes recieved from the line (any size, partial frames are fine).
+    If the buffer is full the oldest bytes are dropped.
+    returns number of bytes dropped
+*/
+int rtuParserFeed(RtuParser *parser, const uint8_t bytes[], int n){
+    int dropped = 0;
+
+    for(int i = 0; i < n; i ++){
+        if(parser->head - parser->tail == ParserBufferSize){
+            parser->tail ++;
+            dropped ++;
+        }
+        parser->buffer[parser->head & ParserMask] = bytes[i];
+        parser->head ++;
+    }
+    parser->discarded += dropped;
+    return dropped;
+}
+
+
+
+/* PENDING BYTES: Number of bytes recieved and not returned in a frame yet.
+*/
+int rtuParserPending(RtuParser *parser){
+    return parser->head - parser->tail;
+}
+
+
+
+/* SKIP BYTE: Drops the first pending byte. Used to give up on a partial frame when the line
+   goes silent (3.5 characters), so the search restarts on the next byte.
+*/
+void rtuParserSkip(RtuParser *parser){
+    if(parser->head == parser->tail) return;
+    parser->tail ++;
+    parser->discarded ++;
+}
+
+
+
+/* FRAME LENGTH: Length of the frame that starts at the first pending byte, from its header.
+    Frame formats:
+        [Slave ID, Fn Code, Byte Count, Data..., Error Check(low), Error Check(high)]    (FC03, FC04)
+        [Slave ID, 0x80|Fn Code, Exception Code, Error Check(low), Error Check(high)]   (exception)
+    returns length of the frame
+            0 if more bytes are needed to know it
+            -1 if the first byte can't start a frame
+*/
+int frameLength(RtuParser *parser){
+    int         pending     = parser->head - parser->tail;
+    uint8_t     slave_id, function_code, byte_count;
+
+    if(pending < 2) return 0;
+    slave_id        = parser->buffer[parser->tail & ParserMask];
+    function_code   = parser->buffer[(parser->tail + 1) & ParserMask];
+
+    // Check the slave we're talking to
+    if(parser->slave_id != 0 && slave_id != parser->slave_id) return -1;
+    if(slave_id == 0 || slave_id > 247) return -1;
+
+    // Check the function code (or its exception)
+    if(parser->function_code != 0){
+        if((function_code & 0x7F) != parser->function_code) return -1;
+    }else if((function_code & 0x7F) != R_3X && (function_code & 0x7F) != RW_4X) return -1;
+    if(function_code & 0x80) return 5;
+
+    // Writes echo the start address and the register count
+    if(function_code == W_4X) return WriteResponseSize;
+
+    // Reads carry an even byte count up to 125 registers
+    if(pending < 3) return 0;
+    byte_count = parser->buffer[(parser->tail + 2) & ParserMask];
+    if(byte_count == 0 || byte_count > 250 || (byte_count & 0x1)) return -1;
+    return 5 + byte_count;
+}
+
+
+
+/* NEXT FRAME: Looks for a complete frame in the pending bytes.
+    Bytes that can't start a frame, or frames with a wrong error check, are dropped one byte
+    at a time so the parser realigns with the next valid frame.
+    returns 1 if a frame was copied to frame
+            0 if more bytes are needed
+*/
+int rtuParserNext(RtuParser *parser, RtuFrame *frame){
+    int         length;
+    uint16_t    errorWord;
+
+    while(1){
+        length = frameLength(parser);
+        if(length == 0) return 0;
+        if(length < 0){
+            rtuParserSkip(parser);
+            continue;
+        }
+        if((int)(parser->head - parser->tail) < length) return 0;
+
+        // Copy the candidate frame and check its integrity
+        for(int i = 0; i < length; i ++) frame->bytes[i] = parser->buffer[(parser->tail + i) & ParserMask];
+        errorWord = errorCheck(frame->bytes, length - 2);
+        if((GET_LOW(errorWord) != frame->bytes[length-2]) || (GET_HIGH(errorWord) != frame->bytes[length-1])){
+            parser->crc_errors ++;
+            rtuParserSkip(parser);
+            continue;
+        }
+
+        frame->length = length;
+        parser->tail += length;
+        return 1;
+    }
+}
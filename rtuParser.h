@@ -0,0 +1,34 @@
+#ifndef rtuParser
+#define rtuParser
+
+// C headers
+#include <stdint.h>
+
+// Defines
+#define ParserBufferSize    512     // Ring buffer size (power of 2, holds 2 max size frames)
+#define MaxFrameSize        256     // Max size of a RTU frame
+
+// Structs
+typedef struct{
+    uint8_t     bytes[MaxFrameSize];    // Complete frame [Slave ID, Fn Code, ..., Error Check(low), Error Check(high)]
+    int         length;                 // Number of bytes in the frame (error check included)
+}RtuFrame;
+
+typedef struct{
+    uint8_t     buffer[ParserBufferSize];   // Recieved bytes not parsed yet
+    uint32_t    head;                       // Position where the next byte is stored
+    uint32_t    tail;                       // Position of the first byte not parsed
+    uint8_t     slave_id;                   // Slave expected (0 accepts any)
+    uint8_t     function_code;              // Function code expected (0 accepts R_3X and RW_4X)
+    int         crc_errors;                 // Frames aligned correctly but with wrong error check
+    int         discarded;                  // Bytes dropped while resynchronising
+}RtuParser;
+
+// Functions
+void        rtuParserInit(RtuParser *parser, uint8_t slave_id, uint8_t function_code);
+int         rtuParserFeed(RtuParser *parser, const uint8_t bytes[], int n);
+int         rtuParserNext(RtuParser *parser, RtuFrame *frame);
+void        rtuParserSkip(RtuParser *parser);
+int         rtuParserPending(RtuParser *parser);
+
+#endif
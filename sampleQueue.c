@@ -0,0 +1,93 @@
+/***********************************
+*          sampleQueue.c
+*
+* -Sample queue: bounded lock-free
+*  ring between one acquisition
+*  thread (producer) and the
+*  publisher thread (consumer).
+*
+* used with sampleQueue.h
+*
+***********************************/
+
+// Include header file
+#include "sampleQueue.h"
+
+// Define constants
+#define QueueMask (SampleQueueSize - 1)     // Wraps positions in the ring
+#define BlockWait 1000000                   // Time the producer waits for space (nano seconds)
+
+
+
+/* QUEUE INITIALIZATION: Empties the queue and sets what happens when it's full.
+*/
+void sampleQueueInit(SampleQueue *queue, OverflowPolicy policy){
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->drops, 0);
+    atomic_init(&queue->max_depth, 0);
+    queue->policy = policy;
+}
+
+
+
+/* PUSH SAMPLE: Adds a sample (producer thread only).
+    If the queue is full the oldest sample is dropped (DropOldest) or the call waits for space (BlockProducer).
+    To drop, the producer moves the tail itself with a compare and swap, so the consumer can tell
+    its copy of that slot is stale.
+*/
+void sampleQueuePush(SampleQueue *queue, const Sample *sample){
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    uint32_t tail;
+    uint32_t depth;
+
+    while(1){
+        tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        if(head - tail < SampleQueueSize) break;
+        if(queue->policy == BlockProducer){
+            struct timespec wait = {0, BlockWait};
+            nanosleep(&wait, NULL);
+            continue;
+        }
+        if(atomic_compare_exchange_weak_explicit(&queue->tail, &tail, tail + 1, memory_order_acq_rel, memory_order_acquire)){
+            atomic_fetch_add_explicit(&queue->drops, 1, memory_order_relaxed);
+            break;
+        }
+    }
+
+    queue->slots[head & QueueMask] = *sample;
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+    depth = head + 1 - atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if(depth > atomic_load_explicit(&queue->max_depth, memory_order_relaxed)){
+        atomic_store_explicit(&queue->max_depth, depth, memory_order_relaxed);
+    }
+}
+
+
+
+/* POP SAMPLE: Takes the oldest sample (consumer thread only).
+    The slot is copied before the tail is moved. If the producer dropped that slot meanwhile,
+    the compare and swap fails and the copy is discarded.
+    returns 1 if a sample was copied
+            0 if the queue is empty
+*/
+int sampleQueuePop(SampleQueue *queue, Sample *sample){
+    uint32_t tail, head;
+
+    while(1){
+        tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if(tail == head) return 0;
+        *sample = queue->slots[tail & QueueMask];
+        if(atomic_compare_exchange_weak_explicit(&queue->tail, &tail, tail + 1, memory_order_acq_rel, memory_order_acquire)) return 1;
+    }
+}
+
+
+
+/* QUEUE DEPTH: Number of samples waiting to be published.
+*/
+uint32_t sampleQueueDepth(SampleQueue *queue){
+    return atomic_load_explicit(&queue->head, memory_order_acquire) - atomic_load_explicit(&queue->tail, memory_order_acquire);
+}
@@ -0,0 +1,52 @@
+#ifndef sampleQueue
+#define sampleQueue
+
+// C headers
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Defines
+#define SampleQueueSize     1024    // Samples held by a queue (power of 2)
+#define SampleTopicSize     38      // Topic of a parameter (fits in a journal record)
+
+// Enums
+typedef enum{
+    SampleOk        = 0,    // Value read from the meter
+    SampleError     = 1     // Register couldn't be read (value is the error signal)
+}SampleStatus;
+
+typedef enum{
+    DropOldest,             // Full queue: the oldest sample is dropped
+    BlockProducer           // Full queue: the acquisition thread waits
+}OverflowPolicy;
+
+// Structs
+typedef struct{
+    struct timespec     timestamp;      // Time the value was read (CLOCK_REALTIME)
+    uint8_t             slave_id;       // Meter
+    uint16_t            address;        // Register (StartAddress_3X)
+    float               value;          // Value read
+    SampleStatus        status;
+    char                topic[SampleTopicSize]; // Topic of the parameter (without the meter prefix), a copy: the
+                                                // register map it comes from can be reloaded while it waits
+    uint8_t             statistic;      // Statistic of an aggregated window (AggregateStat, 0 for values read)
+    uint8_t             last;           // Last sample of a scan (end of a batch)
+}Sample;
+
+typedef struct{
+    Sample              slots[SampleQueueSize];
+    _Atomic uint32_t    head;           // Next slot written (producer)
+    _Atomic uint32_t    tail;           // Next slot read (consumer, producer when dropping)
+    OverflowPolicy      policy;
+    _Atomic uint32_t    drops;          // Samples dropped because the queue was full
+    _Atomic uint32_t    max_depth;      // Highest number of samples waiting
+}SampleQueue;
+
+// Functions
+void        sampleQueueInit(SampleQueue *queue, OverflowPolicy policy);
+void        sampleQueuePush(SampleQueue *queue, const Sample *sample);
+int         sampleQueuePop(SampleQueue *queue, Sample *sample);
+uint32_t    sampleQueueDepth(SampleQueue *queue);
+
+#endif
@@ -0,0 +1,212 @@
+/***********************************
+*          scheduler.c
+*
+* -Bus scheduler: decides which
+*  (slave, register group) is read
+*  next on the shared bus, earliest
+*  deadline first.
+*
+* used with scheduler.h
+*
+***********************************/
+
+// Include header file
+#include "scheduler.h"
+
+
+
+/* SCHEDULER INITIALIZATION: Empties the schedule table.
+*/
+void schedulerInit(Schedule *schedule){
+    schedule->n_entries = 0;
+    schedule->misses    = 0;
+}
+
+
+
+/* ADD ENTRY: Adds a group of parameters of one slave to be polled every period.
+    +Slave ID::         [1...247]
+    +Function Code::    R_3X or RW_4X, the requests are built for it
+    +Addresses::        Parameters read together with a block query
+    +Fields::           How each parameter is decoded (NULL: SDM230 floats), the table must outlive the entry
+    +Period::           Poll period in mili seconds (ScanRatePeriod follows the scan rate)
+    +Priority::         0 is the most important
+    +Context::          Caller data returned with the entry
+
+    returns index of the entry
+            or -1 if the table is full or the parameters need too many windows
+*/
+int schedulerAdd(Schedule *schedule, uint8_t slave_id, FunctionCode funtion_code, const StartAddress_3X addresses[],
+                 const RegisterField fields[], int n, int period_ms, int priority, void *context){
+    ScheduleEntry *entry;
+
+    if(n > MaxEntryParameters){
+        printf("ERROR: Too many parameters (%i) for slave %i, max %i.\n", n, slave_id, MaxEntryParameters);
+        syslog(LOG_ERR, "ERROR from schedulerAdd: Too many parameters (%i) for slave %i.", n, slave_id);
+        return -1;
+    }
+    if(schedule->n_entries == MaxScheduleEntries){
+        printf("ERROR: Schedule table full, slave %i not added.\n", slave_id);
+        syslog(LOG_ERR, "ERROR from schedulerAdd: Schedule table full, slave %i not added.", slave_id);
+        return -1;
+    }
+    entry = &schedule->entries[schedule->n_entries];
+    // Plan the block query and build its requests once, every poll sends them as they are
+    entry->n_windows    = modbusPlanWindows(addresses, fields, n, funtion_code == R_3X ? MaxWindowGap : 0, entry->windows, MaxWindows);
+    if(entry->n_windows < 0){
+        printf("ERROR: Too many register windows for slave %i.\n", slave_id);
+        syslog(LOG_ERR, "ERROR from schedulerAdd: Too many register windows for slave %i.", slave_id);
+        return -1;
+    }
+    for(int w = 0; w < entry->n_windows; w ++) modbusBuildRequest(&entry->windows[w], slave_id, funtion_code);
+    entry->slave_id     = slave_id;
+    entry->addresses    = addresses;
+    entry->fields       = fields;
+    entry->n            = n;
+    entry->period_ms    = period_ms;
+    entry->priority     = priority;
+    entry->context      = context;
+    entry->runs         = 0;
+    entry->misses       = 0;
+    entry->late_misses  = 0;
+    entry->lateness_us  = 0;
+    // Everything is due on start
+    clock_gettime(CLOCK_MONOTONIC, &entry->deadline);
+    return schedule->n_entries ++;
+}
+
+
+
+/* NEXT ENTRY: Chooses the entry to poll next.
+    If some entries are already due, the most important one goes first (earliest deadline breaks ties),
+    otherwise the entry with the earliest deadline.
+    returns the entry (NULL if the table is empty)
+*/
+ScheduleEntry *schedulerNext(Schedule *schedule){
+    struct timespec now;
+    ScheduleEntry   *next   = NULL;
+    int             next_due = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for(int i = 0; i < schedule->n_entries; i ++){
+        ScheduleEntry *entry = &schedule->entries[i];
+        int due = timespecDiffNs(&entry->deadline, &now) >= 0;
+
+        if(next == NULL){
+            next = entry;
+            next_due = due;
+            continue;
+        }
+        int64_t earlier = timespecDiffNs(&entry->deadline, &next->deadline);    // >0 if entry is due before next
+        if(due && next_due){
+            if(entry->priority < next->priority || (entry->priority == next->priority && earlier > 0)){
+                next = entry;
+            }
+        }else if(due || earlier > 0){
+            next = entry;
+            next_due = due;
+        }
+    }
+    return next;
+}
+
+
+
+/* WAIT FOR ENTRY: Sleeps until the deadline of the entry (returns at once if it's late).
+    The deadline is absolute, so the time spent before the call doesn't move the cadence.
+*/
+void schedulerWait(ScheduleEntry *entry){
+    int error;
+
+    do{
+        error = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &entry->deadline, NULL);
+    }while(error == EINTR);
+    if(error != 0) printf("ERROR %i from clock_nanosleep: %s\n", error, strerror(error));
+}
+
+
+
+/* ENTRY START: Called when the poll of an entry starts, measures the jitter of the cadence.
+    Deadlines are whole periods apart, so the change of lateness between two polls is how far
+    their spacing moved from the nominal period (skipped periods don't count as jitter).
+*/
+void schedulerStart(ScheduleEntry *entry){
+    struct timespec now;
+    long            lateness_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    lateness_us = timespecDiffUs(&entry->deadline, &now);
+    if(entry->runs > 0) metricsJitter(entry->slave_id, labs(lateness_us - entry->lateness_us));
+    entry->lateness_us = lateness_us;
+}
+
+
+
+/* ENTRY DONE: Sets the next deadline of an entry after it has been polled.
+    The deadline moves one period from the previous deadline (not from now) so the cadence doesn't drift.
+    If the bus was so busy that the poll ended after the next deadline (deadline + period, compared to the
+    nano second), the missed periods are skipped and counted (the first miss and the recovery are logged).
+    Meters found down (see health.h) wait for their next probe.
+    +Scan Rate::        Period used by entries with ScanRatePeriod (mili seconds)
+*/
+void schedulerDone(Schedule *schedule, ScheduleEntry *entry, int scan_rate_ms){
+    struct timespec now;
+    int             period_ms   = (entry->period_ms == ScanRatePeriod) ? scan_rate_ms : entry->period_ms;
+    int64_t         late_ns;        // Time the poll ended after the next deadline
+    long            missed;
+    long            hold_ms;        // Time until the next probe of a meter found down
+
+    if(period_ms <= 0) period_ms = 1;
+    entry->runs ++;
+    timespecAddMs(&entry->deadline, period_ms);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    late_ns = timespecDiffNs(&entry->deadline, &now);
+    if(late_ns > 0){
+        missed = late_ns/((int64_t)period_ms*1000000) + 1;
+        entry->misses       += missed;
+        schedule->misses    += missed;
+        timespecAddMs(&entry->deadline, missed*period_ms);
+        metricsCount(entry->slave_id, CounterMisses, missed);
+        // Only the first miss is logged, the next ones are counted until the entry is on time again
+        if(entry->late_misses == 0){
+            logWarning("WARNING: Slave %i [%#06x] missed %li deadline(s).\n", entry->slave_id, entry->addresses[0], missed);
+            syslog(LOG_WARNING, "WARNING from schedulerDone: Slave %i [%#06x] missed %li deadline(s).", entry->slave_id, entry->addresses[0], missed);
+        }
+        entry->late_misses  += missed;
+    }else if(entry->late_misses > 0){
+        logWarning("WARNING: Slave %i [%#06x] on time again, %li deadline(s) missed.\n", entry->slave_id, entry->addresses[0], entry->late_misses);
+        syslog(LOG_WARNING, "WARNING from schedulerDone: Slave %i [%#06x] on time again, %li deadline(s) missed.", entry->slave_id, entry->addresses[0], entry->late_misses);
+        entry->late_misses  = 0;
+    }
+
+    // Meters found down are only polled when their next probe is due (whole periods, the cadence is kept),
+    // the bus time goes to the meters that answer
+    hold_ms = healthHoldMs(entry->slave_id);
+    if(hold_ms > 0) timespecAddMs(&entry->deadline, (hold_ms + period_ms - 1)/period_ms*period_ms);
+}
+
+
+
+/* TIME HELPERS: Add mili seconds to a timespec, and difference to - from in mili, micro or nano seconds.
+*/
+void timespecAddMs(struct timespec *t, long ms){
+    t->tv_sec   += ms/1000;
+    t->tv_nsec  += (ms%1000)*1000000;
+    if(t->tv_nsec >= 1000000000){
+        t->tv_sec   ++;
+        t->tv_nsec  -= 1000000000;
+    }
+}
+
+long timespecDiffMs(const struct timespec *from, const struct timespec *to){
+    return (to->tv_sec - from->tv_sec)*1000 + (to->tv_nsec - from->tv_nsec)/1000000;
+}
+
+long timespecDiffUs(const struct timespec *from, const struct timespec *to){
+    return (to->tv_sec - from->tv_sec)*1000000 + (to->tv_nsec - from->tv_nsec)/1000;
+}
+
+int64_t timespecDiffNs(const struct timespec *from, const struct timespec *to){
+    return (int64_t)(to->tv_sec - from->tv_sec)*1000000000 + (to->tv_nsec - from->tv_nsec);
+}
@@ -0,0 +1,49 @@
+#ifndef scheduler
+#define scheduler
+
+// Include the modbus header (register addresses)
+#include "modbus.h"
+
+// Defines
+#define MaxScheduleEntries  128     // Max (slave, register group) pairs polled
+#define MaxEntryParameters  32      // Max parameters read by one entry
+#define ScanRatePeriod      0       // Period of entries that follow the scan rate set on "adqTime/"
+
+// Structs
+typedef struct{
+    uint8_t                 slave_id;       // Slave polled
+    const StartAddress_3X   *addresses;     // Parameters read together (block query)
+    const RegisterField     *fields;        // How each parameter is decoded (NULL: SDM230 floats)
+    int                     n;              // Number of parameters
+    RegisterWindow          windows[MaxWindows];    // Windows of the block query, requests built once
+    int                     n_windows;
+    int                     period_ms;      // Poll period in mili seconds (ScanRatePeriod follows the scan rate)
+    int                     priority;       // 0 is the most important, used when several entries are due
+    void                    *context;       // Caller data (topics, ...)
+    struct timespec         deadline;       // Next time the entry is due (CLOCK_MONOTONIC)
+    long                    runs;           // Times the entry was polled
+    long                    misses;         // Periods skipped because the bus was busy
+    long                    late_misses;    // Periods skipped since the entry fell behind (0: on time)
+    long                    lateness_us;    // Time the last poll started after its deadline (micro seconds)
+}ScheduleEntry;
+
+typedef struct{
+    ScheduleEntry           entries[MaxScheduleEntries];
+    int                     n_entries;
+    long                    misses;         // Periods skipped by all entries
+}Schedule;
+
+// Functions
+void            schedulerInit(Schedule *schedule);
+int             schedulerAdd(Schedule *schedule, uint8_t slave_id, FunctionCode funtion_code, const StartAddress_3X addresses[],
+                             const RegisterField fields[], int n, int period_ms, int priority, void *context);
+ScheduleEntry   *schedulerNext(Schedule *schedule);
+void            schedulerWait(ScheduleEntry *entry);
+void            schedulerStart(ScheduleEntry *entry);
+void            schedulerDone(Schedule *schedule, ScheduleEntry *entry, int scan_rate_ms);
+void            timespecAddMs(struct timespec *t, long ms);
+long            timespecDiffMs(const struct timespec *from, const struct timespec *to);
+long            timespecDiffUs(const struct timespec *from, const struct timespec *to);
+int64_t         timespecDiffNs(const struct timespec *from, const struct timespec *to);
+
+#endif
@@ -0,0 +1,219 @@
+/***********************************
+*          serialLine.c
+*
+* -Line settings of a RS-485 bus:
+*  finds the baud rate and parity
+*  the meters answer at, and raises
+*  their rate (NET_BD) when asked,
+*  going back to the old rate if a
+*  meter stops answering.
+*
+* used with serialLine.h
+*
+***********************************/
+
+// Include header file
+#include "serialLine.h"
+
+// Define constants
+#define LineRates   6       // Rates in lineRates
+#define LineParities 4      // Settings in lineParities
+
+// Internal functions
+int         lineCount(ModbusPort *port, const uint8_t slave_ids[], int n, int *parity_code);
+int         lineWrite(ModbusPort *port, uint8_t slave_id, StartAddress_4X address, float value);
+int         lineRestore(ModbusPort *port, const uint8_t slave_ids[], const int written[], int n, int old_baud, int new_baud);
+int         baudCode(int baud_rate);
+
+// Variables
+static const int        baudRates[]     = {2400, 4800, 9600, 19200, 38400, 1200};   // By NET_BD code
+static const int        lineRates[]     = {38400, 19200, 9600, 4800, 2400, 1200};   // Fastest first
+static const LineParity lineParities[]  = {ParityEven, ParityNone, ParityOdd, ParityNoneTwo};
+
+
+
+/* LINE PROBE: Finds the baud rate and parity of the meters on a bus and sets the port to them.
+    The current settings are tried first, then every rate (fastest first) with every parity.
+    Every meter on a bus must use the same settings, the ones most meters answer at are kept.
+    The parity is then read from NET_PARITY (one or two stop bits can't be told apart on the line).
+    +Slave IDs::        Meters on the bus
+    returns number of meters answering with the settings kept (0 keeps the old settings)
+*/
+int lineProbe(ModbusPort *port, const uint8_t slave_ids[], int n){
+    int         timeout     = port->response_timeout;       // Restored after the probe
+    int         old_baud    = port->baud_rate;
+    LineParity  old_parity  = port->parity;
+    int         best        = 0;                            // Meters answering with the best settings
+    int         best_baud   = old_baud;
+    LineParity  best_parity = old_parity;
+    int         parity_code = -1;                           // NET_PARITY of the first meter answering
+
+    if(port->transport == TransportTcp || n == 0) return 0;
+    logInfo("--Probing the line settings of %s--\n", port->path);
+    port->response_timeout = ProbeTimeout;
+
+    for(int c = -1; c < LineRates*LineParities && best < n; c ++){
+        int         baud    = c < 0 ? old_baud : lineRates[c/LineParities];
+        LineParity  parity  = c < 0 ? old_parity : lineParities[c%LineParities];
+        int         code    = -1;
+
+        if(c >= 0 && baud == old_baud && parity == old_parity) continue;
+        if(modbusSetLine(port, baud, parity) < 0) continue;
+        int answered = lineCount(port, slave_ids, n, &code);
+        logDebug("  %i bauds, parity code %i: %i of %i meters\n", baud, parity, answered, n);
+        if(answered > best){
+            best        = answered;
+            best_baud   = baud;
+            best_parity = parity;
+            parity_code = code;
+        }
+    }
+
+    if(best == 0){
+        modbusSetLine(port, old_baud, old_parity);
+        logWarning(" WARNING: No meter answers on %s, keeping %i bauds.\n", port->path, old_baud);
+        syslog(LOG_WARNING, "WARNING from lineProbe: No meter answers on %s, keeping %i bauds.", port->path, old_baud);
+        port->response_timeout = timeout;
+        return 0;
+    }
+    if(parity_code >= ParityNone && parity_code <= ParityNoneTwo) best_parity = parity_code;
+    modbusSetLine(port, best_baud, best_parity);
+    port->response_timeout = timeout;
+
+    logInfo("--%s: %i of %i meters at %i bauds, parity code %i--\n", port->path, best, n, best_baud, best_parity);
+    syslog(LOG_INFO, "%s: %i of %i meters at %i bauds, parity code %i.", port->path, best, n, best_baud, best_parity);
+    if(best < n){
+        logWarning(" WARNING: %i meters on %s don't answer with these settings.\n", n - best, port->path);
+        syslog(LOG_WARNING, "WARNING from lineProbe: %i meters on %s don't answer at %i bauds.", n - best, port->path, best_baud);
+    }
+    return best;
+}
+
+
+
+/* LINE RAISE: Moves every meter of a bus to the fastest rate they all accept, up to a limit.
+    The new rate is written to NET_BD of every meter at the old rate, then the port follows and every
+    meter must answer at the new rate. If a meter refuses the rate, the rates below are tried.
+    If a meter stops answering, the old rate is written back to every meter (see lineRestore).
+    Only used when every meter answers with the current settings (see lineProbe).
+    +Max Baud::         Fastest rate written (a rate the meters support, MaxLineBaud at most)
+    returns baud rate of the bus
+*/
+int lineRaise(ModbusPort *port, const uint8_t slave_ids[], int n, int max_baud){
+    int         old_baud    = port->baud_rate;
+    int         written[n];                     // Meters that accepted the new rate
+    int         code        = -1;
+
+    if(port->transport == TransportTcp || n == 0 || baudCode(old_baud) < 0) return old_baud;
+    if(lineCount(port, slave_ids, n, &code) < n){
+        logWarning(" WARNING: Not every meter answers on %s, the rate is kept at %i bauds.\n", port->path, old_baud);
+        return old_baud;
+    }
+
+    for(int r = 0; r < LineRates && lineRates[r] > old_baud; r ++){
+        int rate    = lineRates[r];
+        int refused = -1;                       // First meter that didn't accept the rate
+
+        if(rate > max_baud || rate > MaxLineBaud) continue;
+        logInfo("--Raising %s to %i bauds--\n", port->path, rate);
+
+        memset(written, 0, sizeof(written));
+        for(int i = 0; i < n && refused < 0; i ++){
+            int result = lineWrite(port, slave_ids[i], NET_BD, baudCode(rate));
+            written[i] = result <= 0;           // Without a response the meter may have changed
+            if(result != 0){
+                refused = i;
+                if(result > 0) logWarning(" WARNING: Slave %i refuses %i bauds (exception %#04x).\n", slave_ids[i], rate, result);
+                else logWarning(" WARNING: Slave %i doesn't answer the rate change.\n", slave_ids[i]);
+            }
+        }
+        if(refused >= 0){
+            if(lineRestore(port, slave_ids, written, n, old_baud, rate) > 0) return port->baud_rate;
+            continue;
+        }
+
+        // Every meter accepted, the port follows
+        usleep(RateSettle*1000);
+        if(modbusSetLine(port, rate, port->parity) == 0 && lineCount(port, slave_ids, n, &code) == n){
+            logInfo("--%s raised to %i bauds--\n", port->path, rate);
+            syslog(LOG_INFO, "%s raised from %i to %i bauds.", port->path, old_baud, rate);
+            return rate;
+        }
+
+        // Some meter didn't follow (the change may need a restart of the meter): every meter goes back
+        logWarning(" WARNING: Not every meter answers at %i bauds, going back to %i bauds.\n", rate, old_baud);
+        syslog(LOG_WARNING, "WARNING from lineRaise: Not every meter on %s answers at %i bauds, back to %i bauds.", port->path, rate, old_baud);
+        lineRestore(port, slave_ids, written, n, old_baud, rate);
+        return port->baud_rate;
+    }
+    logInfo("--%s kept at %i bauds--\n", port->path, old_baud);
+    return old_baud;
+}
+
+
+
+/* LINE RESTORE: Writes the old rate back to the meters that accepted a new one.
+    Meters that already changed are written at the new rate, then the port goes back to the old rate
+    and the old rate is written again, which also cancels changes the meters haven't applied yet.
+    returns number of meters lost (not answering at the old rate)
+*/
+int lineRestore(ModbusPort *port, const uint8_t slave_ids[], const int written[], int n, int old_baud, int new_baud){
+    int lost = 0;
+
+    if(modbusSetLine(port, new_baud, port->parity) == 0){
+        for(int i = 0; i < n; i ++) if(written[i]) modbusWriteFloat(port, slave_ids[i], NET_BD, baudCode(old_baud));
+        usleep(RateSettle*1000);
+    }
+    if(modbusSetLine(port, old_baud, port->parity) < 0) return n;
+
+    for(int i = 0; i < n; i ++){
+        if(!written[i] || lineWrite(port, slave_ids[i], NET_BD, baudCode(old_baud)) == 0) continue;
+        lost ++;
+        printf("ERROR: Slave %i doesn't answer at %i bauds after the rate change.\n", slave_ids[i], old_baud);
+        syslog(LOG_ERR, "ERROR from lineRestore: Slave %i doesn't answer at %i bauds after the rate change (it may use %i bauds).",
+               slave_ids[i], old_baud, new_baud);
+    }
+    return lost;
+}
+
+
+
+/* LINE COUNT: Number of meters answering with the current settings.
+    If none of the first ProbeMisses meters answers, the settings are given up.
+    +Parity Code::      NET_PARITY of the first meter answering (unchanged if none answers)
+*/
+int lineCount(ModbusPort *port, const uint8_t slave_ids[], int n, int *parity_code){
+    int     answered = 0;
+    float   value;
+
+    for(int i = 0; i < n; i ++){
+        if(answered == 0 && i == ProbeMisses) break;
+        if(modbusReadSetting(port, slave_ids[i], NET_PARITY, &value) < 0) continue;
+        if(answered ++ == 0) *parity_code = (int)value;
+    }
+    return answered;
+}
+
+
+
+/* LINE WRITE: Writes a setting, sending it again if there was no valid response.
+    returns 0 if written, the exception code or -1 (see modbusWriteRegisters)
+*/
+int lineWrite(ModbusPort *port, uint8_t slave_id, StartAddress_4X address, float value){
+    int result = -1;
+
+    for(int attempt = 0; attempt < AttemptTimeout && result < 0; attempt ++){
+        result = modbusWriteFloat(port, slave_id, address, value);
+    }
+    return result;
+}
+
+
+
+/* BAUD CODE: NET_BD code of a baud rate.
+    returns -1 if the meters don't support the rate
+*/
+int baudCode(int baud_rate){
+    for(int code = 0; code < LineRates; code ++) if(baudRates[code] == baud_rate) return code;
+    return -1;
+}
@@ -0,0 +1,17 @@
+#ifndef serialLine
+#define serialLine
+
+// Modbus ports and register writes
+#include "modbus.h"
+
+// Defines
+#define ProbeTimeout        100     // Response timeout while looking for the line settings (mili seconds)
+#define ProbeMisses         3       // Meters tried on a setting before giving it up if none answers
+#define RateSettle          200     // Wait for the meters to change their rate (mili seconds)
+#define MaxLineBaud         38400   // Fastest rate written to NET_BD (SDM230: 9600)
+
+// Functions
+int         lineProbe(ModbusPort *port, const uint8_t slave_ids[], int n);
+int         lineRaise(ModbusPort *port, const uint8_t slave_ids[], int n, int max_baud);
+
+#endif
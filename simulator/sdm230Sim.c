@@ -0,0 +1,523 @@
+/***********************************
+*          sdm230Sim.c
+*
+* -SDM230 meter simulator: answers
+*  the RTU requests of the daemon on
+*  a pseudo-terminal, so the polling
+*  engine can be run and measured
+*  without hardware.
+*
+* build: make -C simulator sdm230Sim, or gcc simulator/sdm230Sim.c modbus.c rtuParser.c modbusTcp.c metrics.c mqttClient.c logger.c health.c
+*        -o sdm230Sim -lm -pthread -lmosquitto
+*
+***********************************/
+
+// Pseudo-terminals (posix_openpt(), ptsname(), cfmakeraw())
+#define _GNU_SOURCE
+
+// Include the modbus header (register map, errorCheck)
+#include "../modbus.h"
+
+// Linux headers
+#include <signal.h>
+
+// Define constants
+#define SimLink             "/tmp/ttySDM230"    // Default link to the pseudo-terminal
+#define MaxSimSlaves        32                  // Max meters simulated on the line
+#define RequestSize         8                   // [Slave ID, Fn Code, Start (2), Count (2), Error Check (2)]
+#define MaxSimRegisters     80                  // Max registers read in one request (40 parameters)
+#define ReportPeriod        10                  // Seconds between two reports of the counters
+
+// Structs
+typedef struct{
+    uint16_t    address;        // First register of the parameter
+    float       value;          // Nominal value
+    float       noise;          // Random variation around it (+/-)
+}SimParameter;
+
+typedef struct{
+    uint16_t    address;        // First register of the setting
+    uint32_t    word;           // Its 4 bytes (not a float)
+}SimSetting;
+
+typedef struct{
+    int         latency_ms;     // Time the meter takes to answer
+    int         baud_rate;      // Wire time of the response (0 doesn't pace, otherwise at the rate of the meter)
+    int         max_baud;       // Fastest rate accepted in NET_BD (SDM230: 9600)
+    int         line_baud;      // Line settings of the meters at start
+    LineParity  line_parity;
+    int         restart_rate;   // A new rate is used after a restart of the meter (never in the simulator)
+    double      crc_rate;       // Probability of a response with a wrong error check
+    double      drop_rate;      // Probability of not answering
+    double      exception_rate; // Probability of answering with an exception
+    uint8_t     exception_code; // Exception sent
+}SimOptions;
+
+typedef struct{
+    unsigned    requests;       // Valid requests recieved
+    unsigned    responses;      // Correct responses sent
+    unsigned    corrupted;      // Responses sent with a wrong error check
+    unsigned    dropped;        // Requests not answered
+    unsigned    exceptions;     // Exceptions sent
+    unsigned    noise;          // Bytes skipped looking for a request
+    unsigned    garbled;        // Requests sent with other line settings than the meter's
+    unsigned    writes;         // Settings written
+}SimCounters;
+
+typedef struct{
+    uint8_t     slave_id;
+    int         baud_code;      // Rate used by the meter (NET_BD code)
+    int         bd_register;    // NET_BD of the meter (differs from the rate used until a restart)
+    int         parity_code;    // NET_PARITY of the meter
+}SimMeter;
+
+// Internal functions
+int         simOpenPty(const char *link);
+void        simServe(int fd);
+int         simRequestSize(uint8_t buffer[], int length);
+int         simResponse(SimMeter *meter, uint8_t request[], uint8_t response[]);
+int         simWrite(SimMeter *meter, uint8_t request[], uint8_t response[]);
+int         simException(uint8_t request[], uint8_t code, uint8_t response[]);
+float       simRegister(SimMeter *meter, FunctionCode function_code, uint16_t address);
+int         simSetting(uint16_t address, uint8_t bytes[]);
+int         simLineMatches(SimMeter *meter);
+int         simBaudCode(int baud_rate);
+void        simPace(SimMeter *meter, int bytes);
+void        simReport();
+void        simStop(int signal_number);
+
+// Variables
+static SimOptions   options         = {20, BaudRate, 9600, BaudRate, DefaultParity, 0, 0, 0, 0, 0x05};
+static SimCounters  counters;
+static SimMeter     slaves[MaxSimSlaves];
+static int          n_slaves        = 0;
+static int          line_fd         = -1;           // Slave side of the pseudo-terminal (settings of the daemon)
+static const int    baudRates[]     = {2400, 4800, 9600, 19200, 38400, 1200};   // By NET_BD code
+static const speed_t lineSpeeds[]   = {B2400, B4800, B9600, B19200, B38400, B1200};
+static const char   *link_path      = SimLink;
+static volatile int running         = 1;
+
+// Register map (3X): values of a meter on a 230 V line
+static const SimParameter inputRegisters[] = {
+    {VOLTAGE,               230.0,  2.0},
+    {CURRENT,               5.0,    0.5},
+    {POWER_ACTIVE,          1100.0, 100.0},
+    {POWER_APPARENT,        1150.0, 100.0},
+    {POWER_REACTIVE,        330.0,  30.0},
+    {POWER_FACTOR,          0.96,   0.02},
+    {PHASE,                 16.0,   2.0},
+    {FREQUENCY,             50.0,   0.05},
+    {ACT_ENERGY_IM,         1520.0, 0},
+    {ACT_ENERGY_EX,         12.0,   0},
+    {REA_ENERGY_IM,         410.0,  0},
+    {REA_ENERGY_EX,         3.0,    0},
+    {T_PDEMAND,             1080.0, 50.0},
+    {T_PDEMAND_MAX,         3200.0, 0},
+    {POS_PDEMAND_CURRENT,   1080.0, 50.0},
+    {POS_PDEMAND_MAX,       3200.0, 0},
+    {REV_PDEMAND_CURRENT,   0.0,    0},
+    {REV_PDEMAND_MAX,       150.0,  0},
+    {CDEMAND,               4.8,    0.3},
+    {CDEMAND_MAX,           14.2,   0},
+    {ACT_ENERGY_T,          1532.0, 0},
+    {REA_ENERGY_T,          413.0,  0},
+    {RS_ACT_ENERGY,         220.0,  0},
+    {RS_REA_ENERGY,         61.0,   0}
+};
+
+// Register map (4X): factory settings
+static const SimParameter holdingRegisters[] = {
+    {PULSE_OUT_W,           100.0,  0},
+    {NET_PARITY,            0.0,    0},
+    {NET_NODE,              1.0,    0},     // Replaced by the slave ID
+    {NET_BD,                2.0,    0},
+    {PULSE_TYPE,            4.0,    0},
+    {RUN_TIME,              8760.0, 0}
+};
+
+// Register map (4X): factory settings that aren't floats
+static const SimSetting settingWords[] = {
+    {DISP_SETTINGS,         0x3C010A3C},    // Demand interval 60 min, slide time 1 min, scroll 10 s, backlight 60 min
+    {PULSE_CONST,           0x00000000},    // 0.001 kWh/imp
+    {MEASURE_MODE,          0x00020000}     // Import + export
+};
+#define MapSize(a) (int)(sizeof(a)/sizeof(a[0]))
+
+
+
+/* MAIN: Simulates the meters given by slave ID (1 by default) on a pseudo-terminal linked from "-L <path>".
+    Example: sdm230Sim -L /tmp/ttyUSB0 -l 30 -c 0.01 -d 0.01 1 2 3
+    "-l <ms>" response latency, "-b 0" answers at once (otherwise after the wire time at the rate of the meter)
+    "-c <rate>" responses with a wrong error check, "-d <rate>" requests not answered,
+    "-x <rate>[:<code>]" exceptions (0x05 by default), rates from 0 to 1.
+    "-s <bauds>:<parity>" line settings of the meters (9600:1 by default, parity codes of NET_PARITY),
+    requests sent by the daemon with other settings aren't understood. "-r <bauds>" fastest rate
+    accepted in NET_BD (9600 by default), faster ones are refused with exception 0x03.
+    With "-k" a rate written to NET_BD is only used after a restart of the meter (never).
+    The counters are printed every ReportPeriod seconds and on exit.
+*/
+int main(int argc, char *argv[]){
+    int fd;
+
+    for(int i = 1; i < argc; i ++){
+        if(strcmp(argv[i], "-L") == 0 && i + 1 < argc){
+            link_path = argv[++ i];
+            continue;
+        }
+        if(strcmp(argv[i], "-l") == 0 && i + 1 < argc){
+            options.latency_ms = atoi(argv[++ i]);
+            continue;
+        }
+        if(strcmp(argv[i], "-b") == 0 && i + 1 < argc){
+            options.baud_rate = atoi(argv[++ i]);
+            continue;
+        }
+        if(strcmp(argv[i], "-s") == 0 && i + 1 < argc){
+            int parity = options.line_parity;
+            sscanf(argv[++ i], "%i:%i", &options.line_baud, &parity);
+            options.line_parity = parity;
+            continue;
+        }
+        if(strcmp(argv[i], "-k") == 0){
+            options.restart_rate = 1;
+            continue;
+        }
+        if(strcmp(argv[i], "-r") == 0 && i + 1 < argc){
+            options.max_baud = atoi(argv[++ i]);
+            continue;
+        }
+        if(strcmp(argv[i], "-c") == 0 && i + 1 < argc){
+            options.crc_rate = atof(argv[++ i]);
+            continue;
+        }
+        if(strcmp(argv[i], "-d") == 0 && i + 1 < argc){
+            options.drop_rate = atof(argv[++ i]);
+            continue;
+        }
+        if(strcmp(argv[i], "-x") == 0 && i + 1 < argc){
+            int code = options.exception_code;
+            sscanf(argv[++ i], "%lf:%i", &options.exception_rate, &code);
+            options.exception_code = code;
+            continue;
+        }
+        int id = atoi(argv[i]);
+        if(id < 1 || id > 247 || n_slaves == MaxSimSlaves){
+            printf("ERROR: Invalid slave ID %s\n", argv[i]);
+            return 1;
+        }
+        slaves[n_slaves ++].slave_id = id;
+    }
+    if(n_slaves == 0) slaves[n_slaves ++].slave_id = 0x01;
+    if(simBaudCode(options.line_baud) < 0 || options.line_parity < ParityNone || options.line_parity > ParityNoneTwo){
+        printf("ERROR: Invalid line settings %i:%i\n", options.line_baud, options.line_parity);
+        return 1;
+    }
+    for(int s = 0; s < n_slaves; s ++){
+        slaves[s].baud_code     = simBaudCode(options.line_baud);
+        slaves[s].bd_register   = slaves[s].baud_code;
+        slaves[s].parity_code   = options.line_parity;
+    }
+
+    fd = simOpenPty(link_path);
+    if(fd < 0) return 1;
+    signal(SIGINT, simStop);
+    signal(SIGTERM, simStop);
+
+    simServe(fd);
+    simReport();
+    unlink(link_path);
+    return 0;
+}
+
+
+
+/* OPEN PSEUDO-TERMINAL: Creates a pseudo-terminal in raw mode and links its slave side from link.
+    returns file descriptor of the master side
+            or -1 if error
+*/
+int simOpenPty(const char *link){
+    struct termios  tty;
+    int             fd, slave_fd;
+    char            *name;
+
+    fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if(fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0 || (name = ptsname(fd)) == NULL){
+        printf("ERROR %i from posix_openpt: %s\n", errno, strerror(errno));
+        return -1;
+    }
+
+    // Keep the slave side open, so the master doesn't see a hang up between two runs of the daemon
+    slave_fd = open(name, O_RDWR | O_NOCTTY);
+    if(slave_fd < 0 || tcgetattr(slave_fd, &tty) < 0){
+        printf("ERROR %i from open %s: %s\n", errno, name, strerror(errno));
+        return -1;
+    }
+    cfmakeraw(&tty);
+    tcsetattr(slave_fd, TCSANOW, &tty);
+    line_fd = slave_fd;
+
+    unlink(link);
+    if(symlink(name, link) < 0){
+        printf("ERROR %i from symlink %s: %s\n", errno, link, strerror(errno));
+        return -1;
+    }
+    printf("--SDM230 simulator on %s (%s), %i meters--\n", link, name, n_slaves);
+    return fd;
+}
+
+
+
+/* SERVE: Reads the requests on the line and answers the ones for the simulated meters.
+    Bytes that don't start a request with a valid error check are skipped one by one.
+*/
+void simServe(int fd){
+    struct pollfd   fds         = {fd, POLLIN, 0};
+    uint8_t         buffer[512];                // Bytes recieved not processed yet
+    int             length      = 0;            // Number of bytes in the buffer
+    time_t          reported    = time(NULL);   // Last report of the counters
+
+    while(running){
+        if(poll(&fds, 1, 1000) > 0){
+            int n_read = read(fd, buffer + length, sizeof(buffer) - length);
+            if(n_read > 0) length += n_read;
+        }
+
+        while(1){
+            uint8_t     response[5 + 2*MaxSimRegisters];
+            int         request_size = simRequestSize(buffer, length);
+            uint16_t    errorWord;
+            SimMeter    *meter = NULL;
+
+            if(request_size == 0 || length < request_size) break;
+            errorWord = errorCheck(buffer, request_size - 2);
+            if(buffer[request_size - 2] != GET_LOW(errorWord) || buffer[request_size - 1] != GET_HIGH(errorWord)){
+                memmove(buffer, buffer + 1, -- length);
+                counters.noise ++;
+                continue;
+            }
+            for(int s = 0; s < n_slaves; s ++) if(slaves[s].slave_id == buffer[0]) meter = &slaves[s];
+            // A meter with other line settings only sees noise
+            if(meter != NULL && !simLineMatches(meter)){
+                counters.garbled ++;
+                meter = NULL;
+            }
+            if(meter != NULL){
+                int size = simResponse(meter, buffer, response);
+                simPace(meter, size);
+                if(size > 0 && write(fd, response, size) < 0) printf("ERROR %i from write: %s\n", errno, strerror(errno));
+            }
+            length -= request_size;
+            memmove(buffer, buffer + request_size, length);
+        }
+
+        if(time(NULL) - reported >= ReportPeriod){
+            simReport();
+            reported = time(NULL);
+        }
+    }
+}
+
+
+
+/* REQUEST SIZE: Size of the request starting the buffer, from its function code.
+    returns 0 if more bytes are needed to know it
+*/
+int simRequestSize(uint8_t buffer[], int length){
+    if(length < 2) return 0;
+    if(buffer[1] != W_4X) return RequestSize;
+    // [Slave ID, Fn Code, Start (2), Count (2), Byte Count, Data, Error Check (2)]
+    if(length < 7) return 0;
+    return 9 + buffer[6];
+}
+
+
+
+/* RESPONSE: Composes the response to a request, with the faults configured.
+    returns size of the response
+            or 0 if the request is dropped
+*/
+int simResponse(SimMeter *meter, uint8_t request[], uint8_t response[]){
+    uint8_t     function_code   = request[1];
+    uint16_t    start           = request[2] << 8 | request[3];
+    uint16_t    count           = request[4] << 8 | request[5];
+    uint16_t    errorWord;
+    int         size;
+
+    counters.requests ++;
+    if(drand48() < options.drop_rate){
+        counters.dropped ++;
+        return 0;
+    }
+    if(function_code == W_4X) return simWrite(meter, request, response);
+    if(function_code != R_3X && function_code != RW_4X) return simException(request, 0x01, response);
+    if(count == 0 || count > MaxSimRegisters || count % 2 != 0 || start % 2 != 0) return simException(request, 0x02, response);
+    if(drand48() < options.exception_rate) return simException(request, options.exception_code, response);
+
+    // [Slave ID, Fn Code, Byte Count, Data (2 bytes per register), Error Check(low), Error Check(high)]
+    response[0] = request[0];
+    response[1] = function_code;
+    response[2] = 2*count;
+    for(int r = 0; r < count; r += 2){
+        if(function_code == RW_4X && simSetting(start + r, &response[3 + 2*r])) continue;
+        floatToBytes(simRegister(meter, function_code, start + r), &response[3 + 2*r]);
+    }
+    size = 3 + 2*count;
+    errorWord = errorCheck(response, size);
+    response[size ++] = GET_LOW(errorWord);
+    response[size ++] = GET_HIGH(errorWord);
+
+    if(drand48() < options.crc_rate){
+        response[3 + lrand48() % (2*count)] ^= 1 << (lrand48() % 8);
+        counters.corrupted ++;
+        return size;
+    }
+    counters.responses ++;
+    return size;
+}
+
+
+
+/* WRITE: Applies a write of a line setting (NET_BD, NET_PARITY) and composes its echo.
+    The meter uses the new setting from the next request on.
+    returns size of the response
+*/
+int simWrite(SimMeter *meter, uint8_t request[], uint8_t response[]){
+    uint16_t    start   = request[2] << 8 | request[3];
+    uint16_t    count   = request[4] << 8 | request[5];
+    uint16_t    errorWord;
+    int         code;
+
+    if(count != 2 || request[6] != 4 || (start != NET_BD && start != NET_PARITY)) return simException(request, 0x02, response);
+    code = (int)bytesToFloat(&request[7]);
+    if(start == NET_BD){
+        if(code < 0 || code > 5 || baudRates[code] > options.max_baud) return simException(request, 0x03, response);
+        meter->bd_register = code;
+        if(!options.restart_rate) meter->baud_code = code;
+    }else{
+        if(code < ParityNone || code > ParityNoneTwo) return simException(request, 0x03, response);
+        meter->parity_code = code;
+    }
+    counters.writes ++;
+    printf("  Slave %i: %s set to %i\n", meter->slave_id, start == NET_BD ? "NET_BD" : "NET_PARITY", code);
+
+    // [Slave ID, Fn Code, Start (2), Count (2), Error Check(low), Error Check(high)]
+    memcpy(response, request, 6);
+    errorWord = errorCheck(response, 6);
+    response[6] = GET_LOW(errorWord);
+    response[7] = GET_HIGH(errorWord);
+    counters.responses ++;
+    return 8;
+}
+
+
+
+/* LINE MATCHES: The daemon uses the baud rate and parity of the meter (read from the pseudo-terminal).
+    One or two stop bits don't matter to the receiver. Pseudo-terminals drop PARENB, so only odd parity
+    (PARODD) can be told apart from even or no parity.
+*/
+int simLineMatches(SimMeter *meter){
+    struct termios  tty;
+    tcflag_t        parity;
+
+    if(tcgetattr(line_fd, &tty) < 0) return 1;
+    parity = tty.c_cflag & PARODD;
+    if(cfgetospeed(&tty) != lineSpeeds[meter->baud_code]) return 0;
+    if(meter->parity_code == ParityOdd) return parity != 0;
+    return parity == 0;
+}
+
+
+
+/* BAUD CODE: NET_BD code of a baud rate (-1 if not supported).
+*/
+int simBaudCode(int baud_rate){
+    for(int code = 0; code < 6; code ++) if(baudRates[code] == baud_rate) return code;
+    return -1;
+}
+
+
+
+/* EXCEPTION: Composes an exception response [Slave ID, 0x80 | Fn Code, Code, Error Check(low), Error Check(high)]
+    returns size of the response
+*/
+int simException(uint8_t request[], uint8_t code, uint8_t response[]){
+    uint16_t errorWord;
+
+    response[0] = request[0];
+    response[1] = 0x80 | request[1];
+    response[2] = code;
+    errorWord = errorCheck(response, 3);
+    response[3] = GET_LOW(errorWord);
+    response[4] = GET_HIGH(errorWord);
+    counters.exceptions ++;
+    return 5;
+}
+
+
+
+/* REGISTER: Value of the parameter starting at a register, 0 if it isn't in the map.
+    Every meter reads a bit differently (slave ID / 100), instantaneous values move randomly.
+*/
+float simRegister(SimMeter *meter, FunctionCode function_code, uint16_t address){
+    const SimParameter  *map    = function_code == R_3X ? inputRegisters : holdingRegisters;
+    int                 n       = function_code == R_3X ? MapSize(inputRegisters) : MapSize(holdingRegisters);
+    uint8_t             slave_id = meter->slave_id;
+
+    if(function_code == RW_4X && address == NET_NODE) return slave_id;
+    if(function_code == RW_4X && address == NET_BD) return meter->bd_register;
+    if(function_code == RW_4X && address == NET_PARITY) return meter->parity_code;
+    for(int i = 0; i < n; i ++){
+        if(map[i].address != address) continue;
+        if(function_code == RW_4X) return map[i].value;
+        return map[i].value + slave_id/100.0 + map[i].noise*(2*drand48() - 1);
+    }
+    return 0;
+}
+
+
+
+/* SETTING: Bytes of a setting that isn't a float (DISP_SETTINGS, PULSE_CONST, MEASURE_MODE).
+    returns 1 if the address is one of them
+*/
+int simSetting(uint16_t address, uint8_t bytes[]){
+    for(int i = 0; i < MapSize(settingWords); i ++){
+        if(settingWords[i].address != address) continue;
+        bytes[0] = settingWords[i].word >> 24;
+        bytes[1] = settingWords[i].word >> 16;
+        bytes[2] = settingWords[i].word >> 8;
+        bytes[3] = settingWords[i].word;
+        return 1;
+    }
+    return 0;
+}
+
+
+
+/* PACE: Waits the latency of the meter plus the wire time of the response at the baud rate of the meter.
+*/
+void simPace(SimMeter *meter, int bytes){
+    int us = options.latency_ms*1000;
+
+    if(options.baud_rate > 0) us += (11*1000000/baudRates[meter->baud_code])*(RequestSize + bytes);
+    if(us > 0) usleep(us);
+}
+
+
+
+/* REPORT: Prints the counters.
+*/
+void simReport(){
+    printf("  Requests: %u, responses: %u, corrupted: %u, dropped: %u, exceptions: %u, noise bytes: %u, garbled: %u, writes: %u\n",
+            counters.requests, counters.responses, counters.corrupted, counters.dropped, counters.exceptions, counters.noise,
+            counters.garbled, counters.writes);
+}
+
+
+
+
+/* STOP: Ends the simulator (SIGINT, SIGTERM).
+*/
+void simStop(int signal_number){
+    (void)signal_number;
+    running = 0;
+}
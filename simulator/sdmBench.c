@@ -0,0 +1,350 @@
+/***********************************
+*          sdmBench.c
+*
+* -Benchmark driver: runs the
+*  daemon against the SDM230
+*  simulator for a while and
+*  reports the throughput, retries
+*  and latency from its metrics.
+*
+* build: make -C simulator (sdm230Sim, sdmBench and the daemon), make -C simulator bench
+*
+***********************************/
+
+// Include the metrics header (buckets of the histograms)
+#include "../metrics.h"
+
+// C headers
+#include <stdlib.h>
+#include <string.h>
+
+// Linux headers
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Define constants
+#define BenchLink           "/tmp/ttySDMBench"  // Link to the pseudo-terminal of the simulator
+#define BenchPort           9105                // Metrics port of the daemon
+#define WarmupSeconds       2                   // Time given to the daemon before the first scrape
+#define MaxBenchArgs        64                  // Arguments of a program started
+#define MaxScrapeSize       (1 << 20)           // Longest metrics page
+#define StartTries          50                  // Checks of the link and the endpoint (every 100 ms)
+
+// Structs
+typedef struct{
+    double      transactions;   // Valid responses
+    double      transaction_s;  // Sum of their times (s)
+    double      scans;          // Register groups read
+    double      retries;
+    double      timeouts;
+    double      crc_errors;
+    double      failures;
+    double      exceptions;
+    double      published;      // Samples published
+    double      drops;          // Samples dropped by the queues
+    double      buckets[HistogramBuckets];  // Transactions by latency bucket (cumulative)
+}BenchCounters;
+
+// Internal functions
+pid_t       benchStart(const char *program, char *args[]);
+int         benchSplit(char *line, char *args[], int n, int max);
+int         benchScrape(int port, BenchCounters *counters);
+double      benchSum(const char *page, const char *name);
+void        benchBuckets(const char *page, double buckets[]);
+double      benchPercentile(const double before[], const double after[], double fraction);
+void        benchStop(pid_t pid);
+
+// Variables
+static const double bucketLimits[HistogramBuckets - 1] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};    // Mili seconds (metrics.c)
+static char         page[MaxScrapeSize];
+
+
+
+/* MAIN: Starts the simulator with the meters given by slave ID (1 by default), then the daemon polling them
+   on its pseudo-terminal, and reports what the daemon did during the run.
+    Example: sdmBench -T 60 -s "-l 5 -c 0.01" -d "-G 100" 1 2 3
+    "-T <seconds>" length of the run (30 by default), after WarmupSeconds
+    "-s <args>" more arguments of the simulator, "-d <args>" more arguments of the daemon
+    "-S <path>" simulator (./sdm230Sim by default), "-D <path>" daemon (./modbus by default)
+    "-P <port>" metrics port of the daemon (BenchPort by default)
+*/
+int main(int argc, char *argv[]){
+    const char      *simulator = "./sdm230Sim";
+    const char      *daemon = "./modbus";
+    char            *sim_args[MaxBenchArgs], *daemon_args[MaxBenchArgs];
+    char            *ids[MaxBenchArgs];
+    char            *sim_extra = NULL, *daemon_extra = NULL;
+    char            port_text[8];
+    int             seconds = 30;
+    int             port = BenchPort;
+    int             n_ids = 0;
+    int             n;
+    pid_t           sim_pid, daemon_pid;
+    BenchCounters   before, after;
+
+    for(int i = 1; i < argc; i ++){
+        if(strcmp(argv[i], "-T") == 0 && i + 1 < argc){
+            seconds = atoi(argv[++ i]);
+            continue;
+        }
+        if(strcmp(argv[i], "-s") == 0 && i + 1 < argc){
+            sim_extra = argv[++ i];
+            continue;
+        }
+        if(strcmp(argv[i], "-d") == 0 && i + 1 < argc){
+            daemon_extra = argv[++ i];
+            continue;
+        }
+        if(strcmp(argv[i], "-S") == 0 && i + 1 < argc){
+            simulator = argv[++ i];
+            continue;
+        }
+        if(strcmp(argv[i], "-D") == 0 && i + 1 < argc){
+            daemon = argv[++ i];
+            continue;
+        }
+        if(strcmp(argv[i], "-P") == 0 && i + 1 < argc){
+            port = atoi(argv[++ i]);
+            continue;
+        }
+        int id = atoi(argv[i]);
+        if(id < 1 || id > 247 || n_ids == MaxBenchArgs/2){
+            printf("ERROR: Invalid slave ID %s\n", argv[i]);
+            return 1;
+        }
+        ids[n_ids ++] = argv[i];
+    }
+    if(seconds <= 0 || port <= 0 || port > 65535){
+        printf("ERROR: Invalid run %i s on port %i\n", seconds, port);
+        return 1;
+    }
+    if(n_ids == 0) ids[n_ids ++] = "1";
+
+    // Simulator: -L <link> <extra> <ids>
+    n = 0;
+    sim_args[n ++] = (char*)simulator;
+    sim_args[n ++] = "-L";
+    sim_args[n ++] = BenchLink;
+    n = benchSplit(sim_extra, sim_args, n, MaxBenchArgs - n_ids - 1);
+    for(int i = 0; i < n_ids; i ++) sim_args[n ++] = ids[i];
+    sim_args[n] = NULL;
+    unlink(BenchLink);
+    sim_pid = benchStart(simulator, sim_args);
+    if(sim_pid < 0) return 1;
+    for(int t = 0; t < StartTries && access(BenchLink, F_OK) < 0; t ++) usleep(100000);
+    if(access(BenchLink, F_OK) < 0){
+        printf("ERROR: The simulator didn't create %s\n", BenchLink);
+        benchStop(sim_pid);
+        return 1;
+    }
+
+    // Daemon: -q -P <port> <extra> -p <link> <ids>
+    n = 0;
+    snprintf(port_text, sizeof(port_text), "%i", port);
+    daemon_args[n ++] = (char*)daemon;
+    daemon_args[n ++] = "-q";
+    daemon_args[n ++] = "-P";
+    daemon_args[n ++] = port_text;
+    n = benchSplit(daemon_extra, daemon_args, n, MaxBenchArgs - n_ids - 3);
+    daemon_args[n ++] = "-p";
+    daemon_args[n ++] = BenchLink;
+    for(int i = 0; i < n_ids; i ++) daemon_args[n ++] = ids[i];
+    daemon_args[n] = NULL;
+    daemon_pid = benchStart(daemon, daemon_args);
+    if(daemon_pid < 0){
+        benchStop(sim_pid);
+        return 1;
+    }
+
+    // Run: a scrape after the warm up and one at the end
+    int started = -1;
+    for(int t = 0; t < StartTries && started < 0; t ++){
+        usleep(100000);
+        started = benchScrape(port, &before);
+    }
+    if(started == 0){
+        sleep(WarmupSeconds);
+        started = benchScrape(port, &before);
+    }
+    if(started < 0){
+        printf("ERROR: No metrics on http://127.0.0.1:%i/metrics\n", port);
+        benchStop(daemon_pid);
+        benchStop(sim_pid);
+        return 1;
+    }
+    printf("--Benchmark: %i meter(s) for %i s--\n", n_ids, seconds);
+    fflush(stdout);
+    sleep(seconds);
+    int ended = benchScrape(port, &after);
+    benchStop(daemon_pid);
+    benchStop(sim_pid);
+    if(ended < 0){
+        printf("ERROR: The daemon stopped during the run\n");
+        return 1;
+    }
+
+    // Report (differences over the run)
+    double transactions = after.transactions - before.transactions;
+    double mean_ms = transactions > 0 ? (after.transaction_s - before.transaction_s)*1000/transactions : 0;
+    printf("  Transactions: %.0f (%.1f/s), scans: %.0f (%.1f/s), samples published: %.0f (%.1f/s)\n",
+           transactions, transactions/seconds, after.scans - before.scans, (after.scans - before.scans)/seconds,
+           after.published - before.published, (after.published - before.published)/seconds);
+    printf("  Retries: %.0f, timeouts: %.0f, CRC errors: %.0f, exceptions: %.0f, failures: %.0f, queue drops: %.0f\n",
+           after.retries - before.retries, after.timeouts - before.timeouts, after.crc_errors - before.crc_errors,
+           after.exceptions - before.exceptions, after.failures - before.failures, after.drops - before.drops);
+    printf("  Transaction time: mean %.1f ms, p50 <= %g ms, p99 <= %g ms\n", mean_ms,
+           benchPercentile(before.buckets, after.buckets, 0.5), benchPercentile(before.buckets, after.buckets, 0.99));
+    return 0;
+}
+
+
+
+/* START: Runs a program in a child process.
+    returns process ID of the child
+            or -1 if error
+*/
+pid_t benchStart(const char *program, char *args[]){
+    pid_t pid = fork();
+
+    if(pid < 0){
+        printf("ERROR %i from fork: %s\n", errno, strerror(errno));
+        return -1;
+    }
+    if(pid == 0){
+        execv(program, args);
+        printf("ERROR %i from execv %s: %s\n", errno, program, strerror(errno));
+        _exit(127);
+    }
+    return pid;
+}
+
+
+
+/* SPLIT: Adds the words of a line (separated by spaces) to the arguments of a program.
+    +Param:: line, NULL adds nothing (modified)
+    +Param:: n, arguments already there
+    +Param:: max, most arguments in total
+    returns number of arguments
+*/
+int benchSplit(char *line, char *args[], int n, int max){
+    char *save;
+
+    if(line == NULL) return n;
+    for(char *word = strtok_r(line, " ", &save); word != NULL && n < max; word = strtok_r(NULL, " ", &save)){
+        args[n ++] = word;
+    }
+    return n;
+}
+
+
+
+/* SCRAPE: Reads the metrics of the daemon from its Prometheus endpoint.
+    returns 0 on success
+            or -1 if error (not serving yet or anymore)
+*/
+int benchScrape(int port, BenchCounters *counters){
+    struct sockaddr_in  address;
+    const char          *request = "GET /metrics HTTP/1.0\r\n\r\n";
+    int                 size = 0;
+    int                 fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(fd < 0) return -1;
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_port        = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || write(fd, request, strlen(request)) < 0){
+        close(fd);
+        return -1;
+    }
+    while(size < MaxScrapeSize - 1){
+        int n = read(fd, page + size, MaxScrapeSize - 1 - size);
+        if(n <= 0) break;
+        size += n;
+    }
+    close(fd);
+    page[size] = '\0';
+    if(strstr(page, "200 OK") == NULL) return -1;
+
+    counters->transactions  = benchSum(page, "modbus_transaction_seconds_count");
+    counters->transaction_s = benchSum(page, "modbus_transaction_seconds_sum");
+    counters->scans         = benchSum(page, "modbus_scan_seconds_count");
+    counters->retries       = benchSum(page, "modbus_retries_total");
+    counters->timeouts      = benchSum(page, "modbus_timeouts_total");
+    counters->crc_errors    = benchSum(page, "modbus_crc_errors_total");
+    counters->failures      = benchSum(page, "modbus_failures_total");
+    counters->exceptions    = benchSum(page, "modbus_exceptions_total");
+    counters->published     = benchSum(page, "mqtt_publish_latency_seconds_count");
+    counters->drops         = benchSum(page, "sample_queue_drops_total");
+    benchBuckets(page, counters->buckets);
+    return 0;
+}
+
+
+
+/* SUM: Adds the values of a metric over all its labels.
+*/
+double benchSum(const char *page, const char *name){
+    size_t      length = strlen(name);
+    double      sum = 0;
+
+    for(const char *line = page; line != NULL && *line != '\0'; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL){
+        if(strncmp(line, name, length) != 0 || (line[length] != '{' && line[length] != ' ')) continue;
+        const char *value = strchr(line, ' ');
+        if(value != NULL) sum += atof(value);
+    }
+    return sum;
+}
+
+
+
+/* BUCKETS: Adds the cumulative buckets of the transaction times over all the register windows.
+    +Param:: buckets, HistogramBuckets counts by upper bound (the last one is +Inf)
+*/
+void benchBuckets(const char *page, double buckets[]){
+    const char  *name = "modbus_transaction_seconds_bucket{";
+    size_t      length = strlen(name);
+
+    memset(buckets, 0, HistogramBuckets*sizeof(double));
+    for(const char *line = page; line != NULL && *line != '\0'; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL){
+        if(strncmp(line, name, length) != 0) continue;
+        const char *le = strstr(line, "le=\"");
+        const char *value = strchr(line, ' ');
+        if(le == NULL || value == NULL) continue;
+        int b = 0;
+        double ms = strncmp(le + 4, "+Inf", 4) == 0 ? -1 : atof(le + 4)*1000;
+        while(ms >= 0 && b < HistogramBuckets - 1 && ms > bucketLimits[b] + 1e-9) b ++;
+        if(ms < 0) b = HistogramBuckets - 1;
+        buckets[b] += atof(value);
+    }
+}
+
+
+
+/* PERCENTILE: Upper bound of the bucket holding a fraction of the transactions of the run.
+    returns mili seconds
+            or -1 if no transaction or beyond the last bound
+*/
+double benchPercentile(const double before[], const double after[], double fraction){
+    double total = after[HistogramBuckets - 1] - before[HistogramBuckets - 1];
+
+    if(total <= 0) return -1;
+    for(int b = 0; b < HistogramBuckets - 1; b ++){
+        if(after[b] - before[b] >= fraction*total) return bucketLimits[b];
+    }
+    return -1;
+}
+
+
+
+/* STOP: Interrupts a child process (the simulator prints its counters) and waits for it.
+*/
+void benchStop(pid_t pid){
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+}
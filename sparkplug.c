@@ -0,0 +1,342 @@
+/***********************************
+*          sparkplug.c
+*
+* -Sparkplug B: publishes the scans
+*  as protobuf messages, the edge
+*  node is the gateway and every
+*  meter a device. Births carry the
+*  metric names, data messages only
+*  their aliases. A host asks for
+*  them again with an NCMD rebirth.
+*
+* used with sparkplug.h
+*
+***********************************/
+
+// Include header file
+#include "sparkplug.h"
+
+// Structs
+typedef struct{
+    int         session;                // MQTT session its DBIRTH was published in (0 not born)
+    uint64_t    announced;              // Metrics in its DBIRTH (bit = alias)
+    uint64_t    valid;                  // Metrics whose last value was read
+    float       values[MaxMetrics];     // Last value of each metric (for the next DBIRTH)
+}SparkplugDevice;
+
+// Internal functions
+int         publishNodeBirth(int rebirth);
+int         publishDeviceBirth(uint8_t slave_id, SparkplugDevice *device, uint64_t ts);
+int         publishDeviceData(const Sample samples[], int n, uint64_t ts);
+void        encodeNodeMetrics(Encoder *enc, uint64_t ts, uint64_t bd_seq, int birth);
+int         rebirthCommand(const uint8_t data[], int len);
+void        encodeMetric(Encoder *enc, int alias, int birth, float value, int valid);
+int         setNodeDeath();
+int         metricAlias(const char *name);
+uint64_t    sampleMs(const Sample *sample);
+
+// Variables (only used from the publisher thread)
+static char             groupId[SparkplugIdSize];
+static char             nodeId[SparkplugIdSize];
+static uint64_t         bdSeq       = 0;        // Birth/death sequence of the next session [0...255]
+static uint64_t         birthSeq    = 0;        // Birth/death sequence of the session born (its NDEATH)
+static char             commandTopic[128];      // NCMD of the edge node
+static atomic_int       rebirthAsked = 0;       // Set by the MQTT client, served by the publisher thread
+static uint8_t          seq         = 0;        // Sequence of the next message [0...255]
+static int              session     = 0;        // MQTT session the NBIRTH was published in (0 none)
+static char             metricNames[MaxMetrics][MetricNameSize];
+static int              n_metrics   = 0;
+static SparkplugDevice  devices[256];           // By slave ID
+
+
+
+/* INIT SPARKPLUG: Sets the group and edge node IDs from "<group>:<node>" and the NDEATH
+   the broker publishes if the gateway goes offline. Must be called before mqtt_setup().
+    returns 0 if set
+            or -1 if the IDs are not valid
+*/
+int sparkplugInit(const char *ids){
+    if(sscanf(ids, "%31[^:/#+]:%31[^:/#+]", groupId, nodeId) != 2) return -1;
+    sprintf(commandTopic, SparkplugNamespace "/%s/NCMD/%s", groupId, nodeId);
+    if(mqtt_handler(commandTopic, sparkplugCommand) < 0) return -1;
+    return setNodeDeath();
+}
+
+
+
+/* COMMAND: Handles an NCMD of the edge node (called from the MQTT client). "Node Control/Rebirth"
+   set to true asks for the NBIRTH and every DBIRTH again, they are sent by sparkplugServe().
+*/
+void sparkplugCommand(const char *payload, int len){
+    if(rebirthCommand((const uint8_t*)payload, len)){
+        logInfo("  Sparkplug rebirth asked for %s/%s\n", groupId, nodeId);
+        atomic_store(&rebirthAsked, 1);
+    }
+}
+
+
+
+/* SERVE: Answers a rebirth asked by a host: the NBIRTH of the session again (same bdSeq, sequence
+   from 0), then the DBIRTH of every meter born in the session with its last values.
+   Meters whose DBIRTH fails are born again with their next scan.
+    returns number of messages published
+*/
+int sparkplugServe(){
+    struct timespec now;
+    int             n_messages = 0;
+
+    if(!atomic_load(&rebirthAsked) || !mqtt_connected()) return 0;
+    atomic_store(&rebirthAsked, 0);
+    if(session == 0 || session != mqtt_sessions()) return 0;    // The next scan starts a new session with births
+    if(publishNodeBirth(1) != MOSQ_ERR_SUCCESS){
+        atomic_store(&rebirthAsked, 1);
+        return 0;
+    }
+    n_messages ++;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    for(int id = 0; id < 256; id ++){
+        SparkplugDevice *device = &devices[id];
+        if(device->session != session) continue;
+        if(publishDeviceBirth(id, device, (uint64_t)now.tv_sec*1000 + now.tv_nsec/1000000) == MOSQ_ERR_SUCCESS) n_messages ++;
+        else device->session = 0;
+    }
+    return n_messages;
+}
+
+
+
+/* PUBLISH SCAN: Publishes a scan of a meter as DDATA, or as DBIRTH the first time the meter
+   is seen in a session or when it has new metrics. The NBIRTH is published first on every new session.
+    returns the result of mosquitto_publish()
+*/
+int sparkplugPublishScan(const Sample samples[], int n){
+    SparkplugDevice *device = &devices[samples[0].slave_id];
+    uint64_t        scan_metrics = 0;
+    int             now = mqtt_sessions();
+    int             result;
+
+    if(session != now){
+        result = publishNodeBirth(0);
+        if(result != MOSQ_ERR_SUCCESS) return result;
+        session = now;
+    }
+
+    // Keep the last values for the next DBIRTH
+    for(int i = 0; i < n; i ++){
+        int alias = metricAlias(samples[i].topic);
+        if(alias < 0) continue;
+        scan_metrics |= 1ULL << alias;
+        device->values[alias] = samples[i].value;
+        if(samples[i].status == SampleOk) device->valid |= 1ULL << alias;
+        else device->valid &= ~(1ULL << alias);
+    }
+
+    if(device->session != session || (scan_metrics & ~device->announced)){
+        device->announced |= scan_metrics;
+        result = publishDeviceBirth(samples[0].slave_id, device, sampleMs(&samples[0]));
+        if(result == MOSQ_ERR_SUCCESS) device->session = session;
+        return result;
+    }
+    return publishDeviceData(samples, n, sampleMs(&samples[0]));
+}
+
+
+
+/* NODE BIRTH: Publishes the NBIRTH of a new session (sequence restarts at 0) and sets
+   the NDEATH of the next one. A rebirth keeps the bdSeq of the session (its NDEATH is set).
+    returns the result of mosquitto_publish()
+*/
+int publishNodeBirth(int rebirth){
+    uint8_t         payload[SparkplugPayloadSize];
+    char            topic[128];
+    Encoder         enc;
+    struct timespec now;
+    int             result;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    seq = 0;
+    if(!rebirth) birthSeq = bdSeq;
+    encoderInit(&enc, payload, sizeof(payload));
+    encodeNodeMetrics(&enc, (uint64_t)now.tv_sec*1000 + now.tv_nsec/1000000, birthSeq, 1);
+    protoVarint(&enc, 3, seq ++);
+
+    sprintf(topic, SparkplugNamespace "/%s/NBIRTH/%s", groupId, nodeId);
+    result = mqtt_publish(topic, payload, enc.len, 0, false);
+    if(result != MOSQ_ERR_SUCCESS || rebirth) return result;
+
+    logInfo("  Sparkplug NBIRTH %s/%s (bdSeq %llu)\n", groupId, nodeId, (unsigned long long)bdSeq);
+    bdSeq = (bdSeq + 1) % 256;
+    setNodeDeath();
+    return result;
+}
+
+
+
+/* DEVICE BIRTH: Publishes the DBIRTH of a meter, with the name, alias, type and last value
+   of every metric seen.
+    returns the result of mosquitto_publish()
+*/
+int publishDeviceBirth(uint8_t slave_id, SparkplugDevice *device, uint64_t ts){
+    uint8_t payload[SparkplugPayloadSize];
+    char    topic[128];
+    Encoder enc;
+
+    encoderInit(&enc, payload, sizeof(payload));
+    protoVarint(&enc, 1, ts);
+    for(int alias = 0; alias < n_metrics; alias ++){
+        if(device->announced & (1ULL << alias)) encodeMetric(&enc, alias, 1, device->values[alias], (device->valid >> alias) & 1);
+    }
+    protoVarint(&enc, 3, seq ++);
+    if(enc.overflow){
+        printf("ERROR: DBIRTH of slave %i too long, not published.\n", slave_id);
+        return MOSQ_ERR_PAYLOAD_SIZE;
+    }
+
+    sprintf(topic, SparkplugNamespace "/%s/DBIRTH/%s/meter%i", groupId, nodeId, slave_id);
+    return mqtt_publish(topic, payload, enc.len, 0, false);
+}
+
+
+
+/* DEVICE DATA: Publishes a scan of a meter as DDATA, metrics only by alias.
+    returns the result of mosquitto_publish()
+*/
+int publishDeviceData(const Sample samples[], int n, uint64_t ts){
+    uint8_t payload[SparkplugPayloadSize];
+    char    topic[128];
+    Encoder enc;
+
+    encoderInit(&enc, payload, sizeof(payload));
+    protoVarint(&enc, 1, ts);
+    for(int i = 0; i < n; i ++){
+        int alias = metricAlias(samples[i].topic);
+        if(alias >= 0) encodeMetric(&enc, alias, 0, samples[i].value, samples[i].status == SampleOk);
+    }
+    protoVarint(&enc, 3, seq ++);
+    if(enc.overflow){
+        printf("ERROR: DDATA of slave %i too long, not published.\n", samples[0].slave_id);
+        return MOSQ_ERR_PAYLOAD_SIZE;
+    }
+
+    sprintf(topic, SparkplugNamespace "/%s/DDATA/%s/meter%i", groupId, nodeId, samples[0].slave_id);
+    return mqtt_publish(topic, payload, enc.len, 0, false);
+}
+
+
+
+/* NODE METRICS: Writes the timestamp and metrics of an NBIRTH (birth) or NDEATH:
+    bdSeq, and "Node Control/Rebirth" in the NBIRTH.
+*/
+void encodeNodeMetrics(Encoder *enc, uint64_t ts, uint64_t bd_seq, int birth){
+    int mark;
+
+    protoVarint(enc, 1, ts);
+    mark = protoBegin(enc, 2);
+    protoString(enc, 1, "bdSeq");
+    protoVarint(enc, 4, DataTypeInt64);
+    protoVarint(enc, 11, bd_seq);
+    protoEnd(enc, mark);
+    if(!birth) return;
+
+    mark = protoBegin(enc, 2);
+    protoString(enc, 1, "Node Control/Rebirth");
+    protoVarint(enc, 4, DataTypeBoolean);
+    protoVarint(enc, 14, 0);
+    protoEnd(enc, mark);
+}
+
+
+
+/* METRIC: Writes a float metric, with its name and type in births.
+    Values that couldn't be read are null.
+*/
+void encodeMetric(Encoder *enc, int alias, int birth, float value, int valid){
+    int mark = protoBegin(enc, 2);
+
+    if(birth) protoString(enc, 1, metricNames[alias]);
+    protoVarint(enc, 2, alias);
+    if(birth) protoVarint(enc, 4, DataTypeFloat);
+    if(valid) protoFloat(enc, 12, value);
+    else protoVarint(enc, 7, 1);
+    protoEnd(enc, mark);
+}
+
+
+
+/* NODE DEATH: Sets the NDEATH of the next session as the MQTT last will.
+    returns 0 if set
+            or -1 if error
+*/
+int setNodeDeath(){
+    uint8_t payload[64];
+    char    topic[128];
+    Encoder enc;
+
+    encoderInit(&enc, payload, sizeof(payload));
+    encodeNodeMetrics(&enc, 0, bdSeq, 0);
+    sprintf(topic, SparkplugNamespace "/%s/NDEATH/%s", groupId, nodeId);
+    if(mqtt_will(topic, payload, enc.len, 1, false) != 0){
+        printf("ERROR: Unable to set the NDEATH of %s/%s\n", groupId, nodeId);
+        syslog(LOG_ERR, "ERROR from setNodeDeath: Unable to set the NDEATH of %s/%s", groupId, nodeId);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/* REBIRTH COMMAND: An NCMD payload has the metric "Node Control/Rebirth" set to true.
+    returns 1 if it has
+            0 if not (other commands are ignored)
+*/
+int rebirthCommand(const uint8_t data[], int len){
+    const char  *rebirth = "Node Control/Rebirth";
+    int         pos = 0, field, wire;
+    uint64_t    value;
+
+    while((wire = protoNext(data, len, &pos, &field, &value)) >= 0){
+        if(wire != WireLength) continue;
+        int end = pos + value;
+        if(field == 2){
+            // Metric: name (1), boolean value (14)
+            int named = 0, set = 0, metric_field, metric_wire;
+            while((metric_wire = protoNext(data, end, &pos, &metric_field, &value)) >= 0){
+                if(metric_wire == WireLength){
+                    if(metric_field == 1 && value == strlen(rebirth) && memcmp(data + pos, rebirth, value) == 0) named = 1;
+                    pos += value;
+                }else if(metric_field == 14) set = value != 0;
+            }
+            if(named && set) return 1;
+        }
+        pos = end;
+    }
+    return 0;
+}
+
+
+
+/* METRIC ALIAS: Alias of a metric by name, new metrics get the next one.
+    returns alias
+            or -1 if there are too many metrics
+*/
+int metricAlias(const char *name){
+    for(int alias = 0; alias < n_metrics; alias ++){
+        if(strcmp(metricNames[alias], name) == 0) return alias;
+    }
+    if(n_metrics == MaxMetrics || strlen(name) >= MetricNameSize){
+        logWarning("WARNING: Metric %s not published, too many metrics or name too long.\n", name);
+        syslog(LOG_WARNING, "WARNING from metricAlias: Metric %s not published.", name);
+        return -1;
+    }
+    strcpy(metricNames[n_metrics], name);
+    return n_metrics ++;
+}
+
+
+
+/* SAMPLE TIME: Timestamp of a sample in mili seconds since epoch.
+*/
+uint64_t sampleMs(const Sample *sample){
+    return (uint64_t)sample->timestamp.tv_sec*1000 + sample->timestamp.tv_nsec/1000000;
+}
@@ -0,0 +1,35 @@
+#ifndef sparkplug
+#define sparkplug
+
+// Include the sample queue, encoder and MQTT headers
+#include "sampleQueue.h"
+#include "encoder.h"
+#include "mqttClient.h"
+
+// C headers
+#include <stdatomic.h>
+
+// Linux headers
+#include <syslog.h>
+
+// Defines
+#define SparkplugNamespace      "spBv1.0"
+#define MaxMetrics              64      // Different parameters of the meters (one alias each)
+#define MetricNameSize          40      // Name of a metric (topic of the parameter)
+#define SparkplugIdSize         32      // Group and edge node IDs
+#define SparkplugPayloadSize    4096    // Size of a birth or data message
+
+// Enums
+typedef enum{
+    DataTypeInt64   = 4,    // Sparkplug B data types used
+    DataTypeFloat   = 9,
+    DataTypeBoolean = 11
+}SparkplugDataType;
+
+// Functions
+int         sparkplugInit(const char *ids);
+int         sparkplugPublishScan(const Sample samples[], int n);
+void        sparkplugCommand(const char *payload, int len);
+int         sparkplugServe();
+
+#endif
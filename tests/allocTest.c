@@ -0,0 +1,151 @@
+/***********************************
+*          allocTest.c
+*
+* -Checks that the steady state of
+*  the daemon doesn't allocate: the
+*  register groups are polled from a
+*  responder on a pseudo-terminal,
+*  queued and published, with the
+*  allocator of the C library
+*  counting every call.
+*
+* build: make -C tests check (glibc: the __libc_ allocator entry points)
+*
+***********************************/
+
+// Include the register map, publisher, aggregator and test headers
+#include "../registerMap.h"
+#include "../publisher.h"
+#include "../aggregator.h"
+#include "fakeMqtt.h"
+#include "ptyLine.h"
+#include "check.h"
+
+// Define constants
+#define TestSlave           1
+#define WarmupCycles        50      // Cycles before counting (first use of the tables, stdio buffers)
+#define CountedCycles       200     // Cycles that must not allocate
+
+// Internal functions
+void        pollCycle(ModbusPort *port, RegisterMap *map, SampleQueue *queue);
+long        countCycles(ModbusPort *port, RegisterMap *map, SampleQueue *queue, int cycles);
+
+// Allocator of the C library (glibc)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+// Variables
+static _Atomic long     allocations = 0;    // Calls to malloc(), calloc() and realloc()
+static SampleQueue      busQueue;           // Queue of the bus (one bus thread)
+
+
+
+/* ALLOCATOR: Every allocation of the process goes through here and is counted.
+*/
+void *malloc(size_t size){
+    allocations ++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size){
+    allocations ++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size){
+    allocations ++;
+    return __libc_realloc(p, size);
+}
+
+void free(void *p){
+    __libc_free(p);
+}
+
+
+
+int main(){
+    uint8_t     slave_ids[1] = {TestSlave};
+    ModbusPort  port = {0};
+    PublishMode modes[3] = {PublishPerTopic, PublishBatch, PublishCbor};
+    const char  *names[3] = {"per topic", "JSON", "CBOR"};
+
+    loggerLevel = LevelWarning;
+    if(ptyLineOpen(&port) < 0){
+        CHECK(0);
+        return CHECK_DONE("allocTest");
+    }
+
+    sampleQueueInit(&busQueue, DropOldest);
+    publisherAddQueue(&busQueue);
+
+    // The built-in map, its fast group aggregated (-G 100) and not
+    for(int aggregate_ms = 0; aggregate_ms <= 100; aggregate_ms += 100){
+        RegisterMap *map = registerMapCreate(slave_ids, 1, aggregate_ms);
+        CHECK(map != NULL);
+        if(map == NULL) break;
+        for(int m = 0; m < 3; m ++){
+            long published, n;
+            publisherSetMode(modes[m]);
+            countCycles(&port, map, &busQueue, WarmupCycles);
+            published = fakeMessages;
+            n = countCycles(&port, map, &busQueue, CountedCycles);
+            printf("  %-9s %s: %li allocations in %i cycles, %li messages\n", names[m], aggregate_ms ? "aggregated" : "values    ",
+                   n, CountedCycles, fakeMessages - published);
+            CHECK(n == 0);
+            CHECK(fakeMessages > published);
+        }
+        registerMapFree(map);
+    }
+    return CHECK_DONE("allocTest");
+}
+
+
+
+/* COUNT CYCLES: Allocations made while polling and publishing a number of register groups.
+*/
+long countCycles(ModbusPort *port, RegisterMap *map, SampleQueue *queue, int cycles){
+    long before = allocations;
+
+    for(int c = 0; c < cycles; c ++) pollCycle(port, map, queue);
+    return allocations - before;
+}
+
+
+
+/* POLL CYCLE: What a bus thread and the publisher do for one register group (see busWorker
+   and publishValues in main.c): the most urgent group is read, its values or statistics are
+   queued, and the publisher drains the queue.
+*/
+void pollCycle(ModbusPort *port, RegisterMap *map, SampleQueue *queue){
+    float           values[MaxEntryParameters];
+    struct timespec stamps[MaxEntryParameters];
+    ScheduleEntry   *entry  = schedulerNext(&map->schedule);
+    const MapEntry  *group  = entry->context;
+    Sample          sample;
+
+    schedulerStart(entry);
+    modbusWindowQuery(port, entry->slave_id, entry->windows, entry->n_windows, entry->addresses, entry->fields, entry->n, values, stamps);
+    if(group->block >= 0){
+        Sample statistics[(AggregateStats - 1)*MaxEntryParameters];
+        aggregatorPush(group->block, values, stamps);
+        int n = aggregatorCollect(group->block, 0, statistics);
+        for(int i = 0; i < n; i ++) sampleQueuePush(queue, &statistics[i]);
+    }else{
+        sample.slave_id     = entry->slave_id;
+        sample.statistic    = StatValue;
+        for(int i = 0; i < entry->n; i ++){
+            sample.timestamp    = stamps[i];
+            sample.address      = group->device->keys[group->group->first + i];
+            sample.value        = values[i];
+            sample.status       = isnan(values[i]) ? SampleError : SampleOk;
+            strncpy(sample.topic, group->device->topics[group->group->first + i], SampleTopicSize - 1);
+            sample.topic[SampleTopicSize - 1] = '\0';
+            sample.last         = (i == entry->n - 1);
+            sampleQueuePush(queue, &sample);
+        }
+    }
+    schedulerDone(&map->schedule, entry, getScanRate());
+    publisherDrain();
+}
@@ -0,0 +1,449 @@
+/***********************************
+*          bench.c
+*
+* -Micro benchmarks of the hot
+*  paths of the daemon, each one
+*  reports what its change was
+*  meant to improve.
+*
+* build: make -C tests bench (all of them), or tests/benchmarks <name>...
+*
+***********************************/
+
+// Include the modbus, register map, publisher, aggregator, MQTT (fake) and test bus headers
+#include "../modbus.h"
+#include "../registerMap.h"
+#include "../publisher.h"
+#include "../aggregator.h"
+#include "fakeMqtt.h"
+#include "ptyLine.h"
+#include "bitwiseCrc.h"
+
+// Linux headers
+#include <pthread.h>
+#include <dirent.h>
+
+// Define constants
+#define ScanSize            8       // Parameters of a scan (fast group of the built-in map)
+#define JournalSamples      200000  // Samples journaled then replayed
+#define EncodedScans        200000  // Scans published in each mode
+#define LoggedPolls         2000    // Register groups polled with each logging setup
+#define AggregatePeriod     100     // Poll period of the aggregated group (ms)
+#define AggregateRounds     20000   // Statistics collected with each window
+#define HistoryScans        64800   // Scans kept in the history (18 hours, each of the 3 meters every 3 s)
+
+// Structs
+typedef struct{
+    const char  *name;
+    void        (*run)();
+}Benchmark;
+
+// Internal functions
+double      elapsed(const struct timespec *start);
+void        fillScan(Sample scan[], long cycle);
+void        benchCrc();
+void        benchJournal();
+void        benchEncoder();
+void        benchLogger();
+void        *discardOutput(void *arg);
+void        benchAggregator();
+void        benchHistory();
+double      historyQuery(const char *request, long *messages, long *bytes);
+
+// Variables
+static volatile uint32_t    sink;           // Results are stored here so the loops aren't optimised away
+static time_t               firstScan;      // Time of the first scan (a day ago, the history keeps recent days)
+static Benchmark            benchmarks[] = {
+    {"crc",     benchCrc},
+    {"journal", benchJournal},
+    {"encoder", benchEncoder},
+    {"logger",  benchLogger},
+    {"aggregator", benchAggregator},
+    {"history", benchHistory}
+};
+static const struct{
+    uint16_t    address;
+    const char  *topic;
+    float       value;
+}parameters[ScanSize] = {
+    {0x0000, "parameters/voltage",      230.0},
+    {0x0006, "parameters/current",      5.0},
+    {0x001E, "parameters/pf",           0.96},
+    {0x0024, "parameters/phase",        16.0},
+    {0x0046, "parameters/frequency",    50.0},
+    {0x0012, "power/apparent",          1150.0},
+    {0x000C, "power/active",            1100.0},
+    {0x0018, "power/reactive",          330.0}
+};
+
+
+
+int main(int argc, char *argv[]){
+    int n = sizeof(benchmarks)/sizeof(benchmarks[0]);
+
+    loggerLevel = LevelWarning;
+    firstScan = time(NULL) - 86400;
+    for(int b = 0; b < n; b ++){
+        int run = argc < 2;
+        for(int i = 1; i < argc; i ++) if(strcmp(argv[i], benchmarks[b].name) == 0) run = 1;
+        if(!run) continue;
+        printf("-- %s --\n", benchmarks[b].name);
+        benchmarks[b].run();
+    }
+    return 0;
+}
+
+
+
+/* CRC: Error check of frames from a read request (8 bytes) to the longest reply (255 bytes),
+   the table driven errorCheck() against the bit by bit algorithm it replaced.
+*/
+void benchCrc(){
+    uint8_t         frame[MaxFrameSize];
+    struct timespec start;
+    int             sizes[6] = {8, 16, 32, 64, 128, 255};
+    uint32_t        crc = 0;
+
+    for(int i = 0; i < MaxFrameSize; i ++) frame[i] = i*31 + 7;
+    for(int s = 0; s < 6; s ++){
+        double  seconds[2];
+        long    rounds = 50000000/sizes[s];
+        for(int table = 0; table < 2; table ++){
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for(long r = 0; r < rounds; r ++){
+                frame[0] = r;
+                crc += table ? errorCheck(frame, sizes[s]) : bitwiseCheck(frame, sizes[s]);
+            }
+            seconds[table] = elapsed(&start);
+        }
+        printf("  %3i bytes: bit by bit %6.1f MB/s, table %6.1f MB/s (%4.1fx, %6.1f ns/frame)\n", sizes[s],
+               rounds*sizes[s]/seconds[0]/1e6, rounds*sizes[s]/seconds[1]/1e6, seconds[0]/seconds[1], seconds[1]*1e9/rounds);
+    }
+    sink = crc;
+}
+
+
+
+/* JOURNAL: Samples written to the journal during an outage, then replayed through the publisher
+   (no rate limit, the fake broker accepts everything) in each publish mode.
+*/
+void benchJournal(){
+    char            dir[] = "/tmp/benchJournalXXXXXX";
+    PublishMode     modes[3] = {PublishPerTopic, PublishBatch, PublishCbor};
+    const char      *names[3] = {"per topic", "JSON", "CBOR"};
+    Sample          scan[ScanSize];
+    struct timespec start;
+
+    if(mkdtemp(dir) == NULL || journalOpen(dir, 4, JournalSamples/2) < 0){
+        printf("  No journal in %s\n", dir);
+        return;
+    }
+    publisherSetReplayRate(1 << 30);
+    for(int m = 0; m < 3; m ++){
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(long i = 0; i < JournalSamples; i ++){
+            if(i % ScanSize == 0) fillScan(scan, i/ScanSize);
+            journalAppend(&scan[i % ScanSize], RecordInclude | (scan[i % ScanSize].last ? RecordLast : 0));
+        }
+        double append_s = elapsed(&start);
+
+        long messages = fakeMessages, bytes = fakeBytes;
+        publisherSetMode(modes[m]);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while(journalPending() > 0) publisherDrain();
+        double replay_s = elapsed(&start);
+        printf("  %-9s append %6.2f M records/s, replay %6.2f M records/s (%li messages, %.1f MB)\n", names[m],
+               JournalSamples/append_s/1e6, JournalSamples/replay_s/1e6, fakeMessages - messages, (fakeBytes - bytes)/1e6);
+    }
+
+    // The files stay mapped until the end of the process, only their names go
+    for(int i = 0; i <= 4; i ++){
+        char path[64];
+        if(i < 4) snprintf(path, sizeof(path), "%s/segment-%03i.jnl", dir, i);
+        else snprintf(path, sizeof(path), "%s/checkpoint.jnl", dir);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+
+
+/* ENCODER: Scans published in each mode (queue, encoding and the fake broker), against the text of the
+   values alone: sprintf("%f") as it was, and floatToText().
+*/
+void benchEncoder(){
+    PublishMode     modes[4] = {PublishPerTopic, PublishBatch, PublishCbor, PublishSparkplug};
+    const char      *names[4] = {"per topic", "JSON", "CBOR", "Sparkplug"};
+    SampleQueue     *queue = malloc(sizeof(SampleQueue));
+    Sample          scan[ScanSize];
+    struct timespec start;
+    char            s[32];
+    long            bytes = 0;
+
+    // Text of the values only (what the per topic mode sends as payload)
+    for(int f = 0; f < 2; f ++){
+        bytes = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(long c = 0; c < EncodedScans; c ++){
+            fillScan(scan, c);
+            for(int i = 0; i < ScanSize; i ++) bytes += f ? floatToText(s, scan[i].value) : sprintf(s, "%f", scan[i].value);
+        }
+        double seconds = elapsed(&start);
+        printf("  %-11s %7.0f ns/scan, %5.1f payload bytes/scan\n", f ? "floatToText" : "sprintf %f",
+               seconds*1e9/EncodedScans, (double)bytes/EncodedScans);
+    }
+
+    sampleQueueInit(queue, DropOldest);
+    if(publisherAddQueue(queue) < 0 || sparkplugInit("bench:node") < 0) return;
+    for(int m = 0; m < 4; m ++){
+        publisherSetMode(modes[m]);
+        fillScan(scan, 0);
+        for(int i = 0; i < ScanSize; i ++) sampleQueuePush(queue, &scan[i]);
+        publisherDrain();       // Birth certificates of Sparkplug
+
+        long messages = fakeMessages, payload = fakeBytes, topics = fakeTopicBytes;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(long c = 1; c <= EncodedScans; c ++){
+            fillScan(scan, c);
+            for(int i = 0; i < ScanSize; i ++) sampleQueuePush(queue, &scan[i]);
+            publisherDrain();
+        }
+        double seconds = elapsed(&start);
+        printf("  %-11s %7.0f ns/scan, %5.1f payload + %5.1f topic bytes/scan in %.0f message(s)\n", names[m],
+               seconds*1e9/EncodedScans, (double)(fakeBytes - payload)/EncodedScans,
+               (double)(fakeTopicBytes - topics)/EncodedScans, (double)(fakeMessages - messages)/EncodedScans);
+    }
+}
+
+
+
+/* LOGGER: CPU time of the polling thread per register group read from a pseudo-terminal, with stdout
+   going to a pipe (as to journald). The messages of every transaction printed at once (before the
+   writer thread runs, as the queries did) against the ring of the writer thread, and the default level.
+*/
+void benchLogger(){
+    const char      *names[3] = {"printed at once, trace", "writer thread, trace", "writer thread, default"};
+    int             levels[3] = {LevelTrace, LevelTrace, LevelInfo};
+    uint8_t         slave_ids[1] = {1};
+    ModbusPort      port = {0};
+    RegisterMap     *map;
+    float           values[MaxEntryParameters];
+    struct timespec stamps[MaxEntryParameters];
+    int             output[2];
+    int             saved = dup(STDOUT_FILENO);
+    pthread_t       thread;
+
+    if(ptyLineOpen(&port) < 0 || (map = registerMapCreate(slave_ids, 1, 0)) == NULL || saved < 0 || pipe(output) < 0){
+        printf("  No bus\n");
+        return;
+    }
+    pthread_create(&thread, NULL, discardOutput, &output[0]);
+
+    for(int c = 0; c < 3; c ++){
+        struct timespec cpu, start, end;
+
+        if(c == 1) loggerStart();
+        fflush(stdout);
+        dup2(output[1], STDOUT_FILENO);
+        loggerLevel = levels[c];
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int p = 0; p < LoggedPolls; p ++){
+            ScheduleEntry *entry = schedulerNext(&map->schedule);
+            schedulerStart(entry);
+            modbusWindowQuery(&port, entry->slave_id, entry->windows, entry->n_windows, entry->addresses, entry->fields, entry->n, values, stamps);
+            schedulerDone(&map->schedule, entry, getScanRate());
+        }
+        double seconds = elapsed(&start);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+        double cpu_s = (end.tv_sec - cpu.tv_sec) + (end.tv_nsec - cpu.tv_nsec)/1e9;
+
+        // The writer thread empties the ring before stdout is given back
+        loggerLevel = LevelWarning;
+        usleep(10*LoggerIdle*1000);
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        printf("  %-23s %6.1f us CPU of the polling thread, %6.1f us per group\n", names[c], cpu_s*1e6/LoggedPolls, seconds*1e6/LoggedPolls);
+    }
+    registerMapFree(map);
+}
+
+
+
+/* DISCARD OUTPUT: Reads what is written to stdout and throws it away (the console of the benchmark).
+*/
+void *discardOutput(void *arg){
+    int     fd = *(int*)arg;
+    char    buffer[4096];
+
+    while(read(fd, buffer, sizeof(buffer)) > 0);
+    return NULL;
+}
+
+
+
+/* AGGREGATOR: The fast group polled every AggregatePeriod and its statistics collected every second,
+   over a short window (1 s) and the longest one (SeriesCapacity scans). Values pushed are timed apart
+   from the statistics computed over the window.
+*/
+void benchAggregator(){
+    int             windows[2] = {1000, SeriesCapacity*AggregatePeriod};
+    int             per_collect = 1000/AggregatePeriod;
+    StartAddress_3X addresses[ScanSize];
+    char            *topics[ScanSize];
+    Sample          scan[ScanSize];
+    Sample          statistics[(AggregateStats - 1)*ScanSize];
+    float           values[ScanSize];
+    struct timespec stamps[ScanSize];
+    struct timespec start;
+
+    for(int i = 0; i < ScanSize; i ++){
+        addresses[i]    = parameters[i].address;
+        topics[i]       = (char*)parameters[i].topic;
+    }
+    for(int w = 0; w < 2; w ++){
+        double  push_s = 0, collect_s = 0;
+        long    collected = 0;
+        int     block;
+
+        aggregatorSetWindow(windows[w]);
+        block = aggregatorAdd(1, R_3X, addresses, topics, ScanSize);
+        if(block < 0) return;
+
+        // The window is filled first, then every collect has the whole window to go through
+        for(long c = 0; c < SeriesCapacity + (long)AggregateRounds*per_collect; c ++){
+            fillScan(scan, c);
+            for(int i = 0; i < ScanSize; i ++){
+                values[i]               = scan[i].value;
+                stamps[i].tv_sec        = c*AggregatePeriod/1000;
+                stamps[i].tv_nsec       = (c*AggregatePeriod%1000)*1000000;
+            }
+            if(c < SeriesCapacity){
+                aggregatorPush(block, values, stamps);
+                continue;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            aggregatorPush(block, values, stamps);
+            push_s += elapsed(&start);
+            if((c + 1) % per_collect != 0) continue;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            collected += aggregatorCollect(block, 1000, statistics);
+            collect_s += elapsed(&start);
+        }
+        aggregatorRelease(block);
+        sink = collected;
+
+        long pushed = (long)AggregateRounds*per_collect*ScanSize;
+        long window = (long)AggregateRounds*ScanSize*(windows[w]/AggregatePeriod);
+        printf("  window %6i ms: push %5.1f ns/sample, statistics %5.2f ns/sample of the window (%7.2f us per collect)\n",
+               windows[w], push_s*1e9/pushed, collect_s*1e9/window, collect_s*1e6/AggregateRounds);
+    }
+    aggregatorSetWindow(0);
+}
+
+
+
+/* HISTORY: Size of the compressed history against the raw points (8 bytes of time, 4 of value),
+   and the time to send back ranges of it to the fake broker.
+*/
+void benchHistory(){
+    char            dir[] = "/tmp/benchHistoryXXXXXX";
+    char            path[64], request[128];
+    Sample          scan[ScanSize];
+    struct timespec start;
+    struct dirent   *file;
+    struct stat     status;
+    DIR             *files;
+    double          disk = 0;
+    long            messages, bytes;
+
+    if(mkdtemp(dir) == NULL || historyOpen(dir, HistoryDayMiB, HistoryDays) < 0){
+        printf("  No history in %s\n", dir);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long c = 0; c < HistoryScans; c ++){
+        fillScan(scan, c);
+        for(int i = 0; i < ScanSize; i ++) historyAppend(&scan[i]);
+    }
+    double seconds = elapsed(&start);
+    long points = HistoryScans*ScanSize;
+
+    files = opendir(dir);
+    while(files != NULL && (file = readdir(files)) != NULL){
+        snprintf(path, sizeof(path), "%s/%.20s", dir, file->d_name);
+        if(file->d_name[0] != '.' && stat(path, &status) == 0) disk += status.st_blocks*512.0;
+    }
+    printf("  append %6.2f M points/s, %li points: %.1f MB raw, %.2f MB on disk (%.1f bits/point, ratio %.1f)\n",
+           points/seconds/1e6, points, points*12/1e6, disk/1e6, disk*8/points, points*12/disk);
+
+    // Every point of a meter, then one hour in the middle (the blocks outside are skipped)
+    int64_t from_ms = (int64_t)firstScan*1000;
+    int64_t to_ms   = from_ms + (int64_t)HistoryScans*1000;
+    snprintf(request, sizeof(request), "all 1 %lld %lld", (long long)from_ms, (long long)to_ms);
+    seconds = historyQuery(request, &messages, &bytes);
+    printf("  query 18 h of a meter: %7.2f ms, %5li messages, %.2f MB, %.2f M points/s\n", seconds*1e3, messages, bytes/1e6,
+           points/3/seconds/1e6);
+    snprintf(request, sizeof(request), "hour 1 %lld %lld", (long long)(from_ms + 9*3600000), (long long)(from_ms + 10*3600000));
+    seconds = historyQuery(request, &messages, &bytes);
+    printf("  query 1 h of a meter:  %7.2f ms, %5li messages, %.2f MB, %.2f M points/s\n", seconds*1e3, messages, bytes/1e6,
+           points/3/18/seconds/1e6);
+
+    // The partitions stay mapped until the end of the process, only the files go
+    if(files != NULL){
+        rewinddir(files);
+        while((file = readdir(files)) != NULL){
+            snprintf(path, sizeof(path), "%s/%.20s", dir, file->d_name);
+            if(file->d_name[0] != '.') unlink(path);
+        }
+        closedir(files);
+    }
+    rmdir(dir);
+}
+
+
+
+/* HISTORY QUERY: Serves a history request to the end.
+    returns seconds taken
+*/
+double historyQuery(const char *request, long *messages, long *bytes){
+    struct timespec start;
+    long            first_messages = fakeMessages, first_bytes = fakeBytes;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    historyRequest(request, strlen(request));
+    while(historyServe() > 0);
+    double seconds = elapsed(&start);
+    *messages   = fakeMessages - first_messages;
+    *bytes      = fakeBytes - first_bytes;
+    return seconds;
+}
+
+
+
+/* FILL SCAN: The fast parameters of a meter read in one scan, the values move a bit from one cycle to the next.
+*/
+void fillScan(Sample scan[], long cycle){
+    for(int i = 0; i < ScanSize; i ++){
+        scan[i].timestamp.tv_sec    = firstScan + cycle;
+        scan[i].timestamp.tv_nsec   = (cycle % 1000)*1000000;
+        scan[i].slave_id            = 1 + cycle % 3;
+        scan[i].address             = parameters[i].address;
+        scan[i].value               = parameters[i].value*(1 + 0.01f*((cycle*7 + i) % 5 - 2));
+        scan[i].status              = SampleOk;
+        scan[i].statistic           = StatValue;
+        scan[i].last                = (i == ScanSize - 1);
+        strcpy(scan[i].topic, parameters[i].topic);
+    }
+}
+
+
+
+/* ELAPSED: Seconds since start (CLOCK_MONOTONIC).
+*/
+double elapsed(const struct timespec *start){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec)/1e9;
+}
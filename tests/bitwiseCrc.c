@@ -0,0 +1,32 @@
+/***********************************
+*          bitwiseCrc.c
+*
+* -The error check computed bit by
+*  bit, as errorCheck() did before
+*  its table: the reference of the
+*  CRC test and benchmark.
+*
+* used with bitwiseCrc.h
+*
+***********************************/
+
+// Include header file
+#include "bitwiseCrc.h"
+
+
+
+/* BIT BY BIT ERROR CHECK: The algorithm of SDM230-ModBus Protocol V1.2 (polynomial 0xA001),
+   the reference of the table driven errorCheck().
+*/
+uint16_t bitwiseCheck(const uint8_t bytes[], int n){
+    uint16_t errorWord = 0xFFFF;
+
+    for(int i = 0; i < n; i ++){
+        errorWord ^= bytes[i];
+        for(int bit = 0; bit < 8; bit ++){
+            if(errorWord & 0x0001) errorWord = (errorWord >> 1) ^ 0xA001;
+            else errorWord >>= 1;
+        }
+    }
+    return errorWord;
+}
@@ -0,0 +1,10 @@
+#ifndef bitwiseCrc
+#define bitwiseCrc
+
+// C headers
+#include <stdint.h>
+
+// Functions
+uint16_t    bitwiseCheck(const uint8_t bytes[], int n);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef check
+#define check
+
+// Standard C libraries
+#include <stdio.h>
+
+// Macros (a failed check is printed and counted, the test goes on)
+#define CHECK(condition)    do{ if(!(condition)){ printf("  FAILED %s:%i: %s\n", __FILE__, __LINE__, #condition); checkFailures ++; } }while(0)
+#define CHECK_DONE(name)    (printf("%s: %s\n", name, checkFailures ? "FAILED" : "passed"), checkFailures ? 1 : 0)
+
+// Variables (one per test program)
+static int checkFailures = 0;
+
+#endif
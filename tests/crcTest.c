@@ -0,0 +1,55 @@
+/***********************************
+*          crcTest.c
+*
+* -Known answers of the table
+*  driven error check, and random
+*  buffers checked against the bit
+*  by bit algorithm of the manual.
+*
+* build: make -C tests check
+*
+***********************************/
+
+// Include the modbus (errorCheck), bit by bit reference and test headers
+#include "../modbus.h"
+#include "bitwiseCrc.h"
+#include "check.h"
+
+// Define constants
+#define RandomBuffers       10000   // Random buffers compared
+#define MaxBufferSize       256     // Longest buffer (a whole RTU frame)
+
+
+
+int main(){
+    uint32_t seed = 7;
+
+    // Read voltage request of the SDM230 manual: 01 04 00 00 00 02, error check 71 CB on the line
+    uint8_t voltage[6] = {0x01, 0x04, 0x00, 0x00, 0x00, 0x02};
+    CHECK(errorCheck(voltage, 6) == 0xCB71);
+    CHECK(bitwiseCheck(voltage, 6) == 0xCB71);
+
+    // Standard check value of CRC-16/MODBUS ("123456789"), and the empty buffer
+    uint8_t digits[9] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    CHECK(errorCheck(digits, 9) == 0x4B37);
+    CHECK(errorCheck(digits, 0) == 0xFFFF);
+
+    // A frame followed by its error check (low byte first) leaves a zero remainder
+    uint8_t frame[8] = {0x01, 0x04, 0x00, 0x00, 0x00, 0x02, 0x71, 0xCB};
+    CHECK(errorCheck(frame, 8) == 0x0000);
+
+    for(int b = 0; b < RandomBuffers; b ++){
+        uint8_t buffer[MaxBufferSize];
+        int     n;
+
+        seed = seed*1103515245 + 12345;
+        n = (seed >> 16) % (MaxBufferSize + 1);
+        for(int i = 0; i < n; i ++){
+            seed = seed*1103515245 + 12345;
+            buffer[i] = seed >> 24;
+        }
+        CHECK(errorCheck(buffer, n) == bitwiseCheck(buffer, n));
+    }
+    return CHECK_DONE("crcTest");
+}
+
@@ -0,0 +1,103 @@
+/***********************************
+*          fakeMqtt.c
+*
+* -Fake MQTT client for the tests
+*  and benchmarks: replaces
+*  mqttClient.c, messages are only
+*  counted (no broker needed).
+*
+* used with fakeMqtt.h
+*
+***********************************/
+
+// Include header file
+#include "fakeMqtt.h"
+
+// Variables
+int     fakeConnected   = 1;
+int     fakeResult      = MOSQ_ERR_SUCCESS;
+long    fakeMessages    = 0;
+long    fakeBytes       = 0;
+long    fakeTopicBytes  = 0;
+void    (*fakeObserver)(const char *topic, const void *payload, int len) = NULL;
+static const char   *handlerTopics[4];
+static void         (*handlers[4])(const char *payload, int len);
+static int          n_handlers = 0;
+
+
+
+void mqtt_setup(int threaded){
+    (void)threaded;
+}
+
+int mqtt_send(char *msg, char *topic){
+    return mqtt_publish(topic, msg, strlen(msg), 0, false);
+}
+
+int mqtt_publish(const char *topic, const void *payload, int len, int qos, bool retain){
+    (void)qos; (void)retain;
+    if(fakeResult != MOSQ_ERR_SUCCESS) return fakeResult;
+    fakeMessages ++;
+    fakeBytes += len;
+    fakeTopicBytes += strlen(topic);
+    if(fakeObserver != NULL) fakeObserver(topic, payload, len);
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt_will(const char *topic, const void *payload, int len, int qos, bool retain){
+    (void)topic; (void)payload; (void)len; (void)qos; (void)retain;
+    return 0;
+}
+
+int mqtt_handler(const char *topic, void (*handler)(const char *payload, int len)){
+    if(n_handlers == 4) return -1;
+    handlerTopics[n_handlers] = topic;
+    handlers[n_handlers ++] = handler;
+    return 0;
+}
+
+// Calls the handler of a topic (exact match) as the MQTT client would, returns -1 if there's none
+int fakeDeliver(const char *topic, const void *payload, int len){
+    for(int i = 0; i < n_handlers; i ++){
+        if(strcmp(handlerTopics[i], topic) != 0) continue;
+        handlers[i]((const char*)payload, len);
+        return 0;
+    }
+    return -1;
+}
+
+int getScanRate(){
+    return 1000;
+}
+
+int mqtt_connected(){
+    return fakeConnected;
+}
+
+int mqtt_sessions(){
+    return 1;
+}
+
+int mqtt_socket(){
+    return -1;
+}
+
+int mqtt_loop_read(){
+    return 0;
+}
+
+int mqtt_loop_write(){
+    return 0;
+}
+
+int mqtt_loop_misc(){
+    return 0;
+}
+
+bool mqtt_want_write(){
+    return false;
+}
+
+int mqtt_reconnect(){
+    return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef fakeMqtt
+#define fakeMqtt
+
+// Include the MQTT client header (the functions faked)
+#include "../mqttClient.h"
+
+// Shared Variables
+extern int      fakeConnected;      // mqtt_connected() (1 by default)
+extern int      fakeResult;         // Result of mqtt_publish() (MOSQ_ERR_SUCCESS by default)
+extern long     fakeMessages;       // Messages published
+extern long     fakeBytes;          // Their payload bytes
+extern long     fakeTopicBytes;     // Their topic bytes
+extern void     (*fakeObserver)(const char *topic, const void *payload, int len);  // Sees every message published (if set)
+
+// Functions
+int         fakeDeliver(const char *topic, const void *payload, int len);
+
+#endif
@@ -0,0 +1,144 @@
+/***********************************
+*          floatTextTest.c
+*
+* -Checks floatToText(): every text
+*  reads back as the same float, and
+*  has no more digits than the
+*  shortest printf precision that
+*  does (the same digits then).
+*
+* build: make -C tests check
+*
+***********************************/
+
+// Include the float to text and test headers
+#include "../floatText.h"
+#include "check.h"
+
+// C headers
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+// Define constants
+#define RandomFloats        250000      // Random bit patterns checked
+
+// Internal functions
+void        checkFloat(float value);
+int         significantDigits(const char *text, char digits[]);
+int         shortestPrintf(float value, char digits[]);
+
+// Variables
+static long checked     = 0;
+static long shorter     = 0;    // Texts shorter than printf's shortest (a closer bound on one side)
+
+
+
+int main(){
+    char        s[FloatTextSize];
+    uint32_t    seed = 2024;
+
+    // Examples of floatText.c and the special values
+    CHECK(floatToText(s, 230.1f) == 5 && strcmp(s, "230.1") == 0);
+    CHECK(floatToText(s, 0.1f) == 3 && strcmp(s, "0.1") == 0);
+    CHECK(floatToText(s, 1e10f) == 5 && strcmp(s, "1e+10") == 0);
+    CHECK(floatToText(s, 1e9f) == 5 && strcmp(s, "1e+09") == 0);
+    CHECK(floatToText(s, 123456789.0f) == 9 && strcmp(s, "123456790") == 0);
+    CHECK(floatToText(s, 0.00001f) == 7 && strcmp(s, "0.00001") == 0);
+    CHECK(floatToText(s, -2.5e-6f) == 8 && strcmp(s, "-2.5e-06") == 0);
+    CHECK(floatToText(s, 0.0f) == 1 && strcmp(s, "0") == 0);
+    CHECK(floatToText(s, -0.0f) == 2 && strcmp(s, "-0") == 0);
+    CHECK(floatToText(s, NAN) == 3 && strcmp(s, "nan") == 0);
+    CHECK(floatToText(s, -INFINITY) == 4 && strcmp(s, "-inf") == 0);
+
+    // Limits of the format and of the float
+    float limits[] = {FLT_MIN, FLT_MAX, FLT_TRUE_MIN, -FLT_MAX, 1.0f, 50.0f, 49.99f, 16777216.0f, 16777217.0f, 1e-5f, 9.99999e8f, 1e9f};
+    for(int i = 0; i < (int)(sizeof(limits)/sizeof(limits[0])); i ++) checkFloat(limits[i]);
+
+    // Every power of 2, and its neighbours (the interval is asymmetric at powers of 2)
+    for(int e = -149; e <= 127; e ++){
+        float p = ldexpf(1.0f, e);
+        checkFloat(p);
+        checkFloat(nextafterf(p, 0));
+        checkFloat(nextafterf(p, INFINITY));
+    }
+
+    // Random bit patterns (every exponent, subnormals included)
+    for(int i = 0; i < RandomFloats; i ++){
+        uint32_t bits;
+        float    value;
+
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        bits = seed;
+        memcpy(&value, &bits, sizeof(value));
+        if(isfinite(value)) checkFloat(value);
+    }
+    printf("  %li floats read back, %li shorter than printf\n", checked, shorter);
+    return CHECK_DONE("floatTextTest");
+}
+
+
+
+/* CHECK FLOAT: The text reads back as the float and is the shortest.
+*/
+void checkFloat(float value){
+    char    s[FloatTextSize];
+    char    digits[16], reference[16];
+    int     len, n, n_reference;
+    float   back;
+
+    len = floatToText(s, value);
+    back = strtof(s, NULL);
+    checked ++;
+    if((int)strlen(s) != len || memcmp(&back, &value, sizeof(float)) != 0){
+        printf("  %.9g -> \"%s\" reads back as %.9g\n", value, s, back);
+        checkFailures ++;
+        return;
+    }
+
+    // printf rounds to the closest text with the precision given: the same digits at the same length
+    n = significantDigits(s, digits);
+    n_reference = shortestPrintf(value, reference);
+    if(n > n_reference || (n == n_reference && strcmp(digits, reference) != 0)){
+        printf("  %.9g -> \"%s\", printf shortest has %i digits (%s)\n", value, s, n_reference, reference);
+        checkFailures ++;
+    }
+    if(n < n_reference) shorter ++;
+}
+
+
+
+/* SIGNIFICANT DIGITS: Digits of a number without the sign, point, exponent and the zeros at both ends.
+    returns number of digits
+*/
+int significantDigits(const char *text, char digits[]){
+    int n = 0;
+
+    for(const char *c = text; *c != '\0' && *c != 'e'; c ++){
+        if(*c < '0' || *c > '9') continue;
+        if(n == 0 && *c == '0') continue;
+        digits[n ++] = *c;
+    }
+    while(n > 1 && digits[n - 1] == '0') n --;
+    if(n == 0) digits[n ++] = '0';
+    digits[n] = '\0';
+    return n;
+}
+
+
+
+/* SHORTEST PRINTF: Digits of the lowest "%.*e" precision that reads back as the float.
+    returns number of digits
+*/
+int shortestPrintf(float value, char digits[]){
+    char s[32];
+
+    for(int precision = 0; precision < 9; precision ++){
+        snprintf(s, sizeof(s), "%.*e", precision, value);
+        if(strtof(s, NULL) == value) break;
+    }
+    return significantDigits(s, digits);
+}
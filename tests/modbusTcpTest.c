@@ -0,0 +1,219 @@
+/***********************************
+*          modbusTcpTest.c
+*
+* -Checks the Modbus TCP transport
+*  against a gateway on loopback:
+*  pipelined requests answered out
+*  of order, exceptions, and a new
+*  connection when the gateway
+*  closes the old one.
+*
+* build: make -C tests check
+*
+***********************************/
+
+// Include the Modbus TCP and test headers
+#include "../modbusTcp.h"
+#include "check.h"
+
+// Linux headers
+#include <pthread.h>
+#include <arpa/inet.h>
+
+// Define constants
+#define TestWindows         4       // Windows read by each query
+#define ResponderWait       50      // Time the gateway waits for more requests before answering (ms)
+
+// Enums
+typedef enum{
+    GatewayReverse,         // Answers the requests waiting in the reverse order
+    GatewayClose            // Closes the first connection at its first request, then as GatewayReverse
+}GatewayMode;
+
+// Internal functions
+void        *gateway(void *arg);
+void        serveConnection(int fd);
+void        answer(int fd, const uint8_t request[]);
+int         listenLoopback(int *port);
+int         query(ModbusPort *port, uint8_t unit_id, uint8_t *data[], int lengths[]);
+
+// Variables
+static const RegisterWindow windows[TestWindows] = {{0x0000, 2}, {0x0006, 2}, {0x000C, 2}, {0x0046, 2}};
+static int                  listenFd;
+static _Atomic int          mode            = GatewayReverse;
+static _Atomic int          exceptionStart  = -1;   // Window answered with an exception (-1 none)
+static _Atomic int          exceptionCode   = 0;
+static _Atomic int          connections     = 0;    // Connections accepted
+static _Atomic int          requests[TestWindows];  // Requests recieved for each window
+static _Atomic int          maxWaiting      = 0;    // Most requests waiting for an answer at once
+
+
+
+int main(){
+    ModbusPort  port = {0};
+    uint8_t     buffers[TestWindows][2*2];
+    uint8_t     *data[TestWindows];
+    int         lengths[TestWindows];
+    char        path[32];
+    int         tcp_port;
+    pthread_t   thread;
+
+    loggerLevel = LevelWarning;
+    for(int w = 0; w < TestWindows; w ++) data[w] = buffers[w];
+    if(listenLoopback(&tcp_port) < 0){
+        CHECK(0);
+        return CHECK_DONE("modbusTcpTest");
+    }
+    pthread_create(&thread, NULL, gateway, NULL);
+    snprintf(path, sizeof(path), "127.0.0.1:%i", tcp_port);
+    port.path               = path;
+    port.transport          = TransportTcp;
+    port.fd                 = -1;
+    port.response_timeout   = 500;
+
+    // Pipelined requests, answered in the reverse order: each window gets its own registers
+    CHECK(query(&port, 1, data, lengths) == TestWindows);
+    for(int w = 0; w < TestWindows; w ++){
+        CHECK(lengths[w] == 4 && bytesToFloat(data[w]) == windows[w].start);
+        CHECK(requests[w] == 1);
+    }
+    CHECK(maxWaiting == TestWindows);
+    CHECK(connections == 1);
+
+    // Recognized exception: sent again, then given up; the other windows are read
+    exceptionStart  = windows[2].start;
+    exceptionCode   = 0x02;
+    CHECK(query(&port, 2, data, lengths) == TestWindows - 1);
+    CHECK(lengths[2] == -1 && lengths[0] == 4 && lengths[3] == 4);
+    CHECK(requests[2] == AttemptTimeout);
+
+    // Exception not recognized: given up at once
+    exceptionCode   = 0x0B;
+    CHECK(query(&port, 3, data, lengths) == TestWindows - 1);
+    CHECK(lengths[2] == -1);
+    CHECK(requests[2] == 1);
+    exceptionStart  = -1;
+
+    // The gateway closes the connection: the client connects again and sends the requests again
+    modbusTcpClose(&port);
+    connections = 0;
+    mode        = GatewayClose;
+    CHECK(query(&port, 4, data, lengths) == TestWindows);
+    for(int w = 0; w < TestWindows; w ++) CHECK(lengths[w] == 4 && bytesToFloat(data[w]) == windows[w].start);
+    CHECK(connections == 2);
+
+    modbusTcpClose(&port);
+    return CHECK_DONE("modbusTcpTest");
+}
+
+
+
+/* QUERY: Reads the test windows from a unit, counting the requests the gateway recieves.
+    returns number of windows read
+*/
+int query(ModbusPort *port, uint8_t unit_id, uint8_t *data[], int lengths[]){
+    for(int w = 0; w < TestWindows; w ++) requests[w] = 0;
+    return modbusTcpPipeline(port, unit_id, R_3X, windows, TestWindows, data, lengths);
+}
+
+
+
+/* GATEWAY: Accepts one connection at a time and answers its requests.
+*/
+void *gateway(void *arg){
+    (void)arg;
+    while(1){
+        int fd = accept(listenFd, NULL, NULL);
+        if(fd < 0) return NULL;
+        connections ++;
+        serveConnection(fd);
+    }
+}
+
+
+
+/* SERVE CONNECTION: Collects the requests sent together (until none comes for ResponderWait),
+   and answers them last first.
+*/
+void serveConnection(int fd){
+    struct pollfd   fds = {fd, POLLIN, 0};
+    uint8_t         waiting[MaxPipeline][12];
+    uint8_t         buffer[12*MaxPipeline];
+    int             have = 0, n_waiting = 0;
+
+    while(1){
+        int ready = poll(&fds, 1, n_waiting > 0 ? ResponderWait : -1);
+        if(ready == 0){
+            if(n_waiting > maxWaiting) maxWaiting = n_waiting;
+            while(n_waiting > 0) answer(fd, waiting[-- n_waiting]);
+            continue;
+        }
+        int n = read(fd, buffer + have, sizeof(buffer) - have);
+        if(n <= 0){
+            close(fd);
+            return;
+        }
+        have += n;
+        while(have >= 12){
+            uint16_t start = buffer[8] << 8 | buffer[9];
+            for(int w = 0; w < TestWindows; w ++) if(windows[w].start == start) requests[w] ++;
+            if(mode == GatewayClose && connections == 1){
+                close(fd);
+                return;
+            }
+            if(n_waiting < MaxPipeline) memcpy(waiting[n_waiting ++], buffer, 12);
+            have -= 12;
+            memmove(buffer, buffer + 12, have);
+        }
+    }
+}
+
+
+
+/* ANSWER: Sends the response to a read request: the start address of the window as a float
+   in each pair of registers, or the exception set for it.
+*/
+void answer(int fd, const uint8_t request[]){
+    uint8_t     response[TcpFrameSize];
+    uint16_t    start = request[8] << 8 | request[9];
+    uint16_t    count = request[10] << 8 | request[11];
+    int         length;
+
+    memcpy(response, request, 4);           // Transaction and protocol IDs
+    response[6] = request[6];               // Unit ID
+    if(start == exceptionStart){
+        response[7] = request[7] | 0x80;
+        response[8] = exceptionCode;
+        length = 9;
+    }else{
+        response[7] = request[7];
+        response[8] = 2*count;
+        for(int r = 0; r + 1 < count; r += 2) floatToBytes(start, &response[9 + 2*r]);
+        length = 9 + 2*count;
+    }
+    response[4] = GET_HIGH((length - 6));   // Length of unit ID and PDU
+    response[5] = GET_LOW((length - 6));
+    if(write(fd, response, length) < 0) return;
+}
+
+
+
+/* LISTEN LOOPBACK: Opens the socket of the gateway on a free port of 127.0.0.1.
+    returns 0 if listening
+            or -1 if error
+*/
+int listenLoopback(int *port){
+    struct sockaddr_in  address;
+    socklen_t           size = sizeof(address);
+
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listenFd < 0) return -1;
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_port        = 0;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(listenFd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listenFd, 4) < 0) return -1;
+    if(getsockname(listenFd, (struct sockaddr *)&address, &size) < 0) return -1;
+    *port = ntohs(address.sin_port);
+    return 0;
+}
@@ -0,0 +1,86 @@
+/***********************************
+*          ptyLine.c
+*
+* -A bus for the tests and
+*  benchmarks: a raw pseudo-terminal
+*  with a responder thread on its
+*  master side answering every read.
+*
+* used with ptyLine.h
+*
+***********************************/
+
+// Pseudo-terminals (posix_openpt(), ptsname(), cfmakeraw())
+#define _GNU_SOURCE
+
+// Include header file
+#include "ptyLine.h"
+
+// Linux headers
+#include <pthread.h>
+
+
+
+/* OPEN LINE: A raw pseudo-terminal used as the RTU port, and a thread answering on it.
+    returns 0 on success
+            or -1 if error
+*/
+int ptyLineOpen(ModbusPort *port){
+    static int      master_fd;
+    struct termios  tty;
+    pthread_t       thread;
+    char            *name;
+
+    master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master_fd < 0 || grantpt(master_fd) < 0 || unlockpt(master_fd) < 0 || (name = ptsname(master_fd)) == NULL) return -1;
+    port->fd = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if(port->fd < 0) return -1;
+    tcgetattr(port->fd, &tty);
+    cfmakeraw(&tty);
+    tcsetattr(port->fd, TCSANOW, &tty);
+    tcgetattr(master_fd, &tty);
+    cfmakeraw(&tty);
+    tcsetattr(master_fd, TCSANOW, &tty);
+
+    port->path              = "pty";
+    port->transport         = TransportRtu;
+    port->baud_rate         = 9600;
+    port->response_timeout  = 500;
+    if(pthread_create(&thread, NULL, ptyLineResponder, &master_fd) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+
+
+/* RESPONDER: Answers every read request on the line with 230.0 in each pair of registers.
+*/
+void *ptyLineResponder(void *arg){
+    int         fd = *(int*)arg;
+    uint8_t     request[8];
+    uint8_t     reply[5 + 2*MaxWindowRegisters];
+    int         have = 0;
+
+    while(1){
+        int n = read(fd, request + have, sizeof(request) - have);
+        if(n <= 0) return NULL;
+        have += n;
+        if(have < (int)sizeof(request)) continue;
+        have = 0;
+
+        uint16_t count = (request[4] << 8) | request[5];
+        if(count > MaxWindowRegisters) continue;
+        reply[0] = request[0];
+        reply[1] = request[1];
+        reply[2] = 2*count;
+        for(int r = 0; r + 1 < count; r += 2) floatToBytes(230.0f, &reply[3 + 2*r]);
+        if(count & 1){
+            reply[3 + 2*(count - 1)] = 0;
+            reply[4 + 2*(count - 1)] = 1;
+        }
+        uint16_t errorWord = errorCheck(reply, 3 + 2*count);
+        reply[3 + 2*count] = GET_LOW(errorWord);
+        reply[4 + 2*count] = GET_HIGH(errorWord);
+        if(write(fd, reply, 5 + 2*count) < 0) return NULL;
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef ptyLine
+#define ptyLine
+
+// Include the modbus header (ModbusPort, errorCheck)
+#include "../modbus.h"
+
+// Functions
+int         ptyLineOpen(ModbusPort *port);
+void        *ptyLineResponder(void *arg);
+
+#endif
@@ -0,0 +1,51 @@
+/***********************************
+*          rtuParserFuzz.c
+*
+* -libFuzzer harness of the RTU
+*  stream parser: any input is fed
+*  in pieces and every frame found
+*  must be whole and valid.
+*
+* build: make -C tests fuzz (clang), run: tests/rtuParserFuzz -max_total_time=60
+*
+***********************************/
+
+// Include the modbus (parser, errorCheck) header
+#include "../modbus.h"
+
+// Linux headers
+#include <assert.h>
+
+
+
+/* FUZZ ONE INPUT: The first byte chooses the slave, the second the size of the pieces fed.
+*/
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    RtuParser   parser;
+    RtuFrame    frame;
+    size_t      fed;
+    int         chunk;
+
+    if(size < 2) return 0;
+    rtuParserInit(&parser, data[0] % 4, data[0] & 0x80 ? R_3X : 0);
+    chunk = 1 + data[1];
+    data += 2;
+    size -= 2;
+
+    for(fed = 0; fed < size || rtuParserPending(&parser) > 0;){
+        if(fed < size){
+            size_t n = size - fed < (size_t)chunk ? size - fed : (size_t)chunk;
+            rtuParserFeed(&parser, data + fed, n);
+            fed += n;
+        }
+        else rtuParserSkip(&parser);
+        while(rtuParserNext(&parser, &frame)){
+            uint16_t errorWord = errorCheck(frame.bytes, frame.length - 2);
+            assert(frame.length >= 5 && frame.length <= MaxFrameSize);
+            assert(GET_LOW(errorWord) == frame.bytes[frame.length - 2] && GET_HIGH(errorWord) == frame.bytes[frame.length - 1]);
+            assert(parser.slave_id == 0 || frame.bytes[0] == parser.slave_id);
+        }
+        assert(rtuParserPending(&parser) <= ParserBufferSize);
+    }
+    return 0;
+}
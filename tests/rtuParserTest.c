@@ -0,0 +1,295 @@
+/***********************************
+*          rtuParserTest.c
+*
+* -Unit tests of the RTU stream
+*  parser, and a fuzz of random
+*  streams: frames split at any
+*  byte, line noise between them
+*  and corrupted frames.
+*
+* build: make -C tests check
+*
+***********************************/
+
+// Include the modbus (parser, errorCheck) and test headers
+#include "../modbus.h"
+#include "check.h"
+
+// Define constants
+#define FuzzRounds          5000    // Random streams parsed
+#define MaxStreamFrames     8       // Frames in one stream
+#define StreamSize          (MaxStreamFrames*(MaxFrameSize + 16))
+
+// Structs
+typedef struct{
+    uint8_t     bytes[MaxFrameSize];
+    int         length;
+}TestFrame;
+
+// Internal functions
+uint32_t    nextRandom(uint32_t *seed);
+int         replyFrame(uint8_t frame[], uint8_t slave_id, uint8_t function_code, int registers, uint32_t *seed);
+int         exceptionFrame(uint8_t frame[], uint8_t slave_id, uint8_t function_code, uint8_t code);
+int         parseAll(RtuParser *parser, const uint8_t stream[], int n, int chunk, TestFrame frames[], int max_frames);
+void        testFrames();
+void        testErrors();
+void        fuzzStreams();
+
+
+
+int main(){
+    testFrames();
+    testErrors();
+    fuzzStreams();
+    return CHECK_DONE("rtuParserTest");
+}
+
+
+
+/* FRAMES: Complete, split and back to back replies.
+*/
+void testFrames(){
+    RtuParser   parser;
+    RtuFrame    frame;
+    uint8_t     stream[3*MaxFrameSize];
+    uint32_t    seed = 1;
+    int         n, length;
+
+    // SDM230 voltage reply: 01 04 04 43 66 F7 0C + error check
+    uint8_t voltage[9] = {0x01, 0x04, 0x04, 0x43, 0x66, 0xF7, 0x0C};
+    uint16_t errorWord = errorCheck(voltage, 7);
+    voltage[7] = GET_LOW(errorWord);
+    voltage[8] = GET_HIGH(errorWord);
+
+    rtuParserInit(&parser, 1, R_3X);
+    rtuParserFeed(&parser, voltage, 9);
+    CHECK(rtuParserNext(&parser, &frame) == 1);
+    CHECK(frame.length == 9 && memcmp(frame.bytes, voltage, 9) == 0);
+    CHECK(rtuParserNext(&parser, &frame) == 0);
+    CHECK(rtuParserPending(&parser) == 0);
+
+    // One byte at a time: nothing until the last one
+    rtuParserInit(&parser, 1, R_3X);
+    for(int i = 0; i < 8; i ++){
+        rtuParserFeed(&parser, &voltage[i], 1);
+        CHECK(rtuParserNext(&parser, &frame) == 0);
+    }
+    rtuParserFeed(&parser, &voltage[8], 1);
+    CHECK(rtuParserNext(&parser, &frame) == 1 && frame.length == 9);
+
+    // Longest read (125 registers) and an exception, back to back in one feed
+    n = replyFrame(stream, 7, RW_4X, 125, &seed);
+    CHECK(n == 255);
+    n += exceptionFrame(stream + n, 7, RW_4X, 0x02);
+    rtuParserInit(&parser, 7, RW_4X);
+    rtuParserFeed(&parser, stream, n);
+    CHECK(rtuParserNext(&parser, &frame) == 1 && frame.length == 255 && memcmp(frame.bytes, stream, 255) == 0);
+    CHECK(rtuParserNext(&parser, &frame) == 1 && frame.length == 5 && frame.bytes[1] == (0x80 | RW_4X) && frame.bytes[2] == 0x02);
+    CHECK(rtuParserNext(&parser, &frame) == 0);
+
+    // Any slave and read function accepted with 0
+    rtuParserInit(&parser, 0, 0);
+    length = replyFrame(stream, 200, R_3X, 2, &seed);
+    length += replyFrame(stream + length, 3, RW_4X, 1, &seed);
+    rtuParserFeed(&parser, stream, length);
+    CHECK(rtuParserNext(&parser, &frame) == 1 && frame.bytes[0] == 200);
+    CHECK(rtuParserNext(&parser, &frame) == 1 && frame.bytes[0] == 3);
+}
+
+
+
+/* ERRORS: Noise, wrong error checks, impossible headers and a full buffer.
+*/
+void testErrors(){
+    RtuParser   parser;
+    RtuFrame    frame;
+    uint8_t     stream[2*ParserBufferSize];
+    uint32_t    seed = 2;
+    int         n;
+
+    // Noise before the frame is discarded
+    uint8_t noise[5] = {0x00, 0xFF, 0x02, 0x04, 0x81};
+    rtuParserInit(&parser, 1, R_3X);
+    rtuParserFeed(&parser, noise, 5);
+    n = replyFrame(stream, 1, R_3X, 4, &seed);
+    rtuParserFeed(&parser, stream, n);
+    CHECK(rtuParserNext(&parser, &frame) == 1 && frame.length == n && memcmp(frame.bytes, stream, n) == 0);
+    CHECK(parser.discarded == 5);
+
+    // A wrong error check drops the frame, the next one is still found
+    rtuParserInit(&parser, 1, R_3X);
+    n = replyFrame(stream, 1, R_3X, 4, &seed);
+    stream[n - 1] ^= 0x01;
+    n += replyFrame(stream + n, 1, R_3X, 2, &seed);
+    rtuParserFeed(&parser, stream, n);
+    CHECK(rtuParserNext(&parser, &frame) == 1 && frame.length == 9);
+    CHECK(parser.crc_errors >= 1);
+    CHECK(rtuParserNext(&parser, &frame) == 0);
+
+    // Odd and zero byte counts can't start a frame
+    uint8_t odd[6] = {0x01, 0x04, 0x03, 0x00, 0x00, 0x00};
+    uint8_t zero[3] = {0x01, 0x04, 0x00};
+    rtuParserInit(&parser, 1, R_3X);
+    rtuParserFeed(&parser, odd, 6);
+    rtuParserFeed(&parser, zero, 3);
+    CHECK(rtuParserNext(&parser, &frame) == 0);
+    CHECK(parser.crc_errors == 0);
+
+    // Another slave or function is not accepted
+    rtuParserInit(&parser, 1, R_3X);
+    n = replyFrame(stream, 2, R_3X, 2, &seed);
+    n += replyFrame(stream + n, 1, RW_4X, 2, &seed);
+    rtuParserFeed(&parser, stream, n);
+    while(rtuParserPending(&parser) > 0){
+        CHECK(rtuParserNext(&parser, &frame) == 0);
+        rtuParserSkip(&parser);
+    }
+
+    // A partial frame waits until the line goes silent, then it's skipped
+    rtuParserInit(&parser, 1, R_3X);
+    n = replyFrame(stream, 1, R_3X, 10, &seed);
+    rtuParserFeed(&parser, stream, n - 3);
+    CHECK(rtuParserNext(&parser, &frame) == 0);
+    rtuParserSkip(&parser);
+    CHECK(rtuParserNext(&parser, &frame) == 0);
+
+    // A full buffer drops the oldest bytes
+    rtuParserInit(&parser, 1, R_3X);
+    for(int i = 0; i < (int)sizeof(stream); i ++) stream[i] = 0x55;
+    CHECK(rtuParserFeed(&parser, stream, sizeof(stream)) == (int)sizeof(stream) - ParserBufferSize);
+    CHECK(rtuParserPending(&parser) == ParserBufferSize);
+    CHECK(rtuParserNext(&parser, &frame) == 0);
+}
+
+
+
+/* FUZZ: Streams of random replies (some corrupted), with noise between them, fed in random pieces.
+    Every intact frame must come out, in order, and anything returned must carry a valid error check.
+*/
+void fuzzStreams(){
+    static uint8_t      stream[StreamSize];
+    static TestFrame    expected[MaxStreamFrames];
+    static TestFrame    parsed[4*MaxStreamFrames];
+    RtuParser           parser;
+    uint32_t            seed        = 12345;
+    long                n_expected  = 0;
+    long                n_extra     = 0;
+
+    for(int round = 0; round < FuzzRounds; round ++){
+        int n = 0, n_frames = 0, n_parsed, k = 0;
+        int frames = 1 + nextRandom(&seed) % MaxStreamFrames;
+
+        for(int f = 0; f < frames; f ++){
+            int start, length, corrupt;
+
+            // Line noise before the frame
+            if(nextRandom(&seed) % 4 == 0){
+                int noise = 1 + nextRandom(&seed) % 8;
+                for(int i = 0; i < noise; i ++) stream[n ++] = nextRandom(&seed);
+            }
+            start = n;
+            if(nextRandom(&seed) % 8 == 0) length = exceptionFrame(stream + n, 1, R_3X, 1 + nextRandom(&seed) % 4);
+            else length = replyFrame(stream + n, 1, R_3X, 1 + nextRandom(&seed) % 125, &seed);
+            n += length;
+
+            // A corrupted byte (any, header included) or a frame cut short
+            corrupt = nextRandom(&seed) % 6;
+            if(corrupt == 0) stream[start + nextRandom(&seed) % length] ^= 1 + nextRandom(&seed) % 255;
+            else if(corrupt == 1 && length > 5) n -= 1 + nextRandom(&seed) % (length - 4);
+            else{
+                memcpy(expected[n_frames].bytes, stream + start, length);
+                expected[n_frames ++].length = length;
+            }
+        }
+
+        rtuParserInit(&parser, 1, R_3X);
+        n_parsed = parseAll(&parser, stream, n, 1 + nextRandom(&seed) % 64, parsed, 4*MaxStreamFrames);
+
+        // The intact frames are a subsequence of the parsed ones
+        for(int p = 0; p < n_parsed; p ++){
+            uint16_t errorWord = errorCheck(parsed[p].bytes, parsed[p].length - 2);
+            CHECK(GET_LOW(errorWord) == parsed[p].bytes[parsed[p].length - 2] && GET_HIGH(errorWord) == parsed[p].bytes[parsed[p].length - 1]);
+            if(k < n_frames && parsed[p].length == expected[k].length && memcmp(parsed[p].bytes, expected[k].bytes, expected[k].length) == 0) k ++;
+            else n_extra ++;
+        }
+        if(k != n_frames) printf("  round %i: %i of %i frames found\n", round, k, n_frames);
+        CHECK(k == n_frames);
+        n_expected += n_frames;
+    }
+    printf("  fuzz: %i streams, %li frames found, %li frames out of noise\n", FuzzRounds, n_expected, n_extra);
+}
+
+
+
+/* PARSE ALL: Feeds a stream in pieces of random size (up to chunk bytes) and takes every frame found,
+   when it ends the pending bytes are skipped as the receiver does when the line goes silent.
+    returns number of frames
+*/
+int parseAll(RtuParser *parser, const uint8_t stream[], int n, int chunk, TestFrame frames[], int max_frames){
+    RtuFrame    frame;
+    uint32_t    seed        = n;
+    int         n_frames    = 0;
+
+    for(int fed = 0; fed < n || rtuParserPending(parser) > 0;){
+        if(fed < n){
+            int size = 1 + nextRandom(&seed) % chunk;
+            if(size > n - fed) size = n - fed;
+            CHECK(rtuParserFeed(parser, stream + fed, size) == 0);
+            fed += size;
+        }
+        else rtuParserSkip(parser);
+        while(rtuParserNext(parser, &frame)){
+            CHECK(frame.length >= 5 && frame.length <= MaxFrameSize);
+            if(n_frames == max_frames) continue;
+            memcpy(frames[n_frames].bytes, frame.bytes, frame.length);
+            frames[n_frames ++].length = frame.length;
+        }
+    }
+    return n_frames;
+}
+
+
+
+/* REPLY FRAME: A read reply with random register bytes.
+    returns length of the frame
+*/
+int replyFrame(uint8_t frame[], uint8_t slave_id, uint8_t function_code, int registers, uint32_t *seed){
+    uint16_t errorWord;
+
+    frame[0] = slave_id;
+    frame[1] = function_code;
+    frame[2] = 2*registers;
+    for(int i = 0; i < 2*registers; i ++) frame[3 + i] = nextRandom(seed);
+    errorWord = errorCheck(frame, 3 + 2*registers);
+    frame[3 + 2*registers] = GET_LOW(errorWord);
+    frame[4 + 2*registers] = GET_HIGH(errorWord);
+    return 5 + 2*registers;
+}
+
+
+
+/* EXCEPTION FRAME: An exception reply.
+    returns length of the frame
+*/
+int exceptionFrame(uint8_t frame[], uint8_t slave_id, uint8_t function_code, uint8_t code){
+    uint16_t errorWord;
+
+    frame[0] = slave_id;
+    frame[1] = 0x80 | function_code;
+    frame[2] = code;
+    errorWord = errorCheck(frame, 3);
+    frame[3] = GET_LOW(errorWord);
+    frame[4] = GET_HIGH(errorWord);
+    return 5;
+}
+
+
+
+/* RANDOM: xorshift32, the streams are the same on every run.
+*/
+uint32_t nextRandom(uint32_t *seed){
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
@@ -0,0 +1,163 @@
+/***********************************
+*          sparkplugTest.c
+*
+* -Checks the Sparkplug B births:
+*  NBIRTH and DBIRTH on the first
+*  scans, DDATA after, and an NCMD
+*  "Node Control/Rebirth" sending
+*  them again in the same session.
+*
+* build: make -C tests check
+*
+***********************************/
+
+// Include the Sparkplug, MQTT (fake) and test headers
+#include "../sparkplug.h"
+#include "fakeMqtt.h"
+#include "check.h"
+
+// Define constants
+#define CommandTopic        SparkplugNamespace "/plant/NCMD/gw"
+
+// Internal functions
+void        observe(const char *topic, const void *payload, int len);
+void        publishScan(uint8_t slave_id);
+int         command(const char *metric, int value, int truncate);
+void        resetCounts();
+
+// Variables
+static int      nbirths, dbirths, ddatas;   // Messages seen since resetCounts()
+static int64_t  birthBdSeq = -1;            // bdSeq of the last NBIRTH
+
+
+
+int main(){
+    int first_bdseq;
+
+    CHECK(sparkplugInit("plant:gw") == 0);
+
+    // First scans: NBIRTH once, a DBIRTH per meter, then DDATA
+    fakeObserver = observe;
+    publishScan(1);
+    publishScan(2);
+    publishScan(1);
+    CHECK(nbirths == 1 && dbirths == 2 && ddatas == 1);
+    first_bdseq = birthBdSeq;
+    CHECK(first_bdseq >= 0);
+    CHECK(sparkplugServe() == 0);
+
+    // Commands that are not a rebirth, or not valid, are ignored
+    resetCounts();
+    CHECK(command("Node Control/Rebirth", 0, 0) == 0);
+    CHECK(sparkplugServe() == 0);
+    CHECK(command("Node Control/Reboot", 1, 0) == 0);
+    CHECK(sparkplugServe() == 0);
+    CHECK(command("Node Control/Rebirth", 1, 1) == 0);
+    CHECK(sparkplugServe() == 0);
+    CHECK(fakeDeliver(CommandTopic, NULL, 0) == 0);
+    CHECK(sparkplugServe() == 0);
+    CHECK(nbirths == 0 && dbirths == 0);
+
+    // A rebirth: the NBIRTH of the session (same bdSeq) and the DBIRTH of both meters
+    CHECK(command("Node Control/Rebirth", 1, 0) == 0);
+    CHECK(sparkplugServe() == 3);
+    CHECK(nbirths == 1 && dbirths == 2);
+    CHECK(birthBdSeq == first_bdseq);
+    CHECK(sparkplugServe() == 0);
+
+    // Broker not accepting the NBIRTH: the rebirth is tried again
+    resetCounts();
+    command("Node Control/Rebirth", 1, 0);
+    fakeResult = MOSQ_ERR_NO_CONN;
+    CHECK(sparkplugServe() == 0);
+    fakeResult = MOSQ_ERR_SUCCESS;
+    CHECK(sparkplugServe() == 3);
+    CHECK(nbirths == 1 && dbirths == 2);
+
+    // The scans go on as DDATA
+    resetCounts();
+    publishScan(2);
+    CHECK(ddatas == 1 && dbirths == 0);
+    return CHECK_DONE("sparkplugTest");
+}
+
+
+
+/* OBSERVE: Counts the messages by type and keeps the bdSeq of the NBIRTH.
+*/
+void observe(const char *topic, const void *payload, int len){
+    const uint8_t   *data = payload;
+    int             pos = 0, field, wire;
+    uint64_t        value;
+
+    if(strstr(topic, "/DBIRTH/") != NULL) dbirths ++;
+    if(strstr(topic, "/DDATA/") != NULL) ddatas ++;
+    if(strstr(topic, "/NBIRTH/") == NULL) return;
+    nbirths ++;
+
+    // The first metric is bdSeq: name (1), long value (11)
+    while((wire = protoNext(data, len, &pos, &field, &value)) >= 0){
+        if(wire != WireLength) continue;
+        int end = pos + value, metric_field;
+        if(field == 2){
+            while((wire = protoNext(data, end, &pos, &metric_field, &value)) >= 0){
+                if(wire == WireLength) pos += value;
+                else if(metric_field == 11) birthBdSeq = value;
+            }
+            return;
+        }
+        pos = end;
+    }
+}
+
+
+
+/* PUBLISH SCAN: Publishes a scan of 3 parameters of a meter.
+*/
+void publishScan(uint8_t slave_id){
+    const char  *topics[3] = {"parameters/voltage", "parameters/current", "power/active"};
+    Sample      samples[3];
+
+    memset(samples, 0, sizeof(samples));
+    for(int i = 0; i < 3; i ++){
+        clock_gettime(CLOCK_REALTIME, &samples[i].timestamp);
+        samples[i].slave_id = slave_id;
+        samples[i].value    = 230.0f + i;
+        samples[i].status   = SampleOk;
+        samples[i].last     = (i == 2);
+        strcpy(samples[i].topic, topics[i]);
+    }
+    CHECK(sparkplugPublishScan(samples, 3) == MOSQ_ERR_SUCCESS);
+}
+
+
+
+/* COMMAND: Delivers an NCMD with a boolean metric, as a host application sends it
+   (timestamp, metric name, data type, value, sequence). truncate cuts the last bytes.
+    returns 0 if delivered
+*/
+int command(const char *metric, int value, int truncate){
+    uint8_t payload[128];
+    Encoder enc;
+    int     mark;
+
+    encoderInit(&enc, payload, sizeof(payload));
+    protoVarint(&enc, 1, 1700000000000ULL);
+    mark = protoBegin(&enc, 2);
+    protoString(&enc, 1, metric);
+    protoVarint(&enc, 4, DataTypeBoolean);
+    protoVarint(&enc, 14, value);
+    protoEnd(&enc, mark);
+    protoVarint(&enc, 3, 0);
+    return fakeDeliver(CommandTopic, payload, truncate ? enc.len - 4 : enc.len);
+}
+
+
+
+/* RESET COUNTS: Starts counting the messages again.
+*/
+void resetCounts(){
+    nbirths = 0;
+    dbirths = 0;
+    ddatas  = 0;
+}